@@ -0,0 +1,143 @@
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "dmrecon/DMRecon.h"
+#include "dmrecon/Metrics.h"
+#include "dmrecon/Settings.h"
+#include "mve/image.h"
+#include "mve/scene.h"
+#include "util/string.h"
+
+/*
+ * Compares the runtime and fill rate of the dense engines on one view.
+ * Both engines reconstruct the view in memory, nothing is written to
+ * the scene.
+ */
+
+struct EngineResult
+{
+    std::string name;
+    mvs::StageTime total;
+    std::size_t filled;
+    std::size_t pixels;
+    std::size_t optimizations;
+    std::size_t nccEvaluations;
+    mve::FloatImage::Ptr depth;
+};
+
+EngineResult
+run_engine (mve::Scene::Ptr scene, mvs::Settings settings,
+    mvs::DenseEngine engine, std::string const& name)
+{
+    settings.engine = engine;
+    mvs::DMRecon recon(scene, settings);
+    recon.start();
+
+    mvs::Metrics const& metrics = recon.getMetrics();
+    EngineResult result;
+    result.name = name;
+    result.total.wallMs = 0;
+    result.total.cpuMs = 0;
+    for (int i = 0; i < mvs::STAGE_COUNT; ++i)
+    {
+        result.total.wallMs += metrics.stages[i].wallMs;
+        result.total.cpuMs += metrics.stages[i].cpuMs;
+    }
+    result.filled = metrics.filled;
+    result.pixels = metrics.width * metrics.height;
+    result.optimizations = metrics.counters.optimizations;
+    result.nccEvaluations = metrics.counters.nccEvaluations;
+
+    /* the next reconstruction replaces the embedding */
+    mve::View::Ptr view = scene->get_view_by_id(settings.refViewNr);
+    mve::FloatImage::Ptr depth = view->get_float_image
+        ("depth-L" + util::string::get(settings.scale));
+    result.depth = depth->duplicate();
+    return result;
+}
+
+void
+print_result (EngineResult const& r)
+{
+    float fill = 100.f * float(r.filled) / float(r.pixels);
+    float rate = r.total.wallMs ? 1000.f * float(r.filled)
+        / float(r.total.wallMs) : 0.f;
+    std::cout << std::setw(10) << r.name
+              << std::setw(10) << r.total.wallMs
+              << std::setw(10) << r.total.cpuMs
+              << std::setw(10) << r.filled
+              << std::setw(8) << util::string::get_fixed(fill, 1)
+              << std::setw(12) << util::string::get_fixed(rate, 0)
+              << std::setw(10) << r.optimizations
+              << std::setw(12) << r.nccEvaluations
+              << std::endl;
+}
+
+int
+main (int argc, char** argv)
+{
+    if (argc < 3 || argc > 6) {
+        std::cerr << "Syntax: " << argv[0] << " <scene path> <view ID>"
+                  << " [<scale> [<threads> [<sweeps>]]]" << std::endl;
+        return 1;
+    }
+
+    mvs::Settings settings;
+    settings.refViewNr = std::atoi(argv[2]);
+    settings.scale = argc > 3 ? std::atof(argv[3]) : 0.f;
+    settings.numThreads = argc > 4 ? std::atoi(argv[4]) : 1;
+    if (argc > 5)
+        settings.patchMatchIterations = std::atoi(argv[5]);
+
+    mve::Scene::Ptr scene(mve::Scene::create());
+    EngineResult growing, patchmatch;
+    try
+    {
+        scene->load_scene(argv[1]);
+        growing = run_engine(scene, settings,
+            mvs::ENGINE_REGION_GROWING, "growing");
+        patchmatch = run_engine(scene, settings,
+            mvs::ENGINE_PATCHMATCH, "patchmatch");
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    /* depths that both engines reconstructed */
+    std::size_t both = 0, agree = 0, onlyGrowing = 0, onlyPatchMatch = 0;
+    for (std::size_t i = 0; i < growing.depth->get_value_amount(); ++i)
+    {
+        float a = growing.depth->at(i);
+        float b = patchmatch.depth->at(i);
+        if (a > 0.f && b > 0.f) {
+            ++both;
+            if (std::abs(a - b) <= 0.01f * a)
+                ++agree;
+        }
+        else if (a > 0.f)
+            ++onlyGrowing;
+        else if (b > 0.f)
+            ++onlyPatchMatch;
+    }
+
+    std::cout << std::endl << "View " << settings.refViewNr << " at scale "
+              << settings.scale << ", " << settings.numThreads
+              << " threads:" << std::endl;
+    std::cout << std::setw(10) << "engine" << std::setw(10) << "wall ms"
+              << std::setw(10) << "cpu ms" << std::setw(10) << "filled"
+              << std::setw(8) << "%" << std::setw(12) << "pixels/s"
+              << std::setw(10) << "patches" << std::setw(12) << "NCCs"
+              << std::endl;
+    print_result(growing);
+    print_result(patchmatch);
+    std::cout << "Filled by both: " << both << ", within 1%: " << agree
+              << ", only growing: " << onlyGrowing
+              << ", only PatchMatch: " << onlyPatchMatch << std::endl;
+
+    return 0;
+}
@@ -2,37 +2,87 @@
 #include <iostream>
 #include <cstdlib>
 #include <csignal>
+#ifdef _OPENMP
+#   include <omp.h>
+#endif
 
 #include "dmrecon/Settings.h"
+#include "dmrecon/BatchScheduler.h"
+#include "dmrecon/ConsistencyFilter.h"
 #include "dmrecon/DMRecon.h"
+#include "mve/embeddingcodec.h"
 #include "mve/scene.h"
 #include "mve/view.h"
 #include "util/arguments.h"
 #include "util/system.h"
 #include "util/tokenizer.h"
 
+#define MAX_SCALE 4
+
 void
-reconstruct (mve::Scene::Ptr scene, mvs::Settings settings)
+reconstruct (mve::Scene::Ptr scene, mvs::Settings settings,
+    mvs::PyramidCache::Ptr cache,
+    mvs::ViewSelectionCache::Ptr vsCache = mvs::ViewSelectionCache::Ptr())
 {
     if (settings.scale == -1.f)
     {
-        for (unsigned int s = 0; s <= 4; ++s)
+        for (unsigned int i = 0; i <= MAX_SCALE; ++i)
         {
+            /* Coarse-to-fine order if seeding from lower resolutions */
+            unsigned int s = settings.useLowResSeeds ? MAX_SCALE - i : i;
             std::cout << "Reconstructing at scale " << s << std::endl;
 
             /* Start MVS reconstruction */
             settings.scale = float(s);
-            mvs::DMRecon recon(scene, settings);
+            mvs::DMRecon recon(scene, settings, cache, vsCache);
+            recon.start();
+        }
+    }
+    else if (settings.useLowResSeeds)
+    {
+        /* Only the next coarser scale seeds a scale. Reconstruct the
+           missing scales below the finest existing coarser scale first,
+           coarse to fine. */
+        mve::View::Ptr view = scene->get_view_by_id(settings.refViewNr);
+        float target = settings.scale;
+        float coarsest = target;
+        while (coarsest + 1.f <= float(MAX_SCALE) && !(view.get()
+            && view->has_embedding("depth-L"
+            + util::string::get(coarsest + 1.f))))
+            coarsest += 1.f;
+        for (float s = coarsest; s >= target; s -= 1.f)
+        {
+            std::cout << "Reconstructing at scale " << s << std::endl;
+            settings.scale = s;
+            mvs::DMRecon recon(scene, settings, cache, vsCache);
             recon.start();
         }
     }
     else
     {
-        mvs::DMRecon recon(scene, settings);
+        mvs::DMRecon recon(scene, settings, cache, vsCache);
         recon.start();
     }
 }
 
+/* Batch reconstruction with the scale handling of this tool */
+class SceneScheduler : public mvs::BatchScheduler
+{
+public:
+    SceneScheduler (mve::Scene::Ptr scene, mvs::Settings const& settings,
+        mvs::PyramidCache::Ptr cache)
+        : mvs::BatchScheduler(scene, settings, cache)
+    {
+    }
+
+protected:
+    void reconstruct (mvs::Settings const& settings)
+    {
+        ::reconstruct(this->scene, settings, this->pyramidCache,
+            this->viewSelectionCache);
+    }
+};
+
 int
 main (int argc, char** argv)
 {
@@ -66,15 +116,59 @@ main (int argc, char** argv)
         "path suffix appended to scene dir to write ply files");
     args.add_option('\0', "logdest", true,
         "path suffix appended to scene dir to write log files");
+    args.add_option('\0', "pointdest", true,
+        "path suffix appended to scene dir to stream point files to");
     args.add_option('\0', "force", false, "Re-reconstruct existing depthmaps");
+    args.add_option('t', "threads", true,
+        "worker threads per view (default is 1, all cores for batches)");
+    args.add_option('\0', "lowres-seeds", false,
+        "reconstruct coarser scales first and seed from them");
+    args.add_option('\0', "adaptive-sampling", false,
+        "sample textured patches sparsely to save time");
+    args.add_option('\0', "tolerance", true,
+        "relative depth step that ends depth refinement (default is 0.001)");
+    args.add_option('\0', "tile-size", true,
+        "reconstruct in tiles of this many pixels, 0 disables (default is 0)");
+    args.add_option('\0', "tile-overlap", true,
+        "pixels shared by neighboring tiles (default is 32)");
+    args.add_option('\0', "engine", true,
+        "dense engine, \"growing\" or \"patchmatch\" (default is growing)."
+        " Use patchmatch for views with few bundle features or for results"
+        " independent of the thread count, it is about 2x slower per"
+        " thread");
+    args.add_option('\0', "sweeps", true,
+        "propagation sweeps of the PatchMatch engine (default is 3)");
+    args.add_option('\0', "consistency", true,
+        "filter depths agreeing with fewer neighbor depth maps, 0 disables"
+        " (default is 0)");
+    args.add_option('\0', "fuse", false,
+        "average agreeing depths when filtering");
+    args.add_option('\0', "pyramid-cache", true,
+        "memory for shared image pyramids in MB (default is 1024)");
+    args.add_option('\0', "memory-limit", true,
+        "memory for cached views and pyramids in MB (default is no limit)");
+    args.add_option('\0', "checkpoint", true,
+        "seconds between checkpoints, 0 disables (default)");
+    args.add_option('\0', "resume", false,
+        "continue interrupted reconstructions from their checkpoints");
+    args.add_option('\0', "header-index", false,
+        "read and update the index of view headers in the scene");
+    args.add_option('\0', "compress", false,
+        "store depth, dz and confidence maps with lossless compression");
     args.parse(argc, argv);
 
     std::string basePath;
     bool writeply = false;
     std::string plyDest("/recon");
     std::string logDest("/log");
+    std::string pointDest;
     int master_id = -1;
     bool force_recon = false;
+    bool threadsGiven = false;
+    std::size_t cacheSize = 1024;
+    std::size_t memoryLimit = 0;
+    unsigned int consistency = 0;
+    bool headerIndex = false;
 
     mvs::Settings mySettings;
     mySettings.useColorScale = true;
@@ -118,8 +212,55 @@ main (int argc, char** argv)
             plyDest = arg->arg;
         else if (arg->opt->lopt == "logdest")
             logDest = arg->arg;
+        else if (arg->opt->lopt == "pointdest")
+            pointDest = arg->arg;
         else if (arg->opt->lopt == "force")
             force_recon = true;
+        else if (arg->opt->lopt == "threads")
+        {
+            mySettings.numThreads = arg->get_arg<unsigned int>();
+            threadsGiven = true;
+        }
+        else if (arg->opt->lopt == "lowres-seeds")
+            mySettings.useLowResSeeds = true;
+        else if (arg->opt->lopt == "adaptive-sampling")
+            mySettings.adaptiveSampling = true;
+        else if (arg->opt->lopt == "tolerance")
+            mySettings.convergenceTolerance = arg->get_arg<float>();
+        else if (arg->opt->lopt == "tile-size")
+            mySettings.tileSize = arg->get_arg<unsigned int>();
+        else if (arg->opt->lopt == "tile-overlap")
+            mySettings.tileOverlap = arg->get_arg<unsigned int>();
+        else if (arg->opt->lopt == "engine")
+        {
+            if (arg->arg == "growing")
+                mySettings.engine = mvs::ENGINE_REGION_GROWING;
+            else if (arg->arg == "patchmatch")
+                mySettings.engine = mvs::ENGINE_PATCHMATCH;
+            else
+            {
+                std::cerr << "Unknown engine: " << arg->arg << std::endl;
+                return 1;
+            }
+        }
+        else if (arg->opt->lopt == "sweeps")
+            mySettings.patchMatchIterations = arg->get_arg<unsigned int>();
+        else if (arg->opt->lopt == "consistency")
+            consistency = arg->get_arg<unsigned int>();
+        else if (arg->opt->lopt == "fuse")
+            mySettings.fuseDepths = true;
+        else if (arg->opt->lopt == "pyramid-cache")
+            cacheSize = arg->get_arg<std::size_t>();
+        else if (arg->opt->lopt == "memory-limit")
+            memoryLimit = arg->get_arg<std::size_t>();
+        else if (arg->opt->lopt == "checkpoint")
+            mySettings.checkpointInterval = arg->get_arg<unsigned int>();
+        else if (arg->opt->lopt == "resume")
+            mySettings.resume = true;
+        else if (arg->opt->lopt == "header-index")
+            headerIndex = true;
+        else if (arg->opt->lopt == "compress")
+            mySettings.mapCodec = MVE_CODEC_DELTA_LZ;
         else {
             std::cout << "WARNING: unrecognized option" << std::endl;
         }
@@ -127,6 +268,8 @@ main (int argc, char** argv)
 
     /* Load MVE scene. */
     mve::Scene::Ptr scene(mve::Scene::create());
+    scene->set_header_index(headerIndex);
+    scene->set_cache_budget(memoryLimit * 1024 * 1024);
     try {
         scene->load_scene(basePath);
         scene->get_bundle();
@@ -146,49 +289,86 @@ main (int argc, char** argv)
     mySettings.plyPath += "/";
     mySettings.logPath += logDest;
     mySettings.logPath += "/";
+    mySettings.checkpointPath = basePath + "/checkpoints/";
+    if (!pointDest.empty())
+        mySettings.pointsPath = basePath + "/" + pointDest + "/";
 
+    /* Neighbor pyramids are shared between all reconstructions */
+    mvs::PyramidCache::Ptr cache(mvs::PyramidCache::create
+        (cacheSize * 1024 * 1024));
+
+    std::vector<std::size_t> ids;
     if (master_id >= 0) {
         std::cout << "Reconstructing view with ID " << master_id << std::endl;
         mySettings.refViewNr = (std::size_t)master_id;
-        reconstruct(scene, mySettings);
+        reconstruct(scene, mySettings, cache);
+        ids.push_back(mySettings.refViewNr);
     }
     else
     {
         mve::Scene::ViewList& views(scene->get_views());
-        std::string embedding_name = "depth-L" +
-            util::string::get(mySettings.scale);
         if (listIDs.empty()) {
             for(std::size_t i = 0; i < views.size(); ++i)
-                listIDs.push_back(i);
+                ids.push_back(i);
             std::cout << "Reconstructing all views..." << std::endl;
         }
         else {
+            ids.assign(listIDs.begin(), listIDs.end());
             std::cout << "Reconstructing views from list..." << std::endl;
         }
 
-#pragma omp parallel for schedule(dynamic, 1)
-        for (std::size_t i = 0; i < listIDs.size(); ++i)
-        {
-            std::size_t id = listIDs[i];
-            if (id >= views.size()){
-                std::cout << "ID: " << id << " is too large! Skipping..."
-                << std::endl;
-                continue;
-            }
-            if (!views[id].get() || !views[id]->is_camera_valid())
-                continue;
-            if (!force_recon && views[id]->has_embedding(embedding_name))
-                continue;
+        /* Views are reconstructed one after another, use all cores
+           for each view unless requested otherwise */
+#ifdef _OPENMP
+        if (!threadsGiven)
+            mySettings.numThreads = omp_get_max_threads();
+#endif
 
-            mvs::Settings settings(mySettings);
-            settings.refViewNr = id;
-            reconstruct(scene, settings);
+        /* Views are ordered for cache reuse and written in background */
+        try {
+            SceneScheduler scheduler(scene, mySettings, cache);
+            scheduler.setMemoryLimit(memoryLimit * 1024 * 1024);
+            scheduler.setSkipExisting(!force_recon);
+            scheduler.run(ids);
+        }
+        catch (std::exception& e) {
+            std::cout << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
 
-#pragma omp critical
-            {
-                views[id]->save_mve_file();
-                //scene->cache_cleanup();
-            }
+    mvs::PyramidCache::Stats stats(cache->getStats());
+    std::cout << "Pyramid cache: " << stats.hits << " hits, "
+        << stats.misses << " misses, " << stats.evictions
+        << " evictions, peak " << (stats.peakMemory >> 20) << " MB"
+        << std::endl;
+
+    /* Drop depths that disagree with the depth maps of the neighbors */
+    if (consistency > 0 && mySettings.scale < 0.f)
+        std::cout << "Consistency filter needs a single scale, skipping."
+                  << std::endl;
+    else if (consistency > 0)
+    {
+#ifdef _OPENMP
+        if (!threadsGiven)
+            mySettings.numThreads = omp_get_max_threads();
+#endif
+        mySettings.minConsistentViews = consistency;
+        try {
+            mvs::ConsistencyFilter filter(scene, mySettings);
+            filter.run(ids);
+            mvs::ConsistencyFilter::Stats const& fs(filter.getStats());
+            std::cout << "Consistency filter kept " << fs.kept << " of "
+                << fs.depths << " depths in " << fs.views << " views ("
+                << fs.fused << " fused) as "
+                << mvs::ConsistencyFilter::getEmbeddingName(mySettings.scale)
+                << ", depth map cache " << fs.cacheHits << " hits, "
+                << fs.cacheMisses << " misses (" << fs.mappedMisses
+                << " mapped)." << std::endl;
+        }
+        catch (std::exception& e) {
+            std::cout << "Error: " << e.what() << std::endl;
+            return 1;
         }
     }
 
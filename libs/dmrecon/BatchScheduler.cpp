@@ -0,0 +1,437 @@
+#include <algorithm>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+
+#include "mve/bundlefile.h"
+#include "util/hrtimer.h"
+#include "util/string.h"
+#include "util/threadlocks.h"
+
+#include "BatchScheduler.h"
+#include "DMRecon.h"
+
+/* Amount of recent reference views whose neighbors are kept resident */
+#define MVS_SCHEDULER_WINDOW 4
+
+MVS_NAMESPACE_BEGIN
+
+class BatchScheduler::ViewWriter : public util::Thread
+{
+public:
+    ViewWriter(BatchScheduler* _scheduler)
+        : scheduler(_scheduler)
+    {
+    }
+
+protected:
+    void* run()
+    {
+        scheduler->writeViews();
+        return 0;
+    }
+
+private:
+    BatchScheduler* scheduler;
+};
+
+/* ------------------------------------------------------------------ */
+
+BatchScheduler::BatchScheduler(mve::Scene::Ptr _scene,
+    Settings const& _settings, PyramidCache::Ptr _pyramidCache)
+    :
+    scene(_scene),
+    settings(_settings),
+    pyramidCache(_pyramidCache),
+    viewSelectionCache(ViewSelectionCache::create()),
+    memoryLimit(0),
+    cacheBudget(0),
+    skipExisting(true),
+    writer(0),
+    writeAvailable(0),
+    writeDone(0),
+    pendingWrites(0)
+{
+    if (pyramidCache.get())
+        cacheBudget = pyramidCache->getMaxMemory();
+}
+
+BatchScheduler::~BatchScheduler()
+{
+    try
+    {
+        stopWriter();
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Error stopping view writer: " << e.what() << std::endl;
+    }
+}
+
+void
+BatchScheduler::setMemoryLimit(std::size_t bytes)
+{
+    memoryLimit = bytes;
+    if (pyramidCache.get() && memoryLimit > 0)
+        pyramidCache->setMaxMemory(std::min(cacheBudget, memoryLimit));
+}
+
+/**  Connects every view to the views it shares the most bundle features
+     with. Only the strongest globalVSMax edges are kept, which roughly
+     resembles the outcome of the global view selection. */
+void
+BatchScheduler::buildViewGraph(std::vector<std::size_t> const& ids)
+{
+    mve::BundleFile::ConstPtr bundle(scene->get_bundle());
+    mve::BundleFile::FeaturePoints const& features = bundle->get_points();
+    mve::Scene::ViewList const& views(scene->get_views());
+
+    viewGraph.clear();
+    viewGraph.resize(views.size());
+    std::vector<std::size_t> shared(views.size(), 0);
+    std::vector<std::size_t> touched;
+    for (std::size_t i = 0; i < ids.size(); ++i)
+    {
+        std::size_t id = ids[i];
+        mve::BundleFile::FeatureIndices const& featIDs =
+            bundle->get_view_features(id);
+        touched.clear();
+        for (std::size_t j = 0; j < featIDs.size(); ++j)
+        {
+            std::vector<mve::FeaturePointRef> const& refs =
+                features[featIDs[j]].refs;
+            for (std::size_t k = 0; k < refs.size(); ++k)
+            {
+                std::size_t other = refs[k].img_id;
+                if (refs[k].img_id < 0 || other == id || other >= views.size())
+                    continue;
+                if (shared[other] == 0)
+                    touched.push_back(other);
+                shared[other] += 1;
+            }
+        }
+
+        EdgeList& edges = viewGraph[id];
+        for (std::size_t j = 0; j < touched.size(); ++j)
+        {
+            Edge edge;
+            edge.view = touched[j];
+            edge.weight = shared[touched[j]];
+            shared[touched[j]] = 0;
+            if (views[edge.view].get() && views[edge.view]->is_camera_valid())
+                edges.push_back(edge);
+        }
+        std::size_t maxEdges = std::min<std::size_t>(edges.size(),
+            settings.globalVSMax);
+        std::partial_sort(edges.begin(), edges.begin() + maxEdges,
+            edges.end());
+        edges.resize(maxEdges);
+    }
+}
+
+/**  Greedily chains the reference views. The next view is the one with
+     the largest feature overlap to the last few reconstructed views. If
+     no remaining view overlaps, the view with the most edges starts a
+     new cluster. */
+std::vector<std::size_t>
+BatchScheduler::orderViews(std::vector<std::size_t> const& viewIDs)
+{
+    /* Duplicate IDs would be reconstructed and written twice */
+    std::vector<std::size_t> ids(viewIDs);
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    buildViewGraph(ids);
+
+    std::size_t const numViews = viewGraph.size();
+    std::vector<std::size_t> score(numViews, 0);
+    std::vector<bool> pending(numViews, false);
+    for (std::size_t i = 0; i < ids.size(); ++i)
+        pending[ids[i]] = true;
+
+    std::vector<std::size_t> order;
+    order.reserve(ids.size());
+    while (order.size() < ids.size())
+    {
+        std::size_t best = 0;
+        std::size_t bestScore = 0;
+        bool found = false;
+        for (std::size_t i = 0; i < ids.size(); ++i)
+        {
+            std::size_t id = ids[i];
+            if (!pending[id] || (found && score[id] <= bestScore))
+                continue;
+            best = id;
+            bestScore = score[id];
+            found = true;
+        }
+        if (bestScore == 0)
+        {
+            /* Start a new cluster at the best connected view */
+            std::size_t maxWeight = 0;
+            for (std::size_t i = 0; i < ids.size(); ++i)
+            {
+                std::size_t id = ids[i];
+                if (!pending[id])
+                    continue;
+                std::size_t weight = 0;
+                for (std::size_t j = 0; j < viewGraph[id].size(); ++j)
+                    weight += viewGraph[id][j].weight;
+                if (weight > maxWeight) {
+                    maxWeight = weight;
+                    best = id;
+                }
+            }
+        }
+
+        order.push_back(best);
+        pending[best] = false;
+        EdgeList const& added = viewGraph[best];
+        for (std::size_t j = 0; j < added.size(); ++j)
+            score[added[j].view] += added[j].weight;
+        if (order.size() > MVS_SCHEDULER_WINDOW)
+        {
+            EdgeList const& removed =
+                viewGraph[order[order.size() - 1 - MVS_SCHEDULER_WINDOW]];
+            for (std::size_t j = 0; j < removed.size(); ++j)
+                score[removed[j].view] -= removed[j].weight;
+        }
+    }
+    return order;
+}
+
+void
+BatchScheduler::run(std::vector<std::size_t> const& ids)
+{
+    mve::Scene::ViewList& views(scene->get_views());
+    std::string embeddingName = "depth-L" + util::string::get(settings.scale);
+
+    std::vector<std::size_t> validIDs;
+    for (std::size_t i = 0; i < ids.size(); ++i)
+    {
+        std::size_t id = ids[i];
+        if (id >= views.size()) {
+            std::cout << "ID: " << id << " is too large! Skipping..."
+                      << std::endl;
+            continue;
+        }
+        if (!views[id].get() || !views[id]->is_camera_valid())
+            continue;
+        if (skipExisting && views[id]->has_embedding(embeddingName))
+            continue;
+        validIDs.push_back(id);
+    }
+
+    std::vector<std::size_t> order(orderViews(validIDs));
+    std::cout << "Reconstructing " << order.size() << " views in order:";
+    for (std::size_t i = 0; i < order.size(); ++i)
+        std::cout << " " << order[i];
+    std::cout << std::endl;
+
+    /* scale -1 reconstructs all scales, selections are then computed
+       by the individual reconstructions */
+    if (settings.scale >= 0.f && !order.empty())
+    {
+        util::HRTimer timer;
+        viewSelectionCache->precompute(scene, settings, order);
+        std::cout << "Global view selection for " << order.size()
+                  << " views took " << timer.get_elapsed() << "ms."
+                  << std::endl;
+    }
+
+    /* the handle of the current view keeps its prefetched images alive
+       until the reconstruction has picked them up */
+    mve::PrefetchHandle::Ptr current, next;
+    startWriter();
+    for (std::size_t i = 0; i < order.size(); ++i)
+    {
+        if (i + 1 < order.size())
+            next = prefetchInputs(order[i + 1], order[i]);
+        Settings viewSettings(settings);
+        viewSettings.refViewNr = order[i];
+        reconstruct(viewSettings);
+        queueWrite(views[order[i]]);
+        enforceMemoryLimit(order, i + 1);
+        current = next;
+        next.reset();
+    }
+    current.reset();
+    stopWriter();
+}
+
+void
+BatchScheduler::reconstruct(Settings const& settings)
+{
+    DMRecon recon(scene, settings, pyramidCache, viewSelectionCache);
+    recon.start();
+}
+
+/**  Releases embeddings of views that are unlikely to be neighbors of the
+     next reference views, starting at order[next]. Views waiting to be
+     written are dirty and not released, so if that is not sufficient the
+     writes are awaited first. The pyramid cache gets the remaining budget. */
+void
+BatchScheduler::enforceMemoryLimit(std::vector<std::size_t> const& order,
+    std::size_t next)
+{
+    if (memoryLimit == 0)
+        return;
+
+    std::size_t cacheMemory = 0;
+    if (pyramidCache.get())
+        cacheMemory = pyramidCache->getStats().memory;
+    std::size_t viewMemory = scene->get_view_mem_usage();
+    if (viewMemory + cacheMemory <= memoryLimit)
+        return;
+
+    std::set<std::size_t> keep;
+    for (std::size_t i = next; i < order.size()
+        && i < next + MVS_SCHEDULER_WINDOW; ++i)
+    {
+        keep.insert(order[i]);
+        EdgeList const& edges = viewGraph[order[i]];
+        for (std::size_t j = 0; j < edges.size(); ++j)
+            keep.insert(edges[j].view);
+    }
+
+    mve::Scene::ViewList& views(scene->get_views());
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        for (std::size_t i = 0; i < views.size(); ++i)
+            if (views[i].get() && keep.find(i) == keep.end())
+                views[i]->cache_cleanup();
+        viewMemory = scene->get_view_mem_usage();
+        if (viewMemory + cacheMemory <= memoryLimit || pass == 1)
+            break;
+        waitForWrites();
+    }
+
+    if (pyramidCache.get())
+    {
+        std::size_t remaining = memoryLimit - std::min(viewMemory, memoryLimit);
+        pyramidCache->setMaxMemory(std::min(cacheBudget, remaining));
+    }
+}
+
+/**  Loads the color images that the reconstruction of the reference view
+     will need in the background: the reference view itself and the
+     neighbors without a cached pyramid. Neighbors are taken from the
+     global view selection if precomputed, otherwise from the view graph.
+     The view reconstructed meanwhile is skipped, it is in memory anyway
+     and gets its results stored while the prefetch runs. */
+mve::PrefetchHandle::Ptr
+BatchScheduler::prefetchInputs(std::size_t refViewNr, std::size_t busyView)
+{
+    std::vector<std::size_t> ids(1, refViewNr);
+    GlobalViewSet neighbors;
+    if (viewSelectionCache->lookup(refViewNr, settings.scale, &neighbors))
+        ids.insert(ids.end(), neighbors.begin(), neighbors.end());
+    else
+        for (std::size_t i = 0; i < viewGraph[refViewNr].size(); ++i)
+            ids.push_back(viewGraph[refViewNr][i].view);
+
+    std::vector<std::size_t> missing(1, refViewNr);
+    for (std::size_t i = 1; i < ids.size(); ++i)
+        if (ids[i] != busyView && (!pyramidCache.get()
+            || !pyramidCache->contains(ids[i], settings.imageEmbedding)))
+            missing.push_back(ids[i]);
+
+    return scene->prefetch(missing,
+        std::vector<std::string>(1, settings.imageEmbedding));
+}
+
+void
+BatchScheduler::startWriter()
+{
+    if (writer)
+        return;
+    writeError.clear();
+    writer = new ViewWriter(this);
+    writer->pt_create();
+}
+
+void
+BatchScheduler::stopWriter()
+{
+    if (!writer)
+        return;
+    pushWrite(mve::View::Ptr());
+    writer->pt_join();
+    delete writer;
+    writer = 0;
+    checkWriteError();
+}
+
+/**  Hands a view to the I/O thread after reporting earlier errors. */
+void
+BatchScheduler::queueWrite(mve::View::Ptr view)
+{
+    checkWriteError();
+    pushWrite(view);
+}
+
+/**  Appends to the write queue, a NULL view stops the thread. */
+void
+BatchScheduler::pushWrite(mve::View::Ptr view)
+{
+    util::MutexLock lock(writeMutex);
+    writeQueue.push_back(view);
+    if (view.get())
+        pendingWrites += 1;
+    lock.unlock();
+    writeAvailable.post();
+}
+
+void
+BatchScheduler::waitForWrites()
+{
+    while (true)
+    {
+        util::MutexLock lock(writeMutex);
+        if (pendingWrites == 0)
+            return;
+        lock.unlock();
+        writeDone.wait();
+    }
+}
+
+void
+BatchScheduler::writeViews()
+{
+    while (true)
+    {
+        writeAvailable.wait();
+        util::MutexLock lock(writeMutex);
+        mve::View::Ptr view = writeQueue.front();
+        writeQueue.pop_front();
+        lock.unlock();
+        if (!view.get())
+            break;
+
+        std::string error;
+        try
+        {
+            view->save_mve_file();
+        }
+        catch (std::exception& e)
+        {
+            error = e.what();
+        }
+
+        util::MutexLock doneLock(writeMutex);
+        if (writeError.empty())
+            writeError = error;
+        pendingWrites -= 1;
+        doneLock.unlock();
+        writeDone.post();
+    }
+}
+
+void
+BatchScheduler::checkWriteError()
+{
+    util::MutexLock lock(writeMutex);
+    if (!writeError.empty())
+        throw std::runtime_error("Error writing view: " + writeError);
+}
+
+MVS_NAMESPACE_END
@@ -0,0 +1,125 @@
+#ifndef BATCHSCHEDULER_H
+#define BATCHSCHEDULER_H
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "mve/scene.h"
+#include "mve/view.h"
+#include "util/thread.h"
+
+#include "defines.h"
+#include "PyramidCache.h"
+#include "Settings.h"
+#include "ViewSelectionCache.h"
+
+MVS_NAMESPACE_BEGIN
+
+/**
+ * Reconstructs depth maps for a list of reference views of a scene.
+ *
+ * The reference views are ordered by walking the view graph, where two
+ * views are connected if they share bundle features, such that
+ * consecutive reference views have many neighbors in common. Neighbor
+ * embeddings and pyramids are then mostly reused from the caches. The
+ * global view selections of all reference views are computed in a single
+ * pass before the first reconstruction.
+ *
+ * If a memory limit is set, embeddings of views that are not expected
+ * to be neighbors of the next reference views are released after each
+ * reconstruction, and the pyramid cache is shrunk to the remaining
+ * budget. Finished views are written by a dedicated I/O thread while the
+ * next view is reconstructed, and the color images of the next reference
+ * view and its neighbors are prefetched meanwhile.
+ */
+class BatchScheduler
+{
+public:
+    BatchScheduler(mve::Scene::Ptr scene, Settings const& settings,
+        PyramidCache::Ptr pyramidCache);
+    virtual ~BatchScheduler();
+
+    /** Limit for cached embeddings and pyramids in bytes, 0 is unlimited */
+    void setMemoryLimit(std::size_t bytes);
+
+    /** Skips views that already have a depth map (default is true) */
+    void setSkipExisting(bool skip);
+
+    /** Returns valid view IDs without duplicates in the order they
+        will be reconstructed */
+    std::vector<std::size_t> orderViews(std::vector<std::size_t> const& ids);
+
+    /** Reconstructs and writes all given views */
+    void run(std::vector<std::size_t> const& ids);
+
+protected:
+    /** Reconstructs one reference view, settings.refViewNr is set */
+    virtual void reconstruct(Settings const& settings);
+
+protected:
+    mve::Scene::Ptr scene;
+    Settings settings;
+    PyramidCache::Ptr pyramidCache;
+    ViewSelectionCache::Ptr viewSelectionCache;
+
+private:
+    /** Edge of the view graph, weighted by the shared features.
+        Sorting puts the heaviest edges first. */
+    struct Edge
+    {
+        std::size_t view;
+        std::size_t weight;
+        bool operator< (Edge const& rhs) const;
+    };
+    typedef std::vector<Edge> EdgeList;
+
+    class ViewWriter;
+
+private:
+    void buildViewGraph(std::vector<std::size_t> const& ids);
+    void enforceMemoryLimit(std::vector<std::size_t> const& order,
+        std::size_t next);
+    mve::PrefetchHandle::Ptr prefetchInputs(std::size_t refViewNr,
+        std::size_t busyView);
+    void startWriter();
+    void stopWriter();
+    void queueWrite(mve::View::Ptr view);
+    void pushWrite(mve::View::Ptr view);
+    void waitForWrites();
+    void writeViews();
+    void checkWriteError();
+
+private:
+    std::size_t memoryLimit;
+    std::size_t cacheBudget;
+    bool skipExisting;
+    std::vector<EdgeList> viewGraph;
+
+    /** state shared with the I/O thread */
+    ViewWriter* writer;
+    util::Mutex writeMutex;
+    util::Semaphore writeAvailable;
+    util::Semaphore writeDone;
+    std::deque<mve::View::Ptr> writeQueue;
+    std::size_t pendingWrites;
+    std::string writeError;
+};
+
+/* ------------------------- Implementation ----------------------- */
+
+inline bool
+BatchScheduler::Edge::operator< (Edge const& rhs) const
+{
+    return weight > rhs.weight || (weight == rhs.weight && view < rhs.view);
+}
+
+inline void
+BatchScheduler::setSkipExisting(bool skip)
+{
+    skipExisting = skip;
+}
+
+MVS_NAMESPACE_END
+
+#endif
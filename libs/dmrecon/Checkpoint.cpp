@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <stdint.h>
+
+#include "util/fs.h"
+#include "Checkpoint.h"
+
+/* Layout: signature, header values as uint64, tile slots, queue entries */
+#define CHECKPOINT_SIGNATURE "MVS-CHECKPOINT2\n"
+#define CHECKPOINT_SIGNATURE_LEN 16
+#define CHECKPOINT_HEADER_VALUES 8
+#define CHECKPOINT_CHANNELS 7       // depth 1, normal 3, dz 2, confidence 1
+
+MVS_NAMESPACE_BEGIN
+
+namespace
+{
+    enum HeaderValue
+    {
+        HEADER_COMPLETE,
+        HEADER_WIDTH,
+        HEADER_HEIGHT,
+        HEADER_TILE,
+        HEADER_ENTRY_SIZE,
+        HEADER_FILLED,
+        HEADER_QUEUE_SIZE,
+        HEADER_SEQUENCE
+    };
+
+    std::size_t const tileSlotSize = MVS_CHECKPOINT_TILE
+        * MVS_CHECKPOINT_TILE * CHECKPOINT_CHANNELS * sizeof(float);
+
+    void
+    writeHeaderValue(std::fstream& out, HeaderValue value, uint64_t data)
+    {
+        out.seekp(CHECKPOINT_SIGNATURE_LEN + value * sizeof(uint64_t));
+        out.write(reinterpret_cast<char const*>(&data), sizeof(uint64_t));
+    }
+
+    /** Copies a tile of all images to or from the slot buffer */
+    template <bool STORE>
+    void
+    copyTile(SingleView const& refV, std::size_t x0, std::size_t y0,
+        float* slot)
+    {
+        mve::FloatImage::Ptr images[4] = { refV.depthImg, refV.normalImg,
+            refV.dzImg, refV.confImg };
+        std::size_t const width = refV.depthImg->width();
+        std::size_t const x1 = std::min(x0 + MVS_CHECKPOINT_TILE, width);
+        std::size_t const y1 = std::min(y0 + MVS_CHECKPOINT_TILE,
+            (std::size_t)refV.depthImg->height());
+        for (int i = 0; i < 4; ++i)
+        {
+            std::size_t const chans = images[i]->channels();
+            std::size_t const rowSize = (x1 - x0) * chans;
+            for (std::size_t y = y0; y < y1; ++y)
+            {
+                float* row = images[i]->begin() + (y * width + x0) * chans;
+                if (STORE)
+                    std::copy(row, row + rowSize, slot);
+                else
+                    std::copy(slot, slot + rowSize, row);
+                slot += MVS_CHECKPOINT_TILE * chans;
+            }
+            slot += (MVS_CHECKPOINT_TILE - (y1 - y0))
+                * MVS_CHECKPOINT_TILE * chans;
+        }
+    }
+}
+
+Checkpoint::Checkpoint(std::string const& filename, std::size_t width,
+    std::size_t height, std::size_t interval)
+    :
+    filename(filename),
+    width(width),
+    height(height),
+    interval(interval),
+    tilesX((width + MVS_CHECKPOINT_TILE - 1) / MVS_CHECKPOINT_TILE),
+    tilesY((height + MVS_CHECKPOINT_TILE - 1) / MVS_CHECKPOINT_TILE),
+    dirtyTiles(tilesX * tilesY, 3),
+    nextSlot(0),
+    sequence(1),
+    lastWrite(std::time(0)),
+    lastWriteSize(0)
+{
+    fileValid[0] = fileValid[1] = false;
+}
+
+std::size_t
+Checkpoint::tileOffset(std::size_t tile) const
+{
+    return CHECKPOINT_SIGNATURE_LEN
+        + CHECKPOINT_HEADER_VALUES * sizeof(uint64_t)
+        + tile * tileSlotSize;
+}
+
+std::size_t
+Checkpoint::queueOffset() const
+{
+    return tileOffset(tilesX * tilesY);
+}
+
+std::string
+Checkpoint::getSlotFilename(int slot) const
+{
+    return slot == 0 ? filename : filename + ".1";
+}
+
+void
+Checkpoint::write(SingleView const& refV, ConfidenceQueue const& queue,
+    std::size_t filled)
+{
+    int const slot = nextSlot;
+    unsigned char const slotBit = 1 << slot;
+    std::string const slotFile = getSlotFilename(slot);
+    if (!fileValid[slot])
+    {
+        /* New file, all tile slots are written below */
+        std::ofstream create(slotFile.c_str(), std::ios::binary);
+        create.write(CHECKPOINT_SIGNATURE, CHECKPOINT_SIGNATURE_LEN);
+        if (!create.good())
+            throw std::runtime_error("Cannot create checkpoint: " + slotFile);
+        create.close();
+        for (std::size_t i = 0; i < dirtyTiles.size(); ++i)
+            dirtyTiles[i] |= slotBit;
+    }
+
+    std::fstream out(slotFile.c_str(),
+        std::ios::in | std::ios::out | std::ios::binary);
+    if (!out.good())
+        throw std::runtime_error("Cannot open checkpoint: " + slotFile);
+
+    /* Invalidate until everything has been written, the other file
+       keeps the previous checkpoint meanwhile */
+    fileValid[slot] = false;
+    writeHeaderValue(out, HEADER_COMPLETE, 0);
+    writeHeaderValue(out, HEADER_WIDTH, width);
+    writeHeaderValue(out, HEADER_HEIGHT, height);
+    writeHeaderValue(out, HEADER_TILE, MVS_CHECKPOINT_TILE);
+    writeHeaderValue(out, HEADER_ENTRY_SIZE, sizeof(QueueData));
+    out.flush();
+
+    std::size_t bytes = 0;
+    std::vector<float> tile(tileSlotSize / sizeof(float), 0.f);
+    for (std::size_t i = 0; i < dirtyTiles.size(); ++i)
+    {
+        if (!(dirtyTiles[i] & slotBit))
+            continue;
+        copyTile<true>(refV, (i % tilesX) * MVS_CHECKPOINT_TILE,
+            (i / tilesX) * MVS_CHECKPOINT_TILE, &tile[0]);
+        out.seekp(tileOffset(i));
+        out.write(reinterpret_cast<char const*>(&tile[0]), tileSlotSize);
+        bytes += tileSlotSize;
+        dirtyTiles[i] &= ~slotBit;
+    }
+
+    out.seekp(queueOffset());
+    for (std::size_t i = 0; i < queue.getNumBuckets(); ++i)
+    {
+        std::vector<QueueData> const& bucket = queue.getBucket(i);
+        if (bucket.empty())
+            continue;
+        std::size_t size = bucket.size() * sizeof(QueueData);
+        out.write(reinterpret_cast<char const*>(&bucket[0]), size);
+        bytes += size;
+    }
+
+    writeHeaderValue(out, HEADER_FILLED, filled);
+    writeHeaderValue(out, HEADER_QUEUE_SIZE, queue.size());
+    writeHeaderValue(out, HEADER_SEQUENCE, sequence);
+    out.flush();
+    writeHeaderValue(out, HEADER_COMPLETE, 1);
+    out.close();
+    if (out.fail())
+        throw std::runtime_error("Error writing checkpoint: " + slotFile);
+
+    fileValid[slot] = true;
+    nextSlot = 1 - slot;
+    sequence += 1;
+    lastWrite = std::time(0);
+    lastWriteSize = bytes;
+}
+
+bool
+Checkpoint::readHeader(int slot, uint64_t* header) const
+{
+    std::string const slotFile = getSlotFilename(slot);
+    std::ifstream in(slotFile.c_str(), std::ios::binary);
+    if (!in.good())
+        return false;
+
+    char signature[CHECKPOINT_SIGNATURE_LEN];
+    in.read(signature, CHECKPOINT_SIGNATURE_LEN);
+    in.read(reinterpret_cast<char*>(header),
+        CHECKPOINT_HEADER_VALUES * sizeof(uint64_t));
+    if (!in.good() || std::memcmp(signature, CHECKPOINT_SIGNATURE,
+        CHECKPOINT_SIGNATURE_LEN) != 0)
+    {
+        std::cout << "Ignoring invalid checkpoint " << slotFile << std::endl;
+        return false;
+    }
+    if (header[HEADER_COMPLETE] != 1)
+    {
+        std::cout << "Ignoring incomplete checkpoint " << slotFile
+                  << std::endl;
+        return false;
+    }
+    if (header[HEADER_WIDTH] != width || header[HEADER_HEIGHT] != height
+        || header[HEADER_TILE] != MVS_CHECKPOINT_TILE
+        || header[HEADER_ENTRY_SIZE] != sizeof(QueueData))
+    {
+        std::cout << "Ignoring checkpoint with different layout "
+                  << slotFile << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool
+Checkpoint::read(SingleView& refV, ConfidenceQueue* queue,
+    std::size_t* filled)
+{
+    uint64_t headers[2][CHECKPOINT_HEADER_VALUES];
+    bool valid[2];
+    for (int i = 0; i < 2; ++i)
+        valid[i] = readHeader(i, headers[i]);
+    if (!valid[0] && !valid[1])
+        return false;
+
+    int const slot = (!valid[1] || (valid[0]
+        && headers[0][HEADER_SEQUENCE] > headers[1][HEADER_SEQUENCE]))
+        ? 0 : 1;
+    uint64_t const* header = headers[slot];
+    std::string const slotFile = getSlotFilename(slot);
+    std::ifstream in(slotFile.c_str(), std::ios::binary);
+    in.seekg(tileOffset(0));
+
+    std::vector<float> tile(tileSlotSize / sizeof(float));
+    for (std::size_t i = 0; i < dirtyTiles.size(); ++i)
+    {
+        in.read(reinterpret_cast<char*>(&tile[0]), tileSlotSize);
+        copyTile<false>(refV, (i % tilesX) * MVS_CHECKPOINT_TILE,
+            (i / tilesX) * MVS_CHECKPOINT_TILE, &tile[0]);
+    }
+
+    std::vector<QueueData> entries(header[HEADER_QUEUE_SIZE]);
+    if (!entries.empty())
+        in.read(reinterpret_cast<char*>(&entries[0]),
+            entries.size() * sizeof(QueueData));
+    if (!in.good())
+        throw std::runtime_error("Error reading checkpoint: " + slotFile);
+
+    *queue = ConfidenceQueue(queue->getNumBuckets());
+    for (std::size_t i = 0; i < entries.size(); ++i)
+        queue->push(entries[i]);
+    *filled = header[HEADER_FILLED];
+
+    /* The other file is rewritten completely by the next write */
+    dirtyTiles.assign(dirtyTiles.size(), 1 << (1 - slot));
+    fileValid[slot] = true;
+    fileValid[1 - slot] = false;
+    nextSlot = 1 - slot;
+    sequence = header[HEADER_SEQUENCE] + 1;
+    lastWrite = std::time(0);
+    return true;
+}
+
+void
+Checkpoint::remove()
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        std::string const slotFile = getSlotFilename(i);
+        if (util::fs::file_exists(slotFile.c_str()))
+            util::fs::unlink(slotFile.c_str());
+        fileValid[i] = false;
+    }
+    nextSlot = 0;
+}
+
+MVS_NAMESPACE_END
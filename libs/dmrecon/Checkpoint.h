@@ -0,0 +1,129 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <ctime>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "util/refptr.h"
+#include "defines.h"
+#include "ConfidenceQueue.h"
+#include "SingleView.h"
+
+/** Edge length of the tiles written to checkpoints */
+#define MVS_CHECKPOINT_TILE 64
+
+MVS_NAMESPACE_BEGIN
+
+/**
+ * Checkpoint of a running reconstruction in sidecar files. It holds the
+ * depth, normal, dz and confidence images of the reference view and the
+ * pixel queue. The images are stored in fixed tile slots, only tiles
+ * changed since the last write of the file are rewritten. The queue is
+ * rewritten completely. Writes alternate between the file and a second
+ * file with ".1" appended, such that the previous checkpoint survives an
+ * interrupted write. A file that was interrupted while being written is
+ * marked incomplete, resuming uses the newest complete file.
+ *
+ * The file is written in native byte order and is only meant to be read
+ * on the same machine.
+ */
+class Checkpoint
+{
+public:
+    typedef util::RefPtr<Checkpoint> Ptr;
+
+public:
+    /** Interval is the minimum time between two writes in seconds */
+    static Ptr create(std::string const& filename, std::size_t width,
+        std::size_t height, std::size_t interval);
+
+    /** Marks the pixel as changed since the last write */
+    void markDirty(std::size_t x, std::size_t y);
+
+    /** Returns true if writes are enabled and the interval has passed */
+    bool isDue() const;
+
+    /** Writes the changed tiles, the queue and the filled pixel count
+        to the file holding the older checkpoint */
+    void write(SingleView const& refV, ConfidenceQueue const& queue,
+        std::size_t filled);
+
+    /**
+     * Restores images, queue and filled pixel count from the newer file.
+     * Returns false if there is no complete checkpoint for the view's
+     * image size.
+     */
+    bool read(SingleView& refV, ConfidenceQueue* queue, std::size_t* filled);
+
+    /** Deletes the files after the reconstruction has been saved */
+    void remove();
+
+    /** File holding the latest checkpoint */
+    std::string getFilename() const;
+    /** Bytes written by the last write */
+    std::size_t getLastWriteSize() const;
+
+private:
+    Checkpoint(std::string const& filename, std::size_t width,
+        std::size_t height, std::size_t interval);
+    std::size_t tileOffset(std::size_t tile) const;
+    std::size_t queueOffset() const;
+    std::string getSlotFilename(int slot) const;
+    bool readHeader(int slot, uint64_t* header) const;
+
+private:
+    std::string filename;
+    std::size_t width;
+    std::size_t height;
+    std::size_t interval;
+    std::size_t tilesX;
+    std::size_t tilesY;
+    std::vector<unsigned char> dirtyTiles;  // bit per file, set if changed
+    bool fileValid[2];              // file exists with all tile slots
+    int nextSlot;                   // file the next write goes to
+    std::size_t sequence;           // number of the next write
+    std::time_t lastWrite;
+    std::size_t lastWriteSize;
+};
+
+/* ------------------------- Implementation ----------------------- */
+
+inline Checkpoint::Ptr
+Checkpoint::create(std::string const& filename, std::size_t width,
+    std::size_t height, std::size_t interval)
+{
+    return Ptr(new Checkpoint(filename, width, height, interval));
+}
+
+inline void
+Checkpoint::markDirty(std::size_t x, std::size_t y)
+{
+    std::size_t tx = x / MVS_CHECKPOINT_TILE;
+    std::size_t ty = y / MVS_CHECKPOINT_TILE;
+    dirtyTiles[ty * tilesX + tx] = 3;
+}
+
+inline bool
+Checkpoint::isDue() const
+{
+    return interval > 0
+        && std::time(0) - lastWrite >= (std::time_t)interval;
+}
+
+inline std::string
+Checkpoint::getFilename() const
+{
+    return fileValid[1 - nextSlot] ? getSlotFilename(1 - nextSlot) : filename;
+}
+
+inline std::size_t
+Checkpoint::getLastWriteSize() const
+{
+    return lastWriteSize;
+}
+
+MVS_NAMESPACE_END
+
+#endif
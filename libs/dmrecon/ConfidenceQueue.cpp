@@ -0,0 +1,51 @@
+#include "ConfidenceQueue.h"
+
+MVS_NAMESPACE_BEGIN
+
+ConfidenceQueue::ConfidenceQueue(std::size_t numBuckets)
+    :
+    buckets(numBuckets),
+    topBucket(0),
+    count(0),
+    peakCount(0)
+{
+}
+
+void
+ConfidenceQueue::push(QueueData const& data)
+{
+    std::size_t const last = buckets.size() - 1;
+    float pos = data.confidence * (float) buckets.size();
+    std::size_t bucket = 0;
+    if (pos >= (float) last)
+        bucket = last;
+    else if (pos > 0.f)
+        bucket = (std::size_t) pos;
+
+    buckets[bucket].push_back(data);
+    if (bucket > topBucket || count == 0)
+        topBucket = bucket;
+    ++count;
+    if (count > peakCount)
+        peakCount = count;
+}
+
+void
+ConfidenceQueue::pop()
+{
+    buckets[topBucket].pop_back();
+    --count;
+    while (topBucket > 0 && buckets[topBucket].empty())
+        --topBucket;
+}
+
+std::size_t
+ConfidenceQueue::getByteSize() const
+{
+    std::size_t size = buckets.capacity() * sizeof(std::vector<QueueData>);
+    for (std::size_t i = 0; i < buckets.size(); ++i)
+        size += buckets[i].capacity() * sizeof(QueueData);
+    return size;
+}
+
+MVS_NAMESPACE_END
@@ -0,0 +1,105 @@
+#ifndef CONFIDENCEQUEUE_H
+#define CONFIDENCEQUEUE_H
+
+#include <vector>
+
+#include "defines.h"
+#include "FixedIndexSet.h"
+
+MVS_NAMESPACE_BEGIN
+
+/** Queue entry of the region growing, kept free of heap storage */
+struct QueueData
+{
+    unsigned int x;             // pixel position
+    unsigned int y;
+    float confidence;
+    float depth;
+    float dz_i, dz_j;
+    LocalViewSet localViewIDs;
+
+    bool operator< (const QueueData& rhs) const;
+};
+
+/**
+ * Priority queue for QueueData ordered by confidence. Confidences in
+ * [0, 1] are quantized into buckets, which makes push and pop O(1).
+ * Entries within one bucket are returned in LIFO order, so the order
+ * of entries with almost equal confidence is not strict.
+ */
+class ConfidenceQueue
+{
+public:
+    ConfidenceQueue(std::size_t numBuckets = 4096);
+
+    void push(QueueData const& data);
+    QueueData const& top() const;
+    void pop();
+    bool empty() const;
+    std::size_t size() const;
+
+    /** Largest number of entries held at the same time */
+    std::size_t getPeakSize() const;
+
+    /** Memory currently reserved by the buckets in bytes */
+    std::size_t getByteSize() const;
+
+    /** Bucket access for serialization. Pushing the entries of all
+        buckets in order restores the queue including its pop order. */
+    std::size_t getNumBuckets() const;
+    std::vector<QueueData> const& getBucket(std::size_t bucket) const;
+
+private:
+    std::vector< std::vector<QueueData> > buckets;
+    std::size_t topBucket;          // highest non-empty bucket
+    std::size_t count;
+    std::size_t peakCount;
+};
+
+/* ------------------------- Implementation ----------------------- */
+
+inline bool
+QueueData::operator< (const QueueData& rhs) const
+{
+    return (confidence < rhs.confidence);
+}
+
+inline QueueData const&
+ConfidenceQueue::top() const
+{
+    return buckets[topBucket].back();
+}
+
+inline bool
+ConfidenceQueue::empty() const
+{
+    return count == 0;
+}
+
+inline std::size_t
+ConfidenceQueue::size() const
+{
+    return count;
+}
+
+inline std::size_t
+ConfidenceQueue::getPeakSize() const
+{
+    return peakCount;
+}
+
+inline std::size_t
+ConfidenceQueue::getNumBuckets() const
+{
+    return buckets.size();
+}
+
+inline std::vector<QueueData> const&
+ConfidenceQueue::getBucket(std::size_t bucket) const
+{
+    return buckets[bucket];
+}
+
+MVS_NAMESPACE_END
+
+#endif
@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+
+#include "mve/camera.h"
+#include "mve/view.h"
+#include "util/string.h"
+#include "util/threadlocks.h"
+#include "ConsistencyFilter.h"
+
+/* Default memory for cached neighbor depth maps */
+#define MVS_CONSISTENCY_CACHE_SIZE (256 * 1024 * 1024)
+
+MVS_NAMESPACE_BEGIN
+
+class ConsistencyFilter::Worker : public util::Thread
+{
+public:
+    Worker(ConsistencyFilter* _filter)
+        : filter(_filter)
+    {
+    }
+
+protected:
+    void* run()
+    {
+        filter->processViews();
+        return 0;
+    }
+
+private:
+    ConsistencyFilter* filter;
+};
+
+/* ------------------------------------------------------------------ */
+
+inline float
+ConsistencyFilter::DepthMap::depthAt(std::size_t x, std::size_t y) const
+{
+    return mapped.get() ? mapped->at<float>(x, y, 0) : depth->at(x, y, 0);
+}
+
+math::Vec3f
+ConsistencyFilter::DepthMap::worldPos(std::size_t x, std::size_t y,
+    float d) const
+{
+    math::Vec3f ray(invproj * math::Vec3f(float(x) + 0.5f,
+        float(y) + 0.5f, 1.f));
+    return camPos + camToWorld * ray.normalized() * d;
+}
+
+/* ------------------------------------------------------------------ */
+
+ConsistencyFilter::ConsistencyFilter(mve::Scene::Ptr _scene,
+    Settings const& _settings, ViewSelectionCache::Ptr _viewSelectionCache)
+    :
+    scene(_scene),
+    settings(_settings),
+    viewSelectionCache(_viewSelectionCache),
+    depthName("depth-L" + util::string::get(_settings.scale)),
+    cacheMemory(0),
+    maxCacheMemory(MVS_CONSISTENCY_CACHE_SIZE),
+    next(0)
+{
+    if (settings.scale < 0.f)
+        throw std::invalid_argument("Invalid scale factor.");
+    if (settings.minConsistentViews > settings.globalVSMax)
+        throw std::invalid_argument("More consistent views than neighbors.");
+    if (!viewSelectionCache.get())
+        viewSelectionCache = ViewSelectionCache::create();
+
+    stats.views = 0;
+    stats.depths = 0;
+    stats.kept = 0;
+    stats.fused = 0;
+    stats.cacheHits = 0;
+    stats.cacheMisses = 0;
+    stats.mappedMisses = 0;
+}
+
+ConsistencyFilter::~ConsistencyFilter()
+{
+}
+
+std::string
+ConsistencyFilter::getEmbeddingName(float scale)
+{
+    return "filtered-L" + util::string::get(scale);
+}
+
+void
+ConsistencyFilter::run(std::vector<std::size_t> const& ids)
+{
+    mve::Scene::ViewList const& views(scene->get_views());
+    pending.clear();
+    for (std::size_t i = 0; i < ids.size(); ++i)
+        if (ids[i] < views.size() && views[ids[i]].get()
+            && views[ids[i]]->is_camera_valid())
+            pending.push_back(ids[i]);
+    viewSelectionCache->precompute(scene, settings, pending);
+
+    next = 0;
+    workerError.clear();
+    if (settings.numThreads <= 1)
+        processViews();
+    else
+    {
+        std::vector<Worker*> workers(settings.numThreads);
+        for (std::size_t i = 0; i < workers.size(); ++i) {
+            workers[i] = new Worker(this);
+            workers[i]->pt_create();
+        }
+        for (std::size_t i = 0; i < workers.size(); ++i) {
+            workers[i]->pt_join();
+            delete workers[i];
+        }
+    }
+
+    /* the cached depth maps are not needed by later runs */
+    cache.clear();
+    lru.clear();
+    cacheMemory = 0;
+
+    if (!workerError.empty())
+        throw std::runtime_error(workerError);
+}
+
+void
+ConsistencyFilter::processViews()
+{
+    util::MutexLock lock(mutex);
+    while (next < pending.size() && workerError.empty())
+    {
+        std::size_t id = pending[next++];
+        mutex.unlock();
+
+        Stats viewStats;
+        viewStats.views = 0;
+        viewStats.depths = 0;
+        viewStats.kept = 0;
+        viewStats.fused = 0;
+        try
+        {
+            filterView(id, &viewStats);
+        }
+        catch (std::exception& e)
+        {
+            mutex.lock();
+            workerError = e.what();
+            break;
+        }
+
+        mutex.lock();
+        stats.views += viewStats.views;
+        stats.depths += viewStats.depths;
+        stats.kept += viewStats.kept;
+        stats.fused += viewStats.fused;
+        if (viewStats.views == 0)
+            continue;
+        float percent = viewStats.depths ? 100.f * float(viewStats.kept)
+            / float(viewStats.depths) : 0.f;
+        std::cout << "View " << id << ": kept " << viewStats.kept << " of "
+                  << viewStats.depths << " depths ("
+                  << util::string::get_fixed(percent, 1) << " %)."
+                  << std::endl;
+    }
+}
+
+/**  Filters the depth map of a view against the depth maps of its global
+     view selection, then stores and saves the result. */
+void
+ConsistencyFilter::filterView(std::size_t id, Stats* viewStats)
+{
+    DepthMap::ConstPtr ref = fetch(id);
+    if (!ref.get())
+        return;
+
+    GlobalViewSet neighIDs;
+    viewSelectionCache->lookup(id, settings.scale, &neighIDs);
+    std::vector<DepthMap::ConstPtr> neighbors;
+    for (GlobalViewSet::const_iterator n = neighIDs.begin();
+        n != neighIDs.end(); ++n)
+    {
+        DepthMap::ConstPtr neighbor = fetch(*n);
+        if (neighbor.get())
+            neighbors.push_back(neighbor);
+    }
+
+    std::size_t const width = ref->width;
+    std::size_t const height = ref->height;
+    mve::FloatImage::Ptr result(mve::FloatImage::create(width, height, 1));
+    viewStats->views = 1;
+    for (std::size_t y = 0; y < height; ++y)
+        for (std::size_t x = 0; x < width; ++x)
+        {
+            float d = ref->depthAt(x, y);
+            if (d <= 0.f)
+                continue;
+            ++viewStats->depths;
+
+            math::Vec3f point(ref->worldPos(x, y, d));
+            std::size_t agree = 0;
+            float sum = d;
+            for (std::size_t k = 0; k < neighbors.size(); ++k)
+            {
+                DepthMap const& n(*neighbors[k]);
+                math::Vec3f cp(n.worldToCam.mult(point, 1.f));
+                /* cameras look along the negative z-axis */
+                if (cp[2] >= 0.f)
+                    continue;
+                math::Vec3f sp(n.proj * cp);
+                float u = sp[0] / sp[2] - 0.5f;
+                float v = sp[1] / sp[2] - 0.5f;
+                if (!(u > -0.5f && v > -0.5f))
+                    continue;
+                std::size_t nx = std::size_t(u + 0.5f);
+                std::size_t ny = std::size_t(v + 0.5f);
+                if (nx >= n.width || ny >= n.height)
+                    continue;
+                float nd = n.depthAt(nx, ny);
+                if (nd <= 0.f)
+                    continue;
+                float dist = (point - n.camPos).norm();
+                if (std::abs(dist - nd) > settings.consistencyTolerance * nd)
+                    continue;
+                ++agree;
+                if (settings.fuseDepths)
+                    sum += (n.worldPos(nx, ny, nd) - ref->camPos).norm();
+            }
+            if (agree < settings.minConsistentViews)
+                continue;
+
+            ++viewStats->kept;
+            if (settings.fuseDepths && agree > 0) {
+                result->at(x, y, 0) = sum / float(agree + 1);
+                ++viewStats->fused;
+            } else
+                result->at(x, y, 0) = d;
+        }
+
+    mve::View::Ptr view = scene->get_view_by_id(id);
+    view->set_image(getEmbeddingName(settings.scale), result);
+    view->save_mve_file();
+    view->cache_cleanup();
+}
+
+/**  Returns the depth map of a view from the cache or loads it. Views
+     without depth map give a NULL pointer. The depth map is loaded
+     without holding the mutex; if another thread loaded it meanwhile,
+     the cached one is returned. */
+ConsistencyFilter::DepthMap::ConstPtr
+ConsistencyFilter::fetch(std::size_t id)
+{
+    {
+        util::MutexLock lock(mutex);
+        CacheMap::iterator it = cache.find(id);
+        if (it != cache.end()) {
+            ++stats.cacheHits;
+            lru.splice(lru.begin(), lru, it->second.lru);
+            return it->second.depthMap;
+        }
+        ++stats.cacheMisses;
+    }
+
+    mve::View::Ptr view = scene->get_view_by_id(id);
+    if (!view.get() || !view->is_camera_valid()
+        || !view->has_embedding(depthName))
+        return DepthMap::ConstPtr();
+
+    DepthMap* depthMap = new DepthMap;
+    DepthMap::ConstPtr ptr(depthMap);
+    mve::MappedEmbedding::Ptr mapped = view->get_mapped_embedding(depthName);
+    if (mapped.get() && mapped->is_image() && mapped->channels() == 1
+        && mapped->get_type() == mve::IMAGE_TYPE_FLOAT)
+    {
+        depthMap->mapped = mapped;
+        depthMap->width = mapped->width();
+        depthMap->height = mapped->height();
+    }
+    else
+    {
+        /* Unsaved or compressed depth maps are loaded */
+        depthMap->depth = view->get_float_image(depthName);
+        view->cache_cleanup();
+        if (!depthMap->depth.get())
+            return DepthMap::ConstPtr();
+        depthMap->width = depthMap->depth->width();
+        depthMap->height = depthMap->depth->height();
+    }
+
+    std::size_t w = depthMap->width;
+    std::size_t h = depthMap->height;
+    mve::CameraInfo const& cam(view->get_camera());
+    cam.fill_projection(*depthMap->proj, w, h);
+    cam.fill_inverse_projection(*depthMap->invproj, w, h);
+    cam.fill_cam_to_world_rot(*depthMap->camToWorld);
+    cam.fill_world_to_cam(*depthMap->worldToCam);
+    cam.fill_camera_pos(*depthMap->camPos);
+
+    util::MutexLock lock(mutex);
+    if (depthMap->mapped.get())
+        ++stats.mappedMisses;
+    CacheMap::iterator it = cache.find(id);
+    if (it != cache.end())
+        return it->second.depthMap;
+
+    CacheEntry& entry = cache[id];
+    entry.depthMap = ptr;
+    entry.size = w * h * sizeof(float);
+    entry.lru = lru.insert(lru.begin(), id);
+    cacheMemory += entry.size;
+    evict();
+    return ptr;
+}
+
+/**  Drops the least recently used depth maps until the cache fits its
+     budget. Dropped depth maps stay valid while they are used. */
+void
+ConsistencyFilter::evict()
+{
+    while (cacheMemory > maxCacheMemory && !lru.empty())
+    {
+        CacheMap::iterator it = cache.find(lru.back());
+        cacheMemory -= it->second.size;
+        cache.erase(it);
+        lru.pop_back();
+    }
+}
+
+MVS_NAMESPACE_END
@@ -0,0 +1,142 @@
+#ifndef CONSISTENCYFILTER_H
+#define CONSISTENCYFILTER_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "math/matrix.h"
+#include "math/vector.h"
+#include "mve/image.h"
+#include "mve/scene.h"
+#include "mve/view.h"
+#include "util/refptr.h"
+#include "util/thread.h"
+#include "defines.h"
+#include "Settings.h"
+#include "ViewSelectionCache.h"
+
+MVS_NAMESPACE_BEGIN
+
+/**
+ * Multi-view consistency filter for the depth maps of a scene. Every
+ * depth of a view is reprojected into the depth maps of the views of its
+ * global view selection. A neighbor agrees if its depth at the projected
+ * pixel is within settings.consistencyTolerance of the distance of the
+ * point to the neighbor's camera. Depths with fewer than
+ * settings.minConsistentViews agreeing neighbors are dropped. Optionally
+ * kept depths are replaced by the mean of the agreeing depths.
+ *
+ * The filter reads the depth-L<scale> embeddings and writes the result
+ * to filtered-L<scale>, so the result does not depend on the order in
+ * which views are filtered. Views are filtered in parallel, neighbor
+ * depth maps are shared in a cache with a memory budget. Depth maps that
+ * are saved uncompressed are read from the memory-mapped view file
+ * without copying them, others are loaded. Each view is saved after
+ * filtering and its embeddings are released. Loading and saving run
+ * outside the lock of the cache.
+ */
+class ConsistencyFilter
+{
+public:
+    struct Stats
+    {
+        std::size_t views;          // views with a depth map
+        std::size_t depths;         // depths before filtering
+        std::size_t kept;           // depths with enough agreement
+        std::size_t fused;          // kept depths averaged with others
+        std::size_t cacheHits;
+        std::size_t cacheMisses;
+        std::size_t mappedMisses;   // misses read from the mapped file
+    };
+
+public:
+    ConsistencyFilter(mve::Scene::Ptr scene, Settings const& settings,
+        ViewSelectionCache::Ptr viewSelectionCache =
+        ViewSelectionCache::Ptr());
+    ~ConsistencyFilter();
+
+    /** Memory for cached neighbor depth maps in bytes */
+    void setCacheSize(std::size_t bytes);
+
+    /** Filters and saves the depth maps of the given views */
+    void run(std::vector<std::size_t> const& ids);
+
+    Stats const& getStats() const;
+
+    /** Name of the embedding the filtered depth maps are written to */
+    static std::string getEmbeddingName(float scale);
+
+private:
+    /** Depth map with the camera of its view at the depth map size */
+    struct DepthMap
+    {
+        typedef util::RefPtr<DepthMap const> ConstPtr;
+
+        mve::FloatImage::ConstPtr depth;    // loaded copy, or
+        mve::MappedEmbedding::Ptr mapped;   // depths in the view file
+        std::size_t width;
+        std::size_t height;
+        math::Matrix3f proj;
+        math::Matrix3f invproj;
+        math::Matrix3f camToWorld;
+        math::Matrix4f worldToCam;
+        math::Vec3f camPos;
+
+        float depthAt(std::size_t x, std::size_t y) const;
+        math::Vec3f worldPos(std::size_t x, std::size_t y, float d) const;
+    };
+
+    typedef std::list<std::size_t> LRUList;
+    struct CacheEntry
+    {
+        DepthMap::ConstPtr depthMap;
+        std::size_t size;
+        LRUList::iterator lru;
+    };
+    typedef std::map<std::size_t, CacheEntry> CacheMap;
+
+    class Worker;
+
+private:
+    void processViews();
+    void filterView(std::size_t id, Stats* stats);
+    DepthMap::ConstPtr fetch(std::size_t id);
+    void evict();
+
+private:
+    mve::Scene::Ptr scene;
+    Settings settings;
+    ViewSelectionCache::Ptr viewSelectionCache;
+    std::string depthName;
+
+    /** guards the cache and the shared state, views lock themselves */
+    util::Mutex mutex;
+    CacheMap cache;
+    LRUList lru;                    // most recently used first
+    std::size_t cacheMemory;
+    std::size_t maxCacheMemory;
+    std::vector<std::size_t> pending;
+    std::size_t next;
+    std::string workerError;
+    Stats stats;
+};
+
+/* ------------------------- Implementation ----------------------- */
+
+inline void
+ConsistencyFilter::setCacheSize(std::size_t bytes)
+{
+    maxCacheMemory = bytes;
+}
+
+inline ConsistencyFilter::Stats const&
+ConsistencyFilter::getStats() const
+{
+    return stats;
+}
+
+MVS_NAMESPACE_END
+
+#endif
@@ -1,26 +1,78 @@
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
 #include <stdexcept>
 #include <set>
 #include <ctime>
+#include <limits>
 
 #include "DMRecon.h"
 #include "GlobalViewSelection.h"
+#include "PatchMatch.h"
 #include "math/vector.h"
 #include "mve/image.h"
 #include "mve/imagetools.h"
 #include "Settings.h"
+#include "simdtools.h"
 #include "util/fs.h"
+#include "util/hrtimer.h"
 #include "util/string.h"
+#include "util/threadlocks.h"
+
+/* Factor by which the depth range of the features is extended */
+#define MVS_DEPTH_RANGE_MARGIN 1.25f
+/* Pixels added around the neighbor image regions of a tile */
+#define MVS_TILE_CROP_MARGIN 8
+/* Passes over the tiles, later passes continue the queue entries that
+   went back to earlier tiles */
+#define MVS_MAX_TILE_PASSES 8
 
 MVS_NAMESPACE_BEGIN
 
+/** Worker thread that grows the depth map from the shared queue */
+class DMRecon::QueueWorker : public util::Thread
+{
+public:
+    QueueWorker(DMRecon* _recon)
+        : recon(_recon)
+    {
+    }
+
+protected:
+    void* run()
+    {
+        recon->processQueueWorker();
+        return 0;
+    }
+
+private:
+    DMRecon* recon;
+};
 
-DMRecon::DMRecon(mve::Scene::Ptr _scene, Settings const& _settings)
+/* ------------------------------------------------------------------ */
+
+DMRecon::DMRecon(mve::Scene::Ptr _scene, Settings const& _settings,
+    PyramidCache::Ptr _pyramidCache,
+    ViewSelectionCache::Ptr _viewSelectionCache)
     :
     scene(_scene),
-    settings(_settings)
+    pyramidCache(_pyramidCache),
+    viewSelectionCache(_viewSelectionCache),
+    settings(_settings),
+    metrics(_settings.maxIterations),
+    streamedRows(0),
+    tilesX(0),
+    currentTile(0),
+    droppedSeeds(0),
+    activeWorkers(0),
+    idleWorkers(0),
+    workerWakeup(0),
+    drainDone(0),
+    queueCount(0),
+    lastStatus(0),
+    checkpointPending(false)
 {
     mve::Scene::ViewList const& mve_views(scene->get_views());
     std::size_t refViewNr = settings.refViewNr;
@@ -38,6 +90,16 @@ DMRecon::DMRecon(mve::Scene::Ptr _scene, Settings const& _settings)
     if (settings.scale < 0.f)
         throw std::invalid_argument("Invalid scale factor.");
 
+    /* View sets of the patches have a fixed capacity */
+    if (settings.nrReconNeighbors > MVS_MAX_LOCAL_VIEWS)
+        throw std::invalid_argument("Too many reconstruction neighbors.");
+    if (settings.globalVSMax > MVS_MAX_GLOBAL_VIEWS)
+        throw std::invalid_argument("Too many global view selection views.");
+    if (settings.tileSize > 0 && settings.tileSize <= settings.filterWidth)
+        throw std::invalid_argument("Tile size too small.");
+    if (settings.tileSize > 0 && settings.engine != ENGINE_REGION_GROWING)
+        throw std::invalid_argument("Tiles require the region growing engine.");
+
     /* Fetch bundle file. */
     try
     {
@@ -66,18 +128,20 @@ DMRecon::DMRecon(mve::Scene::Ptr _scene, Settings const& _settings)
     mve::ImageBase::Ptr scaled_img = refV->getScaledImg();
     this->width = scaled_img->width();
     this->height = scaled_img->height();
+    region.left = 0;
+    region.top = 0;
+    region.right = this->width;
+    region.bottom = this->height;
+    metrics.viewID = refViewNr;
+    metrics.scale = settings.scale;
+    metrics.width = this->width;
+    metrics.height = this->height;
+    metrics.numThreads = std::max<std::size_t>(1, settings.numThreads);
 
     /* Create log file and write out some general MVS information */
     if (!settings.logPath.empty()) {
         // Create directory if necessary
-        std::string logfn(settings.logPath);
-        std::size_t pos = logfn.find_last_of("/");
-        if (pos != logfn.length() - 1)
-            logfn += "/";
-        if (!util::fs::dir_exists(logfn.c_str()))
-            if (!util::fs::mkdir(logfn.c_str()))
-                if (!util::fs::dir_exists(logfn.c_str()))
-                    throw std::runtime_error("Error creating directory: " + logfn);
+        std::string logfn(createDirectory(settings.logPath));
 
         // Build log file name and open file
         std::string name(refV->createFileName(settings.scale));
@@ -88,6 +152,7 @@ DMRecon::DMRecon(mve::Scene::Ptr _scene, Settings const& _settings)
         log.open(logfn.c_str());
         if (!log.good())
             throw std::runtime_error("Cannot open log file");
+        metricsFile = logfn.substr(0, logfn.size() - 4) + ".json";
     }
     log << "MULTI-VIEW STEREO LOG FILE" << std::endl;
     log << "--------------------------" << std::endl;
@@ -100,6 +165,26 @@ DMRecon::DMRecon(mve::Scene::Ptr _scene, Settings const& _settings)
     log << std::setw(20) << "Use color scale: "
         << std::setw(5) << (settings.useColorScale ? "true" : "false")
         << std::endl;
+
+    /* Checkpoints are kept next to each other in a sidecar directory.
+       They hold full size images and the queue of the region growing,
+       and are not written for tiles or the PatchMatch engine. */
+    if (settings.engine == ENGINE_PATCHMATCH) {
+        log << std::setw(20) << "Dense engine: "
+            << std::setw(5) << "PatchMatch" << std::endl;
+    }
+    else if (settings.tileSize > 0) {
+        log << std::setw(20) << "Tile size: "
+            << std::setw(5) << settings.tileSize << std::endl;
+    }
+    else if (!settings.checkpointPath.empty()
+        && (settings.checkpointInterval > 0 || settings.resume))
+    {
+        std::string fn(createDirectory(settings.checkpointPath));
+        fn += refV->createFileName(settings.scale) + ".ckpt";
+        checkpoint = Checkpoint::create(fn, this->width, this->height,
+            settings.checkpointInterval);
+    }
 }
 
 DMRecon::~DMRecon()
@@ -112,23 +197,114 @@ DMRecon::~DMRecon()
 void DMRecon::start()
 {
     progress.start_time = std::time(0);
+    log << "Sampling kernels: " << getSimdLevelName(getSimdLevel())
+        << std::endl;
 
-    analyzeFeatures();
-    globalViewSelection();
-    processFeatures();
-    processQueue();
+    bool resumed = false;
+    if (settings.resume && checkpoint.get()) {
+        SingleViewPtr refV(views[settings.refViewNr]);
+        resumed = checkpoint->read(*refV, &prQueue, &progress.filled);
+        if (resumed) {
+            std::cout << "Resuming from " << checkpoint->getFilename()
+                      << " with " << progress.filled << " filled pixels and "
+                      << prQueue.size() << " queued." << std::endl;
+            log << "Resuming from " << checkpoint->getFilename()
+                << " with " << progress.filled << " filled pixels and "
+                << prQueue.size() << " queued." << std::endl;
+        }
+    }
+
+    /* Files of an earlier run must not be taken for this run's checkpoint */
+    if (checkpoint.get() && !resumed)
+        checkpoint->remove();
+
+    /* Points are streamed to a file per view and scale, rows are written
+       as soon as they cannot change anymore */
+    if (!settings.pointsPath.empty()) {
+        SingleViewPtr refV(views[settings.refViewNr]);
+        std::string fn(createDirectory(settings.pointsPath));
+        fn += refV->createFileName(settings.scale) + ".pts";
+        pointStream = PointStream::create(fn, settings.refViewNr,
+            settings.scale);
+        streamedRows = 0;
+    }
+
+    /* the features are only needed for the global view selection */
+    bool cachedVS = viewSelectionCache.get() && viewSelectionCache->lookup(
+        settings.refViewNr, settings.scale, &neighViews);
+    if (!cachedVS) {
+        StageTimer timer(metrics, STAGE_ANALYZE_FEATURES);
+        analyzeFeatures();
+    }
+    {
+        StageTimer timer(metrics, STAGE_GLOBAL_VS);
+        globalViewSelection(cachedVS);
+    }
+    if (settings.engine == ENGINE_PATCHMATCH)
+        processPatchMatch();
+    else if (settings.tileSize > 0)
+        processTiles();
+    else
+    {
+        if (!resumed) {
+            {
+                StageTimer timer(metrics, STAGE_PROCESS_FEATURES);
+                processFeatures(region);
+            }
+            if (settings.useLowResSeeds) {
+                StageTimer timer(metrics, STAGE_LOWRES_SEEDS);
+                refillQueueFromLowRes(region);
+            }
+        }
+        StageTimer timer(metrics, STAGE_PROCESS_QUEUE);
+        processQueue();
+    }
+    log << "Queue peak size " << prQueue.getPeakSize() << " entries, "
+        << (prQueue.getByteSize() >> 10) << " KB reserved." << std::endl;
 
     if (progress.cancelled) {
+        if (checkpoint.get() && settings.checkpointInterval > 0)
+            writeCheckpoint();
+        /* incomplete tiled results must not be taken for a result */
+        if (outView.get()) {
+            char const* maps[4] = { "depth", "dz", "conf", "normal" };
+            for (int i = 0; i < 4; ++i)
+                outView->remove_embedding(SingleView::getReconImageName(
+                    maps[i], settings.scale));
+            outView->save_mve_file();
+        }
         progress.status = RECON_CANCELLED;
         return;
     }
 
     progress.status = RECON_SAVING;
-    SingleViewPtr refV(views[settings.refViewNr]);
-    if (settings.writePlyFile) {
-        refV->saveReconAsPly(settings.plyPath, settings.scale);
+    {
+        StageTimer timer(metrics, STAGE_SAVING);
+        SingleViewPtr refV(views[settings.refViewNr]);
+        if (settings.writePlyFile) {
+            if (outView.get())
+                refV->loadReconImages(settings.scale);
+            refV->saveReconAsPly(settings.plyPath, settings.scale);
+        }
+        if (pointStream.get()) {
+            streamPoints(this->height, refV->depthImg, refV->normalImg,
+                refV->confImg);
+            pointStream->close();
+            std::cout << "Streamed " << pointStream->getNumPoints()
+                      << " points to " << pointStream->getFilename()
+                      << std::endl;
+            log << "Streamed " << pointStream->getNumPoints()
+                << " points to " << pointStream->getFilename() << std::endl;
+        }
+        if (outView.get())
+            refV->finishReconImages(settings.scale, settings.mapCodec);
+        else
+            refV->writeReconImages(settings.scale, settings.mapCodec);
+        if (checkpoint.get())
+            checkpoint->remove();
     }
-    refV->writeReconImages(settings.scale);
+    metrics.filled = progress.filled;
+    writeMetrics();
     progress.status = RECON_IDLE;
 
     // Output percentage of filled pixels
@@ -161,11 +337,12 @@ void DMRecon::analyzeFeatures()
     SingleViewPtr refV = views[settings.refViewNr];
 
     mve::BundleFile::FeaturePoints const & features = bundle->get_points();
+    mve::BundleFile::FeatureIndices const & refFeatures =
+        bundle->get_view_features(settings.refViewNr);
 
-    for (std::size_t i = 0; i < features.size() && !progress.cancelled; ++i)
+    for (std::size_t k = 0; k < refFeatures.size() && !progress.cancelled; ++k)
     {
-        if (!features[i].contains_view_id(settings.refViewNr))
-            continue;
+        std::size_t i = refFeatures[k];
         math::Vec3f featurePos(features[i].pos);
         if (!refV->pointInFrustum(featurePos))
             continue;
@@ -178,35 +355,45 @@ void DMRecon::analyzeFeatures()
     }
 }
 
-void DMRecon::globalViewSelection()
+void DMRecon::globalViewSelection(bool cached)
 {
     progress.status = RECON_GLOBALVS;
 
     if (progress.cancelled)  return;
-    // Initialize global view selection
-    GlobalViewSelection globalVS(views, bundle->get_points(), settings);
+    if (!cached) {
+        // Initialize global view selection
+        GlobalViewSelection globalVS(views, bundle->get_points(), settings);
 
-    // Perform global view selection
-    globalVS.performVS();
+        // Perform global view selection
+        globalVS.performVS();
+        neighViews = globalVS.getSelectedIDs();
+        if (viewSelectionCache.get())
+            viewSelectionCache->insert(settings.refViewNr, settings.scale,
+                neighViews);
+    }
 
     // Load selected images + logging and output
-    neighViews = globalVS.getSelectedIDs();
     std::stringstream ss;
-    ss << "Global view selection took the following views: " << std::endl;
-    IndexSet::const_iterator citID;
+    ss << "Global view selection " << (cached ? "(cached) " : "")
+       << "took the following views: " << std::endl;
+    GlobalViewSet::const_iterator citID;
     for (citID = neighViews.begin(); citID != neighViews.end()
          && !progress.cancelled; ++citID)
     {
         ss << *citID << " ";
-        views[*citID]->loadColorImage(this->settings.imageEmbedding);
-        views[*citID]->createImagePyramid();
+        /* tiles load the parts of the pyramids they need */
+        if (settings.tileSize == 0)
+            views[*citID]->loadImagePyramid(this->settings.imageEmbedding,
+                this->pyramidCache);
     }
     ss << std::endl;
     std::cout << ss.str();
     log << ss.str();
 }
 
-void DMRecon::processFeatures()
+/**  Optimizes the features that project into the core region and seeds
+     the queue with them. */
+void DMRecon::processFeatures(Region const& core)
 {
     progress.status = RECON_FEATURES;
     if (progress.cancelled)  return;
@@ -214,28 +401,22 @@ void DMRecon::processFeatures()
     mve::BundleFile::FeaturePoints const & features = bundle->get_points();
 
     /* select features that should be processed:
-       take features only from master view for the moment */
-    std::cout<<"Started to process "<<features.size()<<" features."<<std::endl;
-    log<<"Started to process "<<features.size()<<" features."<<std::endl;
+       features seen by the master view or any of the neighbor views */
+    std::vector<std::size_t> viewIDs(neighViews.begin(), neighViews.end());
+    viewIDs.push_back(settings.refViewNr);
+    mve::BundleFile::FeatureIndices featureIDs;
+    bundle->get_features_union(viewIDs, &featureIDs);
+
+    std::cout<<"Started to process "<<featureIDs.size()<<" of "
+             <<features.size()<<" features."<<std::endl;
+    log<<"Started to process "<<featureIDs.size()<<" of "
+       <<features.size()<<" features."<<std::endl;
     size_t success = 0, processed = 0;
+    PatchSampler::Ptr sampler(PatchSampler::create(views, settings));
 
-    for (size_t i = 0; i < features.size() && !progress.cancelled; ++i)
+    for (size_t k = 0; k < featureIDs.size() && !progress.cancelled; ++k)
     {
-        bool useFeature = false;
-        if (features[i].contains_view_id(settings.refViewNr))
-            useFeature = true;
-        else {
-            IndexSet::const_iterator id = neighViews.begin();
-            while (id != neighViews.end()) {
-                if (features[i].contains_view_id(*id)) {
-                    useFeature = true;
-                    break;
-                }
-                ++id;
-            }
-        }
-        if (!useFeature)
-            continue;
+        std::size_t i = featureIDs[k];
         math::Vec3f featPos(features[i].pos);
         if (!refV->pointInFrustum(featPos)) {
             continue;
@@ -243,13 +424,17 @@ void DMRecon::processFeatures()
         math::Vec2f pixPosF = refV->worldToScreen(featPos);
         std::size_t x = round(pixPosF[0]);
         std::size_t y = round(pixPosF[1]);
+        if (!core.contains(x, y))
+            continue;
         float initDepth = (featPos - refV->camPos).norm();
         PatchOptimization patch(views, settings, x, y, initDepth,
-            0.f, 0.f, neighViews, IndexSet());
+            0.f, 0.f, neighViews, LocalViewSet(), sampler);
         patch.doAutoOptimization();
         ++processed;
         float conf = patch.computeConfidence();
-        size_t index = y * this->width + x;
+        metrics.counters.addPatch(patch.getIterations(), conf != 0,
+            patch.exitedEarly());
+        size_t index = pixelIndex(x, y);
         if (conf == 0) {
             continue;
         }
@@ -278,64 +463,227 @@ void DMRecon::processFeatures()
             tmpData.x = x;
             tmpData.y = y;
             prQueue.push(tmpData);
+            ++metrics.counters.queuePushes;
         }
     }
+    metrics.counters.nccEvaluations += sampler->getNCCCount();
+    metrics.counters.sampledPatches += sampler->getPatchCount();
+    metrics.counters.sparsePatches += sampler->getSparsePatchCount();
+    metrics.counters.samples += sampler->getSampleCount();
     std::cout << "Processed " << processed << " features, from which "
               << success << " succeeded optimization." << std::endl;
     log << "Processed " << processed << " features, from which "
           << success << " succeeded optimization." << std::endl;
 }
 
+/**  Seeds the queue from the reconstruction at the next coarser scale.
+     Every valid low-res pixel is upsampled to one pixel at the current
+     scale and optimized with the low-res depth and depth derivatives as
+     initial values. Only pixels in the core region are seeded. Seeded
+     pixels are marked, their queue entries then only push neighbors. */
+void
+DMRecon::refillQueueFromLowRes(Region const& core)
+{
+    progress.status = RECON_FEATURES;
+    if (progress.cancelled)  return;
+
+    SingleViewPtr refV = views[settings.refViewNr];
+    lowResSeeded.assign(region.width() * region.height(), 0);
+    mve::View::Ptr view = scene->get_views()[settings.refViewNr];
+    std::string lowScale = util::string::get(settings.scale + 1.f);
+    mve::FloatImage::Ptr lowDepth = view->get_float_image("depth-L" + lowScale);
+    mve::FloatImage::Ptr lowDz = view->get_float_image("dz-L" + lowScale);
+    mve::FloatImage::Ptr lowConf = view->get_float_image("conf-L" + lowScale);
+    if (!lowDepth.get() || !lowDz.get() || !lowConf.get()) {
+        std::cout << "No reconstruction at scale " << lowScale
+                  << ", skipping low-res seeding." << std::endl;
+        log << "No reconstruction at scale " << lowScale
+              << ", skipping low-res seeding." << std::endl;
+        return;
+    }
+
+    std::size_t lowWidth = lowDepth->width();
+    std::size_t lowHeight = lowDepth->height();
+    std::size_t seeds = 0, success = 0;
+    PatchSampler::Ptr sampler(PatchSampler::create(views, settings));
+    for (std::size_t ly = 0; ly < lowHeight && !progress.cancelled; ++ly)
+        for (std::size_t lx = 0; lx < lowWidth; ++lx)
+        {
+            std::size_t lowIndex = ly * lowWidth + lx;
+            float initDepth = lowDepth->at(lowIndex);
+            if (initDepth <= 0.f || lowConf->at(lowIndex) <= 0.f)
+                continue;
+            std::size_t x = 2 * lx;
+            std::size_t y = 2 * ly;
+            if (!core.contains(x, y))
+                continue;
+            std::size_t index = pixelIndex(x, y);
+            if (refV->confImg->at(index) > 0.f)
+                continue;
+
+            /* depth derivatives are per pixel and halve at twice
+               the resolution */
+            ++seeds;
+            PatchOptimization patch(views, settings, x, y, initDepth,
+                0.5f * lowDz->at(lowIndex, 0), 0.5f * lowDz->at(lowIndex, 1),
+                neighViews, LocalViewSet(), sampler);
+            patch.doAutoOptimization();
+            float conf = patch.computeConfidence();
+            metrics.counters.addPatch(patch.getIterations(), conf != 0,
+                patch.exitedEarly());
+            if (conf == 0)
+                continue;
+
+            ++success;
+            ++progress.filled;
+            math::Vec3f normal = patch.getNormal();
+            refV->depthImg->at(index) = patch.getDepth();
+            refV->normalImg->at(index, 0) = normal[0];
+            refV->normalImg->at(index, 1) = normal[1];
+            refV->normalImg->at(index, 2) = normal[2];
+            refV->dzImg->at(index, 0) = patch.getDzI();
+            refV->dzImg->at(index, 1) = patch.getDzJ();
+            refV->confImg->at(index) = conf;
+            lowResSeeded[index] = 1;
+            QueueData tmpData;
+            tmpData.confidence = conf;
+            tmpData.depth = patch.getDepth();
+            tmpData.dz_i = patch.getDzI();
+            tmpData.dz_j = patch.getDzJ();
+            tmpData.localViewIDs = patch.getLocalViewIDs();
+            tmpData.x = x;
+            tmpData.y = y;
+            prQueue.push(tmpData);
+            ++metrics.counters.queuePushes;
+        }
+    metrics.counters.nccEvaluations += sampler->getNCCCount();
+    metrics.counters.sampledPatches += sampler->getPatchCount();
+    metrics.counters.sparsePatches += sampler->getSparsePatchCount();
+    metrics.counters.samples += sampler->getSampleCount();
+
+    float hitRate = seeds ? (float) success / (float) seeds : 0.f;
+    std::cout << "Seeded " << seeds << " pixels from scale " << lowScale
+              << ", " << success << " succeeded optimization (hit rate "
+              << util::string::get_fixed(hitRate * 100.f, 1) << " %)."
+              << std::endl;
+    log << "Seeded " << seeds << " pixels from scale " << lowScale
+          << ", " << success << " succeeded optimization (hit rate "
+          << util::string::get_fixed(hitRate * 100.f, 1) << " %)."
+          << std::endl;
+}
+
+void
+DMRecon::printQueueStatus(std::size_t count)
+{
+    /* formatted locally, the stream state of std::cout is shared with
+       reconstructions in other threads */
+    std::stringstream ss;
+    ss << "Count: " << std::setw(8) << count
+       << "  filled: " << std::setw(8) << progress.filled
+       << "  Queue: " << std::setw(8) << progress.queueSize
+       << std::endl;
+    std::cout << ss.str();
+    log << ss.str();
+}
+
+/**  Streams the reconstructed pixels of the rows from streamedRows to
+     bottom of the full width result images as points. The images hold
+     the rows from top on. The color is taken from the scaled reference
+     image. */
+void
+DMRecon::streamPoints(std::size_t bottom, mve::FloatImage::ConstPtr depth,
+    mve::FloatImage::ConstPtr normal, mve::FloatImage::ConstPtr conf,
+    std::size_t top)
+{
+    SingleViewPtr refV(views[settings.refViewNr]);
+    mve::ImageBase::ConstPtr image(refV->getScaledImg());
+    std::size_t const chans = image->channels();
+    for (std::size_t y = streamedRows; y < bottom; ++y)
+        for (std::size_t x = 0; x < this->width; ++x)
+        {
+            float d = depth->at(x, y - top, 0);
+            if (conf->at(x, y - top, 0) <= 0.f || d <= 0.f)
+                continue;
+
+            PointStream::Point point;
+            point.position = refV->camPos + refV->viewRay(x, y) * d;
+            for (int c = 0; c < 3; ++c)
+                point.normal[c] = normal.get()
+                    ? normal->at(x, y - top, c) : 0.f;
+            point.confidence = conf->at(x, y - top, 0);
+            std::size_t index = (y * this->width + x) * chans;
+            for (int c = 0; c < 3; ++c)
+            {
+                std::size_t i = index + std::min<std::size_t>(c, chans - 1);
+                if (image->get_type() == mve::IMAGE_TYPE_UINT8)
+                    point.color[c] = static_cast<mve::ByteImage const*>
+                        (image.get())->at(i);
+                else
+                    point.color[c] = (unsigned char)(255.f * std::min(1.f,
+                        std::max(0.f, static_cast<mve::FloatImage const*>
+                        (image.get())->at(i))) + 0.5f);
+            }
+            point.color[3] = 255;
+            pointStream->add(point);
+        }
+    streamedRows = std::max(streamedRows, bottom);
+}
+
 void
 DMRecon::processQueue()
 {
     progress.status = RECON_QUEUE;
     if (progress.cancelled)  return;
 
+    if (settings.numThreads > 1) {
+        processQueueParallel();
+        return;
+    }
+
     SingleViewPtr refV = this->views[settings.refViewNr];
 
     std::cout << "Process queue ..." << std::endl;
     log << "Process queue ..." << std::endl;
     size_t count = 0, lastStatus = 1;
     progress.queueSize = prQueue.size();
-    std::cout << "Count: " << std::setw(8) << count
-              << "  filled: " << std::setw(8) << progress.filled
-              << "  Queue: " << std::setw(8) << progress.queueSize
-              << std::endl;
-    log << "Count: " << std::setw(8) << count
-          << "  filled: " << std::setw(8) << progress.filled
-          << "  Queue: " << std::setw(8) << progress.queueSize
-          << std::endl;
+    printQueueStatus(count);
     lastStatus = progress.filled;
+    PatchSampler::Ptr sampler(PatchSampler::create(views, settings));
 
     while (!prQueue.empty() && !progress.cancelled)
     {
         progress.queueSize = prQueue.size();
         if ((progress.filled % 1000 == 0) && (progress.filled != lastStatus))
         {
-            std::cout << "Count: " << std::setw(8) << count
-                      << "  filled: " << std::setw(8) << progress.filled
-                      << "  Queue: " << std::setw(8) << progress.queueSize
-                      << std::endl;
-            log << "Count: " << std::setw(8) << count
-                  << "  filled: " << std::setw(8) << progress.filled
-                  << "  Queue: " << std::setw(8) << progress.queueSize
-                  << std::endl;
+            printQueueStatus(count);
             lastStatus = progress.filled;
         }
+        if (checkpoint.get() && count % 1000 == 0 && checkpoint->isDue())
+            writeCheckpoint();
         QueueData tmpData = prQueue.top();
         prQueue.pop();
         ++count;
         float x = tmpData.x;
         float y = tmpData.y;
-        std::size_t index = y * this->width + x;
+        std::size_t index = pixelIndex(x, y);
         if (refV->confImg->at(index) > tmpData.confidence) {
+            ++metrics.counters.stalePops;
             continue ;
         }
+        /* low-res seeds are optimized before they are pushed, their
+           pixel holds the result already */
+        if (!lowResSeeded.empty() && lowResSeeded[index]) {
+            lowResSeeded[index] = 0;
+            pushNeighbors(tmpData, metrics.counters);
+            continue;
+        }
         PatchOptimization patch(views, settings, x, y, tmpData.depth,
-            tmpData.dz_i, tmpData.dz_j, neighViews, tmpData.localViewIDs);
+            tmpData.dz_i, tmpData.dz_j, neighViews, tmpData.localViewIDs,
+            sampler);
         patch.doAutoOptimization();
         tmpData.confidence = patch.computeConfidence();
+        metrics.counters.addPatch(patch.getIterations(),
+            tmpData.confidence != 0, patch.exitedEarly());
         if (tmpData.confidence == 0) {
             continue;
         }
@@ -350,6 +698,8 @@ DMRecon::processQueue()
             ++progress.filled;
         }
         if (refV->confImg->at(index) < tmpData.confidence) {
+            if (!lowResSeeded.empty())
+                lowResSeeded[index] = 0;
             refV->depthImg->at(index) = tmpData.depth;
             refV->normalImg->at(index, 0) = normal[0];
             refV->normalImg->at(index, 1) = normal[1];
@@ -357,42 +707,733 @@ DMRecon::processQueue()
             refV->dzImg->at(index, 0) = tmpData.dz_i;
             refV->dzImg->at(index, 1) = tmpData.dz_j;
             refV->confImg->at(index) = tmpData.confidence;
+            if (checkpoint.get())
+                checkpoint->markDirty(x, y);
+            pushNeighbors(tmpData, metrics.counters);
+        }
+    }
+    metrics.counters.nccEvaluations += sampler->getNCCCount();
+    metrics.counters.sampledPatches += sampler->getPatchCount();
+    metrics.counters.sparsePatches += sampler->getSparsePatchCount();
+    metrics.counters.samples += sampler->getSampleCount();
+}
 
-            // left
-            tmpData.x = x - 1; tmpData.y = y;
-            index = tmpData.y * this->width + tmpData.x;
-            if (refV->confImg->at(index) < tmpData.confidence - 0.05f ||
-                refV->confImg->at(index) == 0.f)
-            {
-                prQueue.push(tmpData);
+/**  Pushes the left, right, top and bottom neighbor of a pixel with the
+     pixel's data, unless their confidence is close to it already.
+     Neighbors outside the region are deferred to their tile. */
+void
+DMRecon::pushNeighbors(QueueData data, PatchCounters& counters)
+{
+    mve::FloatImage const& confImg(*views[settings.refViewNr]->confImg);
+    std::size_t const x = data.x;
+    std::size_t const y = data.y;
+    const int offsetX[4] = { -1, 1, 0, 0 };
+    const int offsetY[4] = { 0, 0, -1, 1 };
+    for (int n = 0; n < 4; ++n) {
+        data.x = x + offsetX[n];
+        data.y = y + offsetY[n];
+        if (!region.contains(data.x, data.y)) {
+            deferSeed(data, counters);
+            continue;
+        }
+        float conf = confImg.at(pixelIndex(data.x, data.y));
+        if (conf < data.confidence - 0.05f || conf == 0.f)
+        {
+            prQueue.push(data);
+            ++counters.queuePushes;
+        }
+        else
+            ++counters.rejectedPushes;
+    }
+}
+
+/**  Keeps a queue entry outside the region as seed of the tile it falls
+     into, earlier tiles continue with it in the next pass. Entries
+     outside the image are dropped. */
+void
+DMRecon::deferSeed(QueueData const& data, PatchCounters& counters)
+{
+    if (settings.tileSize == 0 || data.x >= this->width
+        || data.y >= this->height)
+        return;
+    std::size_t tile = data.y / settings.tileSize * tilesX
+        + data.x / settings.tileSize;
+    float conf = outConf->at<float>(data.x, data.y, 0);
+    if (conf < data.confidence - 0.05f || conf == 0.f)
+    {
+        tileSeeds[tile].push_back(data);
+        ++counters.queuePushes;
+    }
+    else
+        ++counters.rejectedPushes;
+}
+
+/**  Writes the checkpoint and reports its size and write time. */
+void
+DMRecon::writeCheckpoint()
+{
+    util::HRTimer timer;
+    checkpoint->write(*views[settings.refViewNr], prQueue, progress.filled);
+    std::cout << "Checkpoint: " << (checkpoint->getLastWriteSize() >> 10)
+              << " KB written in " << timer.get_elapsed() << " ms, "
+              << prQueue.size() << " queued." << std::endl;
+    log << "Checkpoint: " << (checkpoint->getLastWriteSize() >> 10)
+        << " KB written in " << timer.get_elapsed() << " ms, "
+        << prQueue.size() << " queued." << std::endl;
+}
+
+/**  Writes the metrics as JSON next to the log file and a summary to the
+     log. Nothing is written without a log path. */
+void
+DMRecon::writeMetrics()
+{
+    if (metricsFile.empty())
+        return;
+
+    PatchCounters const& c = metrics.counters;
+    log << "Optimized " << c.optimizations << " patches in "
+        << c.iterations << " iterations, " << c.failedOptimizations
+        << " failed, " << c.nccEvaluations << " NCC evaluations."
+        << std::endl;
+    float perPixel = metrics.filled ? float(c.samples)
+        / float(metrics.filled) : 0.f;
+    log << "Sampled " << c.sampledPatches << " patches, "
+        << c.sparsePatches << " sparse, " << c.samples
+        << " neighbor samples, " << util::string::get_fixed(perPixel, 1)
+        << " per filled pixel." << std::endl;
+    log << "Queue pushes: " << c.queuePushes << ", rejected: "
+        << c.rejectedPushes << ", stale pops: " << c.stalePops
+        << ", busy pops: " << c.busyPops << ", lock contentions: "
+        << c.lockContentions << std::endl;
+    for (int i = 0; i < STAGE_COUNT; ++i)
+        log << std::setw(24) << Metrics::getStageName(MetricsStage(i))
+            << std::setw(10) << metrics.stages[i].wallMs << " ms wall"
+            << std::setw(10) << metrics.stages[i].cpuMs << " ms cpu"
+            << std::endl;
+
+    std::ofstream out(metricsFile.c_str());
+    if (!out.good())
+        throw std::runtime_error("Cannot open metrics file: " + metricsFile);
+    metrics.writeJSON(out);
+    out.close();
+}
+
+/**  Creates the directory if necessary and returns the path with a
+     trailing slash. */
+std::string
+DMRecon::createDirectory(std::string const& path)
+{
+    std::string dir(path);
+    std::size_t pos = dir.find_last_of("/");
+    if (pos != dir.length() - 1)
+        dir += "/";
+    if (!util::fs::dir_exists(dir.c_str()))
+        if (!util::fs::mkdir(dir.c_str()))
+            if (!util::fs::dir_exists(dir.c_str()))
+                throw std::runtime_error("Error creating directory: " + dir);
+    return dir;
+}
+
+/**  Processes the queue with several worker threads. All threads share the
+     priority queue and the result images, which are only accessed while
+     holding the queue mutex. The expensive patch optimization runs without
+     the lock. A pixel that is currently optimized by another thread is
+     marked busy and competing queue entries for that pixel are dropped.
+     Workers without work block until another worker pushes pixels or
+     finishes. The queue is not partitioned, every pop and every result
+     goes through the one mutex, which bounds the scaling with the number
+     of threads; the contended acquisitions are counted in the metrics. */
+void
+DMRecon::processQueueParallel()
+{
+    std::cout << "Process queue using " << settings.numThreads
+              << " threads ..." << std::endl;
+    log << "Process queue using " << settings.numThreads
+          << " threads ..." << std::endl;
+
+    pixelBusy.clear();
+    pixelBusy.resize(region.width() * region.height(), 0);
+    activeWorkers = 0;
+    idleWorkers = 0;
+    queueCount = 0;
+    checkpointPending = false;
+    workerError.clear();
+    progress.queueSize = prQueue.size();
+    printQueueStatus(queueCount);
+    lastStatus = progress.filled;
+
+    std::vector<QueueWorker*> workers(settings.numThreads);
+    for (std::size_t i = 0; i < workers.size(); ++i) {
+        workers[i] = new QueueWorker(this);
+        workers[i]->pt_create();
+    }
+    for (std::size_t i = 0; i < workers.size(); ++i) {
+        workers[i]->pt_join();
+        delete workers[i];
+    }
+    pixelBusy.clear();
+
+    if (!workerError.empty())
+        throw std::runtime_error(workerError);
+}
+
+void
+DMRecon::processQueueWorker()
+{
+    SingleViewPtr refV = this->views[settings.refViewNr];
+    PatchSampler::Ptr sampler(PatchSampler::create(views, settings));
+    PatchCounters counters(settings.maxIterations);
+    lockQueue(counters);
+
+    while (!progress.cancelled && workerError.empty())
+    {
+        if (prQueue.empty()) {
+            if (activeWorkers == 0)
+                break;
+            /* other workers may still push new pixels */
+            waitIdle();
+            continue;
+        }
+
+        progress.queueSize = prQueue.size();
+        if ((progress.filled % 1000 == 0) && (progress.filled != lastStatus))
+        {
+            printQueueStatus(queueCount);
+            lastStatus = progress.filled;
+        }
+        if (checkpointPending) {
+            waitIdle();
+            continue;
+        }
+        if (checkpoint.get() && queueCount % 1000 == 0
+            && checkpoint->isDue())
+        {
+            /* the checkpoint needs all optimizations finished */
+            checkpointPending = true;
+            if (activeWorkers > 0) {
+                queueMutex.unlock();
+                drainDone.wait();
+                lockQueue(counters);
             }
-            // right
-            tmpData.x = x + 1; tmpData.y = y;
-            index = tmpData.y * this->width + tmpData.x;
-            if (refV->confImg->at(index) < tmpData.confidence - 0.05f ||
-                refV->confImg->at(index) == 0.f)
-            {
-                prQueue.push(tmpData);
+            writeCheckpoint();
+            checkpointPending = false;
+            wakeIdleWorkers();
+            continue;
+        }
+        QueueData tmpData = prQueue.top();
+        prQueue.pop();
+        ++queueCount;
+        std::size_t x = tmpData.x;
+        std::size_t y = tmpData.y;
+        std::size_t index = pixelIndex(x, y);
+        if (refV->confImg->at(index) > tmpData.confidence) {
+            ++counters.stalePops;
+            continue;
+        }
+        if (!lowResSeeded.empty() && lowResSeeded[index]) {
+            lowResSeeded[index] = 0;
+            pushNeighbors(tmpData, counters);
+            wakeIdleWorkers();
+            continue;
+        }
+        if (pixelBusy[index]) {
+            ++counters.busyPops;
+            continue;
+        }
+        pixelBusy[index] = 1;
+        ++activeWorkers;
+        queueMutex.unlock();
+
+        float confidence = 0.f;
+        std::size_t iterations = 0;
+        bool earlyExit = false;
+        math::Vec3f normal;
+        try
+        {
+            PatchOptimization patch(views, settings, x, y, tmpData.depth,
+                tmpData.dz_i, tmpData.dz_j, neighViews, tmpData.localViewIDs,
+                sampler);
+            patch.doAutoOptimization();
+            confidence = patch.computeConfidence();
+            iterations = patch.getIterations();
+            earlyExit = patch.exitedEarly();
+            if (confidence != 0) {
+                tmpData.depth = patch.getDepth();
+                tmpData.dz_i = patch.getDzI();
+                tmpData.dz_j = patch.getDzJ();
+                tmpData.localViewIDs = patch.getLocalViewIDs();
+                normal = patch.getNormal();
             }
-            // top
-            tmpData.x = x; tmpData.y = y - 1;
-            index = tmpData.y * this->width + tmpData.x;
-            if (refV->confImg->at(index) < tmpData.confidence - 0.05f ||
-                refV->confImg->at(index) == 0.f)
+        }
+        catch (std::exception& e)
+        {
+            lockQueue(counters);
+            workerError = e.what();
+            pixelBusy[index] = 0;
+            finishOptimization();
+            break;
+        }
+
+        lockQueue(counters);
+        pixelBusy[index] = 0;
+        counters.addPatch(iterations, confidence != 0, earlyExit);
+        tmpData.confidence = confidence;
+        if (confidence != 0 && refV->confImg->at(index) <= 0) {
+            ++progress.filled;
+        }
+        if (confidence != 0
+            && refV->confImg->at(index) < tmpData.confidence)
+        {
+            if (!lowResSeeded.empty())
+                lowResSeeded[index] = 0;
+            refV->depthImg->at(index) = tmpData.depth;
+            refV->normalImg->at(index, 0) = normal[0];
+            refV->normalImg->at(index, 1) = normal[1];
+            refV->normalImg->at(index, 2) = normal[2];
+            refV->dzImg->at(index, 0) = tmpData.dz_i;
+            refV->dzImg->at(index, 1) = tmpData.dz_j;
+            refV->confImg->at(index) = tmpData.confidence;
+            if (checkpoint.get())
+                checkpoint->markDirty(x, y);
+            pushNeighbors(tmpData, counters);
+        }
+        finishOptimization();
+    }
+
+    /* the lock is held again when leaving the loop, idle workers have
+       to see why this worker stopped */
+    wakeIdleWorkers();
+    counters.nccEvaluations = sampler->getNCCCount();
+    counters.sampledPatches = sampler->getPatchCount();
+    counters.sparsePatches = sampler->getSparsePatchCount();
+    counters.samples = sampler->getSampleCount();
+    metrics.counters.add(counters);
+    queueMutex.unlock();
+}
+
+/**  Acquires the queue mutex. Acquisitions that have to wait for another
+     worker are counted, they show how much the single queue limits the
+     scaling with the number of threads. */
+void
+DMRecon::lockQueue(PatchCounters& counters)
+{
+    if (queueMutex.trylock() == 0)
+        return;
+    ++counters.lockContentions;
+    queueMutex.lock();
+}
+
+/**  Blocks the worker until another worker wakes it. The queue mutex is
+     held when called and again on return. */
+void
+DMRecon::waitIdle()
+{
+    ++idleWorkers;
+    queueMutex.unlock();
+    workerWakeup.wait();
+    queueMutex.lock();
+}
+
+/**  Wakes all idle workers, the queue mutex is held when called. */
+void
+DMRecon::wakeIdleWorkers()
+{
+    for (; idleWorkers > 0; --idleWorkers)
+        workerWakeup.post();
+}
+
+/**  Ends the optimization of a worker, the queue mutex is held when
+     called. Idle workers are woken if there is work for them or if all
+     work is done, the last optimization lets a pending checkpoint go. */
+void
+DMRecon::finishOptimization()
+{
+    --activeWorkers;
+    if (checkpointPending) {
+        if (activeWorkers == 0)
+            drainDone.post();
+        return;
+    }
+    if (!prQueue.empty() || activeWorkers == 0)
+        wakeIdleWorkers();
+}
+
+/* ------------------------------------------------------------------ */
+
+/**  Reconstructs the reference view in tiles of settings.tileSize pixels.
+     Result images, queue and neighbor pyramids only cover one tile and
+     its overlap at a time, the neighbor images are read cropped to the
+     tile from their mapped embeddings where possible. The results are
+     kept in embeddings of the reference view reserved in its file, each
+     tile reads its region from there and writes it back when finished.
+     Tiles are processed in raster order, queue entries that leave the
+     region of a tile seed the tile they fall into. Entries for earlier
+     tiles are continued in further passes over the tiles that got seeds.
+     Points are streamed after the last pass, band by band. */
+void
+DMRecon::processTiles()
+{
+    std::size_t const size = settings.tileSize;
+    tilesX = (this->width + size - 1) / size;
+    std::size_t tilesY = (this->height + size - 1) / size;
+    std::vector<Region> tiles;
+    for (std::size_t ty = 0; ty < tilesY; ++ty)
+        for (std::size_t tx = 0; tx < tilesX; ++tx)
+        {
+            Region core;
+            core.left = tx * size;
+            core.top = ty * size;
+            core.right = std::min(core.left + size, this->width);
+            core.bottom = std::min(core.top + size, this->height);
+            tiles.push_back(core);
+        }
+
+    std::vector< std::vector<Region> > crops;
+    computeNeighborCrops(tiles, &crops);
+
+    SingleViewPtr refV(views[settings.refViewNr]);
+    outView = scene->get_views()[settings.refViewNr];
+    refV->reserveReconImages(settings.scale, pointStream.get() != 0);
+    outView->save_mve_file();
+    tileSeeds.clear();
+    tileSeeds.resize(tiles.size());
+    droppedSeeds = 0;
+
+    std::cout << "Reconstructing " << tiles.size() << " tiles of "
+              << size << " pixels." << std::endl;
+    log << "Reconstructing " << tiles.size() << " tiles of "
+        << size << " pixels." << std::endl;
+    bool seeded = true;
+    for (std::size_t pass = 0; pass < MVS_MAX_TILE_PASSES && seeded
+        && !progress.cancelled; ++pass)
+    {
+        if (pass > 0) {
+            std::cout << "Pass " << pass + 1 << " over the seeded tiles."
+                      << std::endl;
+            log << "Pass " << pass + 1 << " over the seeded tiles."
+                << std::endl;
+        }
+        for (currentTile = 0; currentTile < tiles.size()
+            && !progress.cancelled; ++currentTile)
+        {
+            if (pass > 0 && tileSeeds[currentTile].empty())
+                continue;
             {
-                prQueue.push(tmpData);
+                StageTimer timer(metrics, STAGE_LOAD_TILE);
+                startTile(tiles[currentTile], crops[currentTile]);
+            }
+            if (pass == 0) {
+                StageTimer timer(metrics, STAGE_PROCESS_FEATURES);
+                processFeatures(tiles[currentTile]);
+            }
+            if (pass == 0 && settings.useLowResSeeds) {
+                StageTimer timer(metrics, STAGE_LOWRES_SEEDS);
+                refillQueueFromLowRes(tiles[currentTile]);
             }
-            // bottom
-            tmpData.x = x; tmpData.y = y + 1;
-            index = tmpData.y * this->width + tmpData.x;
-            if (refV->confImg->at(index) < tmpData.confidence - 0.05f ||
-                refV->confImg->at(index) == 0.f)
             {
-                prQueue.push(tmpData);
+                StageTimer timer(metrics, STAGE_PROCESS_QUEUE);
+                processQueue();
             }
+            finishTile();
+        }
+
+        seeded = false;
+        for (std::size_t i = 0; i < tileSeeds.size() && !seeded; ++i)
+            seeded = !tileSeeds[i].empty();
+    }
+    for (std::size_t i = 0; i < tileSeeds.size(); ++i)
+        droppedSeeds += tileSeeds[i].size();
+    log << "Dropped " << droppedSeeds << " queue entries after the last pass."
+        << std::endl;
+
+    /* Rows are final after the last pass */
+    for (std::size_t top = 0; pointStream.get() && top < this->height
+        && !progress.cancelled; top += size)
+    {
+        StageTimer timer(metrics, STAGE_SAVING);
+        Region band;
+        band.left = 0;
+        band.top = top;
+        band.right = this->width;
+        band.bottom = std::min(top + size, this->height);
+        streamPoints(band.bottom, readResult("depth", band),
+            readResult("normal", band), readResult("conf", band), top);
+    }
+
+    refV->depthImg.reset();
+    refV->normalImg.reset();
+    refV->dzImg.reset();
+    refV->confImg.reset();
+    region.left = 0;
+    region.top = 0;
+    region.right = this->width;
+    region.bottom = this->height;
+}
+
+/* Converts a pixel coordinate to an index, negative values become 0 */
+static std::size_t
+clampCoordinate(float value)
+{
+    if (!(value > 0.f))
+        return 0;
+    return std::size_t(std::min(value, 1e9f));
+}
+
+/**  Computes for every tile and global neighbor the region of the neighbor
+     image the tile's patches can be sampled from. The depths of the
+     patches are assumed to be in the range of the features seen by the
+     reference view plus a margin. Neighbors that see part of this range
+     behind their camera need the full image. */
+void
+DMRecon::computeNeighborCrops(std::vector<Region> const& tiles,
+    std::vector< std::vector<Region> >* crops)
+{
+    SingleViewPtr refV(views[settings.refViewNr]);
+    float minDepth, maxDepth;
+    bool haveRange = featureDepthRange(&minDepth, &maxDepth);
+
+    Region full;
+    full.left = 0;
+    full.top = 0;
+    full.right = std::numeric_limits<std::size_t>::max();
+    full.bottom = std::numeric_limits<std::size_t>::max();
+    crops->clear();
+    crops->resize(tiles.size(), std::vector<Region>(neighViews.size(), full));
+    if (!haveRange)
+        return;
+
+    float const nearDepth = minDepth / MVS_DEPTH_RANGE_MARGIN;
+    float const farDepth = maxDepth * MVS_DEPTH_RANGE_MARGIN;
+    float const border = float(settings.tileOverlap
+        + settings.filterWidth / 2 + 1);
+    for (std::size_t t = 0; t < tiles.size(); ++t)
+    {
+        /* rays through the corners of the region and its patches */
+        Region const& core = tiles[t];
+        float const left = float(core.left) - border;
+        float const top = float(core.top) - border;
+        float const right = float(core.right - 1) + border;
+        float const bottom = float(core.bottom - 1) + border;
+        math::Vec3f center(refV->viewRay(0.5f * (left + right),
+            0.5f * (top + bottom), 0));
+        math::Vec3f rays[4];
+        rays[0] = refV->viewRay(left, top, 0);
+        rays[1] = refV->viewRay(right, top, 0);
+        rays[2] = refV->viewRay(left, bottom, 0);
+        rays[3] = refV->viewRay(right, bottom, 0);
+
+        /* depths are distances along the rays, the far sphere bulges out
+           of the plane through the far corners */
+        float minCos = 1.f;
+        for (int c = 0; c < 4; ++c)
+            minCos = std::min(minCos, rays[c].dot(center));
+        float const depths[2] = { nearDepth, farDepth / minCos };
+
+        GlobalViewSet::const_iterator id = neighViews.begin();
+        for (std::size_t k = 0; id != neighViews.end(); ++id, ++k)
+        {
+            math::Vec2f lo(std::numeric_limits<float>::max());
+            math::Vec2f hi(-std::numeric_limits<float>::max());
+            bool inFront = true;
+            for (int c = 0; c < 4 && inFront; ++c)
+                for (int d = 0; d < 2; ++d)
+                {
+                    math::Vec3f point(refV->camPos + rays[c] * depths[d]);
+                    if (views[*id]->footPrint(point) <= 0.f) {
+                        inFront = false;
+                        break;
+                    }
+                    math::Vec2f pos(views[*id]->worldToScreen(point));
+                    lo = math::Vec2f(std::min(lo[0], pos[0]),
+                        std::min(lo[1], pos[1]));
+                    hi = math::Vec2f(std::max(hi[0], pos[0]),
+                        std::max(hi[1], pos[1]));
+                }
+            if (!inFront)
+                continue;
+
+            Region& crop = (*crops)[t][k];
+            float const margin = float(MVS_TILE_CROP_MARGIN);
+            crop.left = clampCoordinate(std::floor(lo[0]) - margin);
+            crop.top = clampCoordinate(std::floor(lo[1]) - margin);
+            crop.right = clampCoordinate(std::ceil(hi[0]) + margin + 1.f);
+            crop.bottom = clampCoordinate(std::ceil(hi[1]) + margin + 1.f);
         }
     }
 }
 
+/**  Makes the core region plus overlap the current region: loads the
+     neighbor pyramids for it, reads the result images of the region
+     stored so far and pushes the seeds of the tile. */
+void
+DMRecon::startTile(Region const& core, std::vector<Region> const& crops)
+{
+    std::size_t const overlap = settings.tileOverlap;
+    region.left = core.left > overlap ? core.left - overlap : 0;
+    region.top = core.top > overlap ? core.top - overlap : 0;
+    region.right = std::min(core.right + overlap, this->width);
+    region.bottom = std::min(core.bottom + overlap, this->height);
+
+    std::size_t pyramidBytes = 0;
+    GlobalViewSet::const_iterator id = neighViews.begin();
+    for (std::size_t k = 0; id != neighViews.end(); ++id, ++k)
+    {
+        Region const& crop = crops[k];
+        views[*id]->loadImagePyramid(settings.imageEmbedding,
+            crop.left, crop.top, crop.right, crop.bottom);
+        pyramidBytes += views[*id]->getPyramidByteSize();
+    }
+
+    SingleViewPtr refV(views[settings.refViewNr]);
+    refV->depthImg = readResult("depth", region);
+    refV->dzImg = readResult("dz", region);
+    refV->confImg = readResult("conf", region);
+    if (pointStream.get())
+        refV->normalImg = readResult("normal", region);
+    else
+        refV->normalImg = mve::FloatImage::create(region.width(),
+            region.height(), 3);
+    outConf = outView->get_mapped_embedding(
+        SingleView::getReconImageName("conf", settings.scale));
+    lowResSeeded.clear();
+
+    std::vector<QueueData>& seeds = tileSeeds[currentTile];
+    for (std::size_t i = 0; i < seeds.size(); ++i)
+        prQueue.push(seeds[i]);
+    std::cout << "Tile " << currentTile + 1 << " of " << tileSeeds.size()
+              << ": " << seeds.size() << " seeds, neighbor pyramids "
+              << (pyramidBytes >> 20) << " MB." << std::endl;
+    log << "Tile " << currentTile + 1 << " of " << tileSeeds.size()
+        << " at (" << core.left << ", " << core.top << ") - ("
+        << core.right << ", " << core.bottom << "): " << seeds.size()
+        << " seeds, neighbor pyramids " << (pyramidBytes >> 20) << " MB."
+        << std::endl;
+    std::vector<QueueData>().swap(seeds);
+}
+
+/**  Writes the result images of the current region, including the
+     overlap, to the stored results. They started from the stored results
+     and only took better ones. */
+void
+DMRecon::finishTile()
+{
+    SingleViewPtr refV(views[settings.refViewNr]);
+    outConf.reset();
+    outView->write_image_region(SingleView::getReconImageName("depth",
+        settings.scale), region.left, region.top, refV->depthImg);
+    outView->write_image_region(SingleView::getReconImageName("dz",
+        settings.scale), region.left, region.top, refV->dzImg);
+    outView->write_image_region(SingleView::getReconImageName("conf",
+        settings.scale), region.left, region.top, refV->confImg);
+    if (pointStream.get())
+        outView->write_image_region(SingleView::getReconImageName("normal",
+            settings.scale), region.left, region.top, refV->normalImg);
+}
+
+/**  Reads an area of a stored result image of the reference view. */
+mve::FloatImage::Ptr
+DMRecon::readResult(std::string const& map, Region const& area) const
+{
+    std::string const name(SingleView::getReconImageName(map, settings.scale));
+    mve::MappedEmbedding::Ptr mapped = outView->get_mapped_embedding(name);
+    if (mapped.get() == NULL)
+        throw std::runtime_error("Cannot map result image " + name);
+    std::size_t const chans = mapped->channels();
+    mve::FloatImage::Ptr image = mve::FloatImage::create(area.width(),
+        area.height(), chans);
+    std::size_t const rowSize = area.width() * chans * sizeof(float);
+    for (std::size_t y = area.top; y < area.bottom; ++y)
+        std::memcpy(image->begin() + (y - area.top) * area.width() * chans,
+            mapped->get_byte_pointer()
+            + (y * mapped->width() + area.left) * chans * sizeof(float),
+            rowSize);
+    return image;
+}
+
+/* ------------------------------------------------------------------ */
+
+/**  Computes the range of distances to the camera of the bundle features
+     in the frustum of the reference view. Returns false if there are no
+     such features. */
+bool
+DMRecon::featureDepthRange(float* minDepth, float* maxDepth) const
+{
+    SingleViewPtr refV(views[settings.refViewNr]);
+    mve::BundleFile::FeaturePoints const& features = bundle->get_points();
+    *minDepth = std::numeric_limits<float>::max();
+    *maxDepth = 0.f;
+    for (std::size_t i = 0; i < features.size(); ++i)
+    {
+        math::Vec3f pos(features[i].pos);
+        if (!refV->pointInFrustum(pos))
+            continue;
+        float depth = (pos - refV->camPos).norm();
+        *minDepth = std::min(*minDepth, depth);
+        *maxDepth = std::max(*maxDepth, depth);
+    }
+    return *maxDepth > 0.f;
+}
+
+/**  Reconstructs the reference view with the PatchMatch engine. The
+     features of the reference view seed their pixels, the depth range of
+     all features in the frustum bounds the random hypotheses. */
+void
+DMRecon::processPatchMatch()
+{
+    progress.status = RECON_QUEUE;
+    if (progress.cancelled)  return;
+
+    float minDepth, maxDepth;
+    if (!featureDepthRange(&minDepth, &maxDepth)) {
+        std::cout << "No features in the reference view, skipping "
+                  << "PatchMatch." << std::endl;
+        log << "No features in the reference view, skipping "
+            << "PatchMatch." << std::endl;
+        return;
+    }
+
+    SingleViewPtr refV(views[settings.refViewNr]);
+    PatchMatch engine(views, settings, neighViews, progress);
+    engine.setDepthRange(minDepth / MVS_DEPTH_RANGE_MARGIN,
+        maxDepth * MVS_DEPTH_RANGE_MARGIN);
+    mve::BundleFile::FeaturePoints const& features = bundle->get_points();
+    mve::BundleFile::FeatureIndices const& refFeatures =
+        bundle->get_view_features(settings.refViewNr);
+    for (std::size_t k = 0; k < refFeatures.size(); ++k)
+    {
+        math::Vec3f pos(features[refFeatures[k]].pos);
+        if (!refV->pointInFrustum(pos))
+            continue;
+        math::Vec2f pixPos = refV->worldToScreen(pos);
+        engine.addSeed(round(pixPos[0]), round(pixPos[1]),
+            (pos - refV->camPos).norm());
+    }
+
+    std::cout << "PatchMatch with " << settings.patchMatchIterations
+              << " sweeps ..." << std::endl;
+    log << "PatchMatch with " << settings.patchMatchIterations
+        << " sweeps ..." << std::endl;
+    {
+        StageTimer timer(metrics, STAGE_PROPAGATION);
+        engine.initialize();
+        for (std::size_t i = 0; i < settings.patchMatchIterations
+            && !progress.cancelled; ++i)
+        {
+            util::HRTimer sweepTimer;
+            std::size_t improved = engine.sweep(i);
+            std::cout << "Sweep " << i + 1 << ": " << improved
+                      << " hypotheses improved in "
+                      << sweepTimer.get_elapsed() << " ms." << std::endl;
+            log << "Sweep " << i + 1 << ": " << improved
+                << " hypotheses improved in "
+                << sweepTimer.get_elapsed() << " ms." << std::endl;
+        }
+    }
+    {
+        StageTimer timer(metrics, STAGE_REFINEMENT);
+        engine.refine();
+    }
+    metrics.counters.add(engine.getCounters());
+}
 
 MVS_NAMESPACE_END
@@ -4,67 +4,136 @@
 #include <fstream>
 #include <string>
 #include <vector>
-#include <queue>
 
 #include "mve/bundlefile.h"
 #include "mve/image.h"
 #include "mve/scene.h"
+#include "util/thread.h"
 
 #include "defines.h"
+#include "Checkpoint.h"
+#include "ConfidenceQueue.h"
+#include "Metrics.h"
 #include "PatchOptimization.h"
+#include "PointStream.h"
+#include "PyramidCache.h"
 #include "SingleView.h"
 #include "Progress.h"
+#include "ViewSelectionCache.h"
 
 
 MVS_NAMESPACE_BEGIN
 
-struct QueueData
-{
-    std::size_t x;              // pixel position
-    std::size_t y;
-    float confidence;
-    float depth;
-    float dz_i, dz_j;
-    IndexSet localViewIDs;
-
-    bool operator< (const QueueData& rhs) const;
-};
-
-inline bool
-QueueData::operator< (const QueueData& rhs) const
-{
-    return (confidence < rhs.confidence);
-}
-
 class DMRecon
 {
 public:
-    DMRecon(mve::Scene::Ptr scene, Settings const& settings);
+    /** Neighbor image pyramids and global view selections are shared
+        through the caches if given */
+    DMRecon(mve::Scene::Ptr scene, Settings const& settings,
+        PyramidCache::Ptr pyramidCache = PyramidCache::Ptr(),
+        ViewSelectionCache::Ptr viewSelectionCache =
+        ViewSelectionCache::Ptr());
     ~DMRecon();
 
     Progress const& getProgress() const;
     Progress& getProgress();
+    /** Stage times and counters, complete after start() returned */
+    Metrics const& getMetrics() const;
     void start();            // according to settings
 
+private:
+    /** Pixel rectangle [left, right) x [top, bottom) */
+    struct Region
+    {
+        std::size_t left;
+        std::size_t top;
+        std::size_t right;
+        std::size_t bottom;
+
+        bool contains(std::size_t x, std::size_t y) const;
+        std::size_t width() const;
+        std::size_t height() const;
+    };
+
 private:
     mve::Scene::Ptr scene;
     mve::BundleFile::ConstPtr bundle;
     SingleViewPtrList views;
+    PyramidCache::Ptr pyramidCache;
+    ViewSelectionCache::Ptr viewSelectionCache;
 
     Settings settings;
-    std::priority_queue<QueueData> prQueue;
-    IndexSet neighViews;
+    ConfidenceQueue prQueue;
+    GlobalViewSet neighViews;
     std::vector<SingleViewPtr> imgNeighbors;
     std::size_t width;
     std::size_t height;
     Progress progress;
     std::ofstream log;
+    std::string metricsFile;
+    Metrics metrics;
+    Checkpoint::Ptr checkpoint;
+    PointStream::Ptr pointStream;
+    std::size_t streamedRows;       // rows of the view already streamed
+    /** pixels holding an optimized low-res seed that is still queued */
+    std::vector<unsigned char> lowResSeeded;
+
+    /** area of the reference view covered by the result images */
+    Region region;
+
+    /** tiled reconstruction: results are kept in the reserved result
+        maps of the reference view, queue entries that leave the region
+        of a tile are kept for the tile they fall into */
+    mve::View::Ptr outView;
+    mve::MappedEmbedding::Ptr outConf;  // stored confidences
+    std::size_t tilesX;
+    std::size_t currentTile;
+    std::vector< std::vector<QueueData> > tileSeeds;
+    std::size_t droppedSeeds;
+
+    /** shared state of the parallel queue workers */
+    class QueueWorker;
+    util::Mutex queueMutex;
+    std::vector<unsigned char> pixelBusy;
+    std::size_t activeWorkers;
+    std::size_t idleWorkers;
+    util::Semaphore workerWakeup;   // one post per idle worker to wake
+    util::Semaphore drainDone;      // posted when a checkpoint may be written
+    std::size_t queueCount;
+    std::size_t lastStatus;
+    std::string workerError;
+    bool checkpointPending;
 
     void analyzeFeatures();
-    void globalViewSelection();
-    void processFeatures();
+    void globalViewSelection(bool cached);
+    void processFeatures(Region const& core);
     void processQueue();
-    void refillQueueFromLowRes();
+    void processQueueParallel();
+    void processQueueWorker();
+    void lockQueue(PatchCounters& counters);
+    void waitIdle();
+    void wakeIdleWorkers();
+    void finishOptimization();
+    void processTiles();
+    void computeNeighborCrops(std::vector<Region> const& tiles,
+        std::vector< std::vector<Region> >* crops);
+    void startTile(Region const& core, std::vector<Region> const& crops);
+    void finishTile();
+    mve::FloatImage::Ptr readResult(std::string const& map,
+        Region const& area) const;
+    bool featureDepthRange(float* minDepth, float* maxDepth) const;
+    void processPatchMatch();
+    std::size_t pixelIndex(std::size_t x, std::size_t y) const;
+    void pushNeighbors(QueueData data, PatchCounters& counters);
+    void deferSeed(QueueData const& data, PatchCounters& counters);
+    void printQueueStatus(std::size_t count);
+    void streamPoints(std::size_t bottom, mve::FloatImage::ConstPtr depth,
+        mve::FloatImage::ConstPtr normal, mve::FloatImage::ConstPtr conf,
+        std::size_t top = 0);
+    void refillQueueFromLowRes(Region const& core);
+    void writeCheckpoint();
+    void writeMetrics();
+    static std::string createDirectory(std::string const& path);
 };
 
 
@@ -80,6 +149,36 @@ DMRecon::getProgress()
     return progress;
 }
 
+inline Metrics const&
+DMRecon::getMetrics() const
+{
+    return metrics;
+}
+
+inline bool
+DMRecon::Region::contains(std::size_t x, std::size_t y) const
+{
+    return x >= left && x < right && y >= top && y < bottom;
+}
+
+inline std::size_t
+DMRecon::Region::width() const
+{
+    return right - left;
+}
+
+inline std::size_t
+DMRecon::Region::height() const
+{
+    return bottom - top;
+}
+
+inline std::size_t
+DMRecon::pixelIndex(std::size_t x, std::size_t y) const
+{
+    return (y - region.top) * region.width() + (x - region.left);
+}
+
 MVS_NAMESPACE_END
 
 #endif
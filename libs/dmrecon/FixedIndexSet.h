@@ -0,0 +1,165 @@
+#ifndef FIXEDINDEXSET_H
+#define FIXEDINDEXSET_H
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "defines.h"
+
+/** Maximum number of local views of a patch */
+#define MVS_MAX_LOCAL_VIEWS 8
+/** Maximum number of views selected by the global view selection */
+#define MVS_MAX_GLOBAL_VIEWS 64
+
+MVS_NAMESPACE_BEGIN
+
+/**
+ * Sorted set of view IDs with a fixed capacity and in-place storage. It
+ * replaces IndexSet for the small view sets of the per-pixel code, which
+ * then does not allocate. Iteration is in ascending order like IndexSet.
+ * The memory layout is plain, so it can be stored in queue entries and
+ * written to files as is. Unused entries are kept zero, such that the
+ * written bytes only depend on the contained IDs.
+ */
+template <std::size_t N>
+class FixedIndexSet
+{
+public:
+    typedef unsigned int const* const_iterator;
+
+public:
+    FixedIndexSet();
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    std::size_t operator[] (std::size_t pos) const;
+    std::size_t size() const;
+    bool empty() const;
+    bool contains(std::size_t id) const;
+    static std::size_t capacity();
+
+    /** Inserts the ID, throws if the set is full */
+    void insert(std::size_t id);
+    void erase(std::size_t id);
+    void clear();
+
+    template <std::size_t M>
+    FixedIndexSet& operator= (FixedIndexSet<M> const& other);
+
+private:
+    unsigned int num;
+    unsigned int ids[N];
+};
+
+typedef FixedIndexSet<MVS_MAX_LOCAL_VIEWS> LocalViewSet;
+typedef FixedIndexSet<MVS_MAX_GLOBAL_VIEWS> GlobalViewSet;
+
+/* ------------------------- Implementation ----------------------- */
+
+template <std::size_t N>
+inline
+FixedIndexSet<N>::FixedIndexSet()
+    : num(0)
+{
+    std::fill(ids, ids + N, 0u);
+}
+
+template <std::size_t N>
+inline typename FixedIndexSet<N>::const_iterator
+FixedIndexSet<N>::begin() const
+{
+    return ids;
+}
+
+template <std::size_t N>
+inline typename FixedIndexSet<N>::const_iterator
+FixedIndexSet<N>::end() const
+{
+    return ids + num;
+}
+
+template <std::size_t N>
+inline std::size_t
+FixedIndexSet<N>::operator[] (std::size_t pos) const
+{
+    return ids[pos];
+}
+
+template <std::size_t N>
+inline std::size_t
+FixedIndexSet<N>::size() const
+{
+    return num;
+}
+
+template <std::size_t N>
+inline bool
+FixedIndexSet<N>::empty() const
+{
+    return num == 0;
+}
+
+template <std::size_t N>
+inline bool
+FixedIndexSet<N>::contains(std::size_t id) const
+{
+    return std::binary_search(ids, ids + num, (unsigned int)id);
+}
+
+template <std::size_t N>
+inline std::size_t
+FixedIndexSet<N>::capacity()
+{
+    return N;
+}
+
+template <std::size_t N>
+inline void
+FixedIndexSet<N>::insert(std::size_t id)
+{
+    unsigned int* pos = std::lower_bound(ids, ids + num, (unsigned int)id);
+    if (pos != ids + num && *pos == id)
+        return;
+    if (num == N)
+        throw std::length_error("FixedIndexSet capacity exceeded");
+    std::copy_backward(pos, ids + num, ids + num + 1);
+    *pos = id;
+    ++num;
+}
+
+template <std::size_t N>
+inline void
+FixedIndexSet<N>::erase(std::size_t id)
+{
+    unsigned int* pos = std::lower_bound(ids, ids + num, (unsigned int)id);
+    if (pos == ids + num || *pos != id)
+        return;
+    std::copy(pos + 1, ids + num, pos);
+    --num;
+    ids[num] = 0;
+}
+
+template <std::size_t N>
+inline void
+FixedIndexSet<N>::clear()
+{
+    std::fill(ids, ids + num, 0u);
+    num = 0;
+}
+
+template <std::size_t N>
+template <std::size_t M>
+inline FixedIndexSet<N>&
+FixedIndexSet<N>::operator= (FixedIndexSet<M> const& other)
+{
+    if (other.size() > N)
+        throw std::length_error("FixedIndexSet capacity exceeded");
+    num = other.size();
+    std::copy(other.begin(), other.end(), ids);
+    std::fill(ids + num, ids + N, 0u);
+    return *this;
+}
+
+MVS_NAMESPACE_END
+
+#endif
@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
 #include "GlobalViewSelection.h"
 #include "math/vector.h"
 #include "mvstools.h"
@@ -10,22 +14,33 @@ GlobalViewSelection::GlobalViewSelection(
     mve::BundleFile::FeaturePoints const& features,
     Settings const& settings)
     :
-    ViewSelection(settings),
+    ViewSelection<GlobalViewSet>(settings),
     views(views),
     features(features)
 {
-    available.clear();
+    if (settings.globalVSMax > GlobalViewSet::capacity())
+        throw std::invalid_argument("Too many global views.");
+
     available.resize(views.size(), true);
     available[settings.refViewNr] = false;
     for (std::size_t i = 0; i < views.size(); ++i)
         if (!views[i].get())
             available[i] = false;
+
+    /* The cosine test only skips the exact parallax computation if the
+       parallax is clearly above the minimum, the margin covers rounding. */
+    float maxParallax = settings.minParallax + 1.f;
+    if (maxParallax < 180.f)
+        cosMinParallax = std::cos(maxParallax * pi / 180.f);
+    else
+        cosMinParallax = -2.f;
 }
 
 void
 GlobalViewSelection::performVS()
 {
     selected.clear();
+    initTerms();
     bool foundOne = true;
     while (foundOne && (selected.size() < settings.globalVSMax))
     {
@@ -37,7 +52,7 @@ GlobalViewSelection::performVS()
             if (!available[i])
                 continue;
 
-            float benefit = benefitFromView(i);
+            float benefit = benefits[i];
             if (benefit > maxBenefit) {
                 maxBenefit = benefit;
                 maxView = i;
@@ -47,47 +62,143 @@ GlobalViewSelection::performVS()
         if (foundOne) {
             selected.insert(maxView);
             available[maxView] = false;
+            if (selected.size() < settings.globalVSMax)
+                updateTerms(maxView);
         }
     }
 }
 
-
-float
-GlobalViewSelection::benefitFromView(std::size_t i)
+/**  Computes the score of every feature visible in view i and the
+     reference view from the parallax and the resolution ratio between
+     both views. Terms that only depend on the feature are computed once
+     per feature. */
+void
+GlobalViewSelection::initTerms()
 {
     SingleViewPtr refV = views[settings.refViewNr];
-    SingleViewPtr tmpV = views[i];
-
-    std::vector<std::size_t> nFeatIDs = tmpV->getFeatureIndices();
-
-    // Go over all features visible in view i and reference view
-    float benefit = 0;
-    for (std::size_t k = 0; k < nFeatIDs.size(); ++k) {
-        float score = 1.f;
-        // Parallax with reference view
-        math::Vec3f ftPos(features[nFeatIDs[k]].pos);
-        float plx = parallax(ftPos, refV, tmpV);
-        if (plx < settings.minParallax)
-            score *= sqr(plx / 10.f);
-        // Resolution compared to reference view
-        float mfp = refV->footPrint(ftPos);
-        float nfp = tmpV->footPrint(ftPos);
-        float ratio = mfp / nfp;
-        if (ratio > 2.)
-            ratio = 2. / ratio;
-        else if (ratio > 1.)
-            ratio = 1.;
-        score *= ratio;
-        // Parallax with other selected views that see the same feature
-        IndexSet::const_iterator citV;
-        for (citV = selected.begin(); citV != selected.end(); ++citV) {
-            plx = parallax(ftPos, views[*citV], tmpV);
-            if (plx < settings.minParallax)
-                score *= sqr(plx / 10.f);
+
+    std::size_t const noSlot = std::size_t(-1);
+    std::vector<std::size_t> featureSlot(features.size(), noSlot);
+    slotFeatures.clear();
+    termOffsets.assign(views.size() + 1, 0);
+    for (std::size_t i = 0; i < views.size(); ++i)
+    {
+        termOffsets[i + 1] = termOffsets[i];
+        if (!available[i])
+            continue;
+        std::vector<std::size_t> const& nFeatIDs =
+            views[i]->getFeatureIndices();
+        termOffsets[i + 1] += nFeatIDs.size();
+        for (std::size_t k = 0; k < nFeatIDs.size(); ++k)
+            if (featureSlot[nFeatIDs[k]] == noSlot) {
+                featureSlot[nFeatIDs[k]] = slotFeatures.size();
+                slotFeatures.push_back(nFeatIDs[k]);
+            }
+    }
+
+    std::size_t const numSlots = slotFeatures.size();
+    std::vector<float> refFootPrints(numSlots);
+    slotPositions.resize(numSlots);
+    slotDirs.resize(numSlots);
+    for (std::size_t s = 0; s < numSlots; ++s)
+    {
+        math::Vec3f ftPos(features[slotFeatures[s]].pos);
+        slotPositions[s] = ftPos;
+        slotDirs[s] = (ftPos - refV->camPos).normalized();
+        refFootPrints[s] = refV->footPrint(ftPos);
+    }
+
+    termSlots.resize(termOffsets.back());
+    termDirs.resize(termOffsets.back());
+    termScores.resize(termOffsets.back());
+    benefits.assign(views.size(), 0.f);
+    for (std::size_t i = 0; i < views.size(); ++i)
+    {
+        if (!available[i])
+            continue;
+
+        SingleViewPtr tmpV = views[i];
+        std::vector<std::size_t> const& nFeatIDs = tmpV->getFeatureIndices();
+        std::size_t const offset = termOffsets[i];
+
+        float benefit = 0;
+        for (std::size_t k = 0; k < nFeatIDs.size(); ++k) {
+            std::size_t slot = featureSlot[nFeatIDs[k]];
+            math::Vec3f const& ftPos = slotPositions[slot];
+            float score = 1.f;
+            // Parallax with reference view
+            math::Vec3f dir(ftPos - tmpV->camPos);
+            dir.normalize();
+            score *= parallaxPenalty(slotDirs[slot], dir);
+            // Resolution compared to reference view
+            float mfp = refFootPrints[slot];
+            float nfp = tmpV->footPrint(ftPos);
+            float ratio = mfp / nfp;
+            if (ratio > 2.)
+                ratio = 2. / ratio;
+            else if (ratio > 1.)
+                ratio = 1.;
+            score *= ratio;
+
+            termSlots[offset + k] = slot;
+            termDirs[offset + k] = dir;
+            termScores[offset + k] = score;
+            benefit += score;
         }
-        benefit += score;
+        benefits[i] = benefit;
     }
-    return benefit;
+}
+
+/**  Applies the parallax penalty of the newly selected view to the scores
+     of all remaining views. Only views with a changed score are summed
+     up again. */
+void
+GlobalViewSelection::updateTerms(std::size_t selectedView)
+{
+    math::Vec3f const& selPos = views[selectedView]->camPos;
+    for (std::size_t s = 0; s < slotPositions.size(); ++s)
+        slotDirs[s] = (slotPositions[s] - selPos).normalized();
+
+    for (std::size_t i = 0; i < views.size(); ++i)
+    {
+        if (!available[i])
+            continue;
+
+        bool changed = false;
+        for (std::size_t t = termOffsets[i]; t < termOffsets[i + 1]; ++t)
+        {
+            if (termScores[t] == 0.f)
+                continue;
+            float penalty = parallaxPenalty(slotDirs[termSlots[t]],
+                termDirs[t]);
+            if (penalty != 1.f) {
+                termScores[t] *= penalty;
+                changed = true;
+            }
+        }
+        if (!changed)
+            continue;
+
+        float benefit = 0;
+        for (std::size_t t = termOffsets[i]; t < termOffsets[i + 1]; ++t)
+            benefit += termScores[t];
+        benefits[i] = benefit;
+    }
+}
+
+/**  Score factor for the parallax between two viewing directions of a
+     feature, same as computed with parallax(). */
+float
+GlobalViewSelection::parallaxPenalty(math::Vec3f const& dir1,
+    math::Vec3f const& dir2) const
+{
+    float dp = std::min(dir1.dot(dir2), 1.f);
+    if (dp < cosMinParallax)
+        return 1.f;
+    float plx = std::acos(dp) * 180.f / pi;
+    if (plx < settings.minParallax)
+        return sqr(plx / 10.f);
+    return 1.f;
 }
 
 
@@ -2,7 +2,9 @@
 #define GLOBALVIEWSELECTION_H
 
 #include <map>
+#include <vector>
 
+#include "math/vector.h"
 #include "SingleView.h"
 #include "ViewSelection.h"
 #include "mve/bundlefile.h"
@@ -10,8 +12,16 @@
 
 MVS_NAMESPACE_BEGIN
 
-
-class GlobalViewSelection : public ViewSelection
+/**
+ * Greedy selection of the neighbor views of the reference view. The
+ * benefit of a view is the sum of scores of the features it shares with
+ * the reference view. The scores are computed once and only the penalty
+ * for a small parallax to the last selected view is applied in each
+ * round. Views too far from the selected view to have a small parallax
+ * with it are skipped, and the benefit of a view is only summed up again
+ * if one of its scores changed.
+ */
+class GlobalViewSelection : public ViewSelection<GlobalViewSet>
 {
 public:
     GlobalViewSelection(SingleViewPtrList const& views,
@@ -20,10 +30,27 @@ public:
     void performVS();
 
 private:
-    float benefitFromView(std::size_t i);
+    void initTerms();
+    void updateTerms(std::size_t selectedView);
+    float parallaxPenalty(math::Vec3f const& dir1,
+        math::Vec3f const& dir2) const;
 
     SingleViewPtrList const& views;
     mve::BundleFile::FeaturePoints const& features;
+    std::vector<bool> available;
+
+    /** features seen by any available view, terms refer to these slots */
+    std::vector<std::size_t> slotFeatures;
+    std::vector<math::Vec3f> slotPositions;
+    std::vector<math::Vec3f> slotDirs;      // direction in the last view
+
+    /** terms of view i are in [termOffsets[i], termOffsets[i+1]) */
+    std::vector<std::size_t> termOffsets;
+    std::vector<std::size_t> termSlots;
+    std::vector<math::Vec3f> termDirs;      // feature direction in view i
+    std::vector<float> termScores;
+    std::vector<float> benefits;
+    float cosMinParallax;                   // below, no penalty applies
 };
 
 
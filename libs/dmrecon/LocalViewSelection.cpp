@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "math/defines.h"
 
 #include "util/refptr.h"
@@ -11,17 +13,20 @@ MVS_NAMESPACE_BEGIN
 LocalViewSelection::LocalViewSelection(
     SingleViewPtrList const& views,
     Settings const& settings,
-    IndexSet const& globalViewIDs,
-    IndexSet const& propagated,
+    GlobalViewSet const& globalViewIDs,
+    LocalViewSet const& propagated,
     PatchSampler::Ptr sampler)
     :
-    ViewSelection(settings),
+    ViewSelection<LocalViewSet>(settings),
     success(false),
     views(views),
+    candidates(globalViewIDs),
     sampler(sampler)
 {
     // inherited attribute
     this->selected = propagated;
+    for (std::size_t c = 0; c < candidates.size(); ++c)
+        available[c] = !selected.contains(candidates[c]);
 
     if (!sampler->success[settings.refViewNr]) {
         return;
@@ -32,17 +37,6 @@ LocalViewSelection::LocalViewSelection(
         std::cerr << "ERROR: Too many local neighbors propagated!" << std::endl;
         selected.clear();
     }
-
-    available.clear();
-    available.resize(views.size(), false);
-    IndexSet::const_iterator id;
-    for (id = globalViewIDs.begin(); id != globalViewIDs.end(); ++id) {
-        available[*id] = true;
-    }
-    IndexSet::const_iterator sel;
-    for (sel = selected.begin(); sel != selected.end(); ++sel) {
-        available[*sel] = false;
-    }
 }
 
 void
@@ -58,60 +52,67 @@ LocalViewSelection::performVS()
     // pixel print in reference view
     float mfp = refV->footPrint(p);
     math::Vec3f refDir = (p - refV->camPos).normalized();
-    std::map<std::size_t, math::Vec3f> viewDir;
-    std::map<std::size_t, math::Vec3f> epipolarPlane; // plane normal
-    std::map<std::size_t, float> ncc;
+    float ncc[MVS_MAX_GLOBAL_VIEWS];
+    math::Vec3f viewDir[MVS_MAX_GLOBAL_VIEWS];
+    math::Vec3f epipolarPlane[MVS_MAX_GLOBAL_VIEWS]; // plane normal
 
-    for (std::size_t i = 0; i < views.size(); ++i) {
-        if (!available[i])
+    std::size_t const numCandidates = candidates.size();
+    for (std::size_t c = 0; c < numCandidates; ++c) {
+        if (!available[c])
             continue;
+        std::size_t i = candidates[c];
         float tmpNCC = sampler->getFastNCC(i);
         assert(!MATH_ISNAN(tmpNCC));
         if (tmpNCC < settings.minNCC) {
-            available[i] = false;
+            available[c] = false;
             continue;
         }
-        ncc[i] = tmpNCC;
-        viewDir[i] = (p - views[i]->camPos).normalized();
-        epipolarPlane[i] = (viewDir[i].cross(refDir)).normalized();
-    }
-    IndexSet::const_iterator sel;
-    for (sel = selected.begin(); sel != selected.end(); ++sel) {
-        viewDir[*sel] = (p - views[*sel]->camPos).normalized();
-        epipolarPlane[*sel] = (viewDir[*sel].cross(refDir)).normalized();
+        ncc[c] = tmpNCC;
+        viewDir[c] = (p - views[i]->camPos).normalized();
+        epipolarPlane[c] = (viewDir[c].cross(refDir)).normalized();
     }
 
+    /* the same for the selected views, in the order of the set */
+    math::Vec3f selDir[MVS_MAX_LOCAL_VIEWS];
+    math::Vec3f selPlane[MVS_MAX_LOCAL_VIEWS];
+
     bool foundOne = true;
     while (selected.size() < settings.nrReconNeighbors && foundOne)
     {
+        std::size_t const numSelected = selected.size();
+        for (std::size_t s = 0; s < numSelected; ++s) {
+            selDir[s] = (p - views[selected[s]]->camPos).normalized();
+            selPlane[s] = (selDir[s].cross(refDir)).normalized();
+        }
+
         foundOne = false;
-        std::size_t maxView = 0;
+        std::size_t maxCandidate = 0;
         float maxScore = 0.f;
-        for (std::size_t i = 0; i < views.size(); ++i) {
-            if (!available[i])
+        for (std::size_t c = 0; c < numCandidates; ++c) {
+            if (!available[c])
                 continue;
-            float score = ncc[i];
+            float score = ncc[c];
 
             // resolution difference
-            float nfp = views[i]->footPrint(p);
+            float nfp = views[candidates[c]]->footPrint(p);
             if (mfp / nfp < 0.5f) {
                 score *= 0.01f;
             }
 
             // parallax w.r.t. reference view
-            float dp = std::min(refDir.dot(viewDir[i]), 1.f);
+            float dp = std::min(refDir.dot(viewDir[c]), 1.f);
             float plx = acos(dp) * 180.f / pi;
             score *= parallaxToWeight(plx);
             assert(score == score);
 
-            for (sel = selected.begin(); sel != selected.end(); ++sel) {
+            for (std::size_t s = 0; s < numSelected; ++s) {
                 // parallax w.r.t. other selected views
-                dp = std::min(viewDir[*sel].dot(viewDir[i]), 1.f);
+                dp = std::min(selDir[s].dot(viewDir[c]), 1.f);
                 plx = acos(dp) * 180.f / pi;
                 score *= parallaxToWeight(plx);
 
                 // epipolar geometry
-                dp = epipolarPlane[i].dot(epipolarPlane[*sel]);
+                dp = epipolarPlane[c].dot(selPlane[s]);
                 dp = std::min(dp, (float) 1.0);
                 float angle = fabs(acos(dp) * 180.f / pi);
                 if (angle > 90.f)
@@ -125,12 +126,12 @@ LocalViewSelection::performVS()
             if (score > maxScore) {
                 foundOne = true;
                 maxScore = score;
-                maxView = i;
+                maxCandidate = c;
             }
         }
         if (foundOne) {
-            selected.insert(maxView);
-            available[maxView] = false;
+            selected.insert(candidates[maxCandidate]);
+            available[maxCandidate] = false;
         }
     }
     if (selected.size() == settings.nrReconNeighbors) {
@@ -139,13 +140,15 @@ LocalViewSelection::performVS()
 }
 
 void
-LocalViewSelection::replaceViews(IndexSet const & toBeReplaced)
+LocalViewSelection::replaceViews(LocalViewSet const& toBeReplaced)
 {
-    IndexSet::const_iterator tbr = toBeReplaced.begin();
-    while (tbr != toBeReplaced.end()) {
-        available[*tbr] = false;
+    LocalViewSet::const_iterator tbr;
+    for (tbr = toBeReplaced.begin(); tbr != toBeReplaced.end(); ++tbr) {
+        GlobalViewSet::const_iterator pos = std::lower_bound(
+            candidates.begin(), candidates.end(), *tbr);
+        if (pos != candidates.end() && *pos == *tbr)
+            available[pos - candidates.begin()] = false;
         selected.erase(*tbr);
-        ++tbr;
     }
     success = false;
     performVS();
@@ -2,29 +2,37 @@
 #define LOCALVIEWSELECTION_H
 
 #include "util/refptr.h"
+#include "FixedIndexSet.h"
 #include "ViewSelection.h"
 #include "PatchSampler.h"
 #include "SingleView.h"
 
 MVS_NAMESPACE_BEGIN
 
-
-class LocalViewSelection : public ViewSelection
+/**
+ * Selects the local views of a patch among the global views. All state
+ * is kept in fixed-size arrays indexed like the global views, so the
+ * selection does not allocate. The global views are referenced and must
+ * outlive the selection.
+ */
+class LocalViewSelection : public ViewSelection<LocalViewSet>
 {
 public:
     LocalViewSelection(
         SingleViewPtrList const& views,
         Settings const& settings,
-        IndexSet const& globalViews,
-        IndexSet const& propagated,
+        GlobalViewSet const& globalViews,
+        LocalViewSet const& propagated,
         PatchSampler::Ptr sampler);
     void performVS();
-    void replaceViews(IndexSet const& toBeReplaced);
+    void replaceViews(LocalViewSet const& toBeReplaced);
 
     bool success;
 
 private:
     SingleViewPtrList const& views;
+    GlobalViewSet const& candidates;
+    bool available[MVS_MAX_GLOBAL_VIEWS];
     PatchSampler::Ptr sampler;
 };
 
@@ -0,0 +1,129 @@
+#include "Metrics.h"
+
+MVS_NAMESPACE_BEGIN
+
+PatchCounters::PatchCounters(std::size_t maxIterations)
+    : optimizations(0)
+    , failedOptimizations(0)
+    , iterations(0)
+    , earlyExits(0)
+    , nccEvaluations(0)
+    , sampledPatches(0)
+    , sparsePatches(0)
+    , samples(0)
+    , queuePushes(0)
+    , rejectedPushes(0)
+    , stalePops(0)
+    , busyPops(0)
+    , lockContentions(0)
+    , iterationHistogram(maxIterations + 1, 0)
+{
+}
+
+void
+PatchCounters::add(PatchCounters const& other)
+{
+    optimizations += other.optimizations;
+    failedOptimizations += other.failedOptimizations;
+    iterations += other.iterations;
+    earlyExits += other.earlyExits;
+    nccEvaluations += other.nccEvaluations;
+    sampledPatches += other.sampledPatches;
+    sparsePatches += other.sparsePatches;
+    samples += other.samples;
+    queuePushes += other.queuePushes;
+    rejectedPushes += other.rejectedPushes;
+    stalePops += other.stalePops;
+    busyPops += other.busyPops;
+    lockContentions += other.lockContentions;
+    if (iterationHistogram.size() < other.iterationHistogram.size())
+        iterationHistogram.resize(other.iterationHistogram.size(), 0);
+    for (std::size_t i = 0; i < other.iterationHistogram.size(); ++i)
+        iterationHistogram[i] += other.iterationHistogram[i];
+}
+
+/* ------------------------------------------------------------------ */
+
+Metrics::Metrics(std::size_t maxIterations)
+    : viewID(0)
+    , scale(0.f)
+    , width(0)
+    , height(0)
+    , numThreads(1)
+    , filled(0)
+    , counters(maxIterations)
+{
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        stages[i].wallMs = 0;
+        stages[i].cpuMs = 0;
+    }
+}
+
+char const*
+Metrics::getStageName(MetricsStage stage)
+{
+    switch (stage)
+    {
+        case STAGE_ANALYZE_FEATURES: return "analyze_features";
+        case STAGE_GLOBAL_VS: return "global_view_selection";
+        case STAGE_LOAD_TILE: return "load_tile";
+        case STAGE_PROCESS_FEATURES: return "process_features";
+        case STAGE_LOWRES_SEEDS: return "lowres_seeds";
+        case STAGE_PROCESS_QUEUE: return "process_queue";
+        case STAGE_PROPAGATION: return "propagation";
+        case STAGE_REFINEMENT: return "refinement";
+        case STAGE_SAVING: return "saving";
+        default: return "unknown";
+    }
+}
+
+void
+Metrics::writeJSON(std::ostream& out) const
+{
+    StageTime total = { 0, 0 };
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        total.wallMs += stages[i].wallMs;
+        total.cpuMs += stages[i].cpuMs;
+    }
+
+    out << "{\n"
+        << "  \"view\": " << viewID << ",\n"
+        << "  \"scale\": " << scale << ",\n"
+        << "  \"width\": " << width << ",\n"
+        << "  \"height\": " << height << ",\n"
+        << "  \"threads\": " << numThreads << ",\n"
+        << "  \"filled\": " << filled << ",\n"
+        << "  \"stages\": {\n";
+    for (int i = 0; i < STAGE_COUNT; ++i)
+    {
+        out << "    \"" << getStageName(MetricsStage(i)) << "\": "
+            << "{ \"wall_ms\": " << stages[i].wallMs
+            << ", \"cpu_ms\": " << stages[i].cpuMs << " },\n";
+    }
+    out << "    \"total\": { \"wall_ms\": " << total.wallMs
+        << ", \"cpu_ms\": " << total.cpuMs << " }\n"
+        << "  },\n"
+        << "  \"counters\": {\n"
+        << "    \"optimizations\": " << counters.optimizations << ",\n"
+        << "    \"failed_optimizations\": "
+        << counters.failedOptimizations << ",\n"
+        << "    \"iterations\": " << counters.iterations << ",\n"
+        << "    \"early_exits\": " << counters.earlyExits << ",\n"
+        << "    \"ncc_evaluations\": " << counters.nccEvaluations << ",\n"
+        << "    \"sampled_patches\": " << counters.sampledPatches << ",\n"
+        << "    \"sparse_patches\": " << counters.sparsePatches << ",\n"
+        << "    \"samples\": " << counters.samples << ",\n"
+        << "    \"queue_pushes\": " << counters.queuePushes << ",\n"
+        << "    \"rejected_pushes\": " << counters.rejectedPushes << ",\n"
+        << "    \"stale_pops\": " << counters.stalePops << ",\n"
+        << "    \"busy_pops\": " << counters.busyPops << ",\n"
+        << "    \"lock_contentions\": " << counters.lockContentions << "\n"
+        << "  },\n"
+        << "  \"iteration_histogram\": [";
+    for (std::size_t i = 0; i < counters.iterationHistogram.size(); ++i)
+        out << (i ? ", " : "") << counters.iterationHistogram[i];
+    out << "]\n"
+        << "}\n";
+}
+
+MVS_NAMESPACE_END
@@ -0,0 +1,126 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <algorithm>
+#include <ostream>
+#include <vector>
+
+#include "util/clocktimer.h"
+#include "util/hrtimer.h"
+#include "defines.h"
+
+MVS_NAMESPACE_BEGIN
+
+enum MetricsStage
+{
+    STAGE_ANALYZE_FEATURES,
+    STAGE_GLOBAL_VS,
+    STAGE_LOAD_TILE,
+    STAGE_PROCESS_FEATURES,
+    STAGE_LOWRES_SEEDS,
+    STAGE_PROCESS_QUEUE,
+    STAGE_PROPAGATION,
+    STAGE_REFINEMENT,
+    STAGE_SAVING,
+    STAGE_COUNT
+};
+
+/** Wall and CPU time of a stage, CPU time includes all threads */
+struct StageTime
+{
+    std::size_t wallMs;
+    std::size_t cpuMs;
+};
+
+/** Counters of the hot loops, kept per thread and merged afterwards */
+struct PatchCounters
+{
+    PatchCounters(std::size_t maxIterations);
+
+    void addPatch(std::size_t iterations, bool success, bool earlyExit);
+    void add(PatchCounters const& other);
+
+    std::size_t optimizations;        ///< patch optimizations run
+    std::size_t failedOptimizations;  ///< optimizations without confidence
+    std::size_t iterations;           ///< iterations of all optimizations
+    std::size_t earlyExits;           ///< depth refinements cut short
+    std::size_t nccEvaluations;       ///< NCC computations of the samplers
+    std::size_t sampledPatches;       ///< patches set up by the samplers
+    std::size_t sparsePatches;        ///< patches with sparse samples
+    std::size_t samples;              ///< samples drawn in neighbor views
+    std::size_t queuePushes;          ///< pixels pushed to the queue
+    std::size_t rejectedPushes;       ///< neighbors not pushed, confident
+    std::size_t stalePops;            ///< pixels improved since their push
+    std::size_t busyPops;             ///< pixels optimized by another thread
+    std::size_t lockContentions;      ///< queue lock acquisitions that waited
+    std::vector<std::size_t> iterationHistogram; ///< patches per iterations
+};
+
+/**
+ * Per-view metrics of a reconstruction. Written as JSON next to the log
+ * file, such that performance can be tracked across versions and scenes.
+ */
+struct Metrics
+{
+    Metrics(std::size_t maxIterations);
+
+    void writeJSON(std::ostream& out) const;
+    static char const* getStageName(MetricsStage stage);
+
+    std::size_t viewID;
+    float scale;
+    std::size_t width;
+    std::size_t height;
+    std::size_t numThreads;
+    std::size_t filled;
+    StageTime stages[STAGE_COUNT];
+    PatchCounters counters;
+};
+
+/** Adds the time until destruction to the stage */
+class StageTimer
+{
+public:
+    StageTimer(Metrics& metrics, MetricsStage stage);
+    ~StageTimer();
+
+private:
+    Metrics& metrics;
+    MetricsStage stage;
+    util::HRTimer wallTimer;
+    util::ClockTimer cpuTimer;
+};
+
+/* ------------------------- Implementation ----------------------- */
+
+inline void
+PatchCounters::addPatch(std::size_t iterations, bool success,
+    bool earlyExit)
+{
+    ++this->optimizations;
+    this->iterations += iterations;
+    if (earlyExit)
+        ++this->earlyExits;
+    if (!success)
+        ++this->failedOptimizations;
+    std::size_t bin = std::min(iterations, iterationHistogram.size() - 1);
+    ++this->iterationHistogram[bin];
+}
+
+inline
+StageTimer::StageTimer(Metrics& metrics, MetricsStage stage)
+    : metrics(metrics)
+    , stage(stage)
+{
+}
+
+inline
+StageTimer::~StageTimer()
+{
+    metrics.stages[stage].wallMs += wallTimer.get_elapsed();
+    metrics.stages[stage].cpuMs += cpuTimer.get_elapsed();
+}
+
+MVS_NAMESPACE_END
+
+#endif
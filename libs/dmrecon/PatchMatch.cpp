@@ -0,0 +1,380 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+
+#include "PatchMatch.h"
+#include "PatchOptimization.h"
+
+/* Neighbors tried per direction, at these distances of opposite color */
+#define MVS_PM_NEAR_STEP 1
+#define MVS_PM_FAR_STEP 3
+/* Relative depth difference below which hypotheses are not rescored */
+#define MVS_PM_SAME_PLANE 1e-4f
+
+MVS_NAMESPACE_BEGIN
+
+class PatchMatch::Worker : public util::Thread
+{
+public:
+    Worker(PatchMatch* _engine)
+        : engine(_engine)
+    {
+    }
+
+protected:
+    void* run()
+    {
+        engine->processRows();
+        return 0;
+    }
+
+private:
+    PatchMatch* engine;
+};
+
+/* ------------------------------------------------------------------ */
+
+/* Uniform random number in [0, 1) from a hash of its arguments */
+static float
+randomUnit(std::size_t x, std::size_t y, std::size_t step, std::size_t draw)
+{
+    unsigned int h = (unsigned int)x * 73856093u
+        ^ (unsigned int)y * 19349663u
+        ^ (unsigned int)step * 83492791u
+        ^ (unsigned int)draw * 2654435761u;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return float(h >> 8) / 16777216.f;
+}
+
+PatchMatch::PatchMatch(SingleViewPtrList const& _views,
+    Settings const& _settings, GlobalViewSet const& _neighViews,
+    Progress& _progress)
+    :
+    views(_views),
+    settings(_settings),
+    neighViews(_neighViews),
+    progress(_progress),
+    minDepth(0.f),
+    maxDepth(0.f),
+    phase(PHASE_INITIALIZE),
+    step(0),
+    nextRow(0),
+    improved(0),
+    counters(_settings.maxIterations)
+{
+    SingleViewPtr refV(views[settings.refViewNr]);
+    mve::ImageBase::Ptr img(refV->getScaledImg());
+    width = img->width();
+    height = img->height();
+    unitFootPrint = refV->footPrint(refV->camPos
+        + refV->viewRay(width / 2, height / 2));
+
+    Hypothesis empty;
+    empty.depth = 0.f;
+    empty.dzI = 0.f;
+    empty.dzJ = 0.f;
+    empty.score = -1.f;
+    hyps.resize(width * height, empty);
+}
+
+PatchMatch::~PatchMatch()
+{
+}
+
+void
+PatchMatch::setDepthRange(float minDepth, float maxDepth)
+{
+    if (!(minDepth > 0.f) || !(maxDepth > minDepth))
+        throw std::invalid_argument("Invalid depth range.");
+    this->minDepth = minDepth;
+    this->maxDepth = maxDepth;
+}
+
+void
+PatchMatch::addSeed(std::size_t x, std::size_t y, float depth)
+{
+    if (x < width && y < height)
+        hyps[y * width + x].depth = depth;
+}
+
+void
+PatchMatch::initialize()
+{
+    if (maxDepth <= 0.f)
+        throw std::runtime_error("Depth range not set.");
+    runPhase(PHASE_INITIALIZE, 0);
+}
+
+std::size_t
+PatchMatch::sweep(std::size_t iteration)
+{
+    improved = 0;
+    runPhase(PHASE_SWEEP, 2 * iteration);
+    runPhase(PHASE_SWEEP, 2 * iteration + 1);
+    return improved;
+}
+
+void
+PatchMatch::refine()
+{
+    runPhase(PHASE_REFINE, 0);
+}
+
+/**  Processes all rows for the phase, with one worker per thread. */
+void
+PatchMatch::runPhase(Phase phase, std::size_t step)
+{
+    this->phase = phase;
+    this->step = step;
+    nextRow = 0;
+    workerError.clear();
+
+    if (settings.numThreads <= 1)
+        processRows();
+    else
+    {
+        std::vector<Worker*> workers(settings.numThreads);
+        for (std::size_t i = 0; i < workers.size(); ++i) {
+            workers[i] = new Worker(this);
+            workers[i]->pt_create();
+        }
+        for (std::size_t i = 0; i < workers.size(); ++i) {
+            workers[i]->pt_join();
+            delete workers[i];
+        }
+    }
+
+    if (!workerError.empty())
+        throw std::runtime_error(workerError);
+}
+
+/**  Takes rows until all are processed. In a sweep only the pixels of
+     the current color are updated. */
+void
+PatchMatch::processRows()
+{
+    PatchSampler::Ptr sampler(PatchSampler::create(views, settings));
+    PatchCounters rowCounters(settings.maxIterations);
+    std::size_t rowImproved = 0;
+    std::size_t filled = 0;
+    util::MutexLock lock(mutex);
+
+    while (nextRow < height && !progress.cancelled && workerError.empty())
+    {
+        std::size_t y = nextRow++;
+        mutex.unlock();
+        try
+        {
+            if (phase == PHASE_INITIALIZE) {
+                for (std::size_t x = 0; x < width; ++x)
+                    initializePixel(*sampler, x, y);
+            } else if (phase == PHASE_SWEEP) {
+                for (std::size_t x = (y + step) % 2; x < width; x += 2)
+                    if (improvePixel(*sampler, x, y))
+                        ++rowImproved;
+            } else {
+                for (std::size_t x = 0; x < width; ++x)
+                    if (refinePixel(sampler, x, y, rowCounters))
+                        ++filled;
+            }
+        }
+        catch (std::exception& e)
+        {
+            mutex.lock();
+            workerError = e.what();
+            break;
+        }
+        mutex.lock();
+    }
+
+    /* the lock is held again when leaving the loop */
+    rowCounters.nccEvaluations = sampler->getNCCCount();
+    rowCounters.sampledPatches = sampler->getPatchCount();
+    rowCounters.sparsePatches = sampler->getSparsePatchCount();
+    rowCounters.samples = sampler->getSampleCount();
+    counters.add(rowCounters);
+    improved += rowImproved;
+    progress.filled += filled;
+}
+
+/**  Scores the seed depth or a random fronto-parallel hypothesis with
+     random slant. */
+bool
+PatchMatch::initializePixel(PatchSampler& sampler, std::size_t x,
+    std::size_t y)
+{
+    Hypothesis& hyp = hyps[y * width + x];
+    if (hyp.depth > 0.f) {
+        hyp.dzI = 0.f;
+        hyp.dzJ = 0.f;
+    } else {
+        hyp.depth = randomDepth(x, y, 0);
+        float slope = hyp.depth * unitFootPrint;
+        hyp.dzI = (2.f * randomUnit(x, y, 0, 1) - 1.f) * slope;
+        hyp.dzJ = (2.f * randomUnit(x, y, 0, 2) - 1.f) * slope;
+    }
+
+    /* the master samples do not depend on the hypothesis */
+    sampler.reset(x, y, hyp.depth, 0.f, 0.f);
+    if (!sampler.success[settings.refViewNr]) {
+        hyp.score = -2.f;
+        return false;
+    }
+    sampler.update(hyp.depth, hyp.dzI, hyp.dzJ);
+    hyp.score = score(sampler);
+    return true;
+}
+
+/**  Tries the best hypothesis of the near and far neighbor in each
+     direction, a perturbation of the own hypothesis that shrinks with
+     the sweeps and, for weak hypotheses, a random depth. */
+bool
+PatchMatch::improvePixel(PatchSampler& sampler, std::size_t x, std::size_t y)
+{
+    Hypothesis& hyp = hyps[y * width + x];
+    if (hyp.score < -1.f)
+        return false;
+    sampler.reset(x, y, hyp.depth, 0.f, 0.f);
+
+    bool changed = false;
+    const int dirX[4] = { -1, 1, 0, 0 };
+    const int dirY[4] = { 0, 0, -1, 1 };
+    const int steps[2] = { MVS_PM_NEAR_STEP, MVS_PM_FAR_STEP };
+    for (int d = 0; d < 4; ++d)
+    {
+        Hypothesis const* best = 0;
+        int offset = 0;
+        for (int s = 0; s < 2; ++s)
+        {
+            int nx = int(x) + dirX[d] * steps[s];
+            int ny = int(y) + dirY[d] * steps[s];
+            if (nx < 0 || ny < 0 || nx >= int(width) || ny >= int(height))
+                break;
+            Hypothesis const& other = hyps[ny * width + nx];
+            if (other.score > -1.f && (!best || other.score > best->score)) {
+                best = &other;
+                offset = steps[s];
+            }
+        }
+        if (!best)
+            continue;
+        /* the neighbor's plane continued to this pixel */
+        float depth = best->depth - float(offset)
+            * (dirX[d] * best->dzI + dirY[d] * best->dzJ);
+        changed |= tryHypothesis(sampler, &hyp, depth, best->dzI, best->dzJ);
+    }
+
+    /* step 0 draws the initial hypotheses */
+    std::size_t const draw = step + 1;
+    float radius = 1.f / float(2 << std::min<std::size_t>(step / 2, 16));
+    float slope = hyp.depth * unitFootPrint;
+    changed |= tryHypothesis(sampler, &hyp,
+        hyp.depth * (1.f + radius * (randomUnit(x, y, draw, 0) - 0.5f)),
+        hyp.dzI + radius * (2.f * randomUnit(x, y, draw, 1) - 1.f) * slope,
+        hyp.dzJ + radius * (2.f * randomUnit(x, y, draw, 2) - 1.f) * slope);
+
+    /* only pixels without a good hypothesis restart at a random depth */
+    if (hyp.score < settings.acceptNCC) {
+        float depth = randomDepth(x, y, draw);
+        changed |= tryHypothesis(sampler, &hyp, depth,
+            hyp.dzI * depth / hyp.depth, hyp.dzJ * depth / hyp.depth);
+    }
+    return changed;
+}
+
+/**  Optimizes the hypothesis of a pixel that scores at least minNCC and
+     stores the result if it is confident. */
+bool
+PatchMatch::refinePixel(PatchSampler::Ptr sampler, std::size_t x,
+    std::size_t y, PatchCounters& counters)
+{
+    Hypothesis const& hyp = hyps[y * width + x];
+    if (hyp.score < settings.minNCC)
+        return false;
+
+    PatchOptimization patch(views, settings, x, y, hyp.depth, hyp.dzI,
+        hyp.dzJ, neighViews, LocalViewSet(), sampler);
+    patch.doAutoOptimization();
+    float conf = patch.computeConfidence();
+    counters.addPatch(patch.getIterations(), conf != 0,
+        patch.exitedEarly());
+    if (conf == 0)
+        return false;
+
+    SingleViewPtr refV(views[settings.refViewNr]);
+    std::size_t index = y * width + x;
+    math::Vec3f normal = patch.getNormal();
+    refV->depthImg->at(index) = patch.getDepth();
+    refV->normalImg->at(index, 0) = normal[0];
+    refV->normalImg->at(index, 1) = normal[1];
+    refV->normalImg->at(index, 2) = normal[2];
+    refV->dzImg->at(index, 0) = patch.getDzI();
+    refV->dzImg->at(index, 1) = patch.getDzJ();
+    refV->confImg->at(index) = conf;
+    return true;
+}
+
+/**  Replaces the hypothesis if the new one is within the depth range and
+     scores better. The sampler must be reset to the pixel. */
+bool
+PatchMatch::tryHypothesis(PatchSampler& sampler, Hypothesis* hyp,
+    float depth, float dzI, float dzJ)
+{
+    if (!(depth >= minDepth && depth <= maxDepth))
+        return false;
+    /* neighbors on the same plane propagate the current hypothesis */
+    float tolerance = MVS_PM_SAME_PLANE * hyp->depth;
+    if (std::abs(depth - hyp->depth) <= tolerance
+        && std::abs(dzI - hyp->dzI) <= tolerance * unitFootPrint
+        && std::abs(dzJ - hyp->dzJ) <= tolerance * unitFootPrint)
+        return false;
+    sampler.update(depth, dzI, dzJ);
+    float newScore = score(sampler);
+    if (newScore <= hyp->score)
+        return false;
+    hyp->depth = depth;
+    hyp->dzI = dzI;
+    hyp->dzJ = dzJ;
+    hyp->score = newScore;
+    return true;
+}
+
+/**  Mean of the best nrReconNeighbors NCCs, views the patch does not
+     project into count as -1. */
+float
+PatchMatch::score(PatchSampler& sampler)
+{
+    if (!sampler.success[settings.refViewNr])
+        return -1.f;
+    float ncc[MVS_MAX_GLOBAL_VIEWS];
+    std::size_t num = 0;
+    GlobalViewSet::const_iterator id;
+    for (id = neighViews.begin(); id != neighViews.end(); ++id)
+        ncc[num++] = sampler.getFastNCC(*id);
+    if (num == 0)
+        return -1.f;
+
+    std::size_t best = std::min<std::size_t>(settings.nrReconNeighbors, num);
+    std::partial_sort(ncc, ncc + best, ncc + num, std::greater<float>());
+    float sum = 0.f;
+    for (std::size_t i = 0; i < best; ++i)
+        sum += ncc[i];
+    return sum / float(best);
+}
+
+/* Depth with uniformly distributed inverse within the depth range */
+float
+PatchMatch::randomDepth(std::size_t x, std::size_t y, std::size_t step) const
+{
+    float nearInv = 1.f / minDepth;
+    float farInv = 1.f / maxDepth;
+    float r = randomUnit(x, y, step, 3);
+    return 1.f / (farInv + r * (nearInv - farInv));
+}
+
+MVS_NAMESPACE_END
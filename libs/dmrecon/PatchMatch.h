@@ -0,0 +1,128 @@
+#ifndef PATCHMATCH_H
+#define PATCHMATCH_H
+
+#include <string>
+#include <vector>
+
+#include "util/thread.h"
+#include "util/threadlocks.h"
+#include "defines.h"
+#include "FixedIndexSet.h"
+#include "Metrics.h"
+#include "PatchSampler.h"
+#include "Progress.h"
+#include "Settings.h"
+#include "SingleView.h"
+
+MVS_NAMESPACE_BEGIN
+
+/**
+ * Dense depth map engine after PatchMatch stereo [Bleyer '11] with the
+ * red-black propagation of [Galliani '15]. Every pixel of the reference
+ * view holds a depth and depth derivatives as hypothesis. Hypotheses are
+ * initialized randomly within the depth range of the scene, or with the
+ * depth of a bundle feature. Sweeps then alternately update the pixels
+ * of the two colors of a checkerboard. A pixel tries the hypotheses of
+ * its best neighbors in each direction and random perturbations of its
+ * own, scored by the mean of the best NCCs to the global views.
+ *
+ * Pixels of one color only read hypotheses of the other color, so the
+ * rows of a half sweep are processed by all threads without locking.
+ * Random numbers only depend on the pixel and the sweep, which makes the
+ * result independent of the number of threads. Finally every pixel is
+ * optimized like a queue entry of the region growing, which yields the
+ * same depths, normals and confidences.
+ */
+class PatchMatch
+{
+public:
+    PatchMatch(SingleViewPtrList const& views, Settings const& settings,
+        GlobalViewSet const& neighViews, Progress& progress);
+    ~PatchMatch();
+
+    /** Hypotheses are drawn between these depths along the viewing rays */
+    void setDepthRange(float minDepth, float maxDepth);
+
+    /** Initializes the pixel with the depth instead of a random one */
+    void addSeed(std::size_t x, std::size_t y, float depth);
+
+    /** Draws and scores the initial hypotheses */
+    void initialize();
+
+    /** Propagates and perturbs the hypotheses of all pixels once,
+        returns the number of improved hypotheses */
+    std::size_t sweep(std::size_t iteration);
+
+    /** Optimizes the final hypotheses and writes the confident ones to
+        the result images of the reference view */
+    void refine();
+
+    /** Counters of all optimizations and NCC evaluations so far */
+    PatchCounters const& getCounters() const;
+
+private:
+    /** Hypothesis of a pixel, score is negative without one */
+    struct Hypothesis
+    {
+        float depth;
+        float dzI;
+        float dzJ;
+        float score;
+    };
+
+    enum Phase
+    {
+        PHASE_INITIALIZE,
+        PHASE_SWEEP,
+        PHASE_REFINE
+    };
+
+    class Worker;
+
+private:
+    void runPhase(Phase phase, std::size_t step);
+    void processRows();
+    bool initializePixel(PatchSampler& sampler, std::size_t x,
+        std::size_t y);
+    bool improvePixel(PatchSampler& sampler, std::size_t x, std::size_t y);
+    bool refinePixel(PatchSampler::Ptr sampler, std::size_t x,
+        std::size_t y, PatchCounters& counters);
+    bool tryHypothesis(PatchSampler& sampler, Hypothesis* hyp, float depth,
+        float dzI, float dzJ);
+    float score(PatchSampler& sampler);
+    float randomDepth(std::size_t x, std::size_t y, std::size_t step) const;
+
+private:
+    SingleViewPtrList const& views;
+    Settings const& settings;
+    GlobalViewSet const& neighViews;
+    Progress& progress;
+
+    std::size_t width;
+    std::size_t height;
+    float minDepth;
+    float maxDepth;
+    float unitFootPrint;            // pixel size at depth 1
+    std::vector<Hypothesis> hyps;
+
+    /** state of the current phase, shared by the workers */
+    util::Mutex mutex;
+    Phase phase;
+    std::size_t step;               // two steps per sweep, one per color
+    std::size_t nextRow;
+    std::size_t improved;
+    std::string workerError;
+    PatchCounters counters;
+};
+
+/* ------------------------- Implementation ----------------------- */
+
+inline PatchCounters const&
+PatchMatch::getCounters() const
+{
+    return counters;
+}
+
+MVS_NAMESPACE_END
+
+#endif
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <util/string.h>
 
 #include "math/algo.h"
@@ -7,9 +8,22 @@
 #include "math/vector.h"
 #include "PatchOptimization.h"
 #include "Settings.h"
+#include "simdtools.h"
 
 MVS_NAMESPACE_BEGIN
 
+/* Moves a reused sampler to the patch or creates a new one. */
+static PatchSampler::Ptr
+initSampler(PatchSampler::Ptr sampler, SingleViewPtrList const& views,
+    Settings const& settings, std::size_t x, std::size_t y,
+    float depth, float dzI, float dzJ)
+{
+    if (sampler.get() == NULL)
+        return PatchSampler::create(views, settings, x, y, depth, dzI, dzJ);
+    sampler->reset(x, y, depth, dzI, dzJ);
+    return sampler;
+}
+
 PatchOptimization::PatchOptimization(
     SingleViewPtrList const& _views,
     Settings const& _settings,
@@ -18,8 +32,9 @@ PatchOptimization::PatchOptimization(
     float _depth,
     float _dzI,
     float _dzJ,
-    IndexSet const & _globalViewIDs,
-    IndexSet const & _localViewIDs)
+    GlobalViewSet const & _globalViewIDs,
+    LocalViewSet const & _localViewIDs,
+    PatchSampler::Ptr _sampler)
     :
     views(_views),
     settings(_settings),
@@ -28,14 +43,14 @@ PatchOptimization::PatchOptimization(
     depth(_depth),
     dzI(_dzI),
     dzJ(_dzJ),
-    sampler(PatchSampler::create(views, settings, midx, midy, depth, dzI, dzJ)),
-    ii(sqr(settings.filterWidth)),
-    jj(sqr(settings.filterWidth)),
+    sampler(initSampler(_sampler, views, settings, midx, midy,
+        depth, dzI, dzJ)),
     localVS(views, settings, _globalViewIDs, _localViewIDs, sampler)
 {
     status.iterationCount = 0;
     status.optiSuccess = true;
     status.converged = false;
+    status.earlyExit = false;
 
     if (!sampler->success[settings.refViewNr]) {
         // Sampler could not be initialized properly
@@ -43,57 +58,65 @@ PatchOptimization::PatchOptimization(
         return;
     }
 
-    std::size_t count = 0;
-
-    int halfFW = (int) settings.filterWidth / 2;
-    pixel_weight.resize(sampler->getNrSamples());
-    for (int j = -halfFW; j <= halfFW; ++j)
-        for (int i = -halfFW; i <= halfFW; ++i) {
-            ii[count] = i;
-            jj[count] = j;
-            pixel_weight[count] = 1.f;
-            ++count;
-        }
-
     localVS.performVS();
     if (!localVS.success) {
         status.optiSuccess = false;
         return;
     }
 
-    // brute force initialize all colorScale entries
+    // initialize the colorScale entries of all local views
     float masterMeanCol = sampler->getMasterMeanColor();
-    for (std::size_t idx = 0; idx < views.size(); ++idx) {
-        colorScale[idx] = math::Vec3f(1.f / masterMeanCol);
-    }
+    initialColorScale = math::Vec3f(1.f / masterMeanCol);
+    syncColorScale();
     computeColorScale();
 }
 
+/* Keeps the color scales in the order of the local views after these
+   changed. Views that were not selected before get the initial scale. */
+void
+PatchOptimization::syncColorScale()
+{
+    LocalViewSet const & neighIDs = localVS.getSelectedIDs();
+    math::Vec3f scales[MVS_MAX_LOCAL_VIEWS];
+    std::size_t old = 0;
+    for (std::size_t k = 0; k < neighIDs.size(); ++k)
+    {
+        while (old < colorScaleIDs.size() && colorScaleIDs[old] < neighIDs[k])
+            ++old;
+        if (old < colorScaleIDs.size() && colorScaleIDs[old] == neighIDs[k])
+            scales[k] = colorScale[old];
+        else
+            scales[k] = initialColorScale;
+    }
+    std::copy(scales, scales + neighIDs.size(), colorScale);
+    colorScaleIDs = neighIDs;
+}
+
 void
 PatchOptimization::computeColorScale()
 {
     if (!settings.useColorScale)
         return;
     Samples const & mCol = sampler->getMasterColorSamples();
-    IndexSet const & neighIDs = localVS.getSelectedIDs();
-    IndexSet::const_iterator id;
-    for (id = neighIDs.begin(); id != neighIDs.end(); ++id)
+    LocalViewSet const & neighIDs = localVS.getSelectedIDs();
+    for (std::size_t k = 0; k < neighIDs.size(); ++k)
     {
+        std::size_t id = neighIDs[k];
         // just copied from old mvs:
-        Samples const & nCol = sampler->getNeighColorSamples(*id);
-        if (!sampler->success[*id])
+        Samples const & nCol = sampler->getNeighColorSamples(id);
+        if (!sampler->success[id])
             return;
         for (std::size_t c = 0; c < 3; ++c) {
             // for each color channel
             float ab = 0.f;
             float aa = 0.f;
             for (std::size_t i = 0; i < mCol.size(); ++i) {
-                ab += (mCol[i][c] - nCol[i][c] * colorScale[*id][c]) * nCol[i][c];
+                ab += (mCol[i][c] - nCol[i][c] * colorScale[k][c]) * nCol[i][c];
                 aa += sqr(nCol[i][c]);
             }
             if (std::abs(aa) > 1e-6) {
-                colorScale[*id][c] += ab / aa;
-                if (colorScale[*id][c] > 1e3)
+                colorScale[k][c] += ab / aa;
+                if (colorScale[k][c] > 1e3)
                     status.optiSuccess = false;
             }
             else
@@ -112,8 +135,8 @@ PatchOptimization::computeConfidence()
     /* Compute mean NCC between reference view and local neighbors,
        where each NCC has to be higher than acceptance NCC */
     float meanNCC = 0.f;
-    IndexSet const & neighIDs = localVS.getSelectedIDs();
-    IndexSet::const_iterator id;
+    LocalViewSet const & neighIDs = localVS.getSelectedIDs();
+    LocalViewSet::const_iterator id;
     for (id = neighIDs.begin(); id != neighIDs.end(); ++id) {
         meanNCC += sampler->getFastNCC(*id);
     }
@@ -136,23 +159,23 @@ PatchOptimization::computeConfidence()
 float
 PatchOptimization::derivNorm()
 {
-    IndexSet const & neighIDs = localVS.getSelectedIDs();
-    IndexSet::const_iterator id;
+    LocalViewSet const & neighIDs = localVS.getSelectedIDs();
     std::size_t nrSamples = sampler->getNrSamples();
 
     float norm(0);
-    for (id = neighIDs.begin(); id != neighIDs.end(); ++id)
+    for (std::size_t k = 0; k < neighIDs.size(); ++k)
     {
-        Samples nCol, nDeriv;
-        sampler->fastColAndDeriv(*id, nCol, nDeriv);
-        if (!sampler->success[*id]) {
+        std::size_t id = neighIDs[k];
+        sampler->fastColAndDeriv(id);
+        if (!sampler->success[id]) {
             status.optiSuccess = false;
             return -1.f;
         }
 
-        math::Vec3f cs(colorScale[*id]);
+        Samples const & nDeriv = sampler->getDerivSamples();
+        math::Vec3f cs(colorScale[k]);
         for (std::size_t i = 0; i < nrSamples; ++i) {
-            norm += pixel_weight[i] * (cs.cw_mult(nDeriv[i])).square_norm();
+            norm += (cs.cw_mult(nDeriv[i])).square_norm();
         }
     }
     return norm;
@@ -165,27 +188,41 @@ PatchOptimization::doAutoOptimization()
         return;
     }
 
-    // first four iterations only refine depth
+    // first four iterations only refine depth, fewer if the depth
+    // update falls below the convergence tolerance
     while ((status.iterationCount < 4) && (status.optiSuccess)) {
+        float oldDepth = depth;
         optimizeDepthOnly();
         ++status.iterationCount;
+        if (status.optiSuccess && status.iterationCount < 4 &&
+            std::abs(depth - oldDepth) <=
+            settings.convergenceTolerance * oldDepth)
+        {
+            status.earlyExit = true;
+            break;
+        }
     }
 
+    // depth and normal are refined in the first joint iteration and
+    // every fifth iteration after it
+    std::size_t const firstJoint = status.iterationCount;
     bool viewRemoved = false;
     bool converged = false;
     while (status.iterationCount < settings.maxIterations &&
         localVS.success && status.optiSuccess)
     {
-        IndexSet const & neighIDs = localVS.getSelectedIDs();
-        IndexSet::const_iterator id;
+        LocalViewSet const & neighIDs = localVS.getSelectedIDs();
+        LocalViewSet::const_iterator id;
 
-        std::vector<float> oldNCC;
-        for (id = neighIDs.begin(); id != neighIDs.end(); ++id) {
-            oldNCC.push_back(sampler->getFastNCC(*id));
+        float oldNCC[MVS_MAX_LOCAL_VIEWS];
+        std::size_t count = 0;
+        for (id = neighIDs.begin(); id != neighIDs.end(); ++id, ++count) {
+            oldNCC[count] = sampler->getFastNCC(*id);
         }
 
         status.optiSuccess = false;
-        if (status.iterationCount % 5 == 4 || viewRemoved) {
+        std::size_t jointIteration = status.iterationCount - firstJoint;
+        if (jointIteration % 5 == 0 || viewRemoved) {
             optimizeDepthAndNormal();
             computeColorScale();
             viewRemoved = false;
@@ -197,8 +234,8 @@ PatchOptimization::doAutoOptimization()
         if (!status.optiSuccess)
             return;
         converged = true;
-        std::size_t count = 0;
-        IndexSet toBeReplaced;
+        count = 0;
+        LocalViewSet toBeReplaced;
 
         for (id = neighIDs.begin(); id != neighIDs.end(); ++id, ++count)
         {
@@ -206,7 +243,7 @@ PatchOptimization::doAutoOptimization()
             if (fabsf(ncc - oldNCC[count]) > settings.minRefineDiff)
                 converged = false;
             if ((ncc < settings.acceptNCC) ||
-                (status.iterationCount == 14 &&
+                (jointIteration == 10 &&
                  fabsf(ncc - oldNCC[count]) > settings.minRefineDiff))
             {
                 toBeReplaced.insert(*id);
@@ -219,6 +256,7 @@ PatchOptimization::doAutoOptimization()
             if (!localVS.success) {
                 return;
             }
+            syncColorScale();
             computeColorScale();
         }
         else if (!status.optiSuccess) {
@@ -238,16 +276,16 @@ PatchOptimization::objFunValue()
 {
     Samples const & mCol = sampler->getMasterColorSamples();
     std::size_t nrSamples = sampler->getNrSamples();
-    IndexSet const & neighIDs = localVS.getSelectedIDs();
-    IndexSet::const_iterator id;
+    LocalViewSet const & neighIDs = localVS.getSelectedIDs();
     float obj = 0.f;
-    for (id = neighIDs.begin(); id != neighIDs.end(); ++id) {
-        Samples const & nCol = sampler->getNeighColorSamples(*id);
-        if (!sampler->success[*id])
+    for (std::size_t k = 0; k < neighIDs.size(); ++k) {
+        std::size_t id = neighIDs[k];
+        Samples const & nCol = sampler->getNeighColorSamples(id);
+        if (!sampler->success[id])
             return -1.f;
-        math::Vec3f cs(colorScale[*id]);
+        math::Vec3f cs(colorScale[k]);
         for (std::size_t i = 0; i < nrSamples; ++i) {
-            obj += pixel_weight[i] * (mCol[i] - cs.cw_mult(nCol[i])).square_norm();
+            obj += (mCol[i] - cs.cw_mult(nCol[i])).square_norm();
         }
     }
     return obj;
@@ -259,24 +297,25 @@ PatchOptimization::optimizeDepthOnly()
     float numerator = 0.f;
     float denom = 0.f;
     Samples const & mCol = sampler->getMasterColorSamples();
-    IndexSet const & neighIDs = localVS.getSelectedIDs();
-    IndexSet::const_iterator id;
+    LocalViewSet const & neighIDs = localVS.getSelectedIDs();
     std::size_t nrSamples = sampler->getNrSamples();
 
-    for (id = neighIDs.begin(); id != neighIDs.end(); ++id)
+    for (std::size_t k = 0; k < neighIDs.size(); ++k)
     {
-        Samples nCol, nDeriv;
-        sampler->fastColAndDeriv(*id, nCol, nDeriv);
-        if (!sampler->success[*id]) {
+        std::size_t id = neighIDs[k];
+        sampler->fastColAndDeriv(id);
+        if (!sampler->success[id]) {
             status.optiSuccess = false;
             return;
         }
 
-        math::Vec3f cs(colorScale[*id]);
+        Samples const & nCol = sampler->getDerivColorSamples();
+        Samples const & nDeriv = sampler->getDerivSamples();
+        math::Vec3f cs(colorScale[k]);
         for (std::size_t i = 0; i < nrSamples; ++i) {
-            numerator += pixel_weight[i] * (cs.cw_mult(nDeriv[i])).dot
+            numerator += (cs.cw_mult(nDeriv[i])).dot
                 (mCol[i] - cs.cw_mult(nCol[i]));
-            denom += pixel_weight[i] * (cs.cw_mult(nDeriv[i])).square_norm();
+            denom += (cs.cw_mult(nDeriv[i])).square_norm();
         }
     }
 
@@ -296,48 +335,37 @@ PatchOptimization::optimizeDepthAndNormal()
     if (!localVS.success) {
         return;
     }
-    IndexSet const & neighIDs = localVS.getSelectedIDs();
+    LocalViewSet const & neighIDs = localVS.getSelectedIDs();
     std::size_t nrSamples = sampler->getNrSamples();
 
     // Solve linear system A*x = b using Moore-Penrose pseudoinverse
-    // Fill matrix ATA and vector ATb:
-    math::Matrix3d ATA(0.f);
-    math::Vec3d ATb(0.f);
+    // Accumulate the terms of ATA and ATb of all views in float lanes:
+    NormalEquations eq;
+    eq.clear();
     Samples const & mCol = sampler->getMasterColorSamples();
-    IndexSet::const_iterator id;
-    std::size_t row = 0;
-    for (id = neighIDs.begin(); id != neighIDs.end(); ++id)
+    Samples const & offsetI = sampler->getSampleOffsetsI();
+    Samples const & offsetJ = sampler->getSampleOffsetsJ();
+    for (std::size_t k = 0; k < neighIDs.size(); ++k)
     {
-        Samples nCol, nDeriv;
-        sampler->fastColAndDeriv(*id, nCol, nDeriv);
-        if (!sampler->success[*id]) {
+        std::size_t id = neighIDs[k];
+        sampler->fastColAndDeriv(id);
+        if (!sampler->success[id]) {
             status.optiSuccess = false;
             return;
         }
-        math::Vec3f cs(colorScale[*id]);
-        for (std::size_t i = 0; i < nrSamples; ++i) {
-            for (int c = 0; c < 3; ++c) {
-                math::Vec3f a_i;
-                a_i[0] = pixel_weight[i] *         cs[c] * nDeriv[i][c];
-                a_i[1] = pixel_weight[i] * ii[i] * cs[c] * nDeriv[i][c];
-                a_i[2] = pixel_weight[i] * jj[i] * cs[c] * nDeriv[i][c];
-                float b_i = pixel_weight[i] * (mCol[i][c] - cs[c] * nCol[i][c]);
-                assert(!MATH_ISINF(a_i[0]));
-                assert(!MATH_ISINF(a_i[1]));
-                assert(!MATH_ISINF(a_i[2]));
-                assert(!MATH_ISINF(b_i));
-                ATA(0,0) += a_i[0] * a_i[0];
-                ATA(0,1) += a_i[0] * a_i[1];
-                ATA(0,2) += a_i[0] * a_i[2];
-                ATA(1,1) += a_i[1] * a_i[1];
-                ATA(1,2) += a_i[1] * a_i[2];
-                ATA(2,2) += a_i[2] * a_i[2];
-                ATb += a_i * b_i;
-                ++row;
-            }
-        }
+        Samples const & nCol = sampler->getDerivColorSamples();
+        Samples const & nDeriv = sampler->getDerivSamples();
+        normalEquations(*mCol[0], *nCol[0], *nDeriv[0], *offsetI[0],
+            *offsetJ[0], *colorScale[k], nrSamples, &eq);
     }
+    double ata[6], atb[3];
+    eq.reduce(ata, atb);
+    math::Matrix3d ATA;
+    ATA(0,0) = ata[0]; ATA(0,1) = ata[1]; ATA(0,2) = ata[2];
+    ATA(1,1) = ata[3]; ATA(1,2) = ata[4]; ATA(2,2) = ata[5];
     ATA(1,0) = ATA(0,1); ATA(2,0) = ATA(0,2); ATA(2,1) = ATA(1,2);
+    math::Vec3d ATb(atb);
+    assert(!MATH_ISINF(ATA(0,0)) && !MATH_ISINF(ATb[0]));
     double detATA = math::matrix_determinant(ATA);
     if (detATA == 0.f) {
         status.optiSuccess = false;
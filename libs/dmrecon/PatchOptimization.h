@@ -7,6 +7,7 @@
 #include "util/refptr.h"
 #include "defines.h"
 #include "PatchSampler.h"
+#include "FixedIndexSet.h"
 #include "SingleView.h"
 #include "LocalViewSelection.h"
 
@@ -20,6 +21,7 @@ struct Status
     std::size_t iterationCount;
     bool converged;
     bool optiSuccess;
+    bool earlyExit;                 // depth-only refinement cut short
 };
 
 class PatchOptimization
@@ -33,8 +35,9 @@ public:
         float _depth,
         float _dzI,
         float _dzJ,
-        IndexSet const& _globalViewIDs,
-        IndexSet const& _localViewIDs);
+        GlobalViewSet const& _globalViewIDs,
+        LocalViewSet const& _localViewIDs,
+        PatchSampler::Ptr _sampler = PatchSampler::Ptr());
 
     void computeColorScale();
     float computeConfidence();
@@ -43,13 +46,19 @@ public:
     float getDepth() const;
     float getDzI() const;
     float getDzJ() const;
-    IndexSet const& getLocalViewIDs() const;
+    /** Iterations of the last doAutoOptimization() */
+    std::size_t getIterations() const;
+    /** Whether the depth-only refinement ended below the tolerance */
+    bool exitedEarly() const;
+    LocalViewSet const& getLocalViewIDs() const;
     math::Vec3f getNormal() const;
     float objFunValue();
     void optimizeDepthOnly();
     void optimizeDepthAndNormal();
 
 private:
+    void syncColorScale();
+
     SingleViewPtrList const& views;
     Settings const& settings;
     // initial values and settings
@@ -58,12 +67,13 @@ private:
 
     float depth;
     float dzI, dzJ;                 // represents patch normal
-    std::map<std::size_t, math::Vec3f, std::less<std::size_t> > colorScale;
+    /** color scale of the k-th local view in colorScale[k] */
+    math::Vec3f colorScale[MVS_MAX_LOCAL_VIEWS];
+    LocalViewSet colorScaleIDs;
+    math::Vec3f initialColorScale;
     Status status;
 
-    PatchSampler::Ptr sampler;
-    std::vector<int> ii, jj;
-    std::vector<float> pixel_weight;
+    PatchSampler::Ptr sampler;      // may be shared with later patches
     LocalViewSelection localVS;
 };
 
@@ -85,7 +95,19 @@ PatchOptimization::getDzJ() const
     return dzJ;
 }
 
-inline IndexSet const&
+inline std::size_t
+PatchOptimization::getIterations() const
+{
+    return status.iterationCount;
+}
+
+inline bool
+PatchOptimization::exitedEarly() const
+{
+    return status.earlyExit;
+}
+
+inline LocalViewSet const&
 PatchOptimization::getLocalViewIDs() const
 {
     return localVS.getSelectedIDs();
@@ -1,13 +1,37 @@
+#include <cstdlib>
+
 #include "math/defines.h"
 #include "math/matrix.h"
 #include "math/vector.h"
 
 #include "defines.h"
 #include "mvstools.h"
+#include "simdtools.h"
 #include "PatchSampler.h"
 
 MVS_NAMESPACE_BEGIN
 
+PatchSampler::PatchSampler(
+    SingleViewPtrList const& _views,
+    Settings const& _settings)
+    :
+    views(_views),
+    settings(_settings),
+    masterMeanCol(0.f),
+    sparse(false),
+    nccCount(0),
+    patchCount(0),
+    sparsePatchCount(0),
+    sampleCount(0),
+    depth(0.f),
+    dzI(0.f),
+    dzJ(0.f),
+    viewSlot(views.size(), -1),
+    success(views.size(), false)
+{
+    initArrays();
+}
+
 PatchSampler::PatchSampler(
     SingleViewPtrList const& _views,
     Settings const& _settings,
@@ -19,23 +43,99 @@ PatchSampler::PatchSampler(
     :
     views(_views),
     settings(_settings),
-    midPix(_x,_y),
     masterMeanCol(0.f),
-    depth(_depth),
-    dzI(_dzI),
-    dzJ(_dzJ),
+    sparse(false),
+    nccCount(0),
+    patchCount(0),
+    sparsePatchCount(0),
+    sampleCount(0),
+    depth(0.f),
+    dzI(0.f),
+    dzJ(0.f),
+    viewSlot(views.size(), -1),
     success(views.size(), false)
 {
-    SingleViewPtr refV(views[settings.refViewNr]);
-    util::RefPtr<mve::ImageBase> masterImg(refV->getScaledImg());
+    initArrays();
+    reset(_x, _y, _depth, _dzI, _dzJ);
+}
 
+void
+PatchSampler::initArrays()
+{
     offset = settings.filterWidth / 2;
-    nrSamples = sqr(settings.filterWidth);
 
-    /* initialize arrays */
+    /* the sparse pattern keeps every second pixel and the border */
+    for (int i = -(int) offset; i <= (int) offset; ++i) {
+        denseAxis.push_back(i);
+        if (i % 2 == 0 || std::abs(i) == (int) offset)
+            sparseAxis.push_back(i);
+    }
+
+    /* reserve for the dense pattern, switching does not allocate */
+    std::size_t maxSamples = sqr(denseAxis.size());
+    patchPoints.reserve(maxSamples);
+    masterColorSamples.reserve(maxSamples);
+    masterCentered.reserve(maxSamples);
+    masterViewDirs.reserve(maxSamples);
+    imgPos.reserve(maxSamples);
+    gradDir.reserve(maxSamples);
+    masterPos.reserve(maxSamples);
+    derivColor.reserve(maxSamples);
+    derivSamples.reserve(maxSamples);
+    sampleOffsetsI.reserve(maxSamples);
+    sampleOffsetsJ.reserve(maxSamples);
+    usePattern(false);
+}
+
+/** Sizes the sample arrays for the dense or the sparse pattern */
+void
+PatchSampler::usePattern(bool _sparse)
+{
+    sparse = _sparse;
+    std::vector<int> const& axis(getAxis());
+    std::size_t side = axis.size();
+    nrSamples = side * side;
+
     patchPoints.resize(nrSamples);
     masterColorSamples.resize(nrSamples);
+    masterCentered.resize(nrSamples);
     masterViewDirs.resize(nrSamples);
+    imgPos.resize(nrSamples);
+    gradDir.resize(nrSamples);
+    masterPos.resize(nrSamples);
+    derivColor.resize(nrSamples);
+    derivSamples.resize(nrSamples);
+
+    /* samples are ordered row by row */
+    sampleOffsetsI.resize(nrSamples);
+    sampleOffsetsJ.resize(nrSamples);
+    for (std::size_t i = 0; i < nrSamples; ++i) {
+        sampleOffsetsI[i] = math::Vec3f((float) axis[i % side]);
+        sampleOffsetsJ[i] = math::Vec3f((float) axis[i / side]);
+    }
+}
+
+void
+PatchSampler::reset(std::size_t x, std::size_t y, float newDepth,
+    float newDzI, float newDzJ)
+{
+    /* release slots of the previous pixel, buffers are kept */
+    for (std::size_t s = 0; s < slotView.size(); ++s) {
+        viewSlot[slotView[s]] = -1;
+        success[slotView[s]] = false;
+    }
+    slotView.clear();
+    success[settings.refViewNr] = false;
+
+    midPix[0] = x;
+    midPix[1] = y;
+    masterMeanCol = 0.f;
+    depth = newDepth;
+    dzI = newDzI;
+    dzJ = newDzJ;
+
+    SingleViewPtr refV(views[settings.refViewNr]);
+    util::RefPtr<mve::ImageBase> masterImg(refV->getScaledImg());
 
     /* compute patch position and check if it's valid */
     math::Vec2i h;
@@ -49,28 +149,39 @@ PatchSampler::PatchSampler(
         return;
     }
 
-    /* initialize viewing rays from master view */
-    std::size_t count = 0;
-    for (int j = topLeft[1]; j <= bottomRight[1]; ++j)
-        for (int i = topLeft[0]; i <= bottomRight[0]; ++i)
-            masterViewDirs[count++] = refV->viewRay
-                (std::size_t(i), std::size_t(j));
-
-    /* initialize master color samples and 3d patch points */
+    /* initialize master color samples, textured patches continue with
+       the sparse pattern */
+    if (sparse)
+        usePattern(false);
     success[settings.refViewNr] = true;
     computeMasterSamples();
+    if (settings.adaptiveSampling && success[settings.refViewNr]
+        && varInMasterPatch() > settings.sparseSamplingVariance)
+    {
+        usePattern(true);
+        computeMasterSamples();
+        ++sparsePatchCount;
+    }
+    ++patchCount;
+
+    /* initialize viewing rays from master view and 3d patch points */
+    std::vector<int> const& axis(getAxis());
+    std::size_t count = 0;
+    for (std::size_t j = 0; j < axis.size(); ++j)
+        for (std::size_t i = 0; i < axis.size(); ++i)
+            masterViewDirs[count++] = refV->viewRay
+                (std::size_t(midPix[0] + axis[i]),
+                std::size_t(midPix[1] + axis[j]));
     computePatchPoints();
 }
 
 void
-PatchSampler::fastColAndDeriv(std::size_t v, Samples& color, Samples& deriv)
+PatchSampler::fastColAndDeriv(std::size_t v)
 {
+    getSlot(v);
     success[v] = false;
     SingleViewPtr refV = views[settings.refViewNr];
 
-    PixelCoords& imgPos = neighPosSamples[v];
-    imgPos.resize(nrSamples);
-
     math::Vec3f const& p0 = patchPoints[nrSamples/2];
     /* compute pixel prints and decide on which MipMap-Level to draw
        the samples */
@@ -94,23 +205,22 @@ PatchSampler::fastColAndDeriv(std::size_t v, Samples& color, Samples& deriv)
     /* compute step size for derivative */
     math::Vec3f p1(p0 + masterViewDirs[nrSamples/2]);
     float d = (views[v]->worldToScreen(p1, mmLevel)
-        - views[v]->worldToScreen(patchPoints[12], mmLevel)).norm();
+        - views[v]->worldToScreen(p0, mmLevel)).norm();
     if (!(d > 0.f)) {
         return;
     }
-    stepSize[v] = 1.f / d;
+    float stepSize = 1.f / d;
 
     /* request according undistorted color image */
-    util::RefPtr<mve::ImageBase> img(views[v]->getPyramidImg(mmLevel));
+    mve::ImageBase::Ptr const& img(views[v]->getPyramidImg(mmLevel));
     std::size_t w = img->width();
     std::size_t h = img->height();
 
     /* compute image position and gradient direction for each sample
        point in neighbor image v */
-    std::vector<math::Vec2f> gradDir(nrSamples);
     for (std::size_t i = 0; i < nrSamples; ++i) {
         math::Vec3f p0(patchPoints[i]);
-        math::Vec3f p1(patchPoints[i] + masterViewDirs[i] * stepSize[v]);
+        math::Vec3f p1(patchPoints[i] + masterViewDirs[i] * stepSize);
         imgPos[i] = views[v]->worldToScreen(p0, mmLevel);
         // imgPos should be away from image border
         if (!(imgPos[i][0] > 0 && imgPos[i][0] < w-1 &&
@@ -121,13 +231,12 @@ PatchSampler::fastColAndDeriv(std::size_t v, Samples& color, Samples& deriv)
     }
 
     /* draw the samples in the image */
-    color.resize(nrSamples, math::Vec3f(0.f));
-    deriv.resize(nrSamples, math::Vec3f(0.f));
-    colAndExactDeriv(img, imgPos, gradDir, color, deriv);
+    colAndExactDeriv(img, imgPos, gradDir, derivColor, derivSamples);
+    sampleCount += nrSamples;
 
     /* normalize the gradient */
     for (std::size_t i = 0; i < nrSamples; ++i)
-        deriv[i] /= stepSize[v];
+        derivSamples[i] /= stepSize;
 
     success[v] = true;
 }
@@ -135,26 +244,15 @@ PatchSampler::fastColAndDeriv(std::size_t v, Samples& color, Samples& deriv)
 float
 PatchSampler::getFastNCC(std::size_t v)
 {
-    if (neighColorSamples[v].empty()) {
-        computeNeighColorSamples(v);
-    }
+    ++nccCount;
+    Samples const& nCol = getNeighColorSamples(v);
     if (!success[v])
         return -1.f;
     assert(success[settings.refViewNr]);
-    math::Vec3f meanY(0.f);
-    for (std::size_t i = 0; i < nrSamples; ++i) {
-        meanY += neighColorSamples[v][i];
-    }
-    meanY /= (float) nrSamples;
 
-    float sqrDevY = 0.f;
-    float devXY = 0.f;
-    for (std::size_t i = 0; i < nrSamples; ++i) {
-        sqrDevY += (neighColorSamples[v][i] - meanY).square_norm();
-        // Note: master color samples are normalized!
-        devXY += (masterColorSamples[i] - meanX)
-            .dot(neighColorSamples[v][i] - meanY);
-    }
+    // Note: master color samples are normalized!
+    float sqrDevY, devXY;
+    nccTerms(*masterCentered[0], *nCol[0], nrSamples, &sqrDevY, &devXY);
     float tmp = sqrt(sqrDevX * sqrDevY);
     assert(!MATH_ISNAN(tmp) && !MATH_ISNAN(devXY));
     if (tmp > 0)
@@ -166,18 +264,19 @@ PatchSampler::getFastNCC(std::size_t v)
 float
 PatchSampler::getNCC(std::size_t u, std::size_t v)
 {
-    if (neighColorSamples[u].empty())
-        computeNeighColorSamples(u);
-    if (neighColorSamples[v].empty())
-        computeNeighColorSamples(v);
+    ++nccCount;
+    getNeighColorSamples(u);
+    getNeighColorSamples(v);
     if (!success[u] || !success[v])
             return -1.f;
+    Samples const& colU = neighColorSamples[viewSlot[u]];
+    Samples const& colV = neighColorSamples[viewSlot[v]];
 
     math::Vec3f meanX(0.f);
     math::Vec3f meanY(0.f);
     for (std::size_t i = 0; i < nrSamples; ++i) {
-        meanX += neighColorSamples[u][i];
-        meanY += neighColorSamples[v][i];
+        meanX += colU[i];
+        meanY += colV[i];
     }
     meanX /= nrSamples;
     meanY /= nrSamples;
@@ -186,10 +285,10 @@ PatchSampler::getNCC(std::size_t u, std::size_t v)
     float sqrDevY = 0.f;
     float devXY = 0.f;
     for (std::size_t i = 0; i < nrSamples; ++i) {
-        sqrDevX += (neighColorSamples[u][i] - meanX).square_norm();
-        sqrDevY += (neighColorSamples[v][i] - meanY).square_norm();
-        devXY += (neighColorSamples[u][i] - meanX)
-            .dot(neighColorSamples[v][i] - meanY);
+        sqrDevX += (colU[i] - meanX).square_norm();
+        sqrDevY += (colV[i] - meanY).square_norm();
+        devXY += (colU[i] - meanX)
+            .dot(colV[i] - meanY);
     }
 
     float tmp = sqrt(sqrDevX * sqrDevY);
@@ -202,15 +301,14 @@ PatchSampler::getNCC(std::size_t u, std::size_t v)
 float
 PatchSampler::getSAD(std::size_t v, math::Vec3f const& cs)
 {
-    if (neighColorSamples[v].empty())
-        computeNeighColorSamples(v);
+    Samples const& nCol = getNeighColorSamples(v);
     if (!success[v])
         return -1.f;
 
     float sum = 0.f;
     for (std::size_t i = 0; i < nrSamples; ++i) {
         for (std::size_t c = 0; c < 3; ++c) {
-            sum += fabs(cs[c] * neighColorSamples[v][i][c] -
+            sum += fabs(cs[c] * nCol[i][c] -
                 masterColorSamples[i][c]);
         }
     }
@@ -220,15 +318,14 @@ PatchSampler::getSAD(std::size_t v, math::Vec3f const& cs)
 float
 PatchSampler::getSSD(std::size_t v, math::Vec3f const& cs)
 {
-    if (neighColorSamples[v].empty())
-        computeNeighColorSamples(v);
+    Samples const& nCol = getNeighColorSamples(v);
     if (!success[v])
         return -1.f;
 
     float sum = 0.f;
     for (std::size_t i = 0; i < nrSamples; ++i) {
         for (std::size_t c = 0; c < 3; ++c) {
-            float diff = cs[c] * neighColorSamples[v][i][c] -
+            float diff = cs[c] * nCol[i][c] -
                 masterColorSamples[i][c];
             sum += diff * diff;
         }
@@ -239,10 +336,11 @@ PatchSampler::getSSD(std::size_t v, math::Vec3f const& cs)
 math::Vec3f
 PatchSampler::getPatchNormal() const
 {
-    std::size_t right = nrSamples/2 + offset;
-    std::size_t left = nrSamples/2 - offset;
-    std::size_t top = offset;
-    std::size_t bottom = nrSamples - 1 - offset;
+    std::size_t half = getAxis().size() / 2;
+    std::size_t right = nrSamples/2 + half;
+    std::size_t left = nrSamples/2 - half;
+    std::size_t top = half;
+    std::size_t bottom = nrSamples - 1 - half;
 
     math::Vec3f a(patchPoints[right] - patchPoints[left]);
     math::Vec3f b(patchPoints[top] - patchPoints[bottom]);
@@ -255,16 +353,15 @@ PatchSampler::getPatchNormal() const
 void
 PatchSampler::update(float newDepth, float newDzI, float newDzJ)
 {
-    success.clear();
-    success.resize(views.size(), false);
+    for (std::size_t s = 0; s < slotView.size(); ++s) {
+        success[slotView[s]] = false;
+        neighColorValid[s] = 0;
+    }
     depth = newDepth;
     dzI = newDzI;
     dzJ = newDzJ;
     success[settings.refViewNr] = true;
     computePatchPoints();
-    neighColorSamples.clear();
-    neighDerivSamples.clear();
-    neighPosSamples.clear();
 }
 
 void
@@ -272,11 +369,11 @@ PatchSampler::computePatchPoints()
 {
     SingleViewPtr refV = views[settings.refViewNr];
 
+    std::vector<int> const& axis(getAxis());
     unsigned int count = 0;
-    for (int j = topLeft[1]; j <= bottomRight[1]; ++j) {
-        for (int i = topLeft[0]; i <= bottomRight[0]; ++i) {
-            float tmpDepth = depth + (i - midPix[0]) * dzI +
-                (j - midPix[1]) * dzJ;
+    for (std::size_t j = 0; j < axis.size(); ++j) {
+        for (std::size_t i = 0; i < axis.size(); ++i) {
+            float tmpDepth = depth + axis[i] * dzI + axis[j] * dzJ;
             if (tmpDepth <= 0.f) {
                 success[settings.refViewNr] = false;
                 return;
@@ -295,15 +392,15 @@ PatchSampler::computeMasterSamples()
     util::RefPtr<mve::ImageBase> img(refV->getScaledImg());
 
     /* draw color samples from image and compute mean color */
+    std::vector<int> const& axis(getAxis());
     std::size_t count = 0;
-    std::vector<math::Vec2i> imgPos(nrSamples);
-    for (int j = topLeft[1]; j <= bottomRight[1]; ++j)
-        for (int i = topLeft[0]; i <= bottomRight[0]; ++i) {
-            imgPos[count][0] = i;
-            imgPos[count][1] = j;
+    for (std::size_t j = 0; j < axis.size(); ++j)
+        for (std::size_t i = 0; i < axis.size(); ++i) {
+            masterPos[count][0] = midPix[0] + axis[i];
+            masterPos[count][1] = midPix[1] + axis[j];
             ++count;
         }
-    getXYZColorAtPix(img, imgPos, &masterColorSamples);
+    getXYZColorAtPix(img, masterPos, &masterColorSamples);
 
     masterMeanCol = 0.f;
     for (std::size_t i = 0; i < nrSamples; ++i)
@@ -332,7 +429,8 @@ PatchSampler::computeMasterSamples()
 
     /* compute variance (independent from actual mean) */
     for (std::size_t i = 0; i < nrSamples; ++i) {
-        sqrDevX += (masterColorSamples[i] - meanX).square_norm();
+        masterCentered[i] = masterColorSamples[i] - meanX;
+        sqrDevX += masterCentered[i].square_norm();
     }
 }
 
@@ -341,8 +439,9 @@ PatchSampler::computeNeighColorSamples(std::size_t v)
 {
     SingleViewPtr refV = views[settings.refViewNr];
 
-    Samples & color = neighColorSamples[v];
-    PixelCoords & imgPos = neighPosSamples[v];
+    std::size_t slot = getSlot(v);
+    Samples & color = neighColorSamples[slot];
+    neighColorValid[slot] = 1;
     success[v] = false;
 
     /* compute pixel prints and decide on which MipMap-Level to draw
@@ -365,12 +464,11 @@ PatchSampler::computeNeighColorSamples(std::size_t v)
         ratio *= 2.f;
     }
     mmLevel = std::min(views[v]->getMaxLevel(), mmLevel);
-    util::RefPtr<mve::ImageBase> img(views[v]->getPyramidImg(mmLevel));
+    mve::ImageBase::Ptr const& img(views[v]->getPyramidImg(mmLevel));
     std::size_t w = img->width();
     std::size_t h = img->height();
 
     color.resize(nrSamples);
-    imgPos.resize(nrSamples);
 
     for (std::size_t i = 0; i < nrSamples; ++i) {
         imgPos[i] = views[v]->worldToScreen(patchPoints[i], mmLevel);
@@ -381,6 +479,7 @@ PatchSampler::computeNeighColorSamples(std::size_t v)
         }
     }
     getXYZColorAtPos(img, imgPos, &color);
+    sampleCount += nrSamples;
     success[v] = true;
 }
 
@@ -1,7 +1,7 @@
 #ifndef PATCHSAMPLER_H
 #define PATCHSAMPLER_H
 
-#include <map>
+#include <vector>
 
 #include "math/vector.h"
 #include "util/refptr.h"
@@ -14,6 +14,19 @@ MVS_NAMESPACE_BEGIN
 class PatchSampler;
 typedef util::RefPtr<PatchSampler> PatchSamplerPtr;
 
+/**
+ * Draws color samples of a planar patch around a reference pixel in the
+ * reference view and its neighbors. Samples of neighbor views are kept
+ * in slots that are assigned on first access, so a sampler can be
+ * reset() to a new pixel and reused as a per-thread arena without
+ * releasing its buffers.
+ *
+ * With adaptive sampling, patches whose master samples vary strongly use
+ * a sparse pattern of every second pixel and the patch border instead of
+ * every pixel. Both patterns have the same support, textured patches
+ * keep enough samples for a distinct NCC while the neighbor views are
+ * sampled at about a third of the cost for the default filter width.
+ */
 class PatchSampler
 {
 public:
@@ -21,8 +34,10 @@ public:
     typedef util::RefPtr<PatchSampler const> ConstPtr;
 
 public:
-    /** Default constructor */
-    PatchSampler();
+    /** Constructor for an empty sampler, call reset() before use */
+    PatchSampler(
+        SingleViewPtrList const& _views,
+        Settings const& _settings);
 
     /** Constructor */
     PatchSampler(
@@ -34,14 +49,34 @@ public:
         float _dzI,
         float _dzJ);
 
+    /** Smart pointer PatchSampler constructor for an empty sampler. */
+    static PatchSampler::Ptr create(SingleViewPtrList const& views,
+        Settings const& settings);
+
     /** Smart pointer PatchSampler constructor. */
     static PatchSampler::Ptr create(SingleViewPtrList const& views,
         Settings const& settings, std::size_t x, std::size_t _y,
         float _depth, float _dzI, float _dzJ);
 
-    /** Draw color samples and derivatives in neighbor view v */
-    void fastColAndDeriv(std::size_t v, Samples & color,
-        Samples& deriv);
+    /** Moves the patch to a new pixel, keeps allocated buffers */
+    void reset(std::size_t x, std::size_t y, float newDepth,
+        float newDzI, float newDzJ);
+
+    /** Draw color samples and derivatives in neighbor view v. The
+        result is available through getDerivColorSamples() and
+        getDerivSamples() until the next call. */
+    void fastColAndDeriv(std::size_t v);
+
+    /** Color samples of the last fastColAndDeriv() call */
+    Samples const& getDerivColorSamples() const;
+
+    /** Derivative samples of the last fastColAndDeriv() call */
+    Samples const& getDerivSamples() const;
+
+    /** Horizontal and vertical pixel offsets of the samples from the
+        patch center, repeated for each color channel */
+    Samples const& getSampleOffsetsI() const;
+    Samples const& getSampleOffsetsJ() const;
 
     /** Compute NCC between reference view and a neighbor view */
     float getFastNCC(std::size_t v);
@@ -84,6 +119,21 @@ public:
     /**  */    
     float varInMasterPatch();
 
+    /** Whether the current patch uses the sparse sample pattern */
+    bool isSparse() const;
+
+    /** Number of NCC computations since construction */
+    std::size_t getNCCCount() const;
+
+    /** Number of patches sampled since construction */
+    std::size_t getPatchCount() const;
+
+    /** Number of patches that used the sparse sample pattern */
+    std::size_t getSparsePatchCount() const;
+
+    /** Number of samples drawn in neighbor views since construction */
+    std::size_t getSampleCount() const;
+
 
 private:
     SingleViewPtrList const& views;
@@ -104,8 +154,21 @@ private:
     /** filter width = 2 * offset + 1 */
     std::size_t offset;
 
+    /** pixel offsets of the samples along each axis, the patch samples
+        are ordered row by row */
+    std::vector<int> denseAxis;
+    std::vector<int> sparseAxis;
+    bool sparse;
+
     size_t nrSamples;
 
+    /** NCC computations, read by the reconstruction metrics */
+    std::size_t nccCount;
+    /** sampled and sparse patches, neighbor samples for the metrics */
+    std::size_t patchCount;
+    std::size_t sparsePatchCount;
+    std::size_t sampleCount;
+
     /** depth and encoded normal */
     float depth;
     float dzI, dzJ;
@@ -116,16 +179,36 @@ private:
     /** 3d position of patch points */
     Samples patchPoints;
 
+    /** pixel offsets of the samples from the patch center */
+    Samples sampleOffsetsI;
+    Samples sampleOffsetsJ;
+
     /** pixel colors of patch in master image */
     Samples masterColorSamples;
 
-    /** samples in neighbor images */
-    std::map<std::size_t, Samples> neighColorSamples;
-    std::map<std::size_t, Samples> neighDerivSamples;
-    std::map<std::size_t, PixelCoords> neighPosSamples;
-
-    std::map<std::size_t, float> stepSize;
-
+    /** master colors with meanX subtracted, input to the NCC kernel */
+    Samples masterCentered;
+
+    /** slot of each view in the sample store, -1 if not assigned */
+    std::vector<int> viewSlot;
+    /** views in slot order, the number of assigned slots */
+    std::vector<std::size_t> slotView;
+    /** color samples in neighbor images, one entry per slot */
+    std::vector<Samples> neighColorSamples;
+    /** whether the color samples of a slot are up to date */
+    std::vector<char> neighColorValid;
+
+    /** scratch buffers reused for every neighbor view */
+    PixelCoords imgPos;
+    PixelCoords gradDir;
+    std::vector<math::Vec2i> masterPos;
+    Samples derivColor;
+    Samples derivSamples;
+
+    void initArrays();
+    void usePattern(bool sparse);
+    std::vector<int> const& getAxis() const;
+    std::size_t getSlot(std::size_t v);
     void computePatchPoints();
     void computeMasterSamples();
     void computeNeighColorSamples(std::size_t v);
@@ -134,6 +217,12 @@ public:
     std::vector<bool> success;
 };
 
+inline PatchSampler::Ptr
+PatchSampler::create(SingleViewPtrList const& views, Settings const& settings)
+{
+    return PatchSampler::Ptr(new PatchSampler(views, settings));
+}
+
 inline PatchSampler::Ptr
 PatchSampler::create(SingleViewPtrList const& views, Settings const& settings,
     std::size_t x, std::size_t y, float depth, float dzI, float dzJ)
@@ -142,6 +231,42 @@ PatchSampler::create(SingleViewPtrList const& views, Settings const& settings,
         (views, settings, x, y, depth, dzI, dzJ));
 }
 
+inline bool
+PatchSampler::isSparse() const
+{
+    return sparse;
+}
+
+inline std::size_t
+PatchSampler::getNCCCount() const
+{
+    return nccCount;
+}
+
+inline std::size_t
+PatchSampler::getPatchCount() const
+{
+    return patchCount;
+}
+
+inline std::size_t
+PatchSampler::getSparsePatchCount() const
+{
+    return sparsePatchCount;
+}
+
+inline std::size_t
+PatchSampler::getSampleCount() const
+{
+    return sampleCount;
+}
+
+inline std::vector<int> const&
+PatchSampler::getAxis() const
+{
+    return sparse ? sparseAxis : denseAxis;
+}
+
 inline Samples const&
 PatchSampler::getMasterColorSamples() const
 {
@@ -151,9 +276,51 @@ PatchSampler::getMasterColorSamples() const
 inline Samples const&
 PatchSampler::getNeighColorSamples(std::size_t v)
 {
-    if (neighColorSamples[v].empty())
+    std::size_t slot = getSlot(v);
+    if (!neighColorValid[slot])
         computeNeighColorSamples(v);
-    return neighColorSamples[v];
+    return neighColorSamples[slot];
+}
+
+inline Samples const&
+PatchSampler::getDerivColorSamples() const
+{
+    return derivColor;
+}
+
+inline Samples const&
+PatchSampler::getDerivSamples() const
+{
+    return derivSamples;
+}
+
+inline Samples const&
+PatchSampler::getSampleOffsetsI() const
+{
+    return sampleOffsetsI;
+}
+
+inline Samples const&
+PatchSampler::getSampleOffsetsJ() const
+{
+    return sampleOffsetsJ;
+}
+
+inline std::size_t
+PatchSampler::getSlot(std::size_t v)
+{
+    int slot = viewSlot[v];
+    if (slot < 0) {
+        slot = (int) slotView.size();
+        viewSlot[v] = slot;
+        slotView.push_back(v);
+        if (neighColorSamples.size() < slotView.size()) {
+            neighColorSamples.push_back(Samples());
+            neighColorValid.push_back(0);
+        }
+        neighColorValid[slot] = 0;
+    }
+    return (std::size_t) slot;
 }
 
 inline float
@@ -0,0 +1,131 @@
+#include <cstring>
+#include <stdexcept>
+#include <stdint.h>
+
+#include "PointStream.h"
+
+/* Chunk layout: signature, view ID and point count as uint64, scale as
+   float with padding, point records */
+#define POINTSTREAM_SIGNATURE "MVS-POINTCHUNK1\n"
+#define POINTSTREAM_SIGNATURE_LEN 16
+
+MVS_NAMESPACE_BEGIN
+
+namespace
+{
+    struct ChunkHeader
+    {
+        uint64_t viewID;
+        uint64_t numPoints;
+        float scale;
+        float padding;
+    };
+}
+
+PointStream::PointStream(std::string const& filename, std::size_t viewID,
+    float scale, std::size_t chunkSize)
+    :
+    filename(filename),
+    viewID(viewID),
+    scale(scale),
+    chunkSize(chunkSize > 0 ? chunkSize : 1),
+    numPoints(0)
+{
+    out.open(filename.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out.good())
+        throw std::runtime_error("Cannot create point file: " + filename);
+    buffer.reserve(this->chunkSize);
+}
+
+PointStream::~PointStream()
+{
+    /* errors cannot be reported here, close() reports them */
+    try
+    {
+        close();
+    }
+    catch (std::exception&)
+    {
+    }
+}
+
+void
+PointStream::flush()
+{
+    if (buffer.empty())
+        return;
+    if (!out.is_open())
+        throw std::runtime_error("Point file closed: " + filename);
+
+    ChunkHeader header;
+    header.viewID = viewID;
+    header.numPoints = buffer.size();
+    header.scale = scale;
+    header.padding = 0.f;
+    out.write(POINTSTREAM_SIGNATURE, POINTSTREAM_SIGNATURE_LEN);
+    out.write(reinterpret_cast<char const*>(&header), sizeof(ChunkHeader));
+    out.write(reinterpret_cast<char const*>(&buffer[0]),
+        buffer.size() * sizeof(Point));
+    out.flush();
+    if (!out.good())
+        throw std::runtime_error("Error writing point file: " + filename);
+    buffer.clear();
+}
+
+void
+PointStream::close()
+{
+    if (!out.is_open())
+        return;
+    flush();
+    out.close();
+}
+
+mve::TriangleMesh::Ptr
+PointStream::load(std::string const& filename)
+{
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if (!in.good())
+        throw std::runtime_error("Cannot open point file: " + filename);
+
+    mve::TriangleMesh::Ptr mesh(mve::TriangleMesh::create());
+    mve::TriangleMesh::VertexList& verts(mesh->get_vertices());
+    mve::TriangleMesh::NormalList& normals(mesh->get_vertex_normals());
+    mve::TriangleMesh::ColorList& colors(mesh->get_vertex_colors());
+    mve::TriangleMesh::ConfidenceList& confs(mesh->get_vertex_confidences());
+
+    std::vector<Point> points;
+    while (true)
+    {
+        char signature[POINTSTREAM_SIGNATURE_LEN];
+        in.read(signature, POINTSTREAM_SIGNATURE_LEN);
+        if (in.gcount() == 0 && in.eof())
+            break;
+        ChunkHeader header;
+        in.read(reinterpret_cast<char*>(&header), sizeof(ChunkHeader));
+        if (!in.good() || std::memcmp(signature, POINTSTREAM_SIGNATURE,
+            POINTSTREAM_SIGNATURE_LEN) != 0)
+            throw std::runtime_error("Invalid point chunk in " + filename);
+
+        if (header.numPoints == 0)
+            continue;
+        points.resize(header.numPoints);
+        in.read(reinterpret_cast<char*>(&points[0]),
+            points.size() * sizeof(Point));
+        if (!in.good())
+            throw std::runtime_error("Truncated point chunk in " + filename);
+
+        for (std::size_t i = 0; i < points.size(); ++i)
+        {
+            Point const& p(points[i]);
+            verts.push_back(p.position);
+            normals.push_back(p.normal);
+            colors.push_back(math::Vec4f(p.color[0] / 255.f,
+                p.color[1] / 255.f, p.color[2] / 255.f, 1.f));
+            confs.push_back(p.confidence);
+        }
+    }
+    return mesh;
+}
+
+MVS_NAMESPACE_END
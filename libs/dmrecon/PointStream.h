@@ -0,0 +1,112 @@
+#ifndef POINTSTREAM_H
+#define POINTSTREAM_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "math/vector.h"
+#include "mve/trianglemesh.h"
+#include "util/refptr.h"
+#include "defines.h"
+
+/** Default number of points per chunk */
+#define MVS_POINT_CHUNK_SIZE 65536
+
+MVS_NAMESPACE_BEGIN
+
+/**
+ * Binary point file that reconstructed points are streamed into while
+ * the depth map is computed. Points are buffered and written in chunks,
+ * each with a signature, the view ID, the scale and the number of points.
+ * Chunks do not depend on each other, so the files of several views can
+ * simply be concatenated into one scene-wide point file, which load()
+ * reads like a single one.
+ *
+ * The file is written in native byte order and is only meant to be read
+ * on the same machine.
+ */
+class PointStream
+{
+public:
+    typedef util::RefPtr<PointStream> Ptr;
+
+    /** Point record as written to the file */
+    struct Point
+    {
+        math::Vec3f position;
+        math::Vec3f normal;
+        float confidence;
+        unsigned char color[4];     // RGB, the last byte is padding
+    };
+
+public:
+    /** Truncates or creates the file */
+    static Ptr create(std::string const& filename, std::size_t viewID,
+        float scale, std::size_t chunkSize = MVS_POINT_CHUNK_SIZE);
+    ~PointStream();
+
+    /** Buffers the point, writes a chunk when the buffer is full */
+    void add(Point const& point);
+
+    /** Writes the buffered points as a chunk */
+    void flush();
+
+    /** Flushes and closes the file, further points are an error */
+    void close();
+
+    std::string const& getFilename() const;
+    /** Points added so far, including the buffered ones */
+    std::size_t getNumPoints() const;
+
+    /** Reads the points of all chunks of a file with vertex normals,
+        colors and confidences */
+    static mve::TriangleMesh::Ptr load(std::string const& filename);
+
+private:
+    PointStream(std::string const& filename, std::size_t viewID,
+        float scale, std::size_t chunkSize);
+
+private:
+    std::string filename;
+    std::size_t viewID;
+    float scale;
+    std::size_t chunkSize;
+    std::ofstream out;
+    std::vector<Point> buffer;
+    std::size_t numPoints;
+};
+
+/* ------------------------- Implementation ----------------------- */
+
+inline PointStream::Ptr
+PointStream::create(std::string const& filename, std::size_t viewID,
+    float scale, std::size_t chunkSize)
+{
+    return Ptr(new PointStream(filename, viewID, scale, chunkSize));
+}
+
+inline void
+PointStream::add(Point const& point)
+{
+    buffer.push_back(point);
+    ++numPoints;
+    if (buffer.size() >= chunkSize)
+        flush();
+}
+
+inline std::string const&
+PointStream::getFilename() const
+{
+    return filename;
+}
+
+inline std::size_t
+PointStream::getNumPoints() const
+{
+    return numPoints;
+}
+
+MVS_NAMESPACE_END
+
+#endif
@@ -0,0 +1,124 @@
+#include <algorithm>
+
+#include "util/threadlocks.h"
+#include "PyramidCache.h"
+
+MVS_NAMESPACE_BEGIN
+
+std::size_t
+ImagePyramid::getByteSize() const
+{
+    std::size_t size = 0;
+    for (std::size_t i = 0; i < levels.size(); ++i)
+        size += levels[i]->get_byte_size();
+    return size;
+}
+
+/* ------------------------------------------------------------------ */
+
+PyramidCache::PyramidCache(std::size_t maxMemory)
+    :
+    maxMemory(maxMemory)
+{
+    stats.hits = 0;
+    stats.misses = 0;
+    stats.evictions = 0;
+    stats.memory = 0;
+    stats.peakMemory = 0;
+}
+
+ImagePyramid::ConstPtr
+PyramidCache::lookup(std::size_t viewID, std::string const& embedding)
+{
+    util::MutexLock lock(mutex);
+    EntryMap::iterator it = entries.find(Key(viewID, embedding));
+    if (it == entries.end()) {
+        ++stats.misses;
+        return ImagePyramid::ConstPtr();
+    }
+    ++stats.hits;
+    lru.splice(lru.begin(), lru, it->second.lru);
+    return it->second.pyramid;
+}
+
+bool
+PyramidCache::contains(std::size_t viewID, std::string const& embedding)
+{
+    util::MutexLock lock(mutex);
+    return entries.find(Key(viewID, embedding)) != entries.end();
+}
+
+ImagePyramid::ConstPtr
+PyramidCache::insert(std::size_t viewID, std::string const& embedding,
+    ImagePyramid::ConstPtr pyramid)
+{
+    util::MutexLock lock(mutex);
+    Key key(viewID, embedding);
+    EntryMap::iterator it = entries.find(key);
+    if (it != entries.end()) {
+        /* built concurrently by another reconstruction */
+        lru.splice(lru.begin(), lru, it->second.lru);
+        return it->second.pyramid;
+    }
+
+    Entry& entry = entries[key];
+    entry.pyramid = pyramid;
+    entry.size = pyramid->getByteSize();
+    entry.lru = lru.insert(lru.begin(), key);
+    stats.memory += entry.size;
+    stats.peakMemory = std::max(stats.peakMemory, stats.memory);
+    evict();
+    return pyramid;
+}
+
+void
+PyramidCache::setMaxMemory(std::size_t maxMemory)
+{
+    util::MutexLock lock(mutex);
+    this->maxMemory = maxMemory;
+    evict();
+}
+
+std::size_t
+PyramidCache::getMaxMemory()
+{
+    util::MutexLock lock(mutex);
+    return maxMemory;
+}
+
+void
+PyramidCache::clear()
+{
+    util::MutexLock lock(mutex);
+    std::size_t budget = maxMemory;
+    maxMemory = 0;
+    evict();
+    maxMemory = budget;
+}
+
+PyramidCache::Stats
+PyramidCache::getStats()
+{
+    util::MutexLock lock(mutex);
+    return stats;
+}
+
+void
+PyramidCache::evict()
+{
+    /* walk from least recently used, skip pyramids in use elsewhere */
+    LRUList::iterator it = lru.end();
+    while (stats.memory > maxMemory && it != lru.begin())
+    {
+        --it;
+        EntryMap::iterator entry = entries.find(*it);
+        if (entry->second.pyramid.use_count() > 1)
+            continue;
+        stats.memory -= entry->second.size;
+        ++stats.evictions;
+        entries.erase(entry);
+        it = lru.erase(it);
+    }
+}
+
+MVS_NAMESPACE_END
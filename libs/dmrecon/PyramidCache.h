@@ -0,0 +1,114 @@
+#ifndef PYRAMIDCACHE_H
+#define PYRAMIDCACHE_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mve/image.h"
+#include "util/refptr.h"
+#include "util/thread.h"
+#include "defines.h"
+
+MVS_NAMESPACE_BEGIN
+
+/**
+ * Image pyramid of a view. Level 0 is the full resolution color image,
+ * every further level has half the size of the previous one. The levels
+ * hold linear (not sRGB) colors and are shared between reconstructions,
+ * they must not be modified.
+ */
+struct ImagePyramid
+{
+    typedef util::RefPtr<ImagePyramid> Ptr;
+    typedef util::RefPtr<ImagePyramid const> ConstPtr;
+
+    std::vector<mve::ImageBase::Ptr> levels;
+
+    /** Memory used by all levels in bytes */
+    std::size_t getByteSize() const;
+};
+
+/**
+ * Thread-safe cache for image pyramids keyed by view ID and color
+ * embedding, shared between DMRecon instances working on the same scene.
+ * Once the memory budget is exceeded, the least recently used pyramids
+ * are dropped. Pyramids still in use by a reconstruction are never
+ * dropped; they stay valid as long as references exist.
+ */
+class PyramidCache
+{
+public:
+    typedef util::RefPtr<PyramidCache> Ptr;
+
+    /** Statistics for reporting */
+    struct Stats
+    {
+        std::size_t hits;
+        std::size_t misses;
+        std::size_t evictions;
+        std::size_t memory;         // bytes currently held by the cache
+        std::size_t peakMemory;
+    };
+
+public:
+    /** Creates a cache with a memory budget in bytes */
+    static Ptr create(std::size_t maxMemory);
+
+    /** Returns the cached pyramid or a NULL pointer */
+    ImagePyramid::ConstPtr lookup(std::size_t viewID,
+        std::string const& embedding);
+
+    /** Returns if the pyramid is cached, without counting a hit or miss */
+    bool contains(std::size_t viewID, std::string const& embedding);
+
+    /** Inserts a pyramid and returns the cached one, which differs from
+        the given pyramid if another thread inserted it first */
+    ImagePyramid::ConstPtr insert(std::size_t viewID,
+        std::string const& embedding, ImagePyramid::ConstPtr pyramid);
+
+    /** Changes the memory budget in bytes */
+    void setMaxMemory(std::size_t maxMemory);
+    std::size_t getMaxMemory();
+
+    /** Drops all pyramids not in use */
+    void clear();
+
+    Stats getStats();
+
+private:
+    typedef std::pair<std::size_t, std::string> Key;
+    typedef std::list<Key> LRUList;
+    struct Entry
+    {
+        ImagePyramid::ConstPtr pyramid;
+        std::size_t size;
+        LRUList::iterator lru;
+    };
+    typedef std::map<Key, Entry> EntryMap;
+
+private:
+    PyramidCache(std::size_t maxMemory);
+    void evict();
+
+private:
+    util::Mutex mutex;
+    EntryMap entries;
+    LRUList lru;                    // most recently used first
+    std::size_t maxMemory;
+    Stats stats;
+};
+
+/* ------------------------- Implementation ----------------------- */
+
+inline PyramidCache::Ptr
+PyramidCache::create(std::size_t maxMemory)
+{
+    return Ptr(new PyramidCache(maxMemory));
+}
+
+MVS_NAMESPACE_END
+
+#endif
@@ -9,8 +9,11 @@ Settings::Settings()
     : minNCC(0.3f)
     , minParallax(10.f)
     , filterWidth(5)
+    , adaptiveSampling(false)
+    , sparseSamplingVariance(0.005f)
     , acceptNCC(0.6f)
     , minRefineDiff(0.001f)
+    , convergenceTolerance(0.001f)
     , maxIterations(20)
     , nrReconNeighbors(4)
     , scale(1.f)
@@ -19,6 +22,17 @@ Settings::Settings()
     , imageEmbedding("undistorted")
     , refViewNr(0)
     , globalVSMax(20)
+    , numThreads(1)
+    , useLowResSeeds(false)
+    , checkpointInterval(0)
+    , resume(false)
+    , tileSize(0)
+    , tileOverlap(32)
+    , engine(ENGINE_REGION_GROWING)
+    , patchMatchIterations(3)
+    , minConsistentViews(2)
+    , consistencyTolerance(0.01f)
+    , fuseDepths(false)
 {
 }
 
@@ -8,6 +8,13 @@
 
 MVS_NAMESPACE_BEGIN
 
+/** Engine that computes the dense depth map of the reference view */
+enum DenseEngine
+{
+    ENGINE_REGION_GROWING,            // best-first growing from features
+    ENGINE_PATCHMATCH                 // propagation sweeps over all pixels
+};
+
 
 struct Settings
 {
@@ -17,8 +24,11 @@ struct Settings
     float minNCC;
     float minParallax;
     unsigned int filterWidth;         // patch size is filterWidth*filterWidth
+    bool adaptiveSampling;            // sparse samples in textured patches
+    float sparseSamplingVariance;     // master variance for sparse samples
     float acceptNCC;
     float minRefineDiff;
+    float convergenceTolerance;       // relative depth step ending refinement
     unsigned int maxIterations;
     unsigned int nrReconNeighbors;
     float scale;
@@ -29,6 +39,20 @@ struct Settings
     std::size_t refViewNr;
     unsigned int globalVSMax;
     std::string logPath;
+    unsigned int numThreads;          // queue workers, 1 is serial
+    bool useLowResSeeds;              // seed queue from scale + 1 result
+    std::string checkpointPath;       // directory for checkpoints
+    unsigned int checkpointInterval;  // seconds, 0 disables checkpoints
+    bool resume;                      // continue from last checkpoint
+    unsigned int tileSize;            // tile edge in pixels, 0 disables
+    unsigned int tileOverlap;         // pixels shared with adjacent tiles
+    DenseEngine engine;
+    unsigned int patchMatchIterations; // sweeps of the PatchMatch engine
+    unsigned int minConsistentViews;  // neighbors agreeing with a kept depth
+    float consistencyTolerance;       // relative difference of agreeing depths
+    bool fuseDepths;                  // average agreeing depths when filtering
+    std::string pointsPath;           // point file directory, empty disables
+    std::string mapCodec;             // codec of stored maps, empty is raw
 };
 
 
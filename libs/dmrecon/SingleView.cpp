@@ -1,4 +1,5 @@
 #include <cassert>
+#include <cstring>
 
 #include "mve/imagefile.h"
 #include "mve/imagetools.h"
@@ -6,6 +7,7 @@
 #include "mve/view.h"
 #include "util/fs.h"
 #include "defines.h"
+#include "mvstools.h"
 #include "SingleView.h"
 
 
@@ -13,7 +15,10 @@ MVS_NAMESPACE_BEGIN
 
 SingleView::SingleView(mve::View::Ptr _view)
     :
-    view(_view)
+    view(_view),
+    has_scaled_proj(false),
+    crop_left(0),
+    crop_top(0)
 {
     if ((view.get() == NULL) || (!view->is_camera_valid()))
         throw std::invalid_argument("NULL view");
@@ -40,32 +45,148 @@ SingleView::SingleView(mve::View::Ptr _view)
 
 void
 SingleView::createImagePyramid()
+{
+    /* check if color image is present */
+    if (!this->color_image.get())
+        throw util::Exception("No color image loaded.");
+
+    /* halve the 8-bit or float image and linearize colors per level,
+       so interpolated samples equal those from the original image */
+    ImagePyramid::Ptr pyramid(new ImagePyramid);
+    mve::ImageType type = this->color_image->get_type();
+    mve::ImageBase::Ptr img = this->color_image;
+    pyramid->levels.push_back(linearFloatImage(img));
+
+    /* the amount of levels depends on the full image, also if the
+       color image is cropped */
+    std::size_t w = this->width;
+    std::size_t h = this->height;
+    while (std::min(w, h) >= 30) {
+        w = (w + 1) >> 1;
+        h = (h + 1) >> 1;
+        if (type == mve::IMAGE_TYPE_UINT8)
+            img = mve::image::rescale_half_size_gaussian<uint8_t>(img, 1.f);
+        else if (type == mve::IMAGE_TYPE_FLOAT)
+            img = mve::image::rescale_half_size_gaussian<float>(img, 1.f);
+        else
+            throw util::Exception("Invalid image type");
+        pyramid->levels.push_back(linearFloatImage(img));
+    }
+    this->img_pyramid = pyramid;
+    this->initPyramidProjections();
+}
+
+void
+SingleView::loadImagePyramid(std::string const& name,
+    PyramidCache::Ptr cache)
+{
+    this->crop_left = 0;
+    this->crop_top = 0;
+    if (cache.get())
+        this->img_pyramid = cache->lookup(this->viewID, name);
+
+    if (this->img_pyramid.get()) {
+        this->initPyramidProjections();
+        return;
+    }
+
+    this->loadColorImage(name);
+    this->createImagePyramid();
+    if (cache.get())
+        this->img_pyramid = cache->insert(this->viewID, name,
+            this->img_pyramid);
+}
+
+void
+SingleView::loadImagePyramid(std::string const& name, std::size_t left,
+    std::size_t top, std::size_t right, std::size_t bottom)
+{
+    std::size_t levels = 1;
+    for (std::size_t w = width, h = height; std::min(w, h) >= 30; ++levels) {
+        w = (w + 1) >> 1;
+        h = (h + 1) >> 1;
+    }
+
+    /* every level has at least two pixels, so the halving is valid */
+    std::size_t const align = std::size_t(1) << (levels - 1);
+    std::size_t bounds[2][2] = { { left, right }, { top, bottom } };
+    std::size_t const size[2] = { this->width, this->height };
+    for (int d = 0; d < 2; ++d) {
+        std::size_t lo = std::min(bounds[d][0], size[d] - 1);
+        std::size_t hi = std::min(std::max(bounds[d][1], lo + 1), size[d]);
+        lo = lo / align * align;
+        hi = std::min((hi + align - 1) / align * align, size[d]);
+        if (hi - lo < 2 * align) {
+            hi = std::min(lo + 2 * align, size[d]);
+            lo = hi > 2 * align ? (hi - 2 * align) / align * align : 0;
+        }
+        bounds[d][0] = lo;
+        bounds[d][1] = hi;
+    }
+
+    std::size_t cropWidth = bounds[0][1] - bounds[0][0];
+    std::size_t cropHeight = bounds[1][1] - bounds[1][0];
+    mve::MappedEmbedding::Ptr mapped = this->view->get_mapped_embedding(name);
+    mve::ImageType type = mapped.get() && mapped->is_image()
+        ? mapped->get_type() : mve::IMAGE_TYPE_UNKNOWN;
+    if (type == mve::IMAGE_TYPE_UINT8 || type == mve::IMAGE_TYPE_FLOAT) {
+        /* copy the rows of the region from the mapped file */
+        std::size_t const chans = mapped->channels();
+        if (type == mve::IMAGE_TYPE_UINT8)
+            this->color_image = mve::ByteImage::create(cropWidth,
+                cropHeight, chans);
+        else
+            this->color_image = mve::FloatImage::create(cropWidth,
+                cropHeight, chans);
+        std::size_t const pixelSize = this->color_image->get_byte_size()
+            / (cropWidth * cropHeight);
+        std::size_t const rowSize = cropWidth * pixelSize;
+        char* dest = this->color_image->get_byte_pointer();
+        for (std::size_t y = 0; y < cropHeight; ++y)
+            std::memcpy(dest + y * rowSize, mapped->get_byte_pointer()
+                + ((bounds[1][0] + y) * mapped->width() + bounds[0][0])
+                * pixelSize, rowSize);
+        mapped.reset();
+        this->convertColorImage();
+    }
+    else {
+        this->loadColorImage(name);
+        if (this->color_image->get_type() == mve::IMAGE_TYPE_UINT8)
+            this->color_image = mve::image::crop<uint8_t>(this->color_image,
+                bounds[0][0], bounds[1][0], cropWidth, cropHeight);
+        else
+            this->color_image = mve::image::crop<float>(this->color_image,
+                bounds[0][0], bounds[1][0], cropWidth, cropHeight);
+    }
+    this->crop_left = bounds[0][0];
+    this->crop_top = bounds[1][0];
+    this->createImagePyramid();
+
+    this->color_image.reset();
+    this->view->cache_cleanup();
+}
+
+void
+SingleView::initPyramidProjections()
 {
     /* clear everything */
-    this->img_pyramid.clear();
     this->widths.clear();
     this->heights.clear();
     this->projs.clear();
     this->invprojs.clear();
 
-    /* check if color image is present */
-    if (!this->color_image.get())
-        throw util::Exception("No color image loaded.");
-
     /* start with high-res color image */
-    this->img_pyramid.push_back(this->color_image);
     this->widths.push_back(this->width);
     this->heights.push_back(this->height);
     this->projs.push_back(this->proj);
     this->invprojs.push_back(this->invproj);
 
-    /* create image pyramid */
-    mve::ImageType type = this->color_image->get_type();
-    std::size_t curr_width = width;
-    std::size_t curr_height = height;
-    mve::ImageBase::Ptr img = this->color_image;
+    /* projections refer to the full image, also for cropped levels */
     mve::CameraInfo cam(view->get_camera());
-    while (std::min(curr_width, curr_height) >= 30) {
+    std::vector<mve::ImageBase::Ptr> const& levels = img_pyramid->levels;
+    std::size_t curr_width = this->width;
+    std::size_t curr_height = this->height;
+    for (std::size_t i = 1; i < levels.size(); ++i) {
         // adjust principal point
         if (curr_width % 2 == 1)
             cam.ppoint[0] = cam.ppoint[0] * float(curr_width)
@@ -73,16 +194,11 @@ SingleView::createImagePyramid()
         if (curr_height % 2 == 1)
             cam.ppoint[1] = cam.ppoint[1] * float(curr_height)
                 / float(curr_height + 1);
-        if (type == mve::IMAGE_TYPE_UINT8)
-            img = mve::image::rescale_half_size_gaussian<uint8_t>(img, 1.f);
-        else if (type == mve::IMAGE_TYPE_FLOAT)
-            img = mve::image::rescale_half_size_gaussian<float>(img, 1.f);
-        else
-            throw util::Exception("Invalid image type");
-        this->img_pyramid.push_back(img);
         // compute new projection matrix
-        curr_width = img->width();
-        curr_height = img->height();
+        curr_width = (curr_width + 1) >> 1;
+        curr_height = (curr_height + 1) >> 1;
+        this->widths.push_back(curr_width);
+        this->heights.push_back(curr_height);
         math::Matrix3f mat;
         cam.fill_projection(*mat, curr_width, curr_height);
         this->projs.push_back(mat);
@@ -94,12 +210,9 @@ SingleView::createImagePyramid()
 void
 SingleView::prepareRecon(float scale)
 {
-    // compute scale factor from scale
-    this->scale_factor = 1.f / std::pow(2,scale);
+    this->prepareScaledProjection(scale);
     this->createFileName(scale);
     // scale image
-    this->scaled_width = this->scale_factor * this->width;
-    this->scaled_height = this->scale_factor * this->height;
     std::cout << "scaled image size: " << this->scaled_width
         << " x " << this->scaled_height << std::endl;
     mve::ImageType type = this->color_image->get_type();
@@ -118,13 +231,6 @@ SingleView::prepareRecon(float scale)
     else
         throw util::Exception("Invalid image type");
 
-    // compute projection matrix
-    mve::CameraInfo cam(this->view->get_camera());
-    cam.fill_projection(*this->proj_scaled, this->scaled_width,
-        this->scaled_height);
-    cam.fill_inverse_projection(*this->invproj_scaled, this->scaled_width,
-        this->scaled_height);
-
     // create images for reconstruction
     this->depthImg = mve::FloatImage::create(this->scaled_width,
         this->scaled_height, 1);
@@ -136,6 +242,23 @@ SingleView::prepareRecon(float scale)
         this->scaled_height, 1);
 }
 
+void
+SingleView::prepareScaledProjection(float scale)
+{
+    // compute scale factor from scale
+    this->scale_factor = 1.f / std::pow(2,scale);
+    this->scaled_width = this->scale_factor * this->width;
+    this->scaled_height = this->scale_factor * this->height;
+
+    // compute projection matrix
+    mve::CameraInfo cam(this->view->get_camera());
+    cam.fill_projection(*this->proj_scaled, this->scaled_width,
+        this->scaled_height);
+    cam.fill_inverse_projection(*this->invproj_scaled, this->scaled_width,
+        this->scaled_height);
+    this->has_scaled_proj = true;
+}
+
 math::Vec3f
 SingleView::viewRay(std::size_t x, std::size_t y, int level) const
 {
@@ -145,12 +268,14 @@ SingleView::viewRay(std::size_t x, std::size_t y, int level) const
 math::Vec3f
 SingleView::viewRay(float x, float y, int level) const
 {
-    if (level != 0 && level >= int(this->img_pyramid.size()))
+    if (level != 0 && level >= int(this->projs.size()))
         throw std::invalid_argument("Requested pyramid level does not exist");
 
+    x += float(this->crop_left >> level);
+    y += float(this->crop_top >> level);
     math::Vec3f ray;
     if (level == 0) {
-        if (this->scaled_image.get())
+        if (this->has_scaled_proj)
             ray = this->invproj_scaled * math::Vec3f(x+0.5f, y+0.5f, 1.f);
         else
             ray = this->invproj * math::Vec3f(x+0.5f, y+0.5f, 1.f);
@@ -172,7 +297,13 @@ SingleView::loadColorImage(std::string const& name)
         throw util::Exception("No color image embedding found: ", name);
     assert(this->width == this->color_image->width());
     assert(this->height == this->color_image->height());
+    this->convertColorImage();
+}
 
+/* reduces alpha and expands grayscale, such that the image is RGB */
+void
+SingleView::convertColorImage()
+{
     std::size_t channels = this->color_image->channels();
     mve::ImageType type = this->color_image->get_type();
 
@@ -235,24 +366,67 @@ SingleView::saveReconAsPly(std::string const& path, float scale) const
 }
 
 void
-SingleView::writeReconImages(float scale)
+SingleView::writeReconImages(float scale, std::string const& codec)
 {
     if (depthImg.get() == NULL)
         throw std::invalid_argument("No reconstruction available.");
-    std::string name("depth-L");
-    name += util::string::get(scale);
+    std::string name(getReconImageName("depth", scale));
     view->set_image(name, this->depthImg);
-    name = "dz-L";
-    name += util::string::get(scale);
+    view->set_embedding_codec(name, codec);
+    name = getReconImageName("dz", scale);
     view->set_image(name, this->dzImg);
-    name = "conf-L";
-    name += util::string::get(scale);
+    view->set_embedding_codec(name, codec);
+    name = getReconImageName("conf", scale);
     view->set_image(name, this->confImg);
+    view->set_embedding_codec(name, codec);
     if (this->scale_factor != 1.f) {
-        name = "undist-L";
-        name += util::string::get(scale);
+        name = getReconImageName("undist", scale);
         view->set_image(name, this->scaled_image);
     }
 }
 
+void
+SingleView::reserveReconImages(float scale, bool normals)
+{
+    std::string const type(util::string::for_type<float>());
+    view->reserve_image(getReconImageName("depth", scale),
+        scaled_width, scaled_height, 1, type);
+    view->reserve_image(getReconImageName("dz", scale),
+        scaled_width, scaled_height, 2, type);
+    view->reserve_image(getReconImageName("conf", scale),
+        scaled_width, scaled_height, 1, type);
+    if (normals)
+        view->reserve_image(getReconImageName("normal", scale),
+            scaled_width, scaled_height, 3, type);
+    if (this->scale_factor != 1.f)
+        view->set_image(getReconImageName("undist", scale),
+            this->scaled_image);
+}
+
+void
+SingleView::finishReconImages(float scale, std::string const& codec)
+{
+    if (codec.empty())
+        return;
+    view->set_embedding_codec(getReconImageName("depth", scale), codec);
+    view->set_embedding_codec(getReconImageName("dz", scale), codec);
+    view->set_embedding_codec(getReconImageName("conf", scale), codec);
+}
+
+void
+SingleView::loadReconImages(float scale)
+{
+    this->depthImg = view->get_float_image(getReconImageName("depth", scale));
+    this->confImg = view->get_float_image(getReconImageName("conf", scale));
+    if (!this->depthImg.get() || !this->confImg.get())
+        throw util::Exception("No reconstruction at scale ",
+            util::string::get(scale));
+}
+
+std::string
+SingleView::getReconImageName(std::string const& map, float scale)
+{
+    return map + "-L" + util::string::get(scale);
+}
+
 MVS_NAMESPACE_END
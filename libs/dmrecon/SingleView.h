@@ -1,6 +1,7 @@
 #ifndef SINGLEVIEW_H
 #define SINGLEVIEW_H
 
+#include <algorithm>
 #include <cassert>
 #include <set>
 #include <iostream>
@@ -12,6 +13,7 @@
 #include "mve/bundlefile.h"
 #include "mve/image.h"
 #include "defines.h"
+#include "PyramidCache.h"
 
 MVS_NAMESPACE_BEGIN
 
@@ -26,14 +28,27 @@ public:
     SingleView(mve::View::Ptr _view);
 
     void addFeature(std::size_t idx);
+    void clearFeatures();
     std::vector<std::size_t> const& getFeatureIndices() const;
     int getMaxLevel() const;
     mve::ImageBase::Ptr getColorImg() const;
     mve::ImageBase::Ptr getScaledImg() const;
-    mve::ImageBase::Ptr getPyramidImg(int level) const;
+    mve::ImageBase::Ptr const& getPyramidImg(int level) const;
+    /** Memory used by the pyramid levels in bytes */
+    std::size_t getPyramidByteSize() const;
 
     std::string createFileName(float scale) const;
     void createImagePyramid();
+    void loadImagePyramid(std::string const& name, PyramidCache::Ptr cache);
+    /** Loads the pyramid of the image region [left, right) x [top, bottom)
+        only. The region is grown such that its corners are aligned to the
+        coarsest level. Pixel coordinates of worldToScreen() are then
+        relative to the region, positions outside are not sampled. Only
+        the region is read of images stored uncompressed in the view file,
+        others are decoded completely and released again unless they are
+        used elsewhere. */
+    void loadImagePyramid(std::string const& name, std::size_t left,
+        std::size_t top, std::size_t right, std::size_t bottom);
     float footPrint(math::Vec3f const& point);
     math::Vec3f viewRay(std::size_t x, std::size_t y, int level = 0) const;
     math::Vec3f viewRay(float x, float y, int level) const;
@@ -42,8 +57,25 @@ public:
     void saveReconAsPly(std::string const& path, float scale) const;
     bool seesFeature(std::size_t idx) const;
     void prepareRecon(float _scale);
+    /** Projection at the given scale without loading the image, enough
+        for footPrint() and worldToScreen() */
+    void prepareScaledProjection(float _scale);
     math::Vec2f worldToScreen(math::Vec3f const& point, int level = 0);
-    void writeReconImages(float scale);
+    /** Sets the result maps to the view, the depth, dz and confidence
+        maps are stored with the codec (empty is uncompressed) */
+    void writeReconImages(float scale, std::string const& codec);
+    /** Reserves the depth, dz and confidence maps of the scaled image in
+        the view, and the normal map if requested, such that results can
+        be written in regions. The scaled image is set like above. */
+    void reserveReconImages(float scale, bool normals);
+    /** Stores the reserved maps with the codec, which loads them unless
+        the codec is empty */
+    void finishReconImages(float scale, std::string const& codec);
+    /** Loads the depth and confidence maps from the view */
+    void loadReconImages(float scale);
+    /** Name of the embedding of a result map, e.g. "depth" */
+    static std::string getReconImageName(std::string const& map,
+        float scale);
 
 public:
     std::size_t viewID;
@@ -62,7 +94,7 @@ private:
     math::Matrix3f proj;
     math::Matrix3f invproj;
 
-    /** feature indices */
+    /** feature indices, sorted in ascending order */
     std::vector<std::size_t> featInd;
 
     /** mve view */
@@ -75,29 +107,43 @@ private:
 
     /** scaled image for reconstruction */
     float scale_factor;
+    bool has_scaled_proj;
     mve::ImageBase::Ptr scaled_image;
     std::size_t scaled_width;
     std::size_t scaled_height;
     math::Matrix3f proj_scaled;
     math::Matrix3f invproj_scaled;
 
-    /** image pyramid */
-    std::vector<mve::ImageBase::Ptr> img_pyramid;
+    /** image pyramid with linear colors, possibly shared */
+    ImagePyramid::ConstPtr img_pyramid;
+    /** origin of a cropped pyramid in the full image */
+    std::size_t crop_left;
+    std::size_t crop_top;
     std::vector<std::size_t> widths;
     std::vector<std::size_t> heights;
 
     /** projective matrices for image pyramid */
     std::vector< math::Matrix3f > projs;
     std::vector< math::Matrix3f > invprojs;
+
+    void initPyramidProjections();
+    void convertColorImage();
 };
 
 
 inline void
 SingleView::addFeature(std::size_t idx)
 {
+    assert(featInd.empty() || featInd.back() <= idx);
     featInd.push_back(idx);
 }
 
+inline void
+SingleView::clearFeatures()
+{
+    featInd.clear();
+}
+
 inline std::vector<std::size_t> const &
 SingleView::getFeatureIndices() const
 {
@@ -107,7 +153,7 @@ SingleView::getFeatureIndices() const
 inline int
 SingleView::getMaxLevel() const
 {
-    return (this->img_pyramid.size() - 1);
+    return (this->projs.size() - 1);
 }
 
 inline mve::ImageBase::Ptr
@@ -116,13 +162,19 @@ SingleView::getColorImg() const
     return this->color_image;
 }
 
-inline mve::ImageBase::Ptr
+inline mve::ImageBase::Ptr const&
 SingleView::getPyramidImg(int level) const
 {
-    if (level >= int(this->img_pyramid.size())) {
+    if (level >= int(this->projs.size())) {
         throw std::invalid_argument("Requested image does not exist.");
     }
-    return this->img_pyramid[level];
+    return this->img_pyramid->levels[level];
+}
+
+inline std::size_t
+SingleView::getPyramidByteSize() const
+{
+    return this->img_pyramid.get() ? this->img_pyramid->getByteSize() : 0;
 }
 
 inline mve::ImageBase::Ptr
@@ -146,7 +198,7 @@ SingleView::createFileName(float scale) const
 inline float
 SingleView::footPrint(math::Vec3f const& point)
 {
-    if (this->scaled_image.get())
+    if (this->has_scaled_proj)
         return (this->worldToCam.mult(point, 1)[2] * this->invproj_scaled[0]);
     else
         return (this->worldToCam.mult(point, 1)[2] * this->invproj[0]);
@@ -155,22 +207,19 @@ SingleView::footPrint(math::Vec3f const& point)
 inline bool
 SingleView::seesFeature(std::size_t idx) const
 {
-    for (std::size_t i = 0; i < featInd.size(); ++i)
-        if (featInd[i] == idx)
-            return true;
-    return false;
+    return std::binary_search(featInd.begin(), featInd.end(), idx);
 }
 
 inline math::Vec2f
 SingleView::worldToScreen(math::Vec3f const& point, int level)
 {
-    if (level != 0 && level >= int(this->img_pyramid.size()))
+    if (level != 0 && level >= int(this->projs.size()))
         throw std::invalid_argument("Requested pyramid level does not exist.");
 
     math::Vec3f cp(this->worldToCam.mult(point,1.f));
     math::Vec3f sp;
     if (level == 0) {
-        if (this->scaled_image.get())
+        if (this->has_scaled_proj)
             sp = this->proj_scaled * cp;
         else
             sp = this->proj * cp;
@@ -178,7 +227,8 @@ SingleView::worldToScreen(math::Vec3f const& point, int level)
     else
         sp = this->projs[level] * cp;
 
-    math::Vec2f res(sp[0] / sp[2] - 0.5f, sp[1] / sp[2] - 0.5f);
+    math::Vec2f res(sp[0] / sp[2] - 0.5f - float(this->crop_left >> level),
+        sp[1] / sp[2] - 0.5f - float(this->crop_top >> level));
     return res;
 }
  
@@ -2,40 +2,39 @@
 #define VIEWSELECTION_H
 
 #include "defines.h"
+#include "FixedIndexSet.h"
 #include "Settings.h"
-#include "util/refptr.h"
 
 
 MVS_NAMESPACE_BEGIN
 
-class ViewSelection;
-typedef util::RefPtr<ViewSelection> ViewSelectionPtr;
-
+/** Base of the view selections, Set is the type of the selected IDs */
+template <typename Set>
 class ViewSelection
 {
 public:
-    ViewSelection();
     ViewSelection(Settings const& settings);
 
 public:
-    IndexSet const& getSelectedIDs() const;
+    Set const& getSelectedIDs() const;
 
 protected:
     Settings const& settings;
-    std::vector<bool> available;
-    IndexSet selected;
+    Set selected;
 };
 
 
+template <typename Set>
 inline
-ViewSelection::ViewSelection(Settings const& settings)
+ViewSelection<Set>::ViewSelection(Settings const& settings)
     :
     settings(settings)
 {
 }
 
-inline IndexSet const&
-ViewSelection::getSelectedIDs() const
+template <typename Set>
+inline Set const&
+ViewSelection<Set>::getSelectedIDs() const
 {
     return selected;
 }
@@ -0,0 +1,100 @@
+#include <stdexcept>
+
+#include "mve/bundlefile.h"
+#include "util/threadlocks.h"
+#include "GlobalViewSelection.h"
+#include "SingleView.h"
+#include "ViewSelectionCache.h"
+
+MVS_NAMESPACE_BEGIN
+
+bool
+ViewSelectionCache::lookup(std::size_t refViewNr, float scale,
+    GlobalViewSet* ids)
+{
+    util::MutexLock lock(mutex);
+    SelectionMap::const_iterator it = selections.find(Key(refViewNr, scale));
+    if (it == selections.end())
+        return false;
+    *ids = it->second;
+    return true;
+}
+
+void
+ViewSelectionCache::insert(std::size_t refViewNr, float scale,
+    GlobalViewSet const& ids)
+{
+    util::MutexLock lock(mutex);
+    selections[Key(refViewNr, scale)] = ids;
+}
+
+std::size_t
+ViewSelectionCache::size()
+{
+    util::MutexLock lock(mutex);
+    return selections.size();
+}
+
+/**  Attaches the features of each reference view to the views that see
+     them, in the same way as DMRecon does, and runs the selection. The
+     neighbor views only need their cameras, the reference view gets the
+     scaled projection for the footprint comparison. */
+void
+ViewSelectionCache::precompute(mve::Scene::Ptr scene,
+    Settings const& settings, std::vector<std::size_t> const& refViewIDs)
+{
+    if (settings.scale < 0.f)
+        throw std::invalid_argument("Invalid scale factor.");
+
+    mve::BundleFile::ConstPtr bundle(scene->get_bundle());
+    mve::BundleFile::FeaturePoints const& features = bundle->get_points();
+    mve::Scene::ViewList const& mveViews(scene->get_views());
+
+    SingleViewPtrList views(mveViews.size());
+    for (std::size_t i = 0; i < mveViews.size(); ++i)
+        if (mveViews[i].get() && mveViews[i]->is_camera_valid())
+            views[i] = SingleViewPtr(new SingleView(mveViews[i]));
+
+    GlobalViewSet cached;
+    for (std::size_t r = 0; r < refViewIDs.size(); ++r)
+    {
+        std::size_t refViewNr = refViewIDs[r];
+        if (refViewNr >= views.size() || !views[refViewNr].get())
+            continue;
+        if (lookup(refViewNr, settings.scale, &cached))
+            continue;
+
+        for (std::size_t i = 0; i < views.size(); ++i)
+            if (views[i].get())
+                views[i]->clearFeatures();
+        SingleViewPtr neighV = views[refViewNr];
+        SingleViewPtr refV(new SingleView(mveViews[refViewNr]));
+        refV->prepareScaledProjection(settings.scale);
+        views[refViewNr] = refV;
+
+        mve::BundleFile::FeatureIndices const& refFeatures =
+            bundle->get_view_features(refViewNr);
+        for (std::size_t k = 0; k < refFeatures.size(); ++k)
+        {
+            std::size_t i = refFeatures[k];
+            math::Vec3f featurePos(features[i].pos);
+            if (!refV->pointInFrustum(featurePos))
+                continue;
+            for (std::size_t j = 0; j < features[i].refs.size(); ++j)
+            {
+                std::size_t id = features[i].refs[j].img_id;
+                if (views[id]->pointInFrustum(featurePos))
+                    views[id]->addFeature(i);
+            }
+        }
+
+        Settings refSettings(settings);
+        refSettings.refViewNr = refViewNr;
+        GlobalViewSelection globalVS(views, features, refSettings);
+        globalVS.performVS();
+        insert(refViewNr, settings.scale, globalVS.getSelectedIDs());
+        views[refViewNr] = neighV;
+    }
+}
+
+MVS_NAMESPACE_END
@@ -0,0 +1,71 @@
+#ifndef VIEWSELECTIONCACHE_H
+#define VIEWSELECTIONCACHE_H
+
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "mve/scene.h"
+#include "util/refptr.h"
+#include "util/thread.h"
+#include "defines.h"
+#include "FixedIndexSet.h"
+#include "Settings.h"
+
+MVS_NAMESPACE_BEGIN
+
+/**
+ * Thread-safe cache for the global view selection of reference views,
+ * keyed by reference view and scale. It is shared between DMRecon
+ * instances working on the same scene with otherwise equal settings.
+ * The selections for many reference views can be computed up front in
+ * a single pass, which sets up the views of the scene only once.
+ */
+class ViewSelectionCache
+{
+public:
+    typedef util::RefPtr<ViewSelectionCache> Ptr;
+
+public:
+    static Ptr create();
+
+    /** Copies the cached selection to ids, returns false if not cached */
+    bool lookup(std::size_t refViewNr, float scale, GlobalViewSet* ids);
+
+    void insert(std::size_t refViewNr, float scale,
+        GlobalViewSet const& ids);
+
+    /** Computes and caches the selections of the given reference views
+        at settings.scale, views already cached are skipped */
+    void precompute(mve::Scene::Ptr scene, Settings const& settings,
+        std::vector<std::size_t> const& refViewIDs);
+
+    std::size_t size();
+
+private:
+    ViewSelectionCache();
+
+private:
+    typedef std::pair<std::size_t, float> Key;
+    typedef std::map<Key, GlobalViewSet> SelectionMap;
+
+    util::Mutex mutex;
+    SelectionMap selections;
+};
+
+/* ------------------------- Implementation ----------------------- */
+
+inline ViewSelectionCache::Ptr
+ViewSelectionCache::create()
+{
+    return Ptr(new ViewSelectionCache);
+}
+
+inline
+ViewSelectionCache::ViewSelectionCache()
+{
+}
+
+MVS_NAMESPACE_END
+
+#endif
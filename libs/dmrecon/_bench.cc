@@ -0,0 +1,1053 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mve/bundlefile.h"
+#include "mve/embeddingcodec.h"
+#include "mve/image.h"
+#include "mve/scene.h"
+#include "mve/view.h"
+#include "util/arguments.h"
+#include "util/atomic.h"
+#include "util/fs.h"
+#include "util/hrtimer.h"
+#include "util/string.h"
+#include "util/tokenizer.h"
+
+#include "DMRecon.h"
+#include "GlobalViewSelection.h"
+#include "LocalViewSelection.h"
+#include "PatchOptimization.h"
+#include "PatchSampler.h"
+#include "Settings.h"
+#include "SingleView.h"
+#include "simdtools.h"
+#include "_benchscene.h"
+
+/*
+ * Benchmarks of the hot kernels, of complete reconstructions and of
+ * loading depth maps on a synthetic scene with known geometry:
+ *
+ *   make bench
+ *   ./bench --output=before.json /tmp/benchscene
+ *   ... change the code ...
+ *   ./bench --output=after.json --compare=before.json /tmp/benchscene
+ *
+ * The scene is generated if the directory holds no bundle file. All
+ * random numbers are hashed, so the scene, the sampled pixels and the
+ * perturbations are the same on every run. The timer has a resolution
+ * of milliseconds, the kernels are therefore timed in batches of at
+ * least --batch-time milliseconds. Heap allocations are counted with a
+ * replaced operator new. Thread scaling of the reconstructions is
+ * measured with --thread-sweep, which needs as many cores as threads.
+ */
+
+/* Pixels sampled for the kernel benchmarks */
+#define BENCH_NUM_PIXELS 500
+/* Relative depth error below which a depth counts as correct */
+#define BENCH_INLIER_ERROR 0.01f
+
+/* ---------------------------------------------------------------- */
+
+struct BenchOptions
+{
+    std::string scenePath;
+    std::string outputFile;
+    std::string compareFile;
+    std::string label;
+    BenchSceneParams sceneParams;
+    int refView;
+    float scale;
+    float sparseVariance;
+    std::size_t numThreads;
+    std::vector<std::size_t> threadSweep;
+    std::size_t repeat;
+    std::size_t batches;
+    std::size_t batchTime;
+    bool kernels;
+    bool reconstruction;
+    bool mapLoading;
+    bool verbose;
+};
+
+/* Result of a benchmark, times are per call of the kernel */
+struct BenchResult
+{
+    BenchResult (void);
+
+    std::string name;
+    std::string unit;
+    std::size_t calls;
+    double median;
+    double min;
+    /* additional "key": value pairs */
+    std::vector<std::pair<std::string, double> > values;
+};
+
+BenchResult::BenchResult (void)
+    : calls(0), median(0.0), min(0.0)
+{
+}
+
+/* A pixel of the reference view with its ground truth depth */
+struct BenchPixel
+{
+    std::size_t x;
+    std::size_t y;
+    float depth;
+};
+
+/* Reference view with neighbors prepared like DMRecon::start() does */
+struct BenchSetup
+{
+    mve::Scene::Ptr scene;
+    mvs::Settings settings;
+    mvs::SingleViewPtrList views;
+    mvs::GlobalViewSet neighViews;
+    std::vector<BenchPixel> pixels;
+    std::size_t width;
+    std::size_t height;
+};
+
+/* ---------------------------------------------------------------- */
+
+/* Calls of operator new, the kernels and reconstructions report the
+   heap allocations they make */
+util::Atomic<std::size_t> benchAllocations(0);
+
+void*
+operator new (std::size_t size) throw (std::bad_alloc)
+{
+    benchAllocations.increment();
+    void* ptr = std::malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void*
+operator new[] (std::size_t size) throw (std::bad_alloc)
+{
+    return operator new(size);
+}
+
+/* not inlined, GCC warns about free() on memory from operator new */
+__attribute__((noinline)) void
+operator delete (void* ptr) throw ()
+{
+    std::free(ptr);
+}
+
+void
+operator delete[] (void* ptr) throw ()
+{
+    operator delete(ptr);
+}
+
+/* ---------------------------------------------------------------- */
+
+/* Deterministic value in [0, 1] */
+float
+bench_random (std::size_t i, std::size_t salt)
+{
+    unsigned int h = i * 2654435761u + salt * 40503u + 1u;
+    h = (h ^ (h >> 15)) * 2246822519u;
+    h = (h ^ (h >> 13)) * 3266489917u;
+    h ^= h >> 16;
+    return float(h & 0xffffff) / float(0xffffff);
+}
+
+void
+bench_prepare (BenchOptions const& opts, BenchSetup* setup)
+{
+    setup->scene = mve::Scene::create();
+    setup->scene->load_scene(opts.scenePath);
+    mve::Scene::ViewList const& mveViews(setup->scene->get_views());
+    mvs::Settings& settings(setup->settings);
+    settings.refViewNr = opts.refView >= 0 ? std::size_t(opts.refView)
+        : mveViews.size() / 2;
+    settings.scale = opts.scale;
+    settings.numThreads = opts.numThreads;
+    settings.adaptiveSampling = opts.sparseVariance > 0.f;
+    if (settings.adaptiveSampling)
+        settings.sparseSamplingVariance = opts.sparseVariance;
+    if (settings.refViewNr >= mveViews.size()
+        || !mveViews[settings.refViewNr].get()
+        || !mveViews[settings.refViewNr]->is_camera_valid())
+        throw std::invalid_argument("Invalid reference view");
+
+    setup->views.resize(mveViews.size());
+    for (std::size_t i = 0; i < mveViews.size(); ++i)
+        if (mveViews[i].get() && mveViews[i]->is_camera_valid())
+            setup->views[i] = mvs::SingleViewPtr
+                (new mvs::SingleView(mveViews[i]));
+    mvs::SingleViewPtr refV(setup->views[settings.refViewNr]);
+    refV->loadColorImage(settings.imageEmbedding);
+    refV->prepareRecon(settings.scale);
+    setup->width = refV->getScaledImg()->width();
+    setup->height = refV->getScaledImg()->height();
+
+    /* features and global view selection, see DMRecon::analyzeFeatures() */
+    mve::BundleFile::ConstPtr bundle(setup->scene->get_bundle());
+    mve::BundleFile::FeaturePoints const& features(bundle->get_points());
+    mve::BundleFile::FeatureIndices const& refFeatures
+        (bundle->get_view_features(settings.refViewNr));
+    for (std::size_t k = 0; k < refFeatures.size(); ++k)
+    {
+        std::size_t i = refFeatures[k];
+        math::Vec3f pos(features[i].pos);
+        if (!refV->pointInFrustum(pos))
+            continue;
+        for (std::size_t j = 0; j < features[i].refs.size(); ++j)
+        {
+            std::size_t id = features[i].refs[j].img_id;
+            if (setup->views[id]->pointInFrustum(pos))
+                setup->views[id]->addFeature(i);
+        }
+    }
+    mvs::GlobalViewSelection globalVS(setup->views, features, settings);
+    globalVS.performVS();
+    setup->neighViews = globalVS.getSelectedIDs();
+    for (mvs::GlobalViewSet::const_iterator id = setup->neighViews.begin();
+        id != setup->neighViews.end(); ++id)
+        setup->views[*id]->loadImagePyramid(settings.imageEmbedding,
+            mvs::PyramidCache::Ptr());
+
+    /* pixels on the surfaces, away from the image border */
+    std::size_t const border = settings.filterWidth;
+    for (std::size_t i = 0; setup->pixels.size() < BENCH_NUM_PIXELS
+        && i < 100 * BENCH_NUM_PIXELS; ++i)
+    {
+        BenchPixel pixel;
+        pixel.x = border + std::size_t(bench_random(i, 1)
+            * float(setup->width - 2 * border - 1));
+        pixel.y = border + std::size_t(bench_random(i, 2)
+            * float(setup->height - 2 * border - 1));
+        pixel.depth = benchSceneIntersect(refV->camPos,
+            refV->viewRay(pixel.x, pixel.y));
+        if (pixel.depth > 0.f)
+            setup->pixels.push_back(pixel);
+    }
+    if (setup->pixels.empty() || setup->neighViews.empty())
+        throw std::runtime_error("Scene is not suited for benchmarking");
+}
+
+/* ---------------------------------------------------------------- */
+
+/* Kernel that is timed, run() processes all pixels once and returns the
+   number of calls of the kernel */
+class BenchKernel
+{
+public:
+    virtual ~BenchKernel (void) {}
+    virtual std::size_t run (void) = 0;
+};
+
+/* Times batches of at least the batch time and reports the median and
+   the minimum time per call in nanoseconds */
+void
+bench_time_kernel (BenchKernel& kernel, BenchOptions const& opts,
+    BenchResult* result)
+{
+    /* warm up and find the runs per batch */
+    std::size_t runs = 1;
+    while (true)
+    {
+        util::HRTimer timer;
+        for (std::size_t i = 0; i < runs; ++i)
+            kernel.run();
+        if (timer.get_elapsed() >= opts.batchTime)
+            break;
+        runs *= 2;
+    }
+
+    std::vector<double> times;
+    std::size_t allocations = 0;
+    for (std::size_t b = 0; b < opts.batches; ++b)
+    {
+        std::size_t calls = 0;
+        std::size_t const allocsBefore = *benchAllocations;
+        util::HRTimer timer;
+        for (std::size_t i = 0; i < runs; ++i)
+            calls += kernel.run();
+        std::size_t elapsed = timer.get_elapsed();
+        allocations += *benchAllocations - allocsBefore;
+        times.push_back(1e6 * double(elapsed) / double(calls));
+        result->calls += calls;
+    }
+    std::sort(times.begin(), times.end());
+    result->values.push_back(std::make_pair("allocs_per_call",
+        double(allocations)
+        / double(std::max<std::size_t>(1, result->calls))));
+    result->unit = "ns";
+    result->median = times[times.size() / 2];
+    result->min = times.front();
+}
+
+/* Resets the sampler to every pixel */
+class ResetKernel : public BenchKernel
+{
+public:
+    ResetKernel (BenchSetup const& setup)
+        : setup(setup), sampler(mvs::PatchSampler::create(setup.views,
+        setup.settings))
+    {
+    }
+
+    std::size_t run (void)
+    {
+        for (std::size_t i = 0; i < setup.pixels.size(); ++i)
+        {
+            BenchPixel const& p(setup.pixels[i]);
+            sampler->reset(p.x, p.y, p.depth, 0.f, 0.f);
+        }
+        return setup.pixels.size();
+    }
+
+private:
+    BenchSetup const& setup;
+    mvs::PatchSampler::Ptr sampler;
+};
+
+/* Samples colors and derivatives of every pixel in all neighbors, the
+   time includes the reset of the sampler for each pixel */
+class ColAndDerivKernel : public BenchKernel
+{
+public:
+    ColAndDerivKernel (BenchSetup const& setup)
+        : setup(setup), sampler(mvs::PatchSampler::create(setup.views,
+        setup.settings))
+    {
+    }
+
+    std::size_t run (void)
+    {
+        std::size_t calls = 0;
+        for (std::size_t i = 0; i < setup.pixels.size(); ++i)
+        {
+            BenchPixel const& p(setup.pixels[i]);
+            sampler->reset(p.x, p.y, p.depth, 0.f, 0.f);
+            mvs::GlobalViewSet::const_iterator id;
+            for (id = setup.neighViews.begin();
+                id != setup.neighViews.end(); ++id, ++calls)
+                sampler->fastColAndDeriv(*id);
+        }
+        return calls;
+    }
+
+private:
+    BenchSetup const& setup;
+    mvs::PatchSampler::Ptr sampler;
+};
+
+/* NCC of every pixel with all neighbors, includes the reset */
+class NCCKernel : public BenchKernel
+{
+public:
+    NCCKernel (BenchSetup const& setup)
+        : setup(setup), sampler(mvs::PatchSampler::create(setup.views,
+        setup.settings))
+    {
+    }
+
+    std::size_t run (void)
+    {
+        std::size_t calls = 0;
+        for (std::size_t i = 0; i < setup.pixels.size(); ++i)
+        {
+            BenchPixel const& p(setup.pixels[i]);
+            sampler->reset(p.x, p.y, p.depth, 0.f, 0.f);
+            mvs::GlobalViewSet::const_iterator id;
+            for (id = setup.neighViews.begin();
+                id != setup.neighViews.end(); ++id, ++calls)
+                sampler->getFastNCC(*id);
+        }
+        return calls;
+    }
+
+private:
+    BenchSetup const& setup;
+    mvs::PatchSampler::Ptr sampler;
+};
+
+/* Local view selection at every pixel, includes the reset */
+class LocalVSKernel : public BenchKernel
+{
+public:
+    LocalVSKernel (BenchSetup const& setup)
+        : setup(setup), sampler(mvs::PatchSampler::create(setup.views,
+        setup.settings)), successes(0)
+    {
+    }
+
+    std::size_t run (void)
+    {
+        successes = 0;
+        for (std::size_t i = 0; i < setup.pixels.size(); ++i)
+        {
+            BenchPixel const& p(setup.pixels[i]);
+            sampler->reset(p.x, p.y, p.depth, 0.f, 0.f);
+            mvs::LocalViewSelection localVS(setup.views, setup.settings,
+                setup.neighViews, mvs::LocalViewSet(), sampler);
+            localVS.performVS();
+            if (localVS.success)
+                ++successes;
+        }
+        return setup.pixels.size();
+    }
+
+    BenchSetup const& setup;
+    mvs::PatchSampler::Ptr sampler;
+    std::size_t successes;
+};
+
+/* Optimizes every pixel from a perturbed depth like the seeds of the
+   region growing, and computes the confidence */
+class OptimizationKernel : public BenchKernel
+{
+public:
+    OptimizationKernel (BenchSetup const& setup)
+        : setup(setup), sampler(mvs::PatchSampler::create(setup.views,
+        setup.settings)), successes(0), inliers(0), iterations(0),
+        depthError(0.0)
+    {
+    }
+
+    std::size_t run (void)
+    {
+        successes = 0;
+        inliers = 0;
+        iterations = 0;
+        depthError = 0.0;
+        for (std::size_t i = 0; i < setup.pixels.size(); ++i)
+        {
+            BenchPixel const& p(setup.pixels[i]);
+            float initDepth = p.depth * (0.97f + 0.06f * bench_random(i, 3));
+            mvs::PatchOptimization patch(setup.views, setup.settings,
+                p.x, p.y, initDepth, 0.f, 0.f, setup.neighViews,
+                mvs::LocalViewSet(), sampler);
+            patch.doAutoOptimization();
+            iterations += patch.getIterations();
+            if (patch.computeConfidence() == 0.f)
+                continue;
+            ++successes;
+            float error = std::abs(patch.getDepth() - p.depth) / p.depth;
+            depthError += error;
+            if (error < BENCH_INLIER_ERROR)
+                ++inliers;
+        }
+        return setup.pixels.size();
+    }
+
+    BenchSetup const& setup;
+    mvs::PatchSampler::Ptr sampler;
+    std::size_t successes;
+    std::size_t inliers;
+    std::size_t iterations;
+    double depthError;
+};
+
+void
+bench_kernels (BenchOptions const& opts, BenchSetup const& setup,
+    std::vector<BenchResult>* results)
+{
+    std::size_t const numPixels = setup.pixels.size();
+    {
+        ResetKernel kernel(setup);
+        BenchResult result;
+        result.name = "patch_sampler_reset";
+        bench_time_kernel(kernel, opts, &result);
+        results->push_back(result);
+    }
+    {
+        ColAndDerivKernel kernel(setup);
+        BenchResult result;
+        result.name = "fast_col_and_deriv";
+        bench_time_kernel(kernel, opts, &result);
+        results->push_back(result);
+    }
+    {
+        NCCKernel kernel(setup);
+        BenchResult result;
+        result.name = "fast_ncc";
+        bench_time_kernel(kernel, opts, &result);
+        results->push_back(result);
+    }
+    {
+        LocalVSKernel kernel(setup);
+        BenchResult result;
+        result.name = "local_view_selection";
+        bench_time_kernel(kernel, opts, &result);
+        result.values.push_back(std::make_pair("success_rate",
+            double(kernel.successes) / double(numPixels)));
+        results->push_back(result);
+    }
+    {
+        OptimizationKernel kernel(setup);
+        BenchResult result;
+        result.name = "patch_optimization";
+        bench_time_kernel(kernel, opts, &result);
+        double successes = std::max<std::size_t>(1, kernel.successes);
+        result.values.push_back(std::make_pair("success_rate",
+            double(kernel.successes) / double(numPixels)));
+        result.values.push_back(std::make_pair("mean_iterations",
+            double(kernel.iterations) / double(numPixels)));
+        result.values.push_back(std::make_pair("depth_error",
+            kernel.depthError / successes));
+        result.values.push_back(std::make_pair("inlier_rate",
+            double(kernel.inliers) / successes));
+        results->push_back(result);
+    }
+}
+
+/* ---------------------------------------------------------------- */
+
+/* Reconstructs the reference view with a freshly loaded scene, such that
+   no images are cached from the previous run */
+void
+bench_reconstruction (BenchOptions const& opts, BenchSetup const& setup,
+    mvs::DenseEngine engine, std::size_t numThreads, BenchResult* result)
+{
+    mvs::Settings settings(setup.settings);
+    settings.engine = engine;
+    settings.numThreads = numThreads;
+    std::string const depthName("depth-L"
+        + util::string::get(settings.scale));
+    mvs::SingleViewPtr refV(setup.views[settings.refViewNr]);
+
+    std::vector<double> times;
+    std::size_t allocations = 0;
+    for (std::size_t r = 0; r < opts.repeat; ++r)
+    {
+        std::streambuf* coutBuf = std::cout.rdbuf();
+        std::stringstream quiet;
+        if (!opts.verbose)
+            std::cout.rdbuf(quiet.rdbuf());
+        mve::Scene::Ptr scene;
+        mvs::Metrics metrics(settings.maxIterations);
+        try
+        {
+            scene = mve::Scene::create();
+            scene->load_scene(opts.scenePath);
+            mvs::DMRecon recon(scene, settings);
+            util::HRTimer timer;
+            allocations = *benchAllocations;
+            recon.start();
+            allocations = *benchAllocations - allocations;
+            times.push_back(double(timer.get_elapsed()));
+            metrics = recon.getMetrics();
+        }
+        catch (...)
+        {
+            std::cout.rdbuf(coutBuf);
+            throw;
+        }
+        std::cout.rdbuf(coutBuf);
+
+        if (r > 0)
+            continue;
+
+        /* the result is the same for every run with one thread */
+        mve::FloatImage::Ptr depth(scene->get_view_by_id
+            (settings.refViewNr)->get_float_image(depthName));
+        if (!depth.get())
+            throw std::runtime_error("Reconstruction has no depth map");
+        std::size_t filled = 0, inliers = 0;
+        double depthError = 0.0;
+        for (std::size_t y = 0; y < depth->height(); ++y)
+            for (std::size_t x = 0; x < depth->width(); ++x)
+            {
+                float d = depth->at(x, y, 0);
+                if (d <= 0.f)
+                    continue;
+                ++filled;
+                float truth = benchSceneIntersect(refV->camPos,
+                    refV->viewRay(x, y));
+                float error = truth > 0.f ? std::abs(d - truth) / truth : 1.f;
+                depthError += error;
+                if (error < BENCH_INLIER_ERROR)
+                    ++inliers;
+            }
+
+        result->values.push_back(std::make_pair("filled", double(filled)));
+        result->values.push_back(std::make_pair("depth_error",
+            depthError / double(std::max<std::size_t>(1, filled))));
+        result->values.push_back(std::make_pair("inlier_rate",
+            double(inliers) / double(std::max<std::size_t>(1, filled))));
+        mvs::PatchCounters const& counters(metrics.counters);
+        result->values.push_back(std::make_pair("samples_per_pixel",
+            double(counters.samples)
+            / double(std::max<std::size_t>(1, filled))));
+        result->values.push_back(std::make_pair("sparse_rate",
+            double(counters.sparsePatches)
+            / double(std::max<std::size_t>(1, counters.sampledPatches))));
+        result->values.push_back(std::make_pair("allocations",
+            double(allocations)));
+        result->values.push_back(std::make_pair("allocs_per_pixel",
+            double(allocations) / double(std::max<std::size_t>(1, filled))));
+        result->values.push_back(std::make_pair("lock_contentions",
+            double(counters.lockContentions)));
+        for (int s = 0; s < mvs::STAGE_COUNT; ++s)
+            if (metrics.stages[s].wallMs > 0)
+                result->values.push_back(std::make_pair(std::string("ms_")
+                    + mvs::Metrics::getStageName(mvs::MetricsStage(s)),
+                    double(metrics.stages[s].wallMs)));
+    }
+
+    std::sort(times.begin(), times.end());
+    result->calls = times.size();
+    result->unit = "ms";
+    result->median = times[times.size() / 2];
+    result->min = times.front();
+    result->values.push_back(std::make_pair("pixels_per_sec",
+        double(setup.width * setup.height) * 1000.0
+        / std::max(1.0, result->median)));
+}
+
+/* Reconstructs with each thread count of the sweep, or with --threads
+   if there is no sweep. Speedup and efficiency are relative to the first
+   thread count. */
+void
+bench_thread_sweep (BenchOptions const& opts, BenchSetup const& setup,
+    mvs::DenseEngine engine, std::string const& name,
+    std::vector<BenchResult>* results)
+{
+    std::vector<std::size_t> counts(opts.threadSweep);
+    if (counts.empty())
+        counts.push_back(opts.numThreads);
+
+    double baseTime = 0.0;
+    for (std::size_t i = 0; i < counts.size(); ++i)
+    {
+        BenchResult result;
+        result.name = name;
+        if (!opts.threadSweep.empty())
+            result.name += "_t" + util::string::get(counts[i]);
+        bench_reconstruction(opts, setup, engine, counts[i], &result);
+        if (i == 0)
+            baseTime = result.median;
+        double speedup = baseTime / std::max(1.0, result.median);
+        result.values.push_back(std::make_pair("threads", double(counts[i])));
+        result.values.push_back(std::make_pair("speedup", speedup));
+        result.values.push_back(std::make_pair("efficiency",
+            speedup * double(counts[0]) / double(counts[i])));
+        results->push_back(result);
+    }
+}
+
+/* ---------------------------------------------------------------- */
+
+/* Loads all embeddings of the view files, a call is one pass */
+class MapLoadKernel : public BenchKernel
+{
+public:
+    MapLoadKernel (std::vector<std::string> const& files)
+        : files(files)
+    {
+    }
+
+    std::size_t run (void)
+    {
+        for (std::size_t i = 0; i < files.size(); ++i)
+        {
+            mve::View::Ptr view(mve::View::create(files[i]));
+            mve::View::Proxies const& proxies(view->get_proxies());
+            for (std::size_t j = 0; j < proxies.size(); ++j)
+                view->get_embedding(proxies[j].name);
+        }
+        return 1;
+    }
+
+private:
+    std::vector<std::string> const& files;
+};
+
+typedef std::vector<std::pair<std::string, mve::ImageBase::Ptr> > BenchMaps;
+
+/* Appends the depth, dz and confidence maps of the view */
+void
+bench_collect_maps (mve::View::Ptr view, std::vector<BenchMaps>* maps)
+{
+    BenchMaps viewMaps;
+    mve::View::Proxies const& proxies(view->get_proxies());
+    for (std::size_t i = 0; i < proxies.size(); ++i)
+    {
+        std::string const& name(proxies[i].name);
+        if (proxies[i].is_image && (name.compare(0, 7, "depth-L") == 0
+            || name.compare(0, 4, "dz-L") == 0
+            || name.compare(0, 6, "conf-L") == 0))
+            viewMaps.push_back(std::make_pair(name, view->get_image(name)));
+    }
+    if (!viewMaps.empty())
+        maps->push_back(viewMaps);
+}
+
+/* Times loading the maps of DMRecon stored uncompressed and compressed.
+   The maps stored in the scene are used, the maps of the reference view
+   are reconstructed if the scene has none. The files are read from the
+   page cache, the times therefore show the cost of decompression rather
+   than the savings of disk reads, see file_bytes for the latter */
+void
+bench_map_loading (BenchOptions const& opts, BenchSetup const& setup,
+    std::vector<BenchResult>* results)
+{
+    std::vector<BenchMaps> maps;
+    mve::Scene::ViewList const& views(setup.scene->get_views());
+    for (std::size_t i = 0; i < views.size(); ++i)
+        if (views[i].get())
+            bench_collect_maps(views[i], &maps);
+
+    std::string const codecs[] = { "", MVE_CODEC_DELTA_LZ };
+    std::vector<std::string> files[2];
+    std::size_t fileBytes[2] = { 0, 0 };
+    std::size_t mapBytes = 0;
+
+    std::streambuf* coutBuf = std::cout.rdbuf();
+    std::stringstream quiet;
+    if (!opts.verbose)
+        std::cout.rdbuf(quiet.rdbuf());
+    try
+    {
+        mve::Scene::Ptr scene;
+        if (maps.empty())
+        {
+            scene = mve::Scene::create();
+            scene->load_scene(opts.scenePath);
+            mvs::DMRecon recon(scene, setup.settings);
+            recon.start();
+            bench_collect_maps(scene->get_view_by_id
+                (setup.settings.refViewNr), &maps);
+        }
+
+        for (std::size_t c = 0; c < 2; ++c)
+            for (std::size_t i = 0; i < maps.size(); ++i)
+            {
+                mve::View::Ptr view(mve::View::create());
+                for (std::size_t j = 0; j < maps[i].size(); ++j)
+                {
+                    view->add_image(maps[i][j].first, maps[i][j].second);
+                    view->set_embedding_codec(maps[i][j].first, codecs[c]);
+                    if (c == 0)
+                        mapBytes += maps[i][j].second->get_byte_size();
+                }
+                files[c].push_back(opts.scenePath + "/bench-maps-"
+                    + (c ? codecs[c] : "raw") + "-"
+                    + util::string::get(i) + ".mve");
+                view->save_mve_file_as(files[c].back());
+                for (std::size_t j = 0; j < view->get_proxies().size(); ++j)
+                    fileBytes[c] += view->get_proxies()[j].file_size;
+            }
+    }
+    catch (...)
+    {
+        std::cout.rdbuf(coutBuf);
+        throw;
+    }
+    std::cout.rdbuf(coutBuf);
+    if (maps.empty())
+        throw std::runtime_error("Reconstruction has no depth map");
+
+    for (std::size_t c = 0; c < 2; ++c)
+    {
+        MapLoadKernel kernel(files[c]);
+        BenchResult result;
+        result.name = c ? "load_maps_delta_lz" : "load_maps_raw";
+        bench_time_kernel(kernel, opts, &result);
+        result.values.push_back(std::make_pair("mb_per_sec",
+            double(mapBytes) * 1000.0 / std::max(1e-9, result.median)));
+        result.values.push_back(std::make_pair("file_bytes",
+            double(fileBytes[c])));
+        result.values.push_back(std::make_pair("ratio",
+            double(mapBytes) / double(std::max<std::size_t>(1, fileBytes[c]))));
+        results->push_back(result);
+
+        for (std::size_t i = 0; i < files[c].size(); ++i)
+            util::fs::unlink(files[c][i].c_str());
+    }
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+bench_write_json (std::ostream& out, BenchOptions const& opts,
+    BenchSetup const& setup, std::vector<BenchResult> const& results)
+{
+    /* one benchmark per line, --compare relies on it */
+    out << "{\n"
+        << "  \"label\": \"" << opts.label << "\",\n"
+        << "  \"simd\": \"" << mvs::getSimdLevelName(mvs::getSimdLevel())
+        << "\",\n"
+        << "  \"scene\": { \"views\": " << setup.scene->get_views().size()
+        << ", \"features\": "
+        << setup.scene->get_bundle()->get_points().size()
+        << ", \"ref_view\": " << setup.settings.refViewNr
+        << ", \"scale\": " << setup.settings.scale
+        << ", \"width\": " << setup.width
+        << ", \"height\": " << setup.height
+        << ", \"threads\": " << setup.settings.numThreads
+        << ", \"sparse_variance\": " << (setup.settings.adaptiveSampling
+        ? setup.settings.sparseSamplingVariance : 0.f) << " },\n"
+        << "  \"benchmarks\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i)
+    {
+        BenchResult const& r(results[i]);
+        out << "    { \"name\": \"" << r.name << "\""
+            << ", \"unit\": \"" << r.unit << "\""
+            << ", \"calls\": " << r.calls
+            << ", \"median\": " << r.median
+            << ", \"min\": " << r.min;
+        for (std::size_t j = 0; j < r.values.size(); ++j)
+            out << ", \"" << r.values[j].first << "\": "
+                << r.values[j].second;
+        out << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n"
+        << "}\n";
+}
+
+/* Returns the value of the key in the line, or a negative value */
+double
+bench_json_value (std::string const& line, std::string const& key)
+{
+    std::string const pattern("\"" + key + "\": ");
+    std::size_t pos = line.find(pattern);
+    if (pos == std::string::npos)
+        return -1.0;
+    return std::atof(line.c_str() + pos + pattern.size());
+}
+
+/* Prints the median times of the results relative to a previous run */
+void
+bench_compare (std::string const& filename,
+    std::vector<BenchResult> const& results)
+{
+    std::ifstream in(filename.c_str());
+    if (!in.good())
+        throw std::runtime_error("Cannot open " + filename);
+
+    std::cout << std::endl << "Compared to " << filename << ":" << std::endl;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::size_t pos = line.find("\"name\": \"");
+        if (pos == std::string::npos)
+            continue;
+        pos += 9;
+        std::string name(line.substr(pos, line.find('"', pos) - pos));
+        double before = bench_json_value(line, "median");
+        for (std::size_t i = 0; i < results.size(); ++i)
+        {
+            if (results[i].name != name || before <= 0.0)
+                continue;
+            double speedup = before / std::max(1e-9, results[i].median);
+            std::cout << "  " << std::left << std::setw(24) << name
+                << std::right << std::setw(12)
+                << util::string::get_fixed(before, 1) << " -> "
+                << std::setw(12)
+                << util::string::get_fixed(results[i].median, 1) << " "
+                << results[i].unit << "  ("
+                << util::string::get_fixed(speedup, 2) << "x)" << std::endl;
+        }
+    }
+}
+
+/* ---------------------------------------------------------------- */
+
+int
+main (int argc, char** argv)
+{
+    util::Arguments args;
+    args.set_usage(argv[0], "[ OPTIONS ] SCENEDIR");
+    args.set_description("Benchmarks the kernels of the reconstruction "
+        "and complete reconstructions of a view. The synthetic benchmark "
+        "scene is generated if SCENEDIR has no bundle file. Depth errors "
+        "are only meaningful for the synthetic scene.");
+    args.set_helptext_indent(23);
+    args.set_nonopt_minnum(1);
+    args.set_nonopt_maxnum(1);
+    args.set_exit_on_error(true);
+    args.add_option('o', "output", true, "Write results as JSON to file");
+    args.add_option('c', "compare", true,
+        "Compare with the results of a previous run");
+    args.add_option('\0', "label", true, "Label of the run in the results");
+    args.add_option('m', "master-view", true,
+        "Reference view ID [center view]");
+    args.add_option('s', "scale", true, "Reconstruction scale [0]");
+    args.add_option('t', "threads", true,
+        "Threads of the reconstructions [1]");
+    args.add_option('\0', "thread-sweep", true,
+        "Reconstruct with each of the thread counts, e.g. 1,2,4,8");
+    args.add_option('r', "repeat", true, "Runs per reconstruction [3]");
+    args.add_option('\0', "batches", true, "Timed batches per kernel [7]");
+    args.add_option('\0', "batch-time", true,
+        "Minimum time per batch in milliseconds [50]");
+    args.add_option('\0', "sparse-variance", true,
+        "Adaptive sampling with sparse patches above the variance");
+    args.add_option('\0', "simd", true,
+        "Restrict the kernels to scalar, sse2 or avx2");
+    args.add_option('\0', "no-kernels", false, "Skip the kernel benchmarks");
+    args.add_option('\0', "no-recon", false, "Skip the reconstructions");
+    args.add_option('\0', "no-io", false,
+        "Skip loading the depth maps from view files");
+    args.add_option('v', "verbose", false, "Show reconstruction output");
+    args.add_option('\0', "views", true, "Views of a generated scene [8]");
+    args.add_option('\0', "width", true, "Image width of a generated "
+        "scene [320]");
+    args.add_option('\0', "height", true, "Image height of a generated "
+        "scene [240]");
+    args.add_option('\0', "features", true,
+        "Bundle features of a generated scene [3000]");
+    args.parse(argc, argv);
+
+    BenchOptions opts;
+    opts.refView = -1;
+    opts.scale = 0.f;
+    opts.sparseVariance = 0.f;
+    opts.numThreads = 1;
+    opts.repeat = 3;
+    opts.batches = 7;
+    opts.batchTime = 50;
+    opts.kernels = true;
+    opts.reconstruction = true;
+    opts.mapLoading = true;
+    opts.verbose = false;
+
+    util::ArgResult const* arg;
+    while ((arg = args.next_result()))
+    {
+        if (arg->opt == 0)
+        {
+            opts.scenePath = arg->arg;
+            continue;
+        }
+        if (arg->opt->lopt == "output")
+            opts.outputFile = arg->arg;
+        else if (arg->opt->lopt == "compare")
+            opts.compareFile = arg->arg;
+        else if (arg->opt->lopt == "label")
+            opts.label = arg->arg;
+        else if (arg->opt->lopt == "master-view")
+            opts.refView = arg->get_arg<int>();
+        else if (arg->opt->lopt == "scale")
+            opts.scale = arg->get_arg<float>();
+        else if (arg->opt->lopt == "threads")
+            opts.numThreads = std::max(1, arg->get_arg<int>());
+        else if (arg->opt->lopt == "thread-sweep")
+        {
+            util::Tokenizer tok;
+            tok.split(arg->arg, ',');
+            for (std::size_t i = 0; i < tok.size(); ++i)
+                opts.threadSweep.push_back(std::max(1,
+                    util::string::convert<int>(tok[i])));
+        }
+        else if (arg->opt->lopt == "repeat")
+            opts.repeat = std::max(1, arg->get_arg<int>());
+        else if (arg->opt->lopt == "batches")
+            opts.batches = std::max(1, arg->get_arg<int>());
+        else if (arg->opt->lopt == "batch-time")
+            opts.batchTime = std::max(1, arg->get_arg<int>());
+        else if (arg->opt->lopt == "sparse-variance")
+            opts.sparseVariance = arg->get_arg<float>();
+        else if (arg->opt->lopt == "simd")
+        {
+            if (arg->arg == "scalar")
+                mvs::setSimdLevel(mvs::SIMD_SCALAR);
+            else if (arg->arg == "sse2")
+                mvs::setSimdLevel(mvs::SIMD_SSE2);
+            else if (arg->arg == "avx2")
+                mvs::setSimdLevel(mvs::SIMD_AVX2);
+            else
+            {
+                std::cerr << "Invalid instruction set: " << arg->arg
+                    << std::endl;
+                return 1;
+            }
+        }
+        else if (arg->opt->lopt == "no-kernels")
+            opts.kernels = false;
+        else if (arg->opt->lopt == "no-recon")
+            opts.reconstruction = false;
+        else if (arg->opt->lopt == "no-io")
+            opts.mapLoading = false;
+        else if (arg->opt->lopt == "verbose")
+            opts.verbose = true;
+        else if (arg->opt->lopt == "views")
+            opts.sceneParams.numViews = arg->get_arg<int>();
+        else if (arg->opt->lopt == "width")
+            opts.sceneParams.width = arg->get_arg<int>();
+        else if (arg->opt->lopt == "height")
+            opts.sceneParams.height = arg->get_arg<int>();
+        else if (arg->opt->lopt == "features")
+            opts.sceneParams.numFeatures = arg->get_arg<int>();
+    }
+    if (opts.label.empty())
+        opts.label = opts.scenePath;
+
+    try
+    {
+        if (!util::fs::file_exists((opts.scenePath + "/"
+            MVE_SCENE_BUNDLE_FILE).c_str()))
+        {
+            std::cout << "Generating benchmark scene in " << opts.scenePath
+                << "..." << std::endl;
+            benchSceneGenerate(opts.scenePath, opts.sceneParams);
+        }
+
+        BenchSetup setup;
+        bench_prepare(opts, &setup);
+        std::cout << "Reference view " << setup.settings.refViewNr << " ("
+            << setup.width << "x" << setup.height << "), "
+            << setup.neighViews.size() << " neighbors, "
+            << setup.pixels.size() << " pixels, "
+            << mvs::getSimdLevelName(mvs::getSimdLevel()) << " kernels."
+            << std::endl;
+
+        std::vector<BenchResult> results;
+        if (opts.kernels)
+            bench_kernels(opts, setup, &results);
+        if (opts.reconstruction)
+        {
+            bench_thread_sweep(opts, setup, mvs::ENGINE_REGION_GROWING,
+                "recon_region_growing", &results);
+            std::size_t const growing = results.size();
+            bench_thread_sweep(opts, setup, mvs::ENGINE_PATCHMATCH,
+                "recon_patchmatch", &results);
+            /* time relative to region growing with the same threads */
+            std::size_t const counts = results.size() - growing;
+            for (std::size_t i = growing; i < results.size(); ++i)
+                results[i].values.push_back(std::make_pair("vs_growing",
+                    results[i].median
+                    / std::max(1.0, results[i - counts].median)));
+        }
+        if (opts.mapLoading)
+            bench_map_loading(opts, setup, &results);
+
+        bench_write_json(std::cout, opts, setup, results);
+        /* before writing, the files may be the same */
+        if (!opts.compareFile.empty())
+            bench_compare(opts.compareFile, results);
+        if (!opts.outputFile.empty())
+        {
+            std::ofstream out(opts.outputFile.c_str());
+            bench_write_json(out, opts, setup, results);
+            if (!out.good())
+                throw std::runtime_error("Cannot write " + opts.outputFile);
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,309 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+
+#include "math/matrix.h"
+#include "mve/bundlefile.h"
+#include "mve/camera.h"
+#include "mve/image.h"
+#include "mve/scene.h"
+#include "mve/view.h"
+#include "util/fs.h"
+#include "util/string.h"
+
+#include "_benchscene.h"
+
+/* Supersamples per pixel along each axis */
+#define BENCH_SUPERSAMPLING 2
+/* Distance of the features to the image border in pixels */
+#define BENCH_FEATURE_BORDER 5.f
+
+namespace
+{
+    struct Sphere
+    {
+        float center[3];
+        float radius;
+    };
+
+    Sphere const spheres[] = {
+        { { 0.f, 0.f, 0.4f }, 0.5f },
+        { { -1.1f, 0.5f, 0.3f }, 0.3f }
+    };
+    std::size_t const numSpheres = sizeof(spheres) / sizeof(Sphere);
+
+    /* ground plane z = 0 and the wall y = wallY up to wallHeight */
+    float const groundExtent = 4.f;
+    float const wallY = 1.5f;
+    float const wallHeight = 2.f;
+
+    /* Uniform value in [0, 1] hashed from the arguments */
+    float
+    hashValue(unsigned int x, unsigned int y, unsigned int z)
+    {
+        unsigned int h = x * 374761393u + y * 668265263u + z * 2147483647u;
+        h = (h ^ (h >> 13)) * 1274126177u;
+        h ^= h >> 16;
+        return float(h & 0xffffff) / float(0xffffff);
+    }
+
+    /* Trilinearly interpolated value noise */
+    float
+    valueNoise(float x, float y, float z)
+    {
+        float const fx = std::floor(x), fy = std::floor(y), fz = std::floor(z);
+        int const ix = int(fx), iy = int(fy), iz = int(fz);
+        float const wx = x - fx, wy = y - fy, wz = z - fz;
+        float value = 0.f;
+        for (int c = 0; c < 8; ++c)
+        {
+            int const dx = c & 1, dy = (c >> 1) & 1, dz = (c >> 2) & 1;
+            float const w = (dx ? wx : 1.f - wx) * (dy ? wy : 1.f - wy)
+                * (dz ? wz : 1.f - wz);
+            value += w * hashValue(ix + dx, iy + dy, iz + dz);
+        }
+        return value;
+    }
+
+    /* Color of the surface point, four octaves of noise per channel */
+    math::Vec3f
+    surfaceColor(math::Vec3f const& p)
+    {
+        math::Vec3f color;
+        for (int ch = 0; ch < 3; ++ch)
+        {
+            float value = 0.f, amplitude = 0.5f, frequency = 8.f;
+            for (int octave = 0; octave < 4; ++octave)
+            {
+                value += amplitude * valueNoise(p[0] * frequency
+                    + float(ch * 17), p[1] * frequency, p[2] * frequency);
+                amplitude *= 0.5f;
+                frequency *= 2.f;
+            }
+            color[ch] = 0.1f + 0.8f * value;
+        }
+        return color;
+    }
+
+    /* Camera on an arc in front of the wall, looking at the center */
+    mve::CameraInfo
+    createCamera(std::size_t index, std::size_t numViews)
+    {
+        float const a = -0.6f + 1.2f * float(index)
+            / float(std::max<std::size_t>(1, numViews - 1));
+        math::Vec3f const pos(3.f * std::sin(a),
+            -2.5f + 0.3f * std::cos(3.f * a), 3.5f);
+        math::Vec3f const target(0.f, 0.3f, 0.3f);
+        math::Vec3f const zAxis((pos - target).normalized());
+        math::Vec3f const xAxis(math::Vec3f(0.f, 0.f, 1.f)
+            .cross(zAxis).normalized());
+        math::Vec3f const yAxis(zAxis.cross(xAxis));
+
+        mve::CameraInfo cam;
+        cam.flen = 1.f;
+        for (int i = 0; i < 3; ++i)
+        {
+            cam.rot[i] = xAxis[i];
+            cam.rot[3 + i] = yAxis[i];
+            cam.rot[6 + i] = zAxis[i];
+        }
+        for (int i = 0; i < 3; ++i)
+            cam.trans[i] = -(cam.rot[3 * i] * pos[0]
+                + cam.rot[3 * i + 1] * pos[1] + cam.rot[3 * i + 2] * pos[2]);
+        return cam;
+    }
+
+    /* Point on one of the surfaces, the k-th of a fixed sequence */
+    math::Vec3f
+    surfacePoint(std::size_t k)
+    {
+        float const r1 = hashValue(k, 1, 7);
+        float const r2 = hashValue(k, 2, 7);
+        switch (k % 4)
+        {
+            case 0:
+            case 1:
+                return math::Vec3f(groundExtent * (2.f * r1 - 1.f),
+                    (groundExtent + wallY) * r2 - groundExtent, 0.f);
+            case 2:
+                return math::Vec3f(groundExtent * (2.f * r1 - 1.f),
+                    wallY, wallHeight * r2);
+            default:
+            {
+                Sphere const& s = spheres[(k / 4) % numSpheres];
+                float const phi = 2.f * float(MATH_PI) * r1;
+                float const theta = std::acos(1.f - 2.f * r2);
+                return math::Vec3f(
+                    s.center[0] + s.radius * std::cos(phi) * std::sin(theta),
+                    s.center[1] + s.radius * std::sin(phi) * std::sin(theta),
+                    s.center[2] + s.radius * std::cos(theta));
+            }
+        }
+    }
+
+    /* Returns if the point is unoccluded and inside the image */
+    bool
+    isVisible(mve::CameraInfo const& cam, math::Vec3f const& point,
+        std::size_t width, std::size_t height)
+    {
+        math::Vec3f pos;
+        cam.fill_camera_pos(*pos);
+        math::Vec3f dir(point - pos);
+        float const dist = dir.norm();
+        float const t = benchSceneIntersect(pos, dir / dist);
+        if (t < 0.f || std::abs(t - dist) > 1e-3f * dist)
+            return false;
+
+        math::Matrix4f worldToCam;
+        math::Matrix3f proj;
+        cam.fill_world_to_cam(*worldToCam);
+        cam.fill_projection(*proj, width, height);
+        math::Vec3f const cp(worldToCam.mult(point, 1.f));
+        if (cp[2] >= 0.f)
+            return false;
+        math::Vec3f const sp(proj * cp);
+        float const x = sp[0] / sp[2];
+        float const y = sp[1] / sp[2];
+        return x >= BENCH_FEATURE_BORDER && y >= BENCH_FEATURE_BORDER
+            && x <= float(width) - BENCH_FEATURE_BORDER
+            && y <= float(height) - BENCH_FEATURE_BORDER;
+    }
+
+    /* Renders the view with gamma corrected colors */
+    mve::ByteImage::Ptr
+    renderView(mve::CameraInfo const& cam, std::size_t width,
+        std::size_t height)
+    {
+        math::Vec3f pos;
+        math::Matrix3f invproj, camToWorld;
+        cam.fill_camera_pos(*pos);
+        cam.fill_inverse_projection(*invproj, width, height);
+        cam.fill_cam_to_world_rot(*camToWorld);
+
+        int const ss = BENCH_SUPERSAMPLING;
+        mve::ByteImage::Ptr image(mve::ByteImage::create(width, height, 3));
+        for (std::size_t y = 0; y < height; ++y)
+            for (std::size_t x = 0; x < width; ++x)
+            {
+                math::Vec3f color(0.f);
+                for (int s = 0; s < ss * ss; ++s)
+                {
+                    float const sx = float(x) + (float(s % ss) + 0.5f) / ss;
+                    float const sy = float(y) + (float(s / ss) + 0.5f) / ss;
+                    math::Vec3f const ray(camToWorld * (invproj
+                        * math::Vec3f(sx, sy, 1.f)).normalized());
+                    float const t = benchSceneIntersect(pos, ray);
+                    color += t > 0.f ? surfaceColor(pos + ray * t)
+                        : math::Vec3f(0.5f);
+                }
+                color /= float(ss * ss);
+                for (int c = 0; c < 3; ++c)
+                    image->at(x, y, c) = (unsigned char)(255.f
+                        * std::pow(color[c], 1.f / 2.2f) + 0.5f);
+            }
+        return image;
+    }
+}
+
+BenchSceneParams::BenchSceneParams()
+    :
+    numViews(8),
+    width(320),
+    height(240),
+    numFeatures(3000)
+{
+}
+
+float
+benchSceneIntersect(math::Vec3f const& origin, math::Vec3f const& dir)
+{
+    float best = -1.f;
+    if (dir[2] < 0.f)
+    {
+        float const t = -origin[2] / dir[2];
+        math::Vec3f const p(origin + dir * t);
+        if (std::abs(p[0]) <= groundExtent && p[1] >= -groundExtent
+            && p[1] <= wallY)
+            best = t;
+    }
+    if (dir[1] > 0.f)
+    {
+        float const t = (wallY - origin[1]) / dir[1];
+        math::Vec3f const p(origin + dir * t);
+        if (t > 0.f && (best < 0.f || t < best)
+            && std::abs(p[0]) <= groundExtent
+            && p[2] >= 0.f && p[2] <= wallHeight)
+            best = t;
+    }
+    for (std::size_t i = 0; i < numSpheres; ++i)
+    {
+        math::Vec3f const oc(origin - math::Vec3f(spheres[i].center));
+        float const b = oc.dot(dir);
+        float const c = oc.dot(oc) - spheres[i].radius * spheres[i].radius;
+        float const disc = b * b - c;
+        if (disc <= 0.f)
+            continue;
+        float const t = -b - std::sqrt(disc);
+        if (t > 0.f && (best < 0.f || t < best))
+            best = t;
+    }
+    return best;
+}
+
+void
+benchSceneGenerate(std::string const& path, BenchSceneParams const& params)
+{
+    if (params.numViews < 2 || params.width == 0 || params.height == 0)
+        throw std::invalid_argument("Invalid benchmark scene parameters");
+
+    std::string const viewsPath(path + "/" MVE_SCENE_VIEWS_DIR);
+    if (!util::fs::dir_exists(path.c_str())
+        && !util::fs::mkdir(path.c_str()))
+        throw std::runtime_error("Cannot create directory: " + path);
+    if (!util::fs::dir_exists(viewsPath.c_str())
+        && !util::fs::mkdir(viewsPath.c_str()))
+        throw std::runtime_error("Cannot create directory: " + viewsPath);
+
+    mve::BundleFile::Ptr bundle(mve::BundleFile::create());
+    mve::BundleFile::BundleCameras& cameras(bundle->get_cameras());
+    for (std::size_t i = 0; i < params.numViews; ++i)
+    {
+        cameras.push_back(createCamera(i, params.numViews));
+
+        mve::View::Ptr view(mve::View::create());
+        view->set_id(i);
+        view->set_name(util::string::get_filled(i, 4));
+        view->set_camera(cameras[i]);
+        view->add_image("undistorted",
+            renderView(cameras[i], params.width, params.height));
+        char filename[32];
+        std::sprintf(filename, "view_%04d.mve", int(i));
+        view->save_mve_file_as(viewsPath + filename);
+    }
+
+    mve::BundleFile::FeaturePoints& points(bundle->get_points());
+    for (std::size_t k = 0; k < params.numFeatures; ++k)
+    {
+        math::Vec3f const pos(surfacePoint(k));
+        math::Vec3f const color(surfaceColor(pos));
+        mve::FeaturePoint point;
+        for (int i = 0; i < 3; ++i)
+        {
+            point.pos[i] = pos[i];
+            point.color[i] = (unsigned char)(255.f * color[i]);
+        }
+        for (std::size_t i = 0; i < params.numViews; ++i)
+        {
+            if (!isVisible(cameras[i], pos, params.width, params.height))
+                continue;
+            mve::FeaturePointRef ref;
+            ref.img_id = i;
+            ref.feature_id = k;
+            ref.error = 0.f;
+            point.refs.push_back(ref);
+        }
+        points.push_back(point);
+    }
+    bundle->write_bundle(path + "/" MVE_SCENE_BUNDLE_FILE);
+}
@@ -0,0 +1,35 @@
+#ifndef BENCHSCENE_H
+#define BENCHSCENE_H
+
+#include <string>
+
+#include "math/vector.h"
+
+/**
+ * Synthetic scene for the benchmarks: a textured ground plane, a wall
+ * behind it and two spheres, seen by a row of cameras looking at the
+ * center. The texture is procedural noise and all random numbers are
+ * hashed from their index, so the scene is identical on every machine.
+ * Views get the camera and an "undistorted" image, the bundle file holds
+ * the visible surface points as features. Depths of the reconstruction
+ * are known exactly from benchSceneIntersect().
+ */
+struct BenchSceneParams
+{
+    BenchSceneParams();
+
+    std::size_t numViews;
+    std::size_t width;
+    std::size_t height;
+    std::size_t numFeatures;
+};
+
+/** Writes the scene with views and bundle file to the directory */
+void benchSceneGenerate(std::string const& path,
+    BenchSceneParams const& params);
+
+/** Distance along the normalized direction to the first surface, or a
+    negative value if the ray hits nothing */
+float benchSceneIntersect(math::Vec3f const& origin, math::Vec3f const& dir);
+
+#endif
@@ -0,0 +1,247 @@
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "mve/image.h"
+#include "mve/scene.h"
+#include "util/thread.h"
+
+#include "DMRecon.h"
+#include "Settings.h"
+#include "mvstools.h"
+
+/*
+ * Stress test for parallel reconstructions. Build and run with the
+ * thread sanitizer to check for data races:
+ *
+ *   make test GCCFLAGS="-Wall -Wextra -ansi -pedantic -g -O1 \
+ *       -fsanitize=thread"
+ *   ./test [<scene path> [<threads>]]
+ *
+ * Without a scene only the color sampling is tested.
+ */
+
+#define NUM_ROUNDS 50
+
+/* ---------------------------------------------------------------- */
+
+bool
+test_srgb_table (void)
+{
+    std::size_t const linThresh = (std::size_t) (0.04045 * 255.);
+    for (std::size_t col = 0; col < 256; ++col)
+    {
+        float expected;
+        if (col <= linThresh)
+            expected = ((float) col / 255.) / 12.92;
+        else
+            expected = std::pow(((float) col / 255. + 0.055) / 1.055, 2.4);
+        if (mvs::srgb2linear((unsigned char)col) != expected)
+        {
+            std::cout << "sRGB table differs at " << col << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/* ---------------------------------------------------------------- */
+
+/* Linearizes and samples the same 8-bit image in every thread */
+class SamplingThread : public util::Thread
+{
+public:
+    SamplingThread (mve::ByteImage::ConstPtr image,
+        mvs::PixelCoords const& positions)
+        : image(image), positions(positions)
+    {
+    }
+
+    void* run (void)
+    {
+        for (int i = 0; i < NUM_ROUNDS; ++i)
+        {
+            linear = mvs::linearFloatImage(image->duplicate());
+            colors.resize(positions.size());
+            mvs::getXYZColorAtPos(image->duplicate(), positions, &colors);
+        }
+        return 0;
+    }
+
+    mve::ByteImage::ConstPtr image;
+    mvs::PixelCoords const& positions;
+    mve::FloatImage::Ptr linear;
+    mvs::Samples colors;
+};
+
+bool
+test_parallel_sampling (std::size_t numThreads)
+{
+    mve::ByteImage::Ptr image(mve::ByteImage::create(64, 64, 3));
+    for (std::size_t i = 0; i < image->get_value_amount(); ++i)
+        image->at(i) = (unsigned char)(std::rand() % 256);
+    mvs::PixelCoords positions;
+    for (std::size_t i = 0; i < 100; ++i)
+        positions.push_back(math::Vec2f(1.f + 61.f * float(std::rand())
+            / float(RAND_MAX), 1.f + 61.f * float(std::rand())
+            / float(RAND_MAX)));
+
+    std::vector<SamplingThread*> threads;
+    for (std::size_t i = 0; i < numThreads; ++i)
+    {
+        threads.push_back(new SamplingThread(image, positions));
+        threads.back()->pt_create();
+    }
+    for (std::size_t i = 0; i < numThreads; ++i)
+        threads[i]->pt_join();
+
+    bool success = true;
+    for (std::size_t i = 1; i < numThreads; ++i)
+    {
+        for (std::size_t j = 0; j < image->get_value_amount(); ++j)
+            if (threads[i]->linear->at(j) != threads[0]->linear->at(j))
+                success = false;
+        for (std::size_t j = 0; j < positions.size(); ++j)
+            if (threads[i]->colors[j] != threads[0]->colors[j])
+                success = false;
+    }
+    for (std::size_t i = 0; i < numThreads; ++i)
+        delete threads[i];
+    if (!success)
+        std::cout << "Parallel sampling results differ" << std::endl;
+    return success;
+}
+
+/* ---------------------------------------------------------------- */
+
+/* Reconstructs a view of its own scene instance. One worker thread, the
+   result of the region growing with several workers depends on their
+   scheduling. */
+class ReconThread : public util::Thread
+{
+public:
+    ReconThread (std::string const& path, std::size_t viewID)
+        : path(path), viewID(viewID)
+    {
+    }
+
+    void* run (void)
+    {
+        try
+        {
+            mve::Scene::Ptr scene(mve::Scene::create());
+            scene->load_scene(path);
+            mvs::Settings settings;
+            settings.refViewNr = viewID;
+            settings.scale = 1.f;
+            settings.numThreads = 1;
+            mvs::DMRecon recon(scene, settings);
+            recon.start();
+            mve::FloatImage::Ptr image = scene->get_view_by_id(viewID)
+                ->get_float_image("depth-L1");
+            if (image.get())
+                depth = image->duplicate();
+        }
+        catch (std::exception& e)
+        {
+            error = e.what();
+        }
+        return 0;
+    }
+
+    std::string path;
+    std::size_t viewID;
+    mve::FloatImage::Ptr depth;
+    std::string error;
+};
+
+bool
+test_parallel_reconstruction (std::string const& path,
+    std::size_t numThreads)
+{
+    /* reference depth maps, reconstructed one after another */
+    std::vector<mve::FloatImage::Ptr> reference;
+    for (std::size_t i = 0; i < numThreads; ++i)
+    {
+        ReconThread recon(path, i);
+        recon.run();
+        if (!recon.error.empty())
+        {
+            std::cout << "Error: " << recon.error << std::endl;
+            return false;
+        }
+        reference.push_back(recon.depth);
+    }
+
+    std::vector<ReconThread*> threads;
+    for (std::size_t i = 0; i < numThreads; ++i)
+    {
+        threads.push_back(new ReconThread(path, i));
+        threads.back()->pt_create();
+    }
+    for (std::size_t i = 0; i < numThreads; ++i)
+        threads[i]->pt_join();
+
+    bool success = true;
+    for (std::size_t i = 0; i < numThreads; ++i)
+    {
+        ReconThread const& t(*threads[i]);
+        if (!t.error.empty())
+        {
+            std::cout << "Error: " << t.error << std::endl;
+            success = false;
+            continue;
+        }
+        if (!t.depth.get() || !reference[i].get())
+        {
+            std::cout << "View " << i << ": missing depth map" << std::endl;
+            success = false;
+            continue;
+        }
+        std::size_t differences = 0;
+        for (std::size_t j = 0; j < t.depth->get_value_amount(); ++j)
+            if (t.depth->at(j) != reference[i]->at(j))
+                ++differences;
+        if (differences)
+        {
+            std::cout << "View " << i << ": " << differences
+                << " depths differ from the serial reconstruction"
+                << std::endl;
+            success = false;
+        }
+    }
+    for (std::size_t i = 0; i < numThreads; ++i)
+        delete threads[i];
+    return success;
+}
+
+/* ---------------------------------------------------------------- */
+
+int
+main (int argc, char** argv)
+{
+    std::size_t numThreads = argc > 2 ? std::atoi(argv[2]) : 4;
+    bool success = true;
+
+    /* first, so the threads are the first to use the sRGB table */
+    std::cout << "Testing parallel sampling with " << numThreads
+        << " threads..." << std::endl;
+    success = test_parallel_sampling(numThreads) && success;
+
+    std::cout << "Testing sRGB table..." << std::endl;
+    success = test_srgb_table() && success;
+
+    if (argc > 1)
+    {
+        std::cout << "Testing " << numThreads
+            << " parallel reconstructions..." << std::endl;
+        success = test_parallel_reconstruction(argv[1], numThreads)
+            && success;
+    }
+
+    std::cout << (success ? "All tests passed." : "Tests FAILED.")
+        << std::endl;
+    return success ? 0 : 1;
+}
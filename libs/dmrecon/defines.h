@@ -1,7 +1,7 @@
 #ifndef DEFINES_H
 #define DEFINES_H
 
-#include <set>
+#include <vector>
 #include "math/vector.h"
 
 #define MVS_NAMESPACE_BEGIN namespace mvs {
@@ -10,7 +10,6 @@
 /** Multi-View Stereo implementation of [Goesele '07, ICCV]. */
 MVS_NAMESPACE_BEGIN
 
-typedef std::set< std::size_t > IndexSet;
 typedef std::vector< math::Vec3f > Samples;
 typedef std::vector< math::Vec2f > PixelCoords;
 
@@ -14,20 +14,37 @@
 MVS_NAMESPACE_BEGIN
 
 
-/** initialize mapping from SRGB to linear color space */
-void initSRGB2linear();
+/** maps an 8-bit sRGB value to linear color space in [0, 1] */
+float srgb2linear(unsigned char value);
+
+/** converts an sRGB 8-bit image to linear float colors,
+    float images are returned unchanged */
+mve::FloatImage::Ptr linearFloatImage(mve::ImageBase::Ptr img);
 
 /** interpolate color and derivative at given sample positions */
-void colAndExactDeriv(util::RefPtr<mve::ImageBase> img,
+void colAndExactDeriv(util::RefPtr<mve::ImageBase> const& img,
     PixelCoords const& imgPos, PixelCoords const& gradDir,
     Samples& color, Samples& deriv);
 
+/** interpolate color and, if gradDir and deriv are not NULL, the
+    derivative in an image of known type, specialized for 8-bit sRGB
+    and float images. The functions on mve::ImageBase dispatch to these
+    once per call, the sample loops only see the concrete type. */
+template <typename T>
+void colAndExactDeriv(mve::Image<T> const& img, PixelCoords const& imgPos,
+    PixelCoords const* gradDir, Samples* color, Samples* deriv);
+
 /** get color at given pixel positions (no interpolation) */
-void getXYZColorAtPix(util::RefPtr<mve::ImageBase> img,
+void getXYZColorAtPix(util::RefPtr<mve::ImageBase> const& img,
+    std::vector<math::Vec2i> const& imgPos, Samples* color);
+
+/** get color at given pixel positions in an image of known type */
+template <typename T>
+void getXYZColorAtPix(mve::Image<T> const& img,
     std::vector<math::Vec2i> const& imgPos, Samples* color);
 
 /** interpolate only color at given sample positions */
-void getXYZColorAtPos(util::RefPtr<mve::ImageBase> img,
+void getXYZColorAtPos(util::RefPtr<mve::ImageBase> const& img,
     PixelCoords const& imgPos, Samples* color);
 
 /** Computes the parallax between two views with respect to some 3D point p */
@@ -40,6 +57,19 @@ float parallaxToWeight(float p);
 
 /* ------------------------- Implementation ----------------------- */
 
+template <>
+void colAndExactDeriv(mve::ByteImage const& img, PixelCoords const& imgPos,
+    PixelCoords const* gradDir, Samples* color, Samples* deriv);
+template <>
+void colAndExactDeriv(mve::FloatImage const& img, PixelCoords const& imgPos,
+    PixelCoords const* gradDir, Samples* color, Samples* deriv);
+template <>
+void getXYZColorAtPix(mve::ByteImage const& img,
+    std::vector<math::Vec2i> const& imgPos, Samples* color);
+template <>
+void getXYZColorAtPix(mve::FloatImage const& img,
+    std::vector<math::Vec2i> const& imgPos, Samples* color);
+
 inline float
 parallax(math::Vec3f p, mvs::SingleViewPtr v1, mvs::SingleViewPtr v2)
 {
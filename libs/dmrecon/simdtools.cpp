@@ -0,0 +1,538 @@
+#include <cmath>
+
+#include "simdtools.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define MVS_SIMD_X86 1
+#   include <immintrin.h>
+#   define MVS_TARGET(isa) __attribute__((target(isa)))
+#else
+#   define MVS_SIMD_X86 0
+#endif
+
+MVS_NAMESPACE_BEGIN
+
+/* ------------------------------------------------------------------ */
+/* Scalar kernels, these define the reference results. */
+
+namespace
+{
+
+void
+nccTermsScalar(float const* x, float const* y, std::size_t n,
+    float* sqrDevY, float* devXY)
+{
+    float m0 = 0.f, m1 = 0.f, m2 = 0.f;
+    for (std::size_t i = 0; i < 3 * n; i += 3) {
+        m0 += y[i];
+        m1 += y[i+1];
+        m2 += y[i+2];
+    }
+    m0 /= (float) n;
+    m1 /= (float) n;
+    m2 /= (float) n;
+
+    float syy = 0.f, sxy = 0.f;
+    for (std::size_t i = 0; i < 3 * n; i += 3) {
+        float d0 = y[i] - m0;
+        float d1 = y[i+1] - m1;
+        float d2 = y[i+2] - m2;
+        syy += d0 * d0 + d1 * d1 + d2 * d2;
+        sxy += x[i] * d0 + x[i+1] * d1 + x[i+2] * d2;
+    }
+    *sqrDevY = syy;
+    *devXY = sxy;
+}
+
+/* Pixel value access, 8-bit values are mapped through a table. */
+struct Uint8Pixels
+{
+    unsigned char const* data;
+    float const* lut;
+    float operator[] (std::size_t i) const { return lut[data[i]]; }
+};
+
+struct FloatPixels
+{
+    float const* data;
+    float operator[] (std::size_t i) const { return data[i]; }
+};
+
+template <typename PIXELS>
+void
+colorAndDerivScalar(PIXELS const& img, std::size_t width,
+    float const* pos, float const* dir, std::size_t first, std::size_t n,
+    float* color, float* deriv)
+{
+    for (std::size_t i = first; i < n; ++i)
+    {
+        std::size_t left = std::floor(pos[2*i]);
+        std::size_t top = std::floor(pos[2*i+1]);
+        float x = pos[2*i] - left;
+        float y = pos[2*i+1] - top;
+
+        /* data position of upper left and lower left pixel */
+        std::size_t p0 = (top * width + left) * 3;
+        std::size_t p1 = p0 + width * 3;
+
+        for (std::size_t c = 0; c < 3; ++c) {
+            float a = img[p0 + c];
+            float b = img[p0 + 3 + c];
+            float d = img[p1 + c];
+            float e = img[p1 + 3 + c];
+            float upper = (1.f - x) * a + x * b;
+            float lower = (1.f - x) * d + x * e;
+            color[3*i+c] = (1.f - y) * upper + y * lower;
+            if (deriv == NULL)
+                continue;
+
+            /* derivative in direction dir -- see GRIS-G wiki */
+            float u = dir[2*i];
+            float v = dir[2*i+1];
+            deriv[3*i+c] = u * (b - a) + v * (d - a)
+                + (v * x + u * y) * (a - b - d + e);
+        }
+    }
+}
+
+void
+normalEquationsScalar(float const* master, float const* color,
+    float const* deriv, float const* offsetI, float const* offsetJ,
+    float const* cs, std::size_t first, std::size_t len,
+    NormalEquations* eq)
+{
+    float sum[9];
+    for (std::size_t k = 0; k < 9; ++k)
+        sum[k] = eq->lanes[k][0];
+    for (std::size_t i = first; i < len; ++i) {
+        float a = cs[i % 3] * deriv[i];
+        float b = master[i] - cs[i % 3] * color[i];
+        float aa = a * a;
+        float ab = a * b;
+        float aai = aa * offsetI[i];
+        float aaj = aa * offsetJ[i];
+        sum[0] += aa;
+        sum[1] += aai;
+        sum[2] += aaj;
+        sum[3] += aai * offsetI[i];
+        sum[4] += aai * offsetJ[i];
+        sum[5] += aaj * offsetJ[i];
+        sum[6] += ab;
+        sum[7] += ab * offsetI[i];
+        sum[8] += ab * offsetJ[i];
+    }
+    for (std::size_t k = 0; k < 9; ++k)
+        eq->lanes[k][0] = sum[k];
+}
+
+} // namespace
+
+/* ------------------------------------------------------------------ */
+/* Vectorized kernels */
+
+#if MVS_SIMD_X86
+
+namespace
+{
+
+/*
+ * The interleaved RGB samples are processed in chunks of 12 floats, a
+ * multiple of both three and the vector width, so each vector lane
+ * always sees the same color channel.
+ */
+MVS_TARGET("sse2") void
+nccTermsSSE2(float const* x, float const* y, std::size_t n,
+    float* sqrDevY, float* devXY)
+{
+    std::size_t const len = 3 * n;
+    std::size_t const vlen = len - len % 12;
+
+    /* channel sums, lane k of chunk offset j belongs to (j + k) % 3 */
+    __m128 s0 = _mm_setzero_ps(), s1 = s0, s2 = s0;
+    for (std::size_t i = 0; i < vlen; i += 12) {
+        s0 = _mm_add_ps(s0, _mm_loadu_ps(y + i));
+        s1 = _mm_add_ps(s1, _mm_loadu_ps(y + i + 4));
+        s2 = _mm_add_ps(s2, _mm_loadu_ps(y + i + 8));
+    }
+    float buf[12];
+    _mm_storeu_ps(buf, s0);
+    _mm_storeu_ps(buf + 4, s1);
+    _mm_storeu_ps(buf + 8, s2);
+    float mean[3] = { 0.f, 0.f, 0.f };
+    for (std::size_t k = 0; k < 12; ++k)
+        mean[k % 3] += buf[k];
+    for (std::size_t i = vlen; i < len; ++i)
+        mean[i % 3] += y[i];
+    for (std::size_t c = 0; c < 3; ++c)
+        mean[c] /= (float) n;
+
+    float const r = mean[0], g = mean[1], b = mean[2];
+    __m128 const m0 = _mm_setr_ps(r, g, b, r);
+    __m128 const m1 = _mm_setr_ps(g, b, r, g);
+    __m128 const m2 = _mm_setr_ps(b, r, g, b);
+
+    __m128 syy = _mm_setzero_ps(), sxy = syy;
+    for (std::size_t i = 0; i < vlen; i += 12) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(y + i), m0);
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(y + i + 4), m1);
+        __m128 d2 = _mm_sub_ps(_mm_loadu_ps(y + i + 8), m2);
+        syy = _mm_add_ps(syy, _mm_mul_ps(d0, d0));
+        syy = _mm_add_ps(syy, _mm_mul_ps(d1, d1));
+        syy = _mm_add_ps(syy, _mm_mul_ps(d2, d2));
+        sxy = _mm_add_ps(sxy, _mm_mul_ps(_mm_loadu_ps(x + i), d0));
+        sxy = _mm_add_ps(sxy, _mm_mul_ps(_mm_loadu_ps(x + i + 4), d1));
+        sxy = _mm_add_ps(sxy, _mm_mul_ps(_mm_loadu_ps(x + i + 8), d2));
+    }
+    _mm_storeu_ps(buf, syy);
+    _mm_storeu_ps(buf + 4, sxy);
+    float rsyy = (buf[0] + buf[1]) + (buf[2] + buf[3]);
+    float rsxy = (buf[4] + buf[5]) + (buf[6] + buf[7]);
+    for (std::size_t i = vlen; i < len; ++i) {
+        float d = y[i] - mean[i % 3];
+        rsyy += d * d;
+        rsxy += x[i] * d;
+    }
+    *sqrDevY = rsyy;
+    *devXY = rsxy;
+}
+
+/*
+ * Eight samples at a time: positions are split into integer and
+ * fractional parts, the 2x2 neighborhood of every channel is fetched
+ * into vectors and interpolated with the same operation order as the
+ * scalar kernel, so results are bit-identical.
+ */
+template <typename PIXELS>
+MVS_TARGET("avx2") void
+colorAndDerivAVX2(PIXELS const& img, std::size_t width,
+    float const* pos, float const* dir, std::size_t n,
+    float* color, float* deriv)
+{
+    std::size_t const vn = n - n % 8;
+    __m256 const one = _mm256_set1_ps(1.f);
+    __m256i const pairs = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+    int offset[8];
+    float a[3][8], b[3][8], d[3][8], e[3][8];
+    float col[3][8], der[3][8];
+
+    for (std::size_t i = 0; i < vn; i += 8)
+    {
+        __m256 px = _mm256_i32gather_ps(pos + 2 * i, pairs, 4);
+        __m256 py = _mm256_i32gather_ps(pos + 2 * i + 1, pairs, 4);
+        __m256 fx = _mm256_floor_ps(px);
+        __m256 fy = _mm256_floor_ps(py);
+        __m256 x = _mm256_sub_ps(px, fx);
+        __m256 y = _mm256_sub_ps(py, fy);
+        __m256i idx = _mm256_add_epi32(_mm256_mullo_epi32
+            (_mm256_cvttps_epi32(fy), _mm256_set1_epi32((int) width)),
+            _mm256_cvttps_epi32(fx));
+        _mm256_storeu_si256((__m256i*) offset, idx);
+
+        for (std::size_t k = 0; k < 8; ++k) {
+            std::size_t p0 = (std::size_t) offset[k] * 3;
+            std::size_t p1 = p0 + width * 3;
+            for (std::size_t c = 0; c < 3; ++c) {
+                a[c][k] = img[p0 + c];
+                b[c][k] = img[p0 + 3 + c];
+                d[c][k] = img[p1 + c];
+                e[c][k] = img[p1 + 3 + c];
+            }
+        }
+
+        __m256 u = _mm256_setzero_ps(), v = u, w = u;
+        if (deriv != NULL) {
+            u = _mm256_i32gather_ps(dir + 2 * i, pairs, 4);
+            v = _mm256_i32gather_ps(dir + 2 * i + 1, pairs, 4);
+            w = _mm256_add_ps(_mm256_mul_ps(v, x), _mm256_mul_ps(u, y));
+        }
+        __m256 x1 = _mm256_sub_ps(one, x);
+        __m256 y1 = _mm256_sub_ps(one, y);
+        for (std::size_t c = 0; c < 3; ++c) {
+            __m256 va = _mm256_loadu_ps(a[c]);
+            __m256 vb = _mm256_loadu_ps(b[c]);
+            __m256 vd = _mm256_loadu_ps(d[c]);
+            __m256 ve = _mm256_loadu_ps(e[c]);
+            __m256 upper = _mm256_add_ps(_mm256_mul_ps(x1, va),
+                _mm256_mul_ps(x, vb));
+            __m256 lower = _mm256_add_ps(_mm256_mul_ps(x1, vd),
+                _mm256_mul_ps(x, ve));
+            _mm256_storeu_ps(col[c], _mm256_add_ps(_mm256_mul_ps(y1, upper),
+                _mm256_mul_ps(y, lower)));
+            if (deriv == NULL)
+                continue;
+            __m256 cross = _mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps
+                (va, vb), vd), ve);
+            __m256 r = _mm256_add_ps(_mm256_add_ps(
+                _mm256_mul_ps(u, _mm256_sub_ps(vb, va)),
+                _mm256_mul_ps(v, _mm256_sub_ps(vd, va))),
+                _mm256_mul_ps(w, cross));
+            _mm256_storeu_ps(der[c], r);
+        }
+
+        for (std::size_t k = 0; k < 8; ++k)
+            for (std::size_t c = 0; c < 3; ++c)
+                color[3 * (i + k) + c] = col[c][k];
+        if (deriv != NULL)
+            for (std::size_t k = 0; k < 8; ++k)
+                for (std::size_t c = 0; c < 3; ++c)
+                    deriv[3 * (i + k) + c] = der[c][k];
+    }
+    colorAndDerivScalar(img, width, pos, dir, vn, n, color, deriv);
+}
+
+/*
+ * The terms of one vector of sample channels. Products are formed in
+ * the same order as in the scalar kernel, only the summation order
+ * differs.
+ */
+MVS_TARGET("sse2") inline void
+addNormalTermsSSE2(__m128* sum, float const* master, float const* color,
+    float const* deriv, float const* offsetI, float const* offsetJ,
+    __m128 cs)
+{
+    __m128 oi = _mm_loadu_ps(offsetI);
+    __m128 oj = _mm_loadu_ps(offsetJ);
+    __m128 a = _mm_mul_ps(cs, _mm_loadu_ps(deriv));
+    __m128 b = _mm_sub_ps(_mm_loadu_ps(master),
+        _mm_mul_ps(cs, _mm_loadu_ps(color)));
+    __m128 aa = _mm_mul_ps(a, a);
+    __m128 ab = _mm_mul_ps(a, b);
+    __m128 aai = _mm_mul_ps(aa, oi);
+    __m128 aaj = _mm_mul_ps(aa, oj);
+    sum[0] = _mm_add_ps(sum[0], aa);
+    sum[1] = _mm_add_ps(sum[1], aai);
+    sum[2] = _mm_add_ps(sum[2], aaj);
+    sum[3] = _mm_add_ps(sum[3], _mm_mul_ps(aai, oi));
+    sum[4] = _mm_add_ps(sum[4], _mm_mul_ps(aai, oj));
+    sum[5] = _mm_add_ps(sum[5], _mm_mul_ps(aaj, oj));
+    sum[6] = _mm_add_ps(sum[6], ab);
+    sum[7] = _mm_add_ps(sum[7], _mm_mul_ps(ab, oi));
+    sum[8] = _mm_add_ps(sum[8], _mm_mul_ps(ab, oj));
+}
+
+/* Chunks of 12 floats as in nccTermsSSE2(), the color scale vectors
+   repeat the channel pattern of the chunk. */
+MVS_TARGET("sse2") void
+normalEquationsSSE2(float const* master, float const* color,
+    float const* deriv, float const* offsetI, float const* offsetJ,
+    float const* cs, std::size_t n, NormalEquations* eq)
+{
+    std::size_t const len = 3 * n;
+    std::size_t const vlen = len - len % 12;
+    __m128 const c0 = _mm_setr_ps(cs[0], cs[1], cs[2], cs[0]);
+    __m128 const c1 = _mm_setr_ps(cs[1], cs[2], cs[0], cs[1]);
+    __m128 const c2 = _mm_setr_ps(cs[2], cs[0], cs[1], cs[2]);
+
+    __m128 sum[9];
+    for (std::size_t k = 0; k < 9; ++k)
+        sum[k] = _mm_loadu_ps(eq->lanes[k]);
+    for (std::size_t i = 0; i < vlen; i += 12) {
+        addNormalTermsSSE2(sum, master + i, color + i, deriv + i,
+            offsetI + i, offsetJ + i, c0);
+        addNormalTermsSSE2(sum, master + i + 4, color + i + 4, deriv + i + 4,
+            offsetI + i + 4, offsetJ + i + 4, c1);
+        addNormalTermsSSE2(sum, master + i + 8, color + i + 8, deriv + i + 8,
+            offsetI + i + 8, offsetJ + i + 8, c2);
+    }
+    for (std::size_t k = 0; k < 9; ++k)
+        _mm_storeu_ps(eq->lanes[k], sum[k]);
+    normalEquationsScalar(master, color, deriv, offsetI, offsetJ, cs,
+        vlen, len, eq);
+}
+
+MVS_TARGET("avx2") inline void
+addNormalTermsAVX2(__m256* sum, float const* master, float const* color,
+    float const* deriv, float const* offsetI, float const* offsetJ,
+    __m256 cs)
+{
+    __m256 oi = _mm256_loadu_ps(offsetI);
+    __m256 oj = _mm256_loadu_ps(offsetJ);
+    __m256 a = _mm256_mul_ps(cs, _mm256_loadu_ps(deriv));
+    __m256 b = _mm256_sub_ps(_mm256_loadu_ps(master),
+        _mm256_mul_ps(cs, _mm256_loadu_ps(color)));
+    __m256 aa = _mm256_mul_ps(a, a);
+    __m256 ab = _mm256_mul_ps(a, b);
+    __m256 aai = _mm256_mul_ps(aa, oi);
+    __m256 aaj = _mm256_mul_ps(aa, oj);
+    sum[0] = _mm256_add_ps(sum[0], aa);
+    sum[1] = _mm256_add_ps(sum[1], aai);
+    sum[2] = _mm256_add_ps(sum[2], aaj);
+    sum[3] = _mm256_add_ps(sum[3], _mm256_mul_ps(aai, oi));
+    sum[4] = _mm256_add_ps(sum[4], _mm256_mul_ps(aai, oj));
+    sum[5] = _mm256_add_ps(sum[5], _mm256_mul_ps(aaj, oj));
+    sum[6] = _mm256_add_ps(sum[6], ab);
+    sum[7] = _mm256_add_ps(sum[7], _mm256_mul_ps(ab, oi));
+    sum[8] = _mm256_add_ps(sum[8], _mm256_mul_ps(ab, oj));
+}
+
+/* Same as normalEquationsSSE2() with chunks of 24 floats. */
+MVS_TARGET("avx2") void
+normalEquationsAVX2(float const* master, float const* color,
+    float const* deriv, float const* offsetI, float const* offsetJ,
+    float const* cs, std::size_t n, NormalEquations* eq)
+{
+    std::size_t const len = 3 * n;
+    std::size_t const vlen = len - len % 24;
+    float const r = cs[0], g = cs[1], b = cs[2];
+    __m256 const c0 = _mm256_setr_ps(r, g, b, r, g, b, r, g);
+    __m256 const c1 = _mm256_setr_ps(b, r, g, b, r, g, b, r);
+    __m256 const c2 = _mm256_setr_ps(g, b, r, g, b, r, g, b);
+
+    __m256 sum[9];
+    for (std::size_t k = 0; k < 9; ++k)
+        sum[k] = _mm256_loadu_ps(eq->lanes[k]);
+    for (std::size_t i = 0; i < vlen; i += 24) {
+        addNormalTermsAVX2(sum, master + i, color + i, deriv + i,
+            offsetI + i, offsetJ + i, c0);
+        addNormalTermsAVX2(sum, master + i + 8, color + i + 8, deriv + i + 8,
+            offsetI + i + 8, offsetJ + i + 8, c1);
+        addNormalTermsAVX2(sum, master + i + 16, color + i + 16,
+            deriv + i + 16, offsetI + i + 16, offsetJ + i + 16, c2);
+    }
+    for (std::size_t k = 0; k < 9; ++k)
+        _mm256_storeu_ps(eq->lanes[k], sum[k]);
+    normalEquationsScalar(master, color, deriv, offsetI, offsetJ, cs,
+        vlen, len, eq);
+}
+
+} // namespace
+
+#endif /* MVS_SIMD_X86 */
+
+/* ------------------------------------------------------------------ */
+
+namespace
+{
+
+SimdLevel
+detectSimdLevel()
+{
+#if MVS_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SIMD_SSE2;
+#endif
+    return SIMD_SCALAR;
+}
+
+/* Selected once at program start, before any threads exist. */
+SimdLevel const supportedLevel = detectSimdLevel();
+SimdLevel activeLevel = supportedLevel;
+
+} // namespace
+
+SimdLevel
+getSupportedSimdLevel()
+{
+    return supportedLevel;
+}
+
+SimdLevel
+getSimdLevel()
+{
+    return activeLevel;
+}
+
+void
+setSimdLevel(SimdLevel level)
+{
+    activeLevel = level < supportedLevel ? level : supportedLevel;
+}
+
+char const*
+getSimdLevelName(SimdLevel level)
+{
+    switch (level)
+    {
+        case SIMD_AVX2: return "AVX2";
+        case SIMD_SSE2: return "SSE2";
+        default: return "scalar";
+    }
+}
+
+/* ------------------------------------------------------------------ */
+
+void
+nccTerms(float const* masterCentered, float const* neigh,
+    std::size_t n, float* sqrDevY, float* devXY)
+{
+#if MVS_SIMD_X86
+    /* AVX2 gives no gain over SSE2 for typical patch sizes (25 to 81
+       samples), the wider vectors only shorten an already short loop */
+    if (activeLevel >= SIMD_SSE2)
+        return nccTermsSSE2(masterCentered, neigh, n, sqrDevY, devXY);
+#endif
+    nccTermsScalar(masterCentered, neigh, n, sqrDevY, devXY);
+}
+
+void
+colorAndDerivUint8(unsigned char const* img, std::size_t width,
+    float const* lut, float const* pos, float const* dir, std::size_t n,
+    float* color, float* deriv)
+{
+    Uint8Pixels pixels;
+    pixels.data = img;
+    pixels.lut = lut;
+#if MVS_SIMD_X86
+    if (activeLevel == SIMD_AVX2)
+        return colorAndDerivAVX2(pixels, width, pos, dir, n, color, deriv);
+#endif
+    colorAndDerivScalar(pixels, width, pos, dir, 0, n, color, deriv);
+}
+
+void
+colorAndDerivFloat(float const* img, std::size_t width,
+    float const* pos, float const* dir, std::size_t n,
+    float* color, float* deriv)
+{
+    FloatPixels pixels;
+    pixels.data = img;
+#if MVS_SIMD_X86
+    if (activeLevel == SIMD_AVX2)
+        return colorAndDerivAVX2(pixels, width, pos, dir, n, color, deriv);
+#endif
+    colorAndDerivScalar(pixels, width, pos, dir, 0, n, color, deriv);
+}
+
+void
+NormalEquations::clear()
+{
+    for (std::size_t k = 0; k < 9; ++k)
+        for (std::size_t l = 0; l < 8; ++l)
+            lanes[k][l] = 0.f;
+}
+
+void
+NormalEquations::reduce(double* ata, double* atb) const
+{
+    for (std::size_t k = 0; k < 9; ++k) {
+        double sum = 0.0;
+        for (std::size_t l = 0; l < 8; ++l)
+            sum += lanes[k][l];
+        if (k < 6)
+            ata[k] = sum;
+        else
+            atb[k - 6] = sum;
+    }
+}
+
+void
+normalEquations(float const* master, float const* color,
+    float const* deriv, float const* offsetI, float const* offsetJ,
+    float const* colorScale, std::size_t n, NormalEquations* eq)
+{
+#if MVS_SIMD_X86
+    if (activeLevel == SIMD_AVX2)
+        return normalEquationsAVX2(master, color, deriv, offsetI, offsetJ,
+            colorScale, n, eq);
+    if (activeLevel == SIMD_SSE2)
+        return normalEquationsSSE2(master, color, deriv, offsetI, offsetJ,
+            colorScale, n, eq);
+#endif
+    normalEquationsScalar(master, color, deriv, offsetI, offsetJ,
+        colorScale, 0, 3 * n, eq);
+}
+
+MVS_NAMESPACE_END
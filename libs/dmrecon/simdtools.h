@@ -0,0 +1,86 @@
+#ifndef SIMDTOOLS_H
+#define SIMDTOOLS_H
+
+#include <cstddef>
+
+#include "defines.h"
+
+MVS_NAMESPACE_BEGIN
+
+/** Instruction sets the sampling kernels are available for */
+enum SimdLevel
+{
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+
+/** Returns the best instruction set supported by the CPU */
+SimdLevel getSupportedSimdLevel();
+
+/** Returns the instruction set currently used by the kernels */
+SimdLevel getSimdLevel();
+
+/** Restricts the kernels to the given instruction set (e.g. for
+    testing), levels not supported by the CPU are clamped */
+void setSimdLevel(SimdLevel level);
+
+/** Human readable name of an instruction set */
+char const* getSimdLevelName(SimdLevel level);
+
+/**
+ * Computes the NCC terms between n interleaved RGB samples of the master
+ * view, which have their mean already subtracted, and n interleaved RGB
+ * samples of a neighbor view: the squared deviation of the neighbor
+ * samples from their mean and the covariance of both.
+ */
+void nccTerms(float const* masterCentered, float const* neigh,
+    std::size_t n, float* sqrDevY, float* devXY);
+
+/**
+ * Bilinear interpolation of color and, if deriv is not NULL, the
+ * derivative along dir at n sub-pixel positions of an interleaved
+ * 3-channel 8-bit image. Values are mapped through the look-up table
+ * lut. Positions and directions are interleaved (x, y) pairs, color
+ * and deriv are interleaved RGB. Positions must be at least one pixel
+ * away from the right and bottom border.
+ */
+void colorAndDerivUint8(unsigned char const* img, std::size_t width,
+    float const* lut, float const* pos, float const* dir, std::size_t n,
+    float* color, float* deriv);
+
+/** Same as colorAndDerivUint8() for an interleaved 3-channel float
+    image without value mapping. */
+void colorAndDerivFloat(float const* img, std::size_t width,
+    float const* pos, float const* dir, std::size_t n,
+    float* color, float* deriv);
+
+/**
+ * Partial sums of the normal equations ATA * x = ATb of the depth and
+ * normal update. The sums are kept in separate vector lanes while the
+ * terms of all neighbor views are added, and only reduce() sums across
+ * the lanes.
+ */
+struct NormalEquations
+{
+    float lanes[9][8];
+
+    void clear();
+    /** Upper triangle of ATA in row order and ATb */
+    void reduce(double* ata, double* atb) const;
+};
+
+/**
+ * Adds the terms of n interleaved RGB samples of a neighbor view to eq.
+ * Each sample channel gives the row a = cs * deriv * (1, offsetI, offsetJ)
+ * and b = master - cs * color, where cs is the color scale of the channel
+ * and offsetI and offsetJ are the pixel offsets of the sample from the
+ * patch center, given per channel like the colors.
+ */
+void normalEquations(float const* master, float const* color,
+    float const* deriv, float const* offsetI, float const* offsetJ,
+    float const* colorScale, std::size_t n, NormalEquations* eq);
+
+MVS_NAMESPACE_END
+
+#endif
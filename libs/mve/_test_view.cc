@@ -1,15 +1,140 @@
+#include <algorithm>
 #include <iostream>
 
 #include "util/system.h"
 
 #include "imagefile.h"
 #include "imageexif.h"
+#include "embeddingcodec.h"
 #include "view.h"
 
 int
 main (int argc, char** argv)
 {
 #if 1
+    /* Mapped embeddings stay valid while the view is saved. */
+    {
+        mve::FloatImage::Ptr img = mve::FloatImage::create(16, 8, 2);
+        for (std::size_t i = 0; i < img->get_value_amount(); ++i)
+            img->at(i) = static_cast<float>(i);
+        mve::View::Ptr view = mve::View::create();
+        view->set_name("Mapped view");
+        view->add_image("float-pattern", img);
+        view->save_mve_file_as("/tmp/mymappedview.mve");
+
+        view = mve::View::create("/tmp/mymappedview.mve");
+        view->set_memory_mapping(true);
+        mve::MappedEmbedding::Ptr mapped
+            = view->get_mapped_embedding("float-pattern");
+        if (mapped.get() == 0 || mapped->width() != 16
+            || mapped->at<float>(3, 2, 1) != img->at(3, 2, 1))
+            std::cout << "Error: Invalid mapped embedding" << std::endl;
+
+        /* Direct-writing is disabled, the file is rebuilt. */
+        mve::FloatImage::Ptr copy = mapped->copy();
+        copy->at(0) = -1.0f;
+        view->set_image("float-pattern", copy);
+        view->save_mve_file();
+        if (mapped->at<float>(0) != 0.0f)
+            std::cout << "Error: Mapped embedding changed" << std::endl;
+        view->save_mve_file_as("/tmp/mymappedview.mve");
+        if (mapped->at<float>(0) != 0.0f)
+            std::cout << "Error: Mapped embedding changed" << std::endl;
+
+        /* Reloading keeps track of mappings in use. */
+        view->reload_mve_file();
+        mapped = view->get_mapped_embedding("float-pattern");
+        view->reload_mve_file();
+        view->set_image("float-pattern", img);
+        view->save_mve_file();
+        if (mapped->at<float>(0) != -1.0f)
+            std::cout << "Error: Mapped embedding changed" << std::endl;
+
+        view = mve::View::create("/tmp/mymappedview.mve");
+        if (view->get_float_image("float-pattern")->at(0) != 0.0f)
+            std::cout << "Error: Modified embedding not saved" << std::endl;
+    }
+
+    /* Compressed embeddings are restored exactly. */
+    {
+        mve::FloatImage::Ptr depth = mve::FloatImage::create(64, 48, 1);
+        for (std::size_t y = 0; y < depth->height(); ++y)
+            for (std::size_t x = 0; x < depth->width(); ++x)
+                depth->at(x, y, 0) = x < 20 ? 0.0f : 1.0f + 0.01f * (x + y);
+        mve::ByteImage::Ptr data = mve::ByteImage::create(100, 1, 1);
+        for (std::size_t i = 0; i < data->get_value_amount(); ++i)
+            data->at(i) = static_cast<unsigned char>(i / 10);
+        mve::View::Ptr view = mve::View::create();
+        view->set_name("Compressed view");
+        view->add_image("depth", depth);
+        view->add_data("data", data);
+        view->add_image("raw", depth->duplicate());
+        view->set_embedding_codec("depth", MVE_CODEC_DELTA_LZ);
+        view->set_embedding_codec("data", MVE_CODEC_DELTA_LZ);
+        view->save_mve_file_as("/tmp/mycompressedview.mve");
+        if (view->get_proxy("depth")->file_size >= depth->get_byte_size())
+            std::cout << "Error: Embedding not compressed" << std::endl;
+
+        for (int mapping = 0; mapping < 2; ++mapping)
+        {
+            view = mve::View::create("/tmp/mycompressedview.mve");
+            view->set_memory_mapping(mapping);
+            mve::FloatImage::Ptr depth2 = view->get_float_image("depth");
+            mve::ByteImage::Ptr data2 = view->get_data("data");
+            if (!std::equal(depth->begin(), depth->end(), depth2->begin())
+                || !std::equal(data->begin(), data->end(), data2->begin()))
+                std::cout << "Error: Invalid compressed data" << std::endl;
+            if (view->get_mapped_embedding("depth").get()
+                || !view->get_mapped_embedding("raw").get())
+                std::cout << "Error: Invalid mapped embedding" << std::endl;
+        }
+
+        /* Uncompressing an embedding that is not loaded. */
+        view->cache_cleanup();
+        view->set_embedding_codec("depth", "");
+        view->save_mve_file();
+        view = mve::View::create("/tmp/mycompressedview.mve");
+        if (!view->get_proxy("depth")->codec.empty()
+            || view->get_float_image("depth")->at(30, 5, 0)
+            != depth->at(30, 5, 0))
+            std::cout << "Error: Embedding not uncompressed" << std::endl;
+    }
+
+    /* Reserved images are written in regions without loading them. */
+    {
+        mve::View::Ptr view = mve::View::create();
+        view->set_name("Reserved view");
+        view->reserve_image("depth", 32, 16, 2, "float");
+        view->save_mve_file_as("/tmp/myreservedview.mve");
+        if (view->get_byte_size() != 0)
+            std::cout << "Error: Reserved image allocated" << std::endl;
+
+        mve::FloatImage::Ptr region = mve::FloatImage::create(4, 3, 2);
+        for (std::size_t i = 0; i < region->get_value_amount(); ++i)
+            region->at(i) = static_cast<float>(i + 1);
+        view->write_image_region("depth", 10, 5, region);
+        mve::MappedEmbedding::Ptr mapped = view->get_mapped_embedding("depth");
+        if (mapped.get() == 0 || mapped->at<float>(10, 5, 0) != 1.0f
+            || mapped->at<float>(13, 7, 1) != region->at(3, 2, 1)
+            || mapped->at<float>(14, 7, 0) != 0.0f)
+            std::cout << "Error: Invalid image region" << std::endl;
+
+        try
+        {
+            view->write_image_region("depth", 30, 5, region);
+            std::cout << "Error: Region outside of image" << std::endl;
+        }
+        catch (util::Exception&)
+        {
+        }
+
+        view = mve::View::create("/tmp/myreservedview.mve");
+        mve::FloatImage::Ptr depth = view->get_float_image("depth");
+        if (depth->at(11, 6, 1) != region->at(1, 1, 1)
+            || depth->at(0, 0, 0) != 0.0f)
+            std::cout << "Error: Image region not saved" << std::endl;
+    }
+
     /* Provoke view corruption. */
 
     /*
@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <cstring>
 #include <cerrno>
+#include <iterator>
 #include <iostream>
 #include <fstream>
 
@@ -92,6 +94,7 @@ BundleFile::read_bundle_intern (std::string const& filename)
     util::string::clip(this->version);
 
     /* Read number of cameras and number of points. */
+    this->invalidate_view_features();
     this->num_valid_cams = 0;
     std::size_t num_cameras(0), num_points(0);
     in >> num_cameras >> num_points;
@@ -276,6 +279,7 @@ BundleFile::delete_camera (std::size_t index)
             else
                 iter++;
     }
+    this->invalidate_view_features();
 }
 
 /* -------------------------------------------------------------- */
@@ -288,11 +292,105 @@ BundleFile::get_byte_size (void) const
     ret += this->points.capacity() * sizeof(FeaturePoint);
     for (std::size_t i = 0; i < this->points.size(); ++i)
         ret += this->points[i].refs.capacity() * sizeof(FeaturePointRef);
+    ret += this->view_features.capacity() * sizeof(FeatureIndices);
+    for (std::size_t i = 0; i < this->view_features.size(); ++i)
+        ret += this->view_features[i].capacity() * sizeof(std::size_t);
     return ret;
 }
 
 /* -------------------------------------------------------------- */
 
+void
+BundleFile::build_view_features (void) const
+{
+    /* Count references per camera to allocate each list only once. */
+    std::vector<std::size_t> counts(this->cameras.size(), 0);
+    for (std::size_t i = 0; i < this->points.size(); ++i)
+    {
+        std::vector<FeaturePointRef> const& refs(this->points[i].refs);
+        for (std::size_t j = 0; j < refs.size(); ++j)
+        {
+            if (refs[j].img_id < 0)
+                continue;
+            std::size_t id = refs[j].img_id;
+            if (id >= counts.size())
+                counts.resize(id + 1, 0);
+            counts[id] += 1;
+        }
+    }
+
+    /* Points are visited in order, thus every list is sorted. */
+    this->view_features.clear();
+    this->view_features.resize(counts.size());
+    for (std::size_t i = 0; i < counts.size(); ++i)
+        this->view_features[i].reserve(counts[i]);
+    for (std::size_t i = 0; i < this->points.size(); ++i)
+    {
+        std::vector<FeaturePointRef> const& refs(this->points[i].refs);
+        for (std::size_t j = 0; j < refs.size(); ++j)
+        {
+            if (refs[j].img_id < 0)
+                continue;
+            FeatureIndices& list(this->view_features[refs[j].img_id]);
+            /* Guard against a point referencing a camera twice. */
+            if (list.empty() || list.back() != i)
+                list.push_back(i);
+        }
+    }
+    this->view_features_valid = true;
+}
+
+/* -------------------------------------------------------------- */
+
+BundleFile::FeatureIndices const&
+BundleFile::get_view_features (std::size_t cam_id) const
+{
+    static FeatureIndices const empty;
+
+    util::AtomicMutex<int> lock(this->view_features_mutex);
+    if (!this->view_features_valid)
+        this->build_view_features();
+    lock.release();
+
+    if (cam_id >= this->view_features.size())
+        return empty;
+    return this->view_features[cam_id];
+}
+
+/* -------------------------------------------------------------- */
+
+void
+BundleFile::get_common_features (std::size_t cam1, std::size_t cam2,
+    FeatureIndices* result) const
+{
+    FeatureIndices const& list1(this->get_view_features(cam1));
+    FeatureIndices const& list2(this->get_view_features(cam2));
+    result->clear();
+    std::set_intersection(list1.begin(), list1.end(),
+        list2.begin(), list2.end(), std::back_inserter(*result));
+}
+
+/* -------------------------------------------------------------- */
+
+void
+BundleFile::get_features_union (std::vector<std::size_t> const& cam_ids,
+    FeatureIndices* result) const
+{
+    result->clear();
+    FeatureIndices merged;
+    for (std::size_t i = 0; i < cam_ids.size(); ++i)
+    {
+        FeatureIndices const& list(this->get_view_features(cam_ids[i]));
+        merged.clear();
+        merged.reserve(result->size() + list.size());
+        std::set_union(result->begin(), result->end(),
+            list.begin(), list.end(), std::back_inserter(merged));
+        std::swap(*result, merged);
+    }
+}
+
+/* -------------------------------------------------------------- */
+
 TriangleMesh::Ptr
 BundleFile::get_points_mesh (int cam_id) const
 {
@@ -13,6 +13,7 @@
 #include <vector>
 
 #include "util/refptr.h"
+#include "util/atomic.h"
 
 #include "defines.h"
 #include "camera.h"
@@ -65,6 +66,7 @@ public:
     typedef util::RefPtr<BundleFile const> ConstPtr;
     typedef std::vector<CameraInfo> BundleCameras;
     typedef std::vector<FeaturePoint> FeaturePoints;
+    typedef std::vector<std::size_t> FeatureIndices;
 
 private:
     std::string version;
@@ -73,8 +75,14 @@ private:
     BundleFormat format;
     std::size_t num_valid_cams;
 
+    /* Inverted index from camera ID to sorted feature indices. */
+    mutable std::vector<FeatureIndices> view_features;
+    mutable bool view_features_valid;
+    mutable util::Atomic<int> view_features_mutex;
+
 private:
     void read_bundle_intern (std::string const& filename);
+    void build_view_features (void) const;
 
 public:
     BundleFile (void);
@@ -121,6 +129,26 @@ public:
     /** Returns the list of feature points. */
     FeaturePoints& get_points (void);
 
+    /**
+     * Returns the sorted indices of all feature points seen by the given
+     * camera. An inverted index over all points is built on first use,
+     * which is thread safe. The index is dropped by the modifying
+     * functions of this class; after changing the feature points through
+     * the non-const accessors, call invalidate_view_features().
+     */
+    FeatureIndices const& get_view_features (std::size_t cam_id) const;
+
+    /** Stores the sorted indices of features seen by both cameras. */
+    void get_common_features (std::size_t cam1, std::size_t cam2,
+        FeatureIndices* result) const;
+
+    /** Stores the sorted indices of features seen by any of the cameras. */
+    void get_features_union (std::vector<std::size_t> const& cam_ids,
+        FeatureIndices* result) const;
+
+    /** Drops the inverted index, it is rebuilt on the next request. */
+    void invalidate_view_features (void);
+
     /** Returns the amount of cameras. */
     std::size_t get_num_cameras (void) const;
     /** Returns the amount of valid cameras. */
@@ -144,6 +172,8 @@ public:
 inline
 BundleFile::BundleFile (void)
     : num_valid_cams(0)
+    , view_features_valid(false)
+    , view_features_mutex(0)
 {
 }
 
@@ -201,6 +231,15 @@ BundleFile::clear (void)
     this->version.clear();
     this->cameras.clear();
     this->points.clear();
+    this->invalidate_view_features();
+}
+
+inline void
+BundleFile::invalidate_view_features (void)
+{
+    util::AtomicMutex<int> lock(this->view_features_mutex);
+    this->view_features.clear();
+    this->view_features_valid = false;
 }
 
 inline BundleFormat
@@ -0,0 +1,164 @@
+#include "util/threadlocks.h"
+
+#include "view.h"
+#include "embeddingcache.h"
+
+MVE_NAMESPACE_BEGIN
+
+void
+EmbeddingCache::set_budget (std::size_t budget)
+{
+    util::MutexLock lock(this->mutex);
+    this->stats.budget = budget;
+    this->enforce_budget();
+}
+
+/* ---------------------------------------------------------------- */
+
+EmbeddingCache::Stats
+EmbeddingCache::get_stats (void)
+{
+    util::MutexLock lock(this->mutex);
+    Stats ret(this->stats);
+    ret.entries = this->entries.size();
+    return ret;
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+EmbeddingCache::reset_counters (void)
+{
+    util::MutexLock lock(this->mutex);
+    this->stats.hits = 0;
+    this->stats.misses = 0;
+    this->stats.evictions = 0;
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+EmbeddingCache::access (View* view, std::string const& name,
+    bool loaded, std::size_t bytes)
+{
+    util::MutexLock lock(this->mutex);
+    EntryMap::iterator iter = this->entries.find(EntryKey(view, name));
+
+    if (!loaded)
+    {
+        this->stats.hits += 1;
+        /* Embeddings loaded before the view was attached are not tracked. */
+        if (iter != this->entries.end())
+            this->lru.splice(this->lru.begin(), this->lru, iter->second);
+        return;
+    }
+
+    this->stats.misses += 1;
+    this->add_entry(view, name, bytes);
+    this->enforce_budget();
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+EmbeddingCache::insert (View* view, std::string const& name,
+    std::size_t bytes)
+{
+    util::MutexLock lock(this->mutex);
+    this->add_entry(view, name, bytes);
+    this->enforce_budget();
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+EmbeddingCache::update_view (View const* view, ByteSizes const& loaded)
+{
+    util::MutexLock lock(this->mutex);
+    EntryMap::iterator iter = this->entries.lower_bound
+        (EntryKey(view, std::string()));
+    while (iter != this->entries.end() && iter->first.first == view)
+    {
+        EntryMap::iterator current = iter++;
+        ByteSizes::const_iterator size = loaded.find(current->first.second);
+        if (size == loaded.end())
+        {
+            this->remove_entry(current);
+            continue;
+        }
+        this->stats.bytes += size->second - current->second->bytes;
+        current->second->bytes = size->second;
+    }
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+EmbeddingCache::remove_view (View const* view)
+{
+    util::MutexLock lock(this->mutex);
+    EntryMap::iterator iter = this->entries.lower_bound
+        (EntryKey(view, std::string()));
+    while (iter != this->entries.end() && iter->first.first == view)
+        this->remove_entry(iter++);
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+EmbeddingCache::add_entry (View* view, std::string const& name,
+    std::size_t bytes)
+{
+    EntryMap::iterator iter = this->entries.find(EntryKey(view, name));
+    if (iter != this->entries.end())
+        this->remove_entry(iter);
+
+    Entry entry;
+    entry.view = view;
+    entry.name = name;
+    entry.bytes = bytes;
+    this->lru.push_front(entry);
+    this->entries[EntryKey(view, name)] = this->lru.begin();
+    this->stats.bytes += bytes;
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+EmbeddingCache::remove_entry (EntryMap::iterator iter)
+{
+    this->stats.bytes -= iter->second->bytes;
+    this->lru.erase(iter->second);
+    this->entries.erase(iter);
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+EmbeddingCache::enforce_budget (void)
+{
+    if (this->stats.budget == 0)
+        return;
+
+    /* Walk from the least recently used entry, skipping busy embeddings. */
+    EntryList::iterator iter = this->lru.end();
+    while (this->stats.bytes > this->stats.budget
+        && iter != this->lru.begin())
+    {
+        --iter;
+        Entry const& entry(*iter);
+        View::EvictResult result = entry.view->evict_embedding(entry.name);
+        if (result == View::EVICT_BUSY)
+            continue;
+
+        if (result == View::EVICT_RELEASED)
+            this->stats.evictions += 1;
+        EntryList::iterator next = iter;
+        ++next;
+        this->remove_entry(this->entries.find(EntryKey(entry.view,
+            entry.name)));
+        iter = next;
+    }
+}
+
+MVE_NAMESPACE_END
@@ -0,0 +1,150 @@
+/*
+ * Memory budget for the embeddings of many views.
+ *
+ * The cache keeps track of all embeddings that views load from their
+ * files or that are set on views, and evicts the least recently used ones
+ * if the memory budget is exceeded. Only clean embeddings that are not
+ * referenced outside of the view are evicted; dirty embeddings and
+ * embeddings in use are skipped.
+ *
+ * Locking: The cache lock is always acquired before the lock of a view.
+ * Views never call into the cache while holding their own lock. While
+ * holding its lock, the cache only tries to lock views and skips busy
+ * ones, so it never waits for a view that is being saved.
+ */
+
+#ifndef MVE_EMBEDDING_CACHE_HEADER
+#define MVE_EMBEDDING_CACHE_HEADER
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "util/refptr.h"
+#include "util/thread.h"
+
+#include "defines.h"
+
+MVE_NAMESPACE_BEGIN
+
+class View;
+
+/**
+ * Scene-wide LRU cache for view embeddings with a memory budget.
+ * Views report embedding accesses to the cache they are attached to,
+ * see View::set_cache().
+ */
+class EmbeddingCache
+{
+public:
+    typedef util::RefPtr<EmbeddingCache> Ptr;
+    /** Memory of the loaded embeddings of a view by name. */
+    typedef std::map<std::string, std::size_t> ByteSizes;
+
+    /** Cache statistics. */
+    struct Stats
+    {
+        std::size_t hits; ///< Accesses to loaded embeddings
+        std::size_t misses; ///< Accesses that loaded the embedding
+        std::size_t evictions; ///< Embeddings released by the cache
+        std::size_t entries; ///< Tracked loaded embeddings
+        std::size_t bytes; ///< Memory of tracked embeddings
+        std::size_t budget; ///< Memory budget, 0 means unlimited
+
+        Stats (void);
+    };
+
+private:
+    typedef std::pair<View const*, std::string> EntryKey;
+    struct Entry
+    {
+        View* view;
+        std::string name;
+        std::size_t bytes;
+    };
+    typedef std::list<Entry> EntryList; ///< Most recently used first
+    typedef std::map<EntryKey, EntryList::iterator> EntryMap;
+
+private:
+    EntryList lru;
+    EntryMap entries;
+    Stats stats;
+    util::Mutex mutex;
+
+private:
+    EmbeddingCache (std::size_t budget);
+    EmbeddingCache (EmbeddingCache const& other);
+    EmbeddingCache& operator= (EmbeddingCache const& other);
+
+    void add_entry (View* view, std::string const& name, std::size_t bytes);
+    void remove_entry (EntryMap::iterator iter);
+    void enforce_budget (void);
+
+public:
+    /** Creates a cache with the given budget in bytes, 0 is unlimited. */
+    static Ptr create (std::size_t budget = 0);
+
+    /** Sets the memory budget in bytes and evicts embeddings if needed. */
+    void set_budget (std::size_t budget);
+    /** Returns the statistics of the cache. */
+    Stats get_stats (void);
+    /** Resets hit, miss and eviction counters. */
+    void reset_counters (void);
+
+    /**
+     * Records an access to an embedding of the view. 'loaded' indicates
+     * that the embedding has been loaded from file with the given size.
+     * This may evict other embeddings and must not be called while the
+     * lock of the view is held.
+     */
+    void access (View* view, std::string const& name,
+        bool loaded, std::size_t bytes);
+
+    /**
+     * Tracks an embedding that has been set on the view rather than
+     * loaded, such that it counts against the budget. This may evict
+     * other embeddings and must not be called while the lock of the
+     * view is held.
+     */
+    void insert (View* view, std::string const& name, std::size_t bytes);
+
+    /**
+     * Re-checks all entries of the view against the memory of its loaded
+     * embeddings, dropping entries of embeddings that the view released
+     * itself and updating the memory of replaced embeddings.
+     */
+    void update_view (View const* view, ByteSizes const& loaded);
+
+    /** Forgets all entries of the view, e.g. when the view is deleted. */
+    void remove_view (View const* view);
+};
+
+/* ---------------------------------------------------------------- */
+
+inline
+EmbeddingCache::Stats::Stats (void)
+    : hits(0)
+    , misses(0)
+    , evictions(0)
+    , entries(0)
+    , bytes(0)
+    , budget(0)
+{
+}
+
+inline
+EmbeddingCache::EmbeddingCache (std::size_t budget)
+{
+    this->stats.budget = budget;
+}
+
+inline EmbeddingCache::Ptr
+EmbeddingCache::create (std::size_t budget)
+{
+    return Ptr(new EmbeddingCache(budget));
+}
+
+MVE_NAMESPACE_END
+
+#endif /* MVE_EMBEDDING_CACHE_HEADER */
@@ -0,0 +1,287 @@
+#include <cstring>
+#include <stdexcept>
+#include <stdint.h>
+
+#include "util/exception.h"
+
+#include "embeddingcodec.h"
+
+/* Shortest match of the LZ77 coder. */
+#define CODEC_MIN_MATCH 4
+/* Size of the hash table of the LZ77 coder in bits. */
+#define CODEC_HASH_BITS 16
+
+MVE_NAMESPACE_BEGIN
+
+namespace
+{
+    /*
+     * Replaces the values with the zig-zag coded difference to the
+     * previous value of the channel and writes byte b of each value
+     * to plane b of the output.
+     */
+    template <typename T>
+    void
+    delta_shuffle (char const* data, std::size_t num_values,
+        std::size_t channels, unsigned char* out)
+    {
+        int const bits = 8 * sizeof(T);
+        std::vector<T> values(num_values);
+        std::memcpy(&values[0], data, num_values * sizeof(T));
+        for (std::size_t i = num_values; i-- > channels;)
+            values[i] = T(values[i] - values[i - channels]);
+        for (std::size_t i = 0; i < num_values; ++i)
+            values[i] = T(T(values[i] << 1)
+                ^ T(T(0) - T(values[i] >> (bits - 1))));
+        for (std::size_t b = 0; b < sizeof(T); ++b)
+        {
+            unsigned char* plane = out + b * num_values;
+            for (std::size_t i = 0; i < num_values; ++i)
+                plane[i] = static_cast<unsigned char>(values[i] >> (8 * b));
+        }
+    }
+
+    /* Inverse of delta_shuffle(). */
+    template <typename T>
+    void
+    unshuffle_delta (unsigned char const* planes, std::size_t num_values,
+        std::size_t channels, char* out)
+    {
+        std::vector<T> values(num_values);
+        for (std::size_t i = 0; i < num_values; ++i)
+        {
+            T zigzag = 0;
+            for (std::size_t b = 0; b < sizeof(T); ++b)
+                zigzag = T(zigzag
+                    | T(T(planes[b * num_values + i]) << (8 * b)));
+            values[i] = T(T(zigzag >> 1) ^ T(T(0) - T(zigzag & 1)));
+        }
+        for (std::size_t i = channels; i < num_values; ++i)
+            values[i] = T(values[i] + values[i - channels]);
+        std::memcpy(out, &values[0], num_values * sizeof(T));
+    }
+
+    /* ------------------------------------------------------------ */
+
+    void
+    put_varint (std::size_t value, std::vector<char>* out)
+    {
+        while (value >= 0x80)
+        {
+            out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out->push_back(static_cast<char>(value));
+    }
+
+    std::size_t
+    varint_size (std::size_t value)
+    {
+        std::size_t size = 1;
+        for (; value >= 0x80; value >>= 7)
+            size += 1;
+        return size;
+    }
+
+    std::size_t
+    get_varint (unsigned char const** in, unsigned char const* end)
+    {
+        std::size_t value = 0;
+        for (int shift = 0; shift < int(8 * sizeof(std::size_t)); shift += 7)
+        {
+            if (*in == end)
+                break;
+            unsigned char byte = *(*in)++;
+            value |= std::size_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return value;
+        }
+        throw util::Exception("Corrupt compressed embedding");
+    }
+
+    /*
+     * The LZ77 stream is a sequence of literal runs and matches: The
+     * length of the literal run, the literals, and unless the output is
+     * complete, the length of the match minus CODEC_MIN_MATCH and the
+     * distance to the match. All numbers are coded as varints.
+     */
+    void
+    lz_encode (unsigned char const* in, std::size_t size,
+        std::vector<char>* out)
+    {
+        /* Positions plus one of recent sequences, 0 is empty. */
+        std::vector<std::size_t> table(1 << CODEC_HASH_BITS, 0);
+        std::size_t anchor = 0;
+        std::size_t pos = 0;
+        while (pos + CODEC_MIN_MATCH <= size)
+        {
+            uint32_t seq;
+            std::memcpy(&seq, in + pos, sizeof(seq));
+            uint32_t hash = (seq * 2654435761u) >> (32 - CODEC_HASH_BITS);
+            std::size_t match = table[hash];
+            table[hash] = pos + 1;
+            if (match == 0 || std::memcmp(in + match - 1, in + pos,
+                CODEC_MIN_MATCH) != 0)
+            {
+                /* Skip faster through incompressible data. */
+                pos += 1 + ((pos - anchor) >> 6);
+                continue;
+            }
+
+            match -= 1;
+            std::size_t len = CODEC_MIN_MATCH;
+            while (pos + len < size && in[match + len] == in[pos + len])
+                len += 1;
+
+            /* Short distant matches cost more than the literals. */
+            if (len <= 2 + varint_size(pos - match))
+            {
+                pos += 1;
+                continue;
+            }
+
+            put_varint(pos - anchor, out);
+            out->insert(out->end(), in + anchor, in + pos);
+            put_varint(len - CODEC_MIN_MATCH, out);
+            put_varint(pos - match, out);
+            pos += len;
+            anchor = pos;
+        }
+
+        put_varint(size - anchor, out);
+        out->insert(out->end(), in + anchor, in + size);
+    }
+
+    void
+    lz_decode (unsigned char const* in, std::size_t size,
+        unsigned char* out, std::size_t out_size)
+    {
+        unsigned char const* in_end = in + size;
+        unsigned char* op = out;
+        unsigned char* out_end = out + out_size;
+        while (true)
+        {
+            std::size_t num_literals = get_varint(&in, in_end);
+            if (num_literals > std::size_t(in_end - in)
+                || num_literals > std::size_t(out_end - op))
+                throw util::Exception("Corrupt compressed embedding");
+            std::memcpy(op, in, num_literals);
+            in += num_literals;
+            op += num_literals;
+            if (op == out_end)
+                break;
+
+            std::size_t len = get_varint(&in, in_end) + CODEC_MIN_MATCH;
+            std::size_t dist = get_varint(&in, in_end);
+            if (dist == 0 || dist > std::size_t(op - out)
+                || len > std::size_t(out_end - op))
+                throw util::Exception("Corrupt compressed embedding");
+
+            unsigned char const* match = op - dist;
+            if (dist >= len)
+                std::memcpy(op, match, len);
+            else
+                for (std::size_t i = 0; i < len; ++i)
+                    op[i] = match[i];
+            op += len;
+        }
+
+        if (in != in_end)
+            throw util::Exception("Corrupt compressed embedding");
+    }
+
+    /* ------------------------------------------------------------ */
+
+    void
+    check_layout (std::size_t size, std::size_t value_size,
+        std::size_t channels)
+    {
+        if (value_size != 1 && value_size != 2
+            && value_size != 4 && value_size != 8)
+            throw std::invalid_argument("Invalid value size");
+        if (channels == 0 || size % value_size != 0)
+            throw std::invalid_argument("Invalid embedding layout");
+    }
+}
+
+/* ---------------------------------------------------------------- */
+
+bool
+codec_is_supported (std::string const& codec)
+{
+    return codec == MVE_CODEC_DELTA_LZ;
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+codec_encode (std::string const& codec, char const* data, std::size_t size,
+    std::size_t value_size, std::size_t channels, std::vector<char>* out)
+{
+    if (!codec_is_supported(codec))
+        throw util::Exception("Unsupported codec: ", codec);
+    check_layout(size, value_size, channels);
+
+    std::vector<unsigned char> planes(size);
+    std::size_t const num_values = size / value_size;
+    if (num_values == 0)
+    {
+        lz_encode(0, 0, out);
+        return;
+    }
+    switch (value_size)
+    {
+        case 1: delta_shuffle<uint8_t>(data, num_values, channels,
+            &planes[0]); break;
+        case 2: delta_shuffle<uint16_t>(data, num_values, channels,
+            &planes[0]); break;
+        case 4: delta_shuffle<uint32_t>(data, num_values, channels,
+            &planes[0]); break;
+        default: delta_shuffle<uint64_t>(data, num_values, channels,
+            &planes[0]); break;
+    }
+
+    /* Incompressible data is stored as a single literal run. */
+    std::size_t const start = out->size();
+    out->reserve(start + size / 2);
+    lz_encode(&planes[0], size, out);
+    if (out->size() - start > size + varint_size(size))
+    {
+        out->resize(start);
+        put_varint(size, out);
+        out->insert(out->end(), planes.begin(), planes.end());
+    }
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+codec_decode (std::string const& codec, char const* data, std::size_t size,
+    std::size_t value_size, std::size_t channels,
+    char* out, std::size_t out_size)
+{
+    if (!codec_is_supported(codec))
+        throw util::Exception("Unsupported codec: ", codec);
+    check_layout(out_size, value_size, channels);
+
+    std::vector<unsigned char> planes(out_size);
+    lz_decode(reinterpret_cast<unsigned char const*>(data), size,
+        planes.empty() ? 0 : &planes[0], out_size);
+
+    std::size_t const num_values = out_size / value_size;
+    if (num_values == 0)
+        return;
+    switch (value_size)
+    {
+        case 1: unshuffle_delta<uint8_t>(&planes[0], num_values, channels,
+            out); break;
+        case 2: unshuffle_delta<uint16_t>(&planes[0], num_values, channels,
+            out); break;
+        case 4: unshuffle_delta<uint32_t>(&planes[0], num_values, channels,
+            out); break;
+        default: unshuffle_delta<uint64_t>(&planes[0], num_values, channels,
+            out); break;
+    }
+}
+
+MVE_NAMESPACE_END
@@ -0,0 +1,54 @@
+/*
+ * Lossless compression of view embeddings.
+ *
+ * The "delta-lz" codec predicts each value from the previous value of
+ * the same channel and stores the zig-zag coded difference of the bit
+ * patterns. The bytes of the differences are grouped by significance,
+ * such that smooth maps produce long runs of zero bytes, and the result
+ * is compressed with a simple LZ77 coder. Empty regions of depth maps
+ * and the high bytes of smooth float values compress very well, noisy
+ * low bytes are stored as literals with little overhead.
+ *
+ * The values are interpreted in the byte order of the machine, just like
+ * uncompressed embeddings are stored.
+ */
+
+#ifndef MVE_EMBEDDING_CODEC_HEADER
+#define MVE_EMBEDDING_CODEC_HEADER
+
+#include <string>
+#include <vector>
+
+#include "defines.h"
+
+/* Name of the delta prediction and LZ77 codec. */
+#define MVE_CODEC_DELTA_LZ "delta-lz"
+
+MVE_NAMESPACE_BEGIN
+
+/** Returns true if the codec is known. */
+bool
+codec_is_supported (std::string const& codec);
+
+/**
+ * Compresses 'size' bytes of embedding data with the codec. The data
+ * consists of values of 'value_size' bytes (1, 2, 4 or 8) with 'channels'
+ * interleaved channels. The compressed data is appended to 'out'.
+ */
+void
+codec_encode (std::string const& codec, char const* data, std::size_t size,
+    std::size_t value_size, std::size_t channels, std::vector<char>* out);
+
+/**
+ * Decompresses 'size' bytes of compressed data to exactly 'out_size'
+ * bytes at 'out'. The value size and channels must be the same as for
+ * compression. Throws if the compressed data is corrupt.
+ */
+void
+codec_decode (std::string const& codec, char const* data, std::size_t size,
+    std::size_t value_size, std::size_t channels,
+    char* out, std::size_t out_size);
+
+MVE_NAMESPACE_END
+
+#endif /* MVE_EMBEDDING_CODEC_HEADER */
@@ -0,0 +1,150 @@
+#include <exception>
+
+#include "util/threadlocks.h"
+
+#include "embeddingprefetcher.h"
+
+MVE_NAMESPACE_BEGIN
+
+void
+PrefetchHandle::finish (ImageBase::Ptr image, std::string const& error)
+{
+    util::MutexLock lock(this->mutex);
+    if (image.get())
+        this->images.push_back(image);
+    if (!error.empty() && this->error.empty())
+        this->error = error;
+    this->pending -= 1;
+    bool done = (this->pending == 0);
+    lock.unlock();
+
+    if (done)
+        this->finished.post();
+}
+
+/* ---------------------------------------------------------------- */
+
+std::size_t
+PrefetchHandle::num_pending (void) const
+{
+    util::MutexLock lock(this->mutex);
+    return this->pending;
+}
+
+/* ---------------------------------------------------------------- */
+
+std::string
+PrefetchHandle::get_error (void)
+{
+    util::MutexLock lock(this->mutex);
+    return this->error;
+}
+
+/* ---------------------------------------------------------------- */
+
+EmbeddingPrefetcher::EmbeddingPrefetcher (std::size_t num_threads)
+    : queue_size(0)
+{
+    for (std::size_t i = 0; i < num_threads; ++i)
+    {
+        this->workers.push_back(new Worker(this));
+        this->workers.back()->pt_create();
+    }
+}
+
+/* ---------------------------------------------------------------- */
+
+EmbeddingPrefetcher::~EmbeddingPrefetcher (void)
+{
+    /* Cancel pending requests, an empty queue stops the workers. */
+    std::deque<Request> canceled;
+    util::MutexLock lock(this->queue_mutex);
+    std::swap(canceled, this->queue);
+    lock.unlock();
+    for (std::size_t i = 0; i < canceled.size(); ++i)
+        canceled[i].handle->finish(ImageBase::Ptr(), "Prefetching canceled");
+
+    for (std::size_t i = 0; i < this->workers.size(); ++i)
+        this->queue_size.post();
+    for (std::size_t i = 0; i < this->workers.size(); ++i)
+    {
+        this->workers[i]->pt_join();
+        delete this->workers[i];
+    }
+}
+
+/* ---------------------------------------------------------------- */
+
+PrefetchHandle::Ptr
+EmbeddingPrefetcher::prefetch (std::vector<View::Ptr> const& views,
+    std::vector<std::string> const& names)
+{
+    std::vector<Request> requests;
+    for (std::size_t i = 0; i < views.size(); ++i)
+    {
+        if (!views[i].get())
+            continue;
+        for (std::size_t j = 0; j < names.size(); ++j)
+        {
+            if (!views[i]->has_embedding(names[j]))
+                continue;
+            Request request;
+            request.view = views[i];
+            request.name = names[j];
+            requests.push_back(request);
+        }
+    }
+
+    PrefetchHandle::Ptr handle(new PrefetchHandle(requests.size()));
+    util::MutexLock lock(this->queue_mutex);
+    for (std::size_t i = 0; i < requests.size(); ++i)
+    {
+        requests[i].handle = handle;
+        this->queue.push_back(requests[i]);
+    }
+    lock.unlock();
+    for (std::size_t i = 0; i < requests.size(); ++i)
+        this->queue_size.post();
+
+    return handle;
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+EmbeddingPrefetcher::process_requests (void)
+{
+    while (true)
+    {
+        this->queue_size.wait();
+        util::MutexLock lock(this->queue_mutex);
+        if (this->queue.empty())
+            break;
+        Request request(this->queue.front());
+        this->queue.pop_front();
+        lock.unlock();
+
+        ImageBase::Ptr image;
+        std::string error;
+        try
+        {
+            image = request.view->get_embedding(request.name);
+        }
+        catch (std::exception& e)
+        {
+            error = request.view->get_filename() + ": " + e.what();
+        }
+        request.handle->finish(image, error);
+    }
+}
+
+/* ---------------------------------------------------------------- */
+
+void*
+EmbeddingPrefetcher::Worker::run (void)
+{
+    this->prefetcher->process_requests();
+    return 0;
+}
+
+MVE_NAMESPACE_END
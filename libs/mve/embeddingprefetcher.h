@@ -0,0 +1,159 @@
+/*
+ * Asynchronous loading of view embeddings.
+ *
+ * Embeddings that will be needed soon are loaded by background I/O
+ * threads while the caller computes. The embeddings are loaded through
+ * View::get_embedding(), i.e. they end up cached in the view and are
+ * reported to the embedding cache of the view. A later request for the
+ * embedding either finds it loaded or blocks until the view has finished
+ * the outstanding load.
+ */
+
+#ifndef MVE_EMBEDDING_PREFETCHER_HEADER
+#define MVE_EMBEDDING_PREFETCHER_HEADER
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "util/refptr.h"
+#include "util/thread.h"
+
+#include "defines.h"
+#include "imagebase.h"
+#include "view.h"
+
+MVE_NAMESPACE_BEGIN
+
+/**
+ * Handle for a set of prefetched embeddings. The handle holds references
+ * to the loaded embeddings, which are thus not evicted from the cache of
+ * the views until the handle is released.
+ */
+class PrefetchHandle
+{
+public:
+    typedef util::RefPtr<PrefetchHandle> Ptr;
+
+private:
+    std::size_t pending;
+    util::Semaphore finished;
+    mutable util::Mutex mutex;
+    std::vector<ImageBase::Ptr> images;
+    std::string error;
+
+private:
+    friend class EmbeddingPrefetcher;
+    PrefetchHandle (std::size_t num_requests);
+    void finish (ImageBase::Ptr image, std::string const& error);
+
+public:
+    /** Blocks until all embeddings are loaded (or failed to load). */
+    void wait (void);
+    /** Returns true if all embeddings are loaded. */
+    bool is_done (void) const;
+    /** Returns the amount of embeddings that are not loaded yet. */
+    std::size_t num_pending (void) const;
+    /** Returns the first error that occured while loading. */
+    std::string get_error (void);
+};
+
+/* ---------------------------------------------------------------- */
+
+/**
+ * Loads embeddings of views on background I/O threads. Requests are
+ * processed in the order they have been issued. On destruction, requests
+ * that have not been started are canceled.
+ */
+class EmbeddingPrefetcher
+{
+public:
+    typedef util::RefPtr<EmbeddingPrefetcher> Ptr;
+
+private:
+    struct Request
+    {
+        View::Ptr view;
+        std::string name;
+        PrefetchHandle::Ptr handle;
+    };
+
+    class Worker : public util::Thread
+    {
+    private:
+        EmbeddingPrefetcher* prefetcher;
+
+    protected:
+        void* run (void);
+
+    public:
+        Worker (EmbeddingPrefetcher* prefetcher);
+    };
+
+private:
+    std::deque<Request> queue;
+    util::Mutex queue_mutex;
+    util::Semaphore queue_size;
+    std::vector<Worker*> workers;
+
+private:
+    EmbeddingPrefetcher (std::size_t num_threads);
+    EmbeddingPrefetcher (EmbeddingPrefetcher const& other);
+    EmbeddingPrefetcher& operator= (EmbeddingPrefetcher const& other);
+
+    void process_requests (void);
+
+public:
+    /** Creates a prefetcher with the given amount of I/O threads. */
+    static Ptr create (std::size_t num_threads = 2);
+    /** Cancels requests that have not been started and joins threads. */
+    ~EmbeddingPrefetcher (void);
+
+    /**
+     * Schedules loading the named embeddings of all given views. Views
+     * that are NULL and embeddings that do not exist are skipped.
+     */
+    PrefetchHandle::Ptr prefetch (std::vector<View::Ptr> const& views,
+        std::vector<std::string> const& names);
+};
+
+/* ---------------------------------------------------------------- */
+
+inline
+PrefetchHandle::PrefetchHandle (std::size_t num_requests)
+    : pending(num_requests)
+    , finished(0)
+{
+    if (num_requests == 0)
+        this->finished.post();
+}
+
+inline void
+PrefetchHandle::wait (void)
+{
+    /* The semaphore is posted once, pass it on to other waiters. */
+    this->finished.wait();
+    this->finished.post();
+}
+
+inline bool
+PrefetchHandle::is_done (void) const
+{
+    return this->num_pending() == 0;
+}
+
+inline EmbeddingPrefetcher::Ptr
+EmbeddingPrefetcher::create (std::size_t num_threads)
+{
+    return Ptr(new EmbeddingPrefetcher(num_threads));
+}
+
+inline
+EmbeddingPrefetcher::Worker::Worker (EmbeddingPrefetcher* prefetcher)
+    : prefetcher(prefetcher)
+{
+}
+
+MVE_NAMESPACE_END
+
+#endif /* MVE_EMBEDDING_PREFETCHER_HEADER */
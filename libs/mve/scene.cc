@@ -1,15 +1,157 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <algorithm>
+#include <map>
+#include <ctime>
+#include <cerrno>
+#include <cstring>
 
 #include "util/exception.h"
 #include "util/inifile.h"
 #include "util/hrtimer.h"
 #include "util/fs.h"
+#include "util/atomic.h"
+#include "util/thread.h"
 
 #include "scene.h"
 
 MVE_NAMESPACE_BEGIN
 
+/* Signature of the header index file. */
+#define MVE_SCENE_INDEX_SIGNATURE "MVE-SCENE-INDEX 1"
+
+namespace
+{
+    /* Headers of a view file and the file properties they are valid for. */
+    struct SceneIndexEntry
+    {
+        std::time_t mtime;
+        std::size_t size;
+        std::string headers;
+    };
+
+    /* Index entries by the file name of the view. */
+    typedef std::map<std::string, SceneIndexEntry> SceneIndex;
+
+    /*
+     * Reads the header index. The index is only a cache, a missing or
+     * broken index yields an empty or partial index.
+     */
+    void
+    read_scene_index (std::string const& filename, SceneIndex* index)
+    {
+        std::ifstream in(filename.c_str(), std::ios::binary);
+        if (!in.good())
+            return;
+
+        std::string line;
+        std::getline(in, line);
+        if (line != MVE_SCENE_INDEX_SIGNATURE)
+            return;
+
+        /* Each entry is "view MTIME SIZE LENGTH NAME" and the headers. */
+        while (std::getline(in, line))
+        {
+            std::istringstream ss(line);
+            std::string keyword, name;
+            std::size_t length = 0;
+            SceneIndexEntry entry;
+            ss >> keyword >> entry.mtime >> entry.size >> length;
+            ss.get();
+            std::getline(ss, name);
+            if (ss.fail() || keyword != "view" || name.empty()
+                || length > (1 << 20))
+                return;
+
+            entry.headers.resize(length);
+            if (length)
+                in.read(&entry.headers[0], length);
+            if (in.get() != '\n' || !in.good())
+                return;
+            (*index)[name] = entry;
+        }
+    }
+
+    /* Writes the header index, replacing the old index atomically. */
+    void
+    write_scene_index (std::string const& filename, SceneIndex const& index)
+    {
+        std::string tmp_filename = filename + ".new";
+        std::ofstream out(tmp_filename.c_str(), std::ios::binary);
+        if (!out.good())
+            throw util::FileException(tmp_filename, std::strerror(errno));
+
+        out << MVE_SCENE_INDEX_SIGNATURE << "\n";
+        for (SceneIndex::const_iterator iter = index.begin();
+            iter != index.end(); ++iter)
+        {
+            SceneIndexEntry const& entry(iter->second);
+            out << "view " << entry.mtime << " " << entry.size << " "
+                << entry.headers.size() << " " << iter->first << "\n";
+            out.write(entry.headers.data(), entry.headers.size());
+            out << "\n";
+        }
+        out.close();
+        if (!out.good())
+            throw util::FileException(tmp_filename, std::strerror(errno));
+
+        if (!util::fs::rename(tmp_filename.c_str(), filename.c_str()))
+            throw util::FileException(filename, std::strerror(errno));
+    }
+
+    /* Views to initialize, shared by all loader threads. */
+    struct ViewLoadJob
+    {
+        std::vector<std::string> filenames;
+        std::vector<std::string> headers; ///< Read if empty
+        std::vector<View::Ptr> views;
+        std::vector<std::string> errors;
+        util::Atomic<int> next;
+
+        ViewLoadJob (void) : next(0) {}
+    };
+
+    /* Takes views from the job and initializes them until none is left. */
+    class ViewLoadThread : public util::Thread
+    {
+    private:
+        ViewLoadJob* job;
+
+    public:
+        ViewLoadThread (ViewLoadJob* job) : job(job) {}
+
+        void*
+        run (void)
+        {
+            while (true)
+            {
+                std::size_t i = this->job->next.increment() - 1;
+                if (i >= this->job->filenames.size())
+                    break;
+
+                std::string const& filename(this->job->filenames[i]);
+                std::string& headers(this->job->headers[i]);
+                try
+                {
+                    if (headers.empty())
+                        headers = View::read_mve_headers(filename);
+                    View::Ptr view(View::create());
+                    view->load_mve_headers(filename, headers);
+                    this->job->views[i] = view;
+                }
+                catch (std::exception& e)
+                {
+                    this->job->errors[i] = filename + ": " + e.what();
+                }
+            }
+            return 0;
+        }
+    };
+}
+
+/* ---------------------------------------------------------------- */
+
 void
 Scene::load_scene (std::string const& base_path)
 {
@@ -119,6 +261,10 @@ Scene::cache_cleanup (void)
 
     std::cout << "Cleanup: Released " << released << " embeddings in "
         << affected_views << " of " << views.size() << " views." << std::endl;
+
+    EmbeddingCache::Stats stats = this->cache->get_stats();
+    std::cout << "Cache: " << stats.hits << " hits, " << stats.misses
+        << " misses, " << stats.evictions << " evictions." << std::endl;
 }
 
 /* ---------------------------------------------------------------- */
@@ -175,19 +321,107 @@ Scene::init_views (void)
     std::cout << "Initializing scene with " << dir.size()
         << " views..." << std::endl;
 
-    /* Load views in a temp list. */
-    ViewList temp_list;
-    std::size_t max_id = 0;
+    /* Read the header index, which is rewritten if anything changed. */
+    std::string index_filename = this->basedir + "/" MVE_SCENE_INDEX_FILE;
+    SceneIndex index;
+    if (this->use_header_index)
+        read_scene_index(index_filename, &index);
+    SceneIndex new_index;
+
+    /* Take headers of unchanged views from the index. */
+    ViewLoadJob job;
+    std::size_t num_indexed = 0;
     for (std::size_t i = 0; i < dir.size(); ++i)
     {
         if (dir[i].name.size() < 4)
             continue;
         if (util::string::right(dir[i].name, 4) != ".mve")
             continue;
-        View::Ptr view = View::create();
-        view->load_mve_file(dir[i].get_absolute_name());
-        temp_list.push_back(view);
-        max_id = std::max(max_id, view->get_id());
+        job.filenames.push_back(dir[i].get_absolute_name());
+        job.headers.push_back(std::string());
+        if (!this->use_header_index)
+            continue;
+
+        SceneIndexEntry entry;
+        if (!util::fs::file_info(job.filenames.back().c_str(),
+            &entry.mtime, &entry.size))
+            continue;
+        SceneIndex::iterator iter = index.find(dir[i].name);
+        if (iter != index.end() && iter->second.mtime == entry.mtime
+            && iter->second.size == entry.size)
+        {
+            job.headers.back().swap(iter->second.headers);
+            num_indexed += 1;
+        }
+        new_index[dir[i].name] = entry;
+    }
+
+    /* Load views in a temp list, reading headers in parallel. */
+    job.views.resize(job.filenames.size());
+    job.errors.resize(job.filenames.size());
+    std::size_t num_threads = std::min(this->num_load_threads,
+        job.filenames.size() - num_indexed);
+    if (num_threads <= 1)
+    {
+        ViewLoadThread loader(&job);
+        loader.run();
+    }
+    else
+    {
+        std::vector<ViewLoadThread*> threads(num_threads);
+        for (std::size_t i = 0; i < num_threads; ++i)
+        {
+            threads[i] = new ViewLoadThread(&job);
+            threads[i]->pt_create();
+        }
+        for (std::size_t i = 0; i < num_threads; ++i)
+        {
+            threads[i]->pt_join();
+            delete threads[i];
+        }
+    }
+
+    for (std::size_t i = 0; i < job.errors.size(); ++i)
+        if (!job.errors[i].empty())
+            throw util::Exception("Cannot init views: ", job.errors[i]);
+
+    ViewList temp_list;
+    std::size_t max_id = 0;
+    for (std::size_t i = 0; i < job.views.size(); ++i)
+    {
+        temp_list.push_back(job.views[i]);
+        max_id = std::max(max_id, job.views[i]->get_id());
+    }
+
+    /*
+     * Update the header index. Files modified within the resolution of
+     * the modification time may change again unnoticed and are skipped.
+     */
+    if (this->use_header_index && (num_indexed != job.filenames.size()
+        || index.size() != num_indexed))
+    {
+        std::time_t now = std::time(0);
+        for (std::size_t i = 0; i < job.filenames.size(); ++i)
+        {
+            std::string name = util::fs::get_file_component(job.filenames[i]);
+            SceneIndex::iterator iter = new_index.find(name);
+            if (iter == new_index.end())
+                continue;
+            if (iter->second.mtime + 1 >= now)
+                new_index.erase(iter);
+            else
+                iter->second.headers.swap(job.headers[i]);
+        }
+
+        try
+        {
+            write_scene_index(index_filename, new_index);
+        }
+        catch (util::Exception& e)
+        {
+            std::cout << "Warning: Cannot write header index: "
+                << e << std::endl;
+        }
     }
 
     if (max_id > 5000 && max_id > 2 * temp_list.size())
@@ -211,15 +445,33 @@ Scene::init_views (void)
         }
 
         this->views[id] = temp_list[i];
+        this->views[id]->set_cache(this->cache);
     }
 
     std::cout << "Initialized " << temp_list.size()
-        << " views (max ID is " << max_id << "), took "
+        << " views (max ID is " << max_id << ", "
+        << num_indexed << " from index), took "
         << timer.get_elapsed() << "ms." << std::endl;
 }
 
 /* ---------------------------------------------------------------- */
 
+PrefetchHandle::Ptr
+Scene::prefetch (std::vector<std::size_t> const& view_ids,
+    std::vector<std::string> const& names)
+{
+    if (!this->prefetcher.get())
+        this->prefetcher = EmbeddingPrefetcher::create
+            (MVE_SCENE_PREFETCH_THREADS);
+
+    std::vector<View::Ptr> views;
+    for (std::size_t i = 0; i < view_ids.size(); ++i)
+        views.push_back(this->get_view_by_id(view_ids[i]));
+    return this->prefetcher->prefetch(views, names);
+}
+
+/* ---------------------------------------------------------------- */
+
 BundleFile::ConstPtr
 Scene::get_bundle (void)
 {
@@ -14,9 +14,14 @@
 #include "defines.h"
 #include "view.h"
 #include "bundlefile.h"
+#include "embeddingcache.h"
+#include "embeddingprefetcher.h"
 
 #define MVE_SCENE_VIEWS_DIR "views/"
 #define MVE_SCENE_BUNDLE_FILE "synth_0.out"
+#define MVE_SCENE_INDEX_FILE "views.index"
+#define MVE_SCENE_LOAD_THREADS 8
+#define MVE_SCENE_PREFETCH_THREADS 2
 
 MVE_NAMESPACE_BEGIN
 
@@ -27,6 +32,17 @@ MVE_NAMESPACE_BEGIN
  *
  * - directory "views": contains the views in the scene.
  * - file "synth_0.out": bundle file that contains key points.
+ * - file "views.index": optional index with the headers of all views.
+ *
+ * The headers of the views are read in parallel. If the header index is
+ * enabled, views that did not change since the index was written (same
+ * modification time and size) are initialized from the index without
+ * opening the view files, and the index is updated after loading.
+ *
+ * All views of the scene share an embedding cache. If a memory budget is
+ * set, the least recently used clean embeddings are released as soon as
+ * loading or setting an embedding exceeds the budget. Embeddings can be prefetched
+ * by background I/O threads, see prefetch().
  */
 class Scene
 {
@@ -39,6 +55,10 @@ private:
     ViewList views;
     BundleFile::Ptr bundle;
     bool bundle_dirty;
+    std::size_t num_load_threads;
+    bool use_header_index;
+    EmbeddingCache::Ptr cache;
+    EmbeddingPrefetcher::Ptr prefetcher;
 
 private:
     void init_views (void);
@@ -55,6 +75,11 @@ public:
     /** Loads the scene from the given directory. */
     void load_scene (std::string const& base_path);
 
+    /** Sets the amount of threads that read view headers. */
+    void set_load_threads (std::size_t num_threads);
+    /** Enables reading and writing the header index file. */
+    void set_header_index (bool enable);
+
     /** Returns the list of views. */
     ViewList const& get_views (void) const;
     /** Returns the list of views. */
@@ -88,6 +113,21 @@ public:
 
     /** Forces cleanup of unused embeddings. */
     void cache_cleanup (void);
+    /** Sets the memory budget for view embeddings, 0 is unlimited. */
+    void set_cache_budget (std::size_t bytes);
+    /** Returns hit, miss and eviction counters of the embedding cache. */
+    EmbeddingCache::Stats get_cache_stats (void);
+    /** Returns the embedding cache shared by the views. */
+    EmbeddingCache::Ptr get_cache (void);
+
+    /**
+     * Loads the named embeddings of the given views in the background.
+     * Invalid view IDs and missing embeddings are skipped. Accessing an
+     * embedding that is being loaded blocks until the load is done.
+     * The returned handle keeps the loaded embeddings in memory.
+     */
+    PrefetchHandle::Ptr prefetch (std::vector<std::size_t> const& view_ids,
+        std::vector<std::string> const& names);
 
     /** Returns total scene memory usage. */
     std::size_t get_total_mem_usage (void);
@@ -102,6 +142,9 @@ public:
 inline
 Scene::Scene (void)
     : bundle_dirty(false)
+    , num_load_threads(MVE_SCENE_LOAD_THREADS)
+    , use_header_index(false)
+    , cache(EmbeddingCache::create())
 {
 }
 
@@ -119,6 +162,36 @@ Scene::create (std::string const& path)
     return scene;
 }
 
+inline void
+Scene::set_load_threads (std::size_t num_threads)
+{
+    this->num_load_threads = num_threads;
+}
+
+inline void
+Scene::set_header_index (bool enable)
+{
+    this->use_header_index = enable;
+}
+
+inline void
+Scene::set_cache_budget (std::size_t bytes)
+{
+    this->cache->set_budget(bytes);
+}
+
+inline EmbeddingCache::Stats
+Scene::get_cache_stats (void)
+{
+    return this->cache->get_stats();
+}
+
+inline EmbeddingCache::Ptr
+Scene::get_cache (void)
+{
+    return this->cache;
+}
+
 inline Scene::ViewList const&
 Scene::get_views (void) const
 {
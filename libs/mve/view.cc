@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <cstring>
 #include <cerrno>
 
@@ -7,8 +9,10 @@
 #include "util/exception.h"
 #include "util/fs.h"
 #include "util/string.h"
+#include "util/threadlocks.h"
 
 #include "image.h"
+#include "embeddingcodec.h"
 #include "view.h"
 
 /* The signature to identify MVE files. */
@@ -28,6 +32,10 @@ MVEFileProxy::check_direct_write (void) const
     if (this->file_pos == 0 || this->byte_size == 0)
         return false;
 
+    /* Compressed embeddings change their size in the file. */
+    if (!this->codec.empty())
+        return false;
+
     /* Image (or data) dimensions must be the same. */
     if (this->width != this->image->width()
         || this->height != this->image->height()
@@ -85,18 +93,71 @@ MVEFileProxy::is_type (std::string const& typestr) const
 }
 
 /* ---------------------------------------------------------------- */
+
+ImageBase::Ptr
+MVEFileProxy::allocate_image (void) const
+{
+    if (!this->is_image)
+    {
+        ByteImage::Ptr img(ByteImage::create());
+        img->allocate(this->byte_size, 1, 1);
+        return img;
+    }
+
+    if (this->datatype == "uint8")
+        return ByteImage::create(this->width, this->height, this->channels);
+    else if (this->datatype == "uint16")
+        return RawImage::create(this->width, this->height, this->channels);
+    else if (this->datatype == "float")
+        return FloatImage::create(this->width, this->height, this->channels);
+    else if (this->datatype == "double")
+        return DoubleImage::create(this->width, this->height, this->channels);
+    else if (this->datatype == "sint32")
+        return IntImage::create(this->width, this->height, this->channels);
+
+    throw util::Exception("Unrecognized image data type");
+}
+
 /* ---------------------------------------------------------------- */
 
 void
-View::load_mve_file (std::string const& filename, bool merge)
+MVEFileProxy::decode (char const* data, ImageBase::Ptr image) const
+{
+    if (image->get_byte_size() != this->byte_size)
+        throw util::Exception("Invalid size of embedding: ", this->name);
+
+    if (this->is_image)
+        codec_decode(this->codec, data, this->file_size,
+            util::string::size_for_type_string(this->datatype),
+            this->channels, image->get_byte_pointer(), this->byte_size);
+    else
+        codec_decode(this->codec, data, this->file_size, 1, 1,
+            image->get_byte_pointer(), this->byte_size);
+}
+
+/* ---------------------------------------------------------------- */
+
+ImageBase::Ptr
+MappedEmbedding::copy (void) const
+{
+    ImageBase::Ptr image(this->proxy.allocate_image());
+    std::copy(this->data, this->data + this->proxy.byte_size,
+        image->get_byte_pointer());
+    return image;
+}
+
+/* ---------------------------------------------------------------- */
+/* ---------------------------------------------------------------- */
+
+std::string
+View::read_mve_headers (std::string const& filename)
 {
     if (filename.empty())
         throw std::invalid_argument("No filename given");
-    this->filename = filename;
 
     /* Check if write locks are set. Wait for release. */
     util::fs::FileLock lock;
-    if (!lock.wait_lock(this->filename))
+    if (!lock.wait_lock(filename))
         throw util::Exception("File is locked: ", lock.get_reason());
 
     /* Open file. */
@@ -104,16 +165,52 @@ View::load_mve_file (std::string const& filename, bool merge)
     if (!infile.good())
         throw util::FileException(filename, std::strerror(errno));
 
+    /* Read signature and header lines up to the end of the headers. */
+    std::string headers(MVE_FILE_SIGNATURE_LEN, '\0');
+    infile.read(&headers[0], MVE_FILE_SIGNATURE_LEN);
+    if (infile.eof())
+        throw util::Exception("Premature end of file");
+    while (infile.good())
+    {
+        std::string buf;
+        std::getline(infile, buf);
+        if (infile.eof())
+            break;
+        headers.append(buf);
+        headers.append(1, '\n');
+        if (buf == "end_headers")
+            break;
+
+        if (headers.size() > (1 << 20))
+            throw util::Exception("Spurious size of headers!");
+    }
+    infile.close();
+
+    return headers;
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+View::load_mve_headers (std::string const& filename,
+    std::string const& headers)
+{
+    if (filename.empty())
+        throw std::invalid_argument("No filename given");
+    this->filename = filename;
+
+    /* Offsets of the embeddings change, a new mapping is required. */
+    this->release_mapping();
+
+    std::istringstream infile(headers);
+
     /* Signature checks. */
     {
         /* Read file signature. */
         char buf[MVE_FILE_SIGNATURE_LEN];
         infile.read(buf, MVE_FILE_SIGNATURE_LEN);
         if (infile.eof())
-        {
-            infile.close();
             throw util::Exception("Premature end of file");
-        }
 
         /* Check file signature. */
         bool valid = true;
@@ -122,10 +219,7 @@ View::load_mve_file (std::string const& filename, bool merge)
                 valid = false;
 
         if (!valid)
-        {
-            infile.close();
             throw util::Exception("Invalid file signature");
-        }
     }
 
     /* Remember old proxies and start with empty list. */
@@ -156,7 +250,6 @@ View::load_mve_file (std::string const& filename, bool merge)
         }
         catch (util::Exception& e)
         {
-            infile.close();
             std::swap(this->proxies, old_proxies);
             std::swap(this->meta, old_meta);
             std::swap(this->camera, old_camera);
@@ -164,9 +257,8 @@ View::load_mve_file (std::string const& filename, bool merge)
         }
     }
 
-    /* Done reading input file. */
+    /* Done reading headers. */
     std::size_t current_pos = infile.tellg();
-    infile.close();
 
     /* Update the camera information. */
     this->update_camera();
@@ -182,14 +274,29 @@ View::load_mve_file (std::string const& filename, bool merge)
          * and byte size of the embedding, two blanks and a newline.
          */
         std::size_t intro_len = 12 + p.name.size()
-            + util::string::get(p.byte_size).size();
+            + util::string::get(p.file_size).size();
         p.file_pos = current_pos + intro_len;
-        current_pos = p.file_pos + p.byte_size + 1; // +1 for trailing newline
+        current_pos = p.file_pos + p.file_size + 1; // +1 for trailing newline
 
         //std::cout << "Guessed parameters for " << p.name << ": size "
-        //    << p.byte_size << ", pos " << p.file_pos << std::endl;
+        //    << p.file_size << ", pos " << p.file_pos << std::endl;
     }
 
+    this->update_cache();
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+View::load_mve_file (std::string const& filename, bool merge)
+{
+    /* Remember old state for merging. */
+    Proxies old_proxies(this->proxies);
+    MVEFileMeta old_meta(this->meta);
+    CameraInfo old_camera(this->camera);
+
+    this->load_mve_headers(filename, View::read_mve_headers(filename));
+
     if (!merge)
         return;
 
@@ -262,9 +369,14 @@ View::parse_header_line (std::string const& header_line)
     if (tokens.empty())
         throw util::Exception("Error: Invalid header line");
 
+    /*
+     * Compressed embeddings append the codec and the size in the file:
+     * "image NAME WIDTH HEIGHT CHANNELS TYPE [CODEC FILESIZE]" and
+     * "data NAME SIZE [CODEC FILESIZE]".
+     */
     if (tokens[0] == "image")
     {
-        if (tokens.size() != 6)
+        if (tokens.size() != 6 && tokens.size() != 8)
             throw util::Exception("Invalid image header: ", str);
 
         MVEFileProxy p;
@@ -278,11 +390,17 @@ View::parse_header_line (std::string const& header_line)
         if (!type_size)
             throw util::Exception("Invalid image type: ", p.datatype);
         p.byte_size = p.width * p.height * p.channels * type_size;
+        p.file_size = p.byte_size;
+        if (tokens.size() == 8)
+        {
+            p.codec = tokens[6];
+            p.file_size = util::string::convert<std::size_t>(tokens[7]);
+        }
         this->proxies.push_back(p);
     }
     else if (tokens[0] == "data")
     {
-        if (tokens.size() != 3)
+        if (tokens.size() != 3 && tokens.size() != 5)
             throw util::Exception("Invalid data header: ", str);
 
         MVEFileProxy p;
@@ -293,6 +411,12 @@ View::parse_header_line (std::string const& header_line)
         p.channels = 1;
         p.datatype = "uint8";
         p.byte_size = p.width;
+        p.file_size = p.byte_size;
+        if (tokens.size() == 5)
+        {
+            p.codec = tokens[3];
+            p.file_size = util::string::convert<std::size_t>(tokens[4]);
+        }
         this->proxies.push_back(p);
     }
     else if (tokens[0] == "id")
@@ -350,6 +474,30 @@ View::save_mve_file_as (std::string const& filename)
     if (filename.empty())
         throw std::invalid_argument("No filename given");
 
+    util::MutexLock lock(this->mutex);
+
+    /*
+     * Truncating a mapped file invalidates the mapped embeddings.
+     * The file is written under a new name and renamed instead.
+     */
+    if (this->is_mapped_by_clients(filename))
+    {
+        this->save_mve_file_intern(filename + ".new");
+        util::fs::unlink(filename.c_str());
+        this->rename_file(filename);
+    }
+    else
+        this->save_mve_file_intern(filename);
+
+    lock.unlock();
+    this->update_cache();
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+View::save_mve_file_intern (std::string const& filename)
+{
     // TODO: Re-read and merge with file on disc?
     //this->reload_mve_file(true);
 
@@ -370,7 +518,10 @@ View::save_mve_file_as (std::string const& filename)
     for (std::size_t i = 0; i < this->proxies.size(); ++i)
     {
         MVEFileProxy& p(this->proxies[i]);
-        this->ensure_embedding(p); // TODO: Use function that does not merge
+        if (p.is_reserved())
+            continue;
+        if (!p.image.get()) // TODO: Use function that does not merge
+            this->load_embedding(p);
         p.width = p.image->width();
         p.height = p.image->height();
         p.channels = p.image->channels();
@@ -378,6 +529,20 @@ View::save_mve_file_as (std::string const& filename)
         p.datatype = p.image->get_type_string();
     }
 
+    /* Compress embeddings, the compressed size is part of the headers. */
+    std::vector<std::vector<char> > encoded(this->proxies.size());
+    for (std::size_t i = 0; i < this->proxies.size(); ++i)
+    {
+        MVEFileProxy& p(this->proxies[i]);
+        p.file_size = p.byte_size;
+        if (p.codec.empty())
+            continue;
+        codec_encode(p.codec, p.image->get_byte_pointer(), p.byte_size,
+            p.is_image ? util::string::size_for_type_string(p.datatype) : 1,
+            p.is_image ? p.channels : 1, &encoded[i]);
+        p.file_size = encoded[i].size();
+    }
+
     /* Open output file. */
     std::ofstream out(filename.c_str());
     if (!out.good())
@@ -409,12 +574,15 @@ View::save_mve_file_as (std::string const& filename)
         if (p.is_image)
         {
             out << "image " << p.name << " " << p.width << " " << p.height
-                << " " << p.channels << " " << p.datatype << "\n";
+                << " " << p.channels << " " << p.datatype;
         }
         else
         {
-            out << "data " << p.name << " " << p.byte_size << "\n";
+            out << "data " << p.name << " " << p.byte_size;
         }
+        if (!p.codec.empty())
+            out << " " << p.codec << " " << p.file_size;
+        out << "\n";
     }
 
     /* Finalize headers. */
@@ -425,10 +593,22 @@ View::save_mve_file_as (std::string const& filename)
     {
         /* Write embedding (and update file_pos proxy information). */
         MVEFileProxy& p(this->proxies[i]);
-        out << "embedding " << p.name << " " << p.byte_size << "\n";
+        out << "embedding " << p.name << " " << p.file_size << "\n";
         p.file_pos = out.tellp();
         p.is_dirty = false;
-        out.write(p.image->get_byte_pointer(), p.byte_size);
+        if (!p.codec.empty())
+            out.write(&encoded[i][0], p.file_size);
+        else if (p.image.get())
+            out.write(p.image->get_byte_pointer(), p.byte_size);
+        else
+        {
+            /* Reserved images are written without allocating them. */
+            std::vector<char> zeros(std::min<std::size_t>(p.byte_size,
+                1 << 20), 0);
+            for (std::size_t pos = 0; pos < p.byte_size; pos += zeros.size())
+                out.write(&zeros[0], std::min(zeros.size(),
+                    p.byte_size - pos));
+        }
         out.write("\n", 1);
     }
 
@@ -437,9 +617,10 @@ View::save_mve_file_as (std::string const& filename)
     out.close();
     this->filename = filename;
     this->needs_rebuild = false;
+    this->release_mapping();
 
     /* Because all embeddings are now cached, we release some memory. */
-    this->cache_cleanup();
+    this->cache_cleanup_intern();
 
     std::cout << "Done saving file as '" << file_component << "'." << std::endl;
 }
@@ -458,6 +639,9 @@ View::save_mve_file (bool force_rebuild)
     /* For debugging... */
     std::string file_component = util::fs::get_file_component(this->filename);
 
+    /* Embeddings must not be loaded while the file is rewritten. */
+    util::MutexLock view_lock(this->mutex);
+
     /*
      * Check if we can write embeddings directly to file instead of creating
      * a new file from scratch. Only dirty embeddings are of interest.
@@ -483,6 +667,10 @@ View::save_mve_file (bool force_rebuild)
                 << "', skipping." << std::endl;
             return;
         }
+
+        /* Mapped embeddings must not change under their clients. */
+        if (this->is_mapped_by_clients(this->filename))
+            direct = false;
     }
 
     /* Acquire file lock for the view. */
@@ -499,6 +687,8 @@ View::save_mve_file (bool force_rebuild)
             << file_component << std::endl;
         try
         {
+            /* The private mapping may not reflect the new contents. */
+            this->release_mapping();
             for (std::size_t i = 0; i < this->proxies.size(); ++i)
                 if (this->proxies[i].is_dirty)
                     this->direct_write(this->proxies[i]);
@@ -515,11 +705,14 @@ View::save_mve_file (bool force_rebuild)
     if (!success)
     {
         std::string orig_filename = this->filename;
-        this->save_mve_file_as(this->filename + ".new");
+        this->save_mve_file_intern(this->filename + ".new");
         util::fs::unlink(orig_filename.c_str());
         this->rename_file(orig_filename);
     }
 
+    view_lock.unlock();
+    this->update_cache();
+
     std::cout << "Done saving '" << file_component << "'." << std::endl;
 }
 
@@ -576,46 +769,54 @@ View::rename_file (std::string const& new_name)
 void
 View::load_embedding (MVEFileProxy& p)
 {
-    if (this->filename.empty() || p.byte_size == 0 || p.file_pos == 0)
+    if (p.is_reserved() && p.byte_size > 0)
+    {
+        p.image = p.allocate_image();
+        return;
+    }
+
+    if (this->filename.empty() || p.byte_size == 0 || p.file_size == 0
+        || p.file_pos == 0)
         throw util::Exception("Proxy not properly initialized");
 
     if (p.is_image && (!p.width || !p.height || !p.channels))
         throw util::Exception("Image with invalid image dimensions");
 
+    /* Copy (or decompress) the embedding from the mapped file. */
+    if (this->use_mapping || this->mapping.get())
+    {
+        this->ensure_mapping();
+        if (p.codec.empty())
+        {
+            MappedEmbedding::Ptr mapped(MappedEmbedding::create
+                (this->mapping, p));
+            p.image = mapped->copy();
+            return;
+        }
+
+        if (p.file_pos + p.file_size > this->mapping->get_size())
+            throw util::Exception("Embedding exceeds mapped file: ", p.name);
+        ImageBase::Ptr image(p.allocate_image());
+        p.decode(this->mapping->get_data() + p.file_pos, image);
+        p.image = image;
+        return;
+    }
+
     /* Open MVE input file. */
     std::ifstream mvefile(this->filename.c_str(), std::ios::binary);
     if (!mvefile.good())
         throw util::FileException(filename, std::strerror(errno));
 
     /* Allocate memory for image or data embedding. */
-    if (p.is_image)
-    {
-        if (p.datatype == "uint8")
-            p.image = ByteImage::create(p.width, p.height, p.channels);
-        else if (p.datatype == "uint16")
-            p.image = RawImage::create(p.width, p.height, p.channels);
-        else if (p.datatype == "float")
-            p.image = FloatImage::create(p.width, p.height, p.channels);
-        else if (p.datatype == "double")
-            p.image = DoubleImage::create(p.width, p.height, p.channels);
-        else if (p.datatype == "sint32")
-            p.image = IntImage::create(p.width, p.height, p.channels);
-        else
-        {
-            mvefile.close();
-            throw util::Exception("Unrecognized image data type");
-        }
-    }
-    else
-    {
-        ByteImage::Ptr img(ByteImage::create());
-        img->allocate(p.byte_size, 1, 1);
-        p.image = img;
-    }
+    ImageBase::Ptr image(p.allocate_image());
 
-    /* Seek and read embedding. */
+    /* Seek and read embedding, compressed embeddings are buffered. */
+    std::vector<char> buffer(p.codec.empty() ? 0 : p.file_size);
     mvefile.seekg(p.file_pos);
-    mvefile.read(p.image->get_byte_pointer(), p.image->get_byte_size());
+    if (p.codec.empty())
+        mvefile.read(image->get_byte_pointer(), image->get_byte_size());
+    else
+        mvefile.read(&buffer[0], p.file_size);
     if (mvefile.eof())
     {
         mvefile.close();
@@ -623,20 +824,98 @@ View::load_embedding (MVEFileProxy& p)
     }
     //mvefile.get(); // Discard final newline
     mvefile.close();
+
+    if (!p.codec.empty())
+        p.decode(&buffer[0], image);
+    p.image = image;
 }
 
 /* ---------------------------------------------------------------- */
 
 void
-View::ensure_embedding (MVEFileProxy& proxy)
+View::ensure_mapping (void)
+{
+    if (this->mapping.get())
+        return;
+
+    if (this->filename.empty())
+        throw util::Exception("View is not associated with a file");
+
+    /* Check if write locks are set. Wait for release. */
+    util::fs::FileLock lock;
+    if (!lock.wait_lock(this->filename))
+        throw util::Exception("File is locked: ", lock.get_reason());
+
+    this->mapping = util::fs::MappedFile::create(this->filename);
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+View::release_mapping (void)
+{
+    /* Mappings in use by clients are kept to protect them when saving. */
+    if (this->mapping.use_count() > 1)
+        this->old_mappings.push_back(this->mapping);
+    this->mapping.reset();
+}
+
+/* ---------------------------------------------------------------- */
+
+bool
+View::is_mapped_by_clients (std::string const& filename)
+{
+    bool mapped = this->mapping.use_count() > 1
+        && this->mapping->get_filename() == filename;
+    for (std::size_t i = 0; i < this->old_mappings.size();)
+    {
+        util::fs::MappedFile::Ptr const& m(this->old_mappings[i]);
+        if (m.use_count() == 1)
+        {
+            this->old_mappings.erase(this->old_mappings.begin() + i);
+            continue;
+        }
+        if (m->get_filename() == filename)
+            mapped = true;
+        i += 1;
+    }
+    return mapped;
+}
+
+/* ---------------------------------------------------------------- */
+
+MappedEmbedding::Ptr
+View::get_mapped_embedding (std::string const& name)
+{
+    util::MutexLock lock(this->mutex);
+    MVEFileProxy* p(this->get_proxy_intern(name));
+    if (p == 0 || p->is_dirty || p->file_pos == 0 || !p->codec.empty())
+        return MappedEmbedding::Ptr();
+    this->ensure_mapping();
+    return MappedEmbedding::create(this->mapping, *p);
+}
+
+/* ---------------------------------------------------------------- */
+
+ImageBase::Ptr
+View::ensure_embedding (MVEFileProxy& proxy, util::MutexLock& lock)
 {
     //if (sync_file)
     //    this->reload_mve_file(true);
 
-    util::AtomicMutex<int> lock(this->mutex);
-    if (!proxy.image.get())
+    /* The reference is taken under the lock, the embedding may otherwise
+     * be released by a concurrent save or cache cleanup. */
+    bool loaded = !proxy.image.get();
+    if (loaded)
         this->load_embedding(proxy);
-    lock.release();
+    ImageBase::Ptr image(proxy.image);
+    std::string name(this->cache.get() ? proxy.name : std::string());
+    lock.unlock();
+
+    /* The cache may evict other embeddings, but not the referenced one. */
+    if (this->cache.get())
+        this->cache->access(this, name, loaded, image->get_byte_size());
+    return image;
 }
 
 /* ---------------------------------------------------------------- */
@@ -666,11 +945,37 @@ View::get_proxy_intern (std::string const& name)
 ImageBase::Ptr
 View::get_embedding (std::string const& name)
 {
+    util::MutexLock lock(this->mutex);
     MVEFileProxy* p(this->get_proxy_intern(name));
     if (p == 0)
         return ImageBase::Ptr();
-    this->ensure_embedding(*p);
-    return p->image;
+    return this->ensure_embedding(*p, lock);
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+View::set_embedding_codec (std::string const& name, std::string const& codec)
+{
+    if (!codec.empty() && !codec_is_supported(codec))
+        throw util::Exception("Unsupported codec: ", codec);
+
+    util::MutexLock lock(this->mutex);
+    MVEFileProxy* p(this->get_proxy_intern(name));
+    if (p == 0)
+        throw util::Exception("No such embedding: ", name);
+    if (p->codec == codec)
+        return;
+
+    /* The embedding is re-encoded, it must not be evicted until saved. */
+    if (!p->image.get())
+        this->load_embedding(*p);
+    p->codec = codec;
+    p->is_dirty = true;
+    this->needs_rebuild = true;
+    std::size_t bytes = p->image->get_byte_size();
+    lock.unlock();
+    this->update_cache(name, bytes);
 }
 
 /* ---------------------------------------------------------------- */
@@ -678,6 +983,7 @@ View::get_embedding (std::string const& name)
 bool
 View::remove_embedding (std::string const& name)
 {
+    util::MutexLock lock(this->mutex);
     std::size_t num_erased = 0;
     for (Proxies::iterator iter = this->proxies.begin();
         iter != this->proxies.end();)
@@ -693,15 +999,39 @@ View::remove_embedding (std::string const& name)
 
     if (num_erased)
         this->needs_rebuild = true;
+    lock.unlock();
+
+    if (num_erased)
+        this->update_cache();
 
     return num_erased > 0;
 }
 
 /* ---------------------------------------------------------------- */
 
+bool
+View::has_embedding (std::string const& name) const
+{
+    util::MutexLock lock(this->mutex);
+    return this->get_proxy(name) != 0;
+}
+
+/* ---------------------------------------------------------------- */
+
+bool
+View::mark_as_dirty (std::string const& name)
+{
+    util::MutexLock lock(this->mutex);
+    MVEFileProxy* p(this->get_proxy_intern(name));
+    return p != 0 && (p->is_dirty = true);
+}
+
+/* ---------------------------------------------------------------- */
+
 std::size_t
 View::count_image_embeddings (void) const
 {
+    util::MutexLock lock(this->mutex);
     std::size_t amount = 0;
     for (std::size_t i = 0; i < this->proxies.size(); ++i)
         amount += this->proxies[i].is_image;
@@ -717,9 +1047,11 @@ View::set_image (std::string const& name, ImageBase::Ptr image)
         throw std::invalid_argument("NULL image passed");
 
     /* If there is no such proxy, add a new one. */
+    util::MutexLock lock(this->mutex);
     MVEFileProxy* p = this->get_proxy_intern(name);
     if (p == 0)
     {
+        lock.unlock();
         this->add_image(name, image);
         return;
     }
@@ -732,6 +1064,8 @@ View::set_image (std::string const& name, ImageBase::Ptr image)
     p->image = image;
     p->is_image = true;
     p->is_dirty = true;
+    lock.unlock();
+    this->update_cache(name, image->get_byte_size());
 }
 
 /* ---------------------------------------------------------------- */
@@ -742,7 +1076,8 @@ View::add_image (std::string const& name, ImageBase::Ptr image)
     if (image.get() == 0)
         throw std::invalid_argument("NULL image passed");
 
-    if (this->has_embedding(name))
+    util::MutexLock lock(this->mutex);
+    if (this->get_proxy(name) != 0)
         throw util::Exception("Embedding already exists: ", name);
 
     MVEFileProxy p;
@@ -752,6 +1087,92 @@ View::add_image (std::string const& name, ImageBase::Ptr image)
     p.is_dirty = true;
     this->proxies.push_back(p);
     this->needs_rebuild = true;
+    lock.unlock();
+    this->update_cache(name, image->get_byte_size());
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+View::reserve_image (std::string const& name, std::size_t width,
+    std::size_t height, std::size_t channels, std::string const& datatype)
+{
+    MVEFileProxy proxy;
+    proxy.name = name;
+    proxy.width = width;
+    proxy.height = height;
+    proxy.channels = channels;
+    proxy.datatype = datatype;
+    proxy.byte_size = width * height * channels
+        * util::string::size_for_type_string(datatype);
+    proxy.file_size = proxy.byte_size;
+    proxy.is_dirty = true;
+    if (proxy.byte_size == 0)
+        throw util::Exception("Invalid size or type of image: ", name);
+
+    util::MutexLock lock(this->mutex);
+    MVEFileProxy* p = this->get_proxy_intern(name);
+    if (p == 0)
+        this->proxies.push_back(proxy);
+    else
+        *p = proxy;
+    this->needs_rebuild = true;
+    lock.unlock();
+    this->update_cache();
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+View::write_image_region (std::string const& name, std::size_t left,
+    std::size_t top, ImageBase::ConstPtr image)
+{
+    if (image.get() == 0)
+        throw std::invalid_argument("NULL image passed");
+
+    util::MutexLock view_lock(this->mutex);
+    MVEFileProxy* p(this->get_proxy_intern(name));
+    if (p == 0 || !p->is_image)
+        throw util::Exception("No such image embedding: ", name);
+    if (p->is_dirty || p->file_pos == 0 || !p->codec.empty())
+        throw util::Exception("Embedding not saved uncompressed: ", name);
+    if (p->datatype != image->get_type_string()
+        || p->channels != image->channels()
+        || left + image->width() > p->width
+        || top + image->height() > p->height)
+        throw util::Exception("Image does not fit embedding: ", name);
+
+    /* Acquire file lock for the view. */
+    util::fs::FileLock lock;
+    if (!lock.acquire_retry(this->filename))
+        throw util::Exception("Cannot acquire lock: ", lock.get_reason());
+
+    /* The private mapping may not reflect the new contents. */
+    this->release_mapping();
+    p->image.reset();
+
+    std::fstream out(this->filename.c_str(),
+        std::ios::in | std::ios::out | std::ios::binary);
+    if (!out.good())
+        throw util::Exception("Error opening MVE file: ",
+            std::strerror(errno));
+
+    std::size_t const pixel_size = p->channels
+        * util::string::size_for_type_string(p->datatype);
+    std::size_t const row_size = image->width() * pixel_size;
+    char const* data = image->get_byte_pointer();
+    for (std::size_t y = 0; y < image->height(); ++y)
+    {
+        out.seekp(p->file_pos + ((top + y) * p->width + left) * pixel_size);
+        out.write(data + y * row_size, row_size);
+    }
+    out.close();
+    if (out.fail())
+        throw util::Exception("Error writing to MVE file: ",
+            std::strerror(errno));
+
+    view_lock.unlock();
+    this->update_cache();
 }
 
 /* ---------------------------------------------------------------- */
@@ -759,11 +1180,11 @@ View::add_image (std::string const& name, ImageBase::Ptr image)
 ImageBase::Ptr
 View::get_image (std::string const& name)
 {
+    util::MutexLock lock(this->mutex);
     MVEFileProxy* p(this->get_proxy_intern(name));
     if (p == 0 || !p->is_image)
         return ImageBase::Ptr();
-    this->ensure_embedding(*p);
-    return p->image;
+    return this->ensure_embedding(*p, lock);
 }
 
 /* ---------------------------------------------------------------- */
@@ -771,11 +1192,11 @@ View::get_image (std::string const& name)
 FloatImage::Ptr
 View::get_float_image (std::string const& name)
 {
+    util::MutexLock lock(this->mutex);
     MVEFileProxy* p(this->get_proxy_intern(name));
     if (p == 0 || !p->is_image || !p->is_type(util::string::for_type<float>()))
         return FloatImage::Ptr();
-    this->ensure_embedding(*p);
-    return p->image;
+    return this->ensure_embedding(*p, lock);
 }
 
 /* ---------------------------------------------------------------- */
@@ -783,11 +1204,11 @@ View::get_float_image (std::string const& name)
 DoubleImage::Ptr
 View::get_double_image (std::string const& name)
 {
+    util::MutexLock lock(this->mutex);
     MVEFileProxy* p(this->get_proxy_intern(name));
     if (p == 0 || !p->is_image || !p->is_type(util::string::for_type<double>()))
         return DoubleImage::Ptr();
-    this->ensure_embedding(*p);
-    return p->image;
+    return this->ensure_embedding(*p, lock);
 }
 
 /* ---------------------------------------------------------------- */
@@ -795,11 +1216,11 @@ View::get_double_image (std::string const& name)
 ByteImage::Ptr
 View::get_byte_image (std::string const& name)
 {
+    util::MutexLock lock(this->mutex);
     MVEFileProxy* p(this->get_proxy_intern(name));
     if (p == 0 || !p->is_image || !p->is_type(util::string::for_type<uint8_t>()))
         return ByteImage::Ptr();
-    this->ensure_embedding(*p);
-    return p->image;
+    return this->ensure_embedding(*p, lock);
 }
 
 /* ---------------------------------------------------------------- */
@@ -807,11 +1228,11 @@ View::get_byte_image (std::string const& name)
 IntImage::Ptr
 View::get_int_image (std::string const& name)
 {
+    util::MutexLock lock(this->mutex);
     MVEFileProxy* p(this->get_proxy_intern(name));
     if (p == 0 || !p->is_image || !p->is_type(util::string::for_type<int>()))
         return IntImage::Ptr();
-    this->ensure_embedding(*p);
-    return p->image;
+    return this->ensure_embedding(*p, lock);
 }
 
 /* ---------------------------------------------------------------- */
@@ -828,9 +1249,11 @@ View::set_data (std::string const& name, ByteImage::Ptr data)
         throw std::invalid_argument("Plain data with invalid dimensions");
 
     /* If there is no such proxy, add a new one. */
+    util::MutexLock lock(this->mutex);
     MVEFileProxy* p = this->get_proxy_intern(name);
     if (p == 0)
     {
+        lock.unlock();
         this->add_data(name, data);
         return;
     }
@@ -843,6 +1266,8 @@ View::set_data (std::string const& name, ByteImage::Ptr data)
     p->image = data;
     p->is_image = false;
     p->is_dirty = true;
+    lock.unlock();
+    this->update_cache(name, data->get_byte_size());
 }
 
 /* ---------------------------------------------------------------- */
@@ -858,7 +1283,8 @@ View::add_data (std::string const& name, ByteImage::Ptr data)
     if (data->height() != 1 || data->channels() != 1)
         throw std::invalid_argument("Plain data has more dimensions");
 
-    if (this->has_embedding(name))
+    util::MutexLock lock(this->mutex);
+    if (this->get_proxy(name) != 0)
         throw util::Exception("Embedding already exists: ", name);
 
     MVEFileProxy p;
@@ -868,6 +1294,8 @@ View::add_data (std::string const& name, ByteImage::Ptr data)
     p.is_dirty = true;
     this->proxies.push_back(p);
     this->needs_rebuild = true;
+    lock.unlock();
+    this->update_cache(name, data->get_byte_size());
 }
 
 /* ---------------------------------------------------------------- */
@@ -877,11 +1305,11 @@ View::get_data (std::string const& name)
 {
     // Heads up: Almost duplicated code in this::get_image
 
+    util::MutexLock lock(this->mutex);
     MVEFileProxy* p(this->get_proxy_intern(name));
     if (p == 0 || p->is_image)
         return ByteImage::Ptr();
-    this->ensure_embedding(*p);
-    return p->image;
+    return this->ensure_embedding(*p, lock);
 }
 
 /* ---------------------------------------------------------------- */
@@ -889,6 +1317,7 @@ View::get_data (std::string const& name)
 bool
 View::is_dirty (void) const
 {
+    util::MutexLock lock(this->mutex);
     if (this->needs_rebuild)
         return true;
 
@@ -903,6 +1332,85 @@ View::is_dirty (void) const
 
 std::size_t
 View::cache_cleanup (void)
+{
+    util::MutexLock lock(this->mutex);
+    std::size_t released = this->cache_cleanup_intern();
+    lock.unlock();
+    this->update_cache();
+    return released;
+}
+
+/* ---------------------------------------------------------------- */
+
+View::~View (void)
+{
+    if (this->cache.get())
+        this->cache->remove_view(this);
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+View::set_cache (EmbeddingCache::Ptr cache)
+{
+    if (this->cache.get())
+        this->cache->remove_view(this);
+    this->cache = cache;
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+View::update_cache (void)
+{
+    if (!this->cache.get())
+        return;
+
+    /* The sizes are taken before the cache is locked, the cache never
+     * waits for a view that is being saved. */
+    EmbeddingCache::ByteSizes loaded;
+    util::MutexLock lock(this->mutex);
+    for (std::size_t i = 0; i < this->proxies.size(); ++i)
+        if (this->proxies[i].image.get())
+            loaded[this->proxies[i].name]
+                = this->proxies[i].image->get_byte_size();
+    lock.unlock();
+    this->cache->update_view(this, loaded);
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+View::update_cache (std::string const& name, std::size_t bytes)
+{
+    if (this->cache.get())
+        this->cache->insert(this, name, bytes);
+}
+
+/* ---------------------------------------------------------------- */
+
+View::EvictResult
+View::evict_embedding (std::string const& name)
+{
+    /* The cache does not wait for views that are saved or loading. */
+    if (this->mutex.trylock() != 0)
+        return EVICT_BUSY;
+    EvictResult result = EVICT_RELEASED;
+    MVEFileProxy* p(this->get_proxy_intern(name));
+    if (p == 0 || !p->image.get())
+        result = EVICT_NOT_LOADED;
+    else if (p->is_dirty || p->image.use_count() != 1)
+        result = EVICT_BUSY;
+    else
+        p->image.reset();
+    this->mutex.unlock();
+    return result;
+}
+
+/* ---------------------------------------------------------------- */
+
+std::size_t
+View::cache_cleanup_intern (void)
 {
     std::size_t released = 0;
     for (std::size_t i = 0; i < this->proxies.size(); ++i)
@@ -913,6 +1421,11 @@ View::cache_cleanup (void)
         p.image.reset();
         released += 1;
     }
+
+    /* The mapping is released if no mapped embeddings are around. */
+    if (this->mapping.use_count() == 1)
+        this->mapping.reset();
+
     return released;
 }
 
@@ -921,6 +1434,7 @@ View::cache_cleanup (void)
 std::size_t
 View::get_byte_size (void) const
 {
+    util::MutexLock lock(this->mutex);
     std::size_t ret = 0;
     for (std::size_t i = 0; i < this->proxies.size(); ++i)
     {
@@ -974,6 +1488,11 @@ View::print_debug (void) const
         else
             std::cout << "  data dimensions: " << p->width << std::endl;
 
+        if (!p->codec.empty())
+            std::cout << "  codec: " << p->codec << ", "
+                << p->file_size << " of " << p->byte_size
+                << " bytes in file" << std::endl;
+
         if (p->image.get())
         {
             ImageBase::Ptr img = p->image;
@@ -7,7 +7,30 @@
  * acquired. Whenever a file is read from, the headers are re-read to ensure
  * a consistent state of the view across processes. For thread safety, a
  * mutexed access to the embeddings is implemented, to ensure that embeddings
- * are load only once.
+ * are load only once. Saving the view and cleaning the cache hold the same
+ * mutex, thus a view can be written by one thread while other threads load
+ * embeddings from it; the loading threads block until the file is written.
+ * An embedding cache skips views that are locked instead of waiting.
+ * Looking up, adding, replacing and removing embeddings hold the mutex as
+ * well, so results can be stored while other threads load embeddings.
+ * Reloading the file and the proxy pointers of get_proxy() are not thread
+ * safe.
+ *
+ * Embeddings can also be read from a read-only memory mapping of the file.
+ * A mapped file is never written to in place or truncated while clients
+ * hold mapped embeddings; the file is then rebuilt and renamed over the
+ * old one, which leaves existing mappings intact. The exception is
+ * write_image_region(), which changes the bytes of one embedding only.
+ *
+ * Large results can be stored without holding them in memory: an image
+ * reserved with reserve_image() is written as zeros when the view is
+ * saved, parts of it are then written with write_image_region() and read
+ * with get_mapped_embedding().
+ *
+ * Embeddings can be stored compressed with a lossless codec, see
+ * set_embedding_codec(). Compressed embeddings are always written by
+ * rebuilding the file. Embeddings that are updated in place should
+ * therefore be stored uncompressed.
  *
  * Current limitations:
  * - The following data types are supported: uint8, uint16, float, double, sint32
@@ -20,16 +43,20 @@
 #ifndef MVE_VIEW_HEADER
 #define MVE_VIEW_HEADER
 
+#include <cstring>
 #include <string>
 #include <vector>
 
 #include "util/refptr.h"
-#include "util/atomic.h"
+#include "util/threadlocks.h"
+#include "util/exception.h"
+#include "util/fs.h"
 
 #include "defines.h"
 #include "camera.h"
 #include "imagebase.h"
 #include "image.h"
+#include "embeddingcache.h"
 
 MVE_NAMESPACE_BEGIN
 
@@ -51,15 +78,23 @@ struct MVEFileProxy
     std::size_t height; ///< Height of image (or 0 for data).
     std::size_t channels; ///< Channels of image (or 0 for data).
     std::string datatype; ///< String rep. of image datatype.
+    std::string codec; ///< Codec of the embedding in the file, empty is raw
 
     /* Properties that links the embedding to a storage location. */
-    std::size_t byte_size; ///< Size of the embedding
+    std::size_t byte_size; ///< Size of the uncompressed embedding
+    std::size_t file_size; ///< Size of the embedding within the file
     std::size_t file_pos; ///< Position of the embedding within the file
 
     MVEFileProxy (void);
     bool check_direct_write (void) const;
+    /** Returns true for reserved images that are not saved or loaded. */
+    bool is_reserved (void) const;
     ImageType get_type (void) const;
     bool is_type (std::string const& typestr) const;
+    /** Allocates an image with type and dimensions as in the file. */
+    ImageBase::Ptr allocate_image (void) const;
+    /** Decompresses the embedding from the file data into the image. */
+    void decode (char const* data, ImageBase::Ptr image) const;
 };
 
 /* ---------------------------------------------------------------- */
@@ -90,6 +125,65 @@ struct MVEFileMeta
 
 /* ---------------------------------------------------------------- */
 
+/**
+ * Read-only embedding that points into the memory-mapped MVE file
+ * instead of holding a copy of the data. The mapped file stays valid as
+ * long as the embedding exists, even if the view is saved meanwhile.
+ * The data is not necessarily aligned for the data type of the image,
+ * use at() to access typed values. To modify the embedding, create an
+ * owning image with copy() and set it to the view.
+ */
+class MappedEmbedding
+{
+public:
+    typedef util::RefPtr<MappedEmbedding> Ptr;
+
+private:
+    util::fs::MappedFile::Ptr file;
+    MVEFileProxy proxy;
+    char const* data;
+
+private:
+    MappedEmbedding (util::fs::MappedFile::Ptr file,
+        MVEFileProxy const& proxy);
+
+public:
+    /** Creates the embedding, throws if the file is too short. */
+    static Ptr create (util::fs::MappedFile::Ptr file,
+        MVEFileProxy const& proxy);
+
+    /** Returns the name of the embedding. */
+    std::string const& get_name (void) const;
+    /** Returns true for image embeddings, false for data embeddings. */
+    bool is_image (void) const;
+    /** Returns the width of the image (or length of data). */
+    std::size_t width (void) const;
+    /** Returns the height of the image (or 1 for data). */
+    std::size_t height (void) const;
+    /** Returns the amount of channels (or 1 for data). */
+    std::size_t channels (void) const;
+    /** Returns the type of the embedding. */
+    ImageType get_type (void) const;
+    /** Returns the string representation of the data type. */
+    std::string const& get_type_string (void) const;
+    /** Returns the size of the embedding in bytes. */
+    std::size_t get_byte_size (void) const;
+    /** Returns a pointer to the embedding within the mapped file. */
+    char const* get_byte_pointer (void) const;
+
+    /** Returns the value at the linear index, with unaligned access. */
+    template <typename T>
+    T at (std::size_t index) const;
+    /** Returns the value at pixel (x, y) and channel c. */
+    template <typename T>
+    T at (std::size_t x, std::size_t y, std::size_t c) const;
+
+    /** Returns an owning copy of the embedding. */
+    ImageBase::Ptr copy (void) const;
+};
+
+/* ---------------------------------------------------------------- */
+
 /**
  * Implementation of the MVE file specification to read and write MVE files.
  *
@@ -104,21 +198,41 @@ public:
     typedef util::RefPtr<View const> ConstPtr;
     typedef std::vector<MVEFileProxy> Proxies;
 
+    /** Result of evicting an embedding. */
+    enum EvictResult
+    {
+        EVICT_RELEASED, ///< The embedding has been released
+        EVICT_BUSY, ///< The embedding is dirty or in use
+        EVICT_NOT_LOADED ///< The embedding does not exist or is not loaded
+    };
+
 private:
     std::string filename; ///< Filename the view is associated with
     MVEFileMeta meta; ///< Meta information, view name, camera, etc
     CameraInfo camera; ///< Per-view camera information
     Proxies proxies; ///< Proxies for all embeddings
     bool needs_rebuild; ///< Disables direct-writing when saving
-    util::Atomic<int> mutex; ///< Mutex to guard file access
+    bool use_mapping; ///< Loads embeddings from the memory-mapped file
+    util::fs::MappedFile::Ptr mapping; ///< Mapped file, if any
+    std::vector<util::fs::MappedFile::Ptr> old_mappings; ///< Still in use
+    EmbeddingCache::Ptr cache; ///< Cache that loaded embeddings count on
+    mutable util::Mutex mutex; ///< Guards file access and the proxies
 
 private:
     void parse_header_line (std::string const& header_line);
     void direct_write (MVEFileProxy& proxy);
     void load_embedding (MVEFileProxy& proxy); // NOT Thread safe!
-    void ensure_embedding (MVEFileProxy& proxy); // Thread safe wrapper.
+    void ensure_mapping (void); // NOT Thread safe!
+    void release_mapping (void); // NOT Thread safe!
+    bool is_mapped_by_clients (std::string const& filename);
+    ImageBase::Ptr ensure_embedding (MVEFileProxy& proxy,
+        util::MutexLock& lock); // Releases the lock.
+    void save_mve_file_intern (std::string const& filename);
+    std::size_t cache_cleanup_intern (void);
     MVEFileProxy* get_proxy_intern (std::string const& name);
     void update_camera (void);
+    void update_cache (void);
+    void update_cache (std::string const& name, std::size_t bytes);
 
 private:
     /** Default constructor. */
@@ -131,6 +245,9 @@ public:
     static View::Ptr create (void);
     static View::Ptr create (std::string const& filename);
 
+    /** Removes the view from its cache. */
+    ~View (void);
+
     /* ----------------------- Manage view ------------------------ */
 
     /** Sets the view ID. */
@@ -162,6 +279,27 @@ public:
     /** Cleans unused embeddings and returns amount of cleaned embeddings. */
     std::size_t cache_cleanup (void);
 
+    /**
+     * Attaches the view to a cache that keeps track of loaded embeddings
+     * and evicts them to stay within a memory budget. Pass a NULL pointer
+     * to detach the view.
+     */
+    void set_cache (EmbeddingCache::Ptr cache);
+
+    /**
+     * Releases the embedding if it is loaded, clean and not referenced
+     * outside of the view. Thread safe.
+     */
+    EvictResult evict_embedding (std::string const& name);
+
+    /**
+     * Enables or disables loading embeddings from a memory mapping of the
+     * MVE file instead of reading them with a new stream each time.
+     * The loaded embeddings are still owning copies of the data, see
+     * get_mapped_embedding() for reading without a copy.
+     */
+    void set_memory_mapping (bool enable);
+
     /* ------------------ Managing of embeddings ------------------ */
 
     /**
@@ -182,6 +320,24 @@ public:
      */
     mve::ImageBase::Ptr get_embedding (std::string const& name);
 
+    /**
+     * Returns a read-only embedding that points into the memory-mapped
+     * MVE file, without copying the data. Returns a NULL pointer if the
+     * embedding does not exist or is not stored in the file, i.e. if it
+     * has been added or modified and the view is not saved yet, or if
+     * the embedding is stored compressed.
+     */
+    MappedEmbedding::Ptr get_mapped_embedding (std::string const& name);
+
+    /**
+     * Sets the codec the embedding is stored with when the view is saved.
+     * An empty codec stores the embedding uncompressed, the only codec is
+     * MVE_CODEC_DELTA_LZ (see embeddingcodec.h). The embedding is loaded
+     * and marked dirty. Throws if the embedding or codec does not exist.
+     */
+    void set_embedding_codec (std::string const& name,
+        std::string const& codec);
+
     /**
      * Returns true if an embedding by the given name exists.
      */
@@ -222,6 +378,27 @@ public:
      */
     void set_image (std::string const& name, ImageBase::Ptr image);
 
+    /**
+     * Sets a zero image embedding of the given size and data type without
+     * allocating it. The zeros are written when the view is saved, loading
+     * the embedding before allocates a zero image. If an embedding by that
+     * name already exists, it is overwritten.
+     */
+    void reserve_image (std::string const& name, std::size_t width,
+        std::size_t height, std::size_t channels,
+        std::string const& datatype);
+
+    /**
+     * Writes the image into the saved image embedding with its upper left
+     * corner at (left, top), in place in the file. The embedding must be
+     * stored uncompressed with the type and channels of the image and must
+     * not be dirty; a loaded copy of it is released. Mapped embeddings of
+     * the view stay valid, mapped copies of the written embedding may or
+     * may not show the new values.
+     */
+    void write_image_region (std::string const& name, std::size_t left,
+        std::size_t top, ImageBase::ConstPtr image);
+
     /**
      * Returns an image embedding as generic type image.
      * Note that changing this image also changes the view contents.
@@ -287,6 +464,19 @@ public:
      */
     void load_mve_file (std::string const& filename, bool merge = false);
 
+    /**
+     * Initializes the view from the headers of the given MVE file without
+     * accessing the file. The headers must be the exact beginning of the
+     * file up to and including the "end_headers" line, as returned by
+     * read_mve_headers(). This allows to keep the headers of many views
+     * in a single index file.
+     */
+    void load_mve_headers (std::string const& filename,
+        std::string const& headers);
+
+    /** Reads the signature and headers of the given MVE file. */
+    static std::string read_mve_headers (std::string const& filename);
+
     /** Loads the MVE file using the associated filename. */
     void reload_mve_file (bool merge = false);
 
@@ -317,10 +507,112 @@ MVEFileProxy::MVEFileProxy (void)
     , height(0)
     , channels(0)
     , byte_size(0)
+    , file_size(0)
     , file_pos(0)
 {
 }
 
+inline
+MappedEmbedding::MappedEmbedding (util::fs::MappedFile::Ptr file,
+    MVEFileProxy const& proxy)
+    : file(file)
+    , proxy(proxy)
+    , data(file->get_data() + proxy.file_pos)
+{
+    this->proxy.image.reset();
+}
+
+inline MappedEmbedding::Ptr
+MappedEmbedding::create (util::fs::MappedFile::Ptr file,
+    MVEFileProxy const& proxy)
+{
+    if (!proxy.codec.empty())
+        throw util::Exception("Cannot map compressed embedding: ", proxy.name);
+    if (proxy.file_pos == 0
+        || proxy.file_pos + proxy.byte_size > file->get_size())
+        throw util::Exception("Embedding exceeds mapped file: ", proxy.name);
+    return Ptr(new MappedEmbedding(file, proxy));
+}
+
+inline std::string const&
+MappedEmbedding::get_name (void) const
+{
+    return this->proxy.name;
+}
+
+inline bool
+MappedEmbedding::is_image (void) const
+{
+    return this->proxy.is_image;
+}
+
+inline std::size_t
+MappedEmbedding::width (void) const
+{
+    return this->proxy.width;
+}
+
+inline std::size_t
+MappedEmbedding::height (void) const
+{
+    return this->proxy.height;
+}
+
+inline std::size_t
+MappedEmbedding::channels (void) const
+{
+    return this->proxy.channels;
+}
+
+inline ImageType
+MappedEmbedding::get_type (void) const
+{
+    return this->proxy.get_type();
+}
+
+inline std::string const&
+MappedEmbedding::get_type_string (void) const
+{
+    return this->proxy.datatype;
+}
+
+inline std::size_t
+MappedEmbedding::get_byte_size (void) const
+{
+    return this->proxy.byte_size;
+}
+
+inline char const*
+MappedEmbedding::get_byte_pointer (void) const
+{
+    return this->data;
+}
+
+template <typename T>
+inline T
+MappedEmbedding::at (std::size_t index) const
+{
+    T value;
+    std::memcpy(&value, this->data + index * sizeof(T), sizeof(T));
+    return value;
+}
+
+template <typename T>
+inline T
+MappedEmbedding::at (std::size_t x, std::size_t y, std::size_t c) const
+{
+    return this->at<T>((y * this->proxy.width + x)
+        * this->proxy.channels + c);
+}
+
+inline bool
+MVEFileProxy::is_reserved (void) const
+{
+    return this->file_pos == 0 && !this->image.get();
+}
+
+/* ---------------------------------------------------------------- */
+
 inline
 MVEFileMeta::MVEFileMeta (void)
     : view_id(static_cast<std::size_t>(-1))
@@ -330,14 +622,14 @@ MVEFileMeta::MVEFileMeta (void)
 inline
 View::View (void)
     : needs_rebuild(false)
-    , mutex(0)
+    , use_mapping(false)
 {
 }
 
 inline
 View::View (std::string const& fname)
     : needs_rebuild(false)
-    , mutex(0)
+    , use_mapping(false)
 {
     this->load_mve_file(fname);
 }
@@ -408,12 +700,14 @@ View::clear (void)
     this->filename.clear();
     this->proxies.clear();
     this->needs_rebuild = false;
+    this->release_mapping();
+    this->update_cache();
 }
 
-inline bool
-View::has_embedding (std::string const& name) const
+inline void
+View::set_memory_mapping (bool enable)
 {
-    return this->get_proxy(name) != 0;
+    this->use_mapping = enable;
 }
 
 inline std::size_t
@@ -422,13 +716,6 @@ View::num_embeddings (void) const
     return this->proxies.size();
 }
 
-inline bool
-View::mark_as_dirty (std::string const& name)
-{
-    MVEFileProxy* p(this->get_proxy_intern(name));
-    return p != 0 && (p->is_dirty = true);
-}
-
 inline void
 View::reload_mve_file (bool merge)
 {
@@ -16,7 +16,9 @@
 #   include <unistd.h>
 #   include <sys/stat.h>
 #   include <sys/types.h>
+#   include <fcntl.h>
 #   include <pwd.h>
+#   include <sys/mman.h>
 #endif
 
 #if defined(__APPLE__)
@@ -73,6 +75,20 @@ file_exists(char const* pathname)
 
 /* ---------------------------------------------------------------- */
 
+bool
+file_info (char const* pathname, std::time_t* mtime, std::size_t* size)
+{
+  struct _stat statbuf;
+  if (::_stat(pathname, &statbuf) < 0)
+    return false;
+
+  *mtime = statbuf.st_mtime;
+  *size = statbuf.st_size;
+  return true;
+}
+
+/* ---------------------------------------------------------------- */
+
 // SHGetFolderPathA seems to expect non-wide chars
 // http://msdn.microsoft.com/en-us/library/bb762181(VS.85).aspx
 
@@ -164,6 +180,20 @@ file_exists(char const* pathname)
 
 /* ---------------------------------------------------------------- */
 
+bool
+file_info (char const* pathname, std::time_t* mtime, std::size_t* size)
+{
+  struct stat statbuf;
+  if (::stat(pathname, &statbuf) < 0)
+    return false;
+
+  *mtime = statbuf.st_mtime;
+  *size = statbuf.st_size;
+  return true;
+}
+
+/* ---------------------------------------------------------------- */
+
 char*
 get_default_home_path(void)
 {
@@ -357,6 +387,74 @@ replace_extension (std::string const& fn, std::string const& ext)
     return ret;
 }
 
+/*
+ * ---------------------- Read-only file mapping ---------------------
+ */
+
+MappedFile::MappedFile (std::string const& filename)
+    : filename(filename)
+    , data(0)
+    , size(0)
+{
+#ifdef _WIN32
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if (!in.good())
+        throw FileException(filename, std::strerror(errno));
+    in.seekg(0, std::ios::end);
+    this->size = in.tellg();
+    in.seekg(0, std::ios::beg);
+    if (this->size == 0)
+        return;
+    this->data = new char[this->size];
+    in.read(this->data, this->size);
+    if (!in.good())
+    {
+        delete [] this->data;
+        throw FileException(filename, "Error reading file");
+    }
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw FileException(filename, std::strerror(errno));
+
+    struct stat statbuf;
+    if (::fstat(fd, &statbuf) < 0)
+    {
+        int error = errno;
+        ::close(fd);
+        throw FileException(filename, std::strerror(error));
+    }
+    this->size = statbuf.st_size;
+
+    /* Empty files cannot be mapped. */
+    if (this->size == 0)
+    {
+        ::close(fd);
+        return;
+    }
+
+    void* addr = ::mmap(0, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int error = errno;
+    ::close(fd); // The mapping keeps a reference to the file
+    if (addr == MAP_FAILED)
+        throw FileException(filename, std::strerror(error));
+    this->data = static_cast<char*>(addr);
+#endif
+}
+
+/* ---------------------------------------------------------------- */
+
+MappedFile::~MappedFile (void)
+{
+    if (this->data == 0)
+        return;
+#ifdef _WIN32
+    delete [] this->data;
+#else
+    ::munmap(this->data, this->size);
+#endif
+}
+
 UTIL_FS_NAMESPACE_END
 UTIL_NAMESPACE_END
 
@@ -6,10 +6,12 @@
 #ifndef UTIL_FS_HEADER
 #define UTIL_FS_HEADER
 
+#include <ctime>
 #include <string>
 #include <vector>
 
 #include "defines.h"
+#include "refptr.h"
 
 UTIL_NAMESPACE_BEGIN
 UTIL_FS_NAMESPACE_BEGIN
@@ -22,6 +24,8 @@ UTIL_FS_NAMESPACE_BEGIN
 bool dir_exists (char const* pathname);
 /** Determines if the given path is a file. */
 bool file_exists (char const* pathname);
+/** Determines modification time and size of a file, false on error. */
+bool file_info (char const* pathname, std::time_t* mtime, std::size_t* size);
 /** Determines the home path for the current user. */
 char* get_default_home_path (void);
 /** Determines the current working directory of the process. */
@@ -155,6 +159,49 @@ public:
     std::string const& get_reason (void) const;
 };
 
+/*
+ * ---------------------- Read-only file mapping ---------------------
+ */
+
+/**
+ * Maps a whole file read-only into memory. The mapping is private: it
+ * is not affected if the file is unlinked or replaced by renaming another
+ * file over it, but it is undefined what the mapping shows if the file
+ * is written to in place. Truncating the file while it is mapped crashes
+ * readers of the truncated region, so files must be replaced, not
+ * rewritten, while mappings exist. On systems without mmap() the file is
+ * read into memory instead.
+ */
+class MappedFile
+{
+public:
+    typedef RefPtr<MappedFile> Ptr;
+    typedef RefPtr<MappedFile const> ConstPtr;
+
+private:
+    std::string filename;
+    char* data;
+    std::size_t size;
+
+private:
+    MappedFile (std::string const& filename);
+    MappedFile (MappedFile const& other);
+    MappedFile& operator= (MappedFile const& other);
+
+public:
+    /** Maps the given file, throws FileException on error. */
+    static Ptr create (std::string const& filename);
+    /** Unmaps the file. */
+    ~MappedFile (void);
+
+    /** Returns the name of the mapped file. */
+    std::string const& get_filename (void) const;
+    /** Returns a pointer to the file contents. */
+    char const* get_data (void) const;
+    /** Returns the size of the file in bytes. */
+    std::size_t get_size (void) const;
+};
+
 /*
  * -------------------------- Implementation -------------------------
  */
@@ -205,6 +252,30 @@ FileLock::get_reason (void) const
     return this->reason;
 }
 
+inline MappedFile::Ptr
+MappedFile::create (std::string const& filename)
+{
+    return Ptr(new MappedFile(filename));
+}
+
+inline std::string const&
+MappedFile::get_filename (void) const
+{
+    return this->filename;
+}
+
+inline char const*
+MappedFile::get_data (void) const
+{
+    return this->data;
+}
+
+inline std::size_t
+MappedFile::get_size (void) const
+{
+    return this->size;
+}
+
 UTIL_FS_NAMESPACE_END
 UTIL_NAMESPACE_END
 